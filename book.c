@@ -26,320 +26,3349 @@
  */
 
 #include <assert.h>
-#include <float.h>
-#include <math.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-#include <libcore/heap.h>
+#include <libcore/darray.h>
 
 #include "book.h"
+#include "journal.h"
+#include "latency.h"
+#include "log.h"
 #include "order.h"
+#include "timer.h"
+#include "timestamp.h"
+#include "trace.h"
 
 #define DEBUG   0
 #define DBG(...) \
     do { if(DEBUG) fprintf(stderr, __VA_ARGS__); } while(0)
 
+/* Prices are matched as an integer number of ticks. The ladder
+ * on each side of the book has one price level per tick, from
+ * zero up to (BOOK_MAX_TICKS - 1) ticks above the book's base. The
+ * base is placed so that the ladder is centred on the first price
+ * the book is given, or starts at zero for a price below the
+ * middle of the ladder. The lowest and highest ticks are where
+ * market orders rest during an auction, so limit prices must lie
+ * strictly between them.
+ */
+#define BOOK_TICKS_PER_UNIT     100
+#define BOOK_MAX_TICKS          (1 << 18)
+
+#define BOOK_MARKET_SELL_TICK   0
+#define BOOK_MARKET_BUY_TICK    (BOOK_MAX_TICKS - 1)
+
+/* Occupied levels are tracked in a three level bitmap, one bit per
+ * tick in the leaf words, one bit per leaf word in the group words
+ * and one bit per group word in the summary. With 64 bit words this
+ * covers 64 * 64 * 64 == BOOK_MAX_TICKS ticks.
+ */
+#define BOOK_BITMAP_BITS        64
+#define BOOK_BITMAP_LEAVES      (BOOK_MAX_TICKS / BOOK_BITMAP_BITS)
+#define BOOK_BITMAP_GROUPS      (BOOK_BITMAP_LEAVES / BOOK_BITMAP_BITS)
+
+/* Price levels are allocated a page at a time, the first time an
+ * order rests in the page, so a book only pays for the prices it
+ * is actually used at
+ */
+#define BOOK_LEVEL_PAGE         1024
+#define BOOK_LEVEL_PAGES        (BOOK_MAX_TICKS / BOOK_LEVEL_PAGE)
+
+#define BOOK_CACHE_LINE         64
+
+/* Book entries are allocated from the book in chunks */
+#define BOOK_ENTRY_CHUNK        1024
+
+/* The order index starts this big, and doubles whenever it is half
+ * full
+ */
+#define BOOK_INDEX_SIZE         1024
+
+/* Orders expire in batches, on the expiry wheel's ticks */
+#define BOOK_EXPIRY_TICK_MS     10
+
+typedef struct _book_entry BookEntry;
+typedef struct _book_side BookSide;
+typedef struct _book_peg_group BookPegGroup;
+
+/* A resting order, queued in time priority at its price level */
+struct _book_entry {
+    BookEntry *prev;
+    BookEntry *next;
+
+    Order *order;
+    long tick;
+
+    /* The side the order rests on, or NULL while it is held for the
+     * close. The ID outlives the order, so the entry can leave the
+     * index after the order is freed.
+     */
+    BookSide *side;
+    unsigned long long id;
+
+    /* Armed while an order with an expire time rests in the book */
+    Timer expiry;
+
+    /* A pegged order's group, and its neighbours in the group */
+    BookPegGroup *peg;
+    BookEntry *peg_prev;
+    BookEntry *peg_next;
+};
+
+/* A slot in the book's order index, empty if entry is NULL */
+typedef struct {
+    unsigned long long id;
+    BookEntry *entry;
+} BookIndexSlot;
+
+typedef struct {
+    BookEntry *head;
+    BookEntry *tail;
+
+    /* Total displayed quantity resting at this price, and the
+     * total quantity held in reserve by iceberg orders
+     */
+    unsigned long long quantity;
+    unsigned long long hidden;
+
+    /* Number of orders resting at this price, and how many of them
+     * are pegged
+     */
+    unsigned long orders;
+    unsigned long pegged;
+} BookLevel;
+
+/* One side of the book. For the buy side, better prices are higher
+ * ticks, and for the sell side they are lower ticks.
+ */
+struct _book_side {
+    BookLevel *pages[BOOK_LEVEL_PAGES];
+
+    /* Bitmap of the levels with orders resting at them */
+    unsigned long long *leaves;
+    unsigned long long groups[BOOK_BITMAP_GROUPS];
+    unsigned long long summary;
+
+    long best;
+    unsigned long occupied;
+
+    /* Total quantity, displayed and hidden, on this side */
+    unsigned long long total;
+
+    int ascending;
+};
+
+/* Pegged orders on one side with the same peg and offset. They all
+ * rest at the same price, in time priority, and move together when
+ * the price they follow moves. A group with no price to peg to is
+ * parked: its orders keep their side, but are held out of the
+ * levels with a tick of -1.
+ */
+struct _book_peg_group {
+    BookPegGroup *next;
+
+    BookSide *side;
+    ORDER_TYPE type;
+    long offset;
+    long tick;
+
+    BookEntry *head;
+    BookEntry *tail;
+};
+
+/* A point on an auction's cumulative buy or sell curve */
+typedef struct {
+    long tick;
+    unsigned long long quantity;
+} BookCurvePoint;
+
+/* Top of book published under a sequence lock. The sequence is odd
+ * while the book is writing a new snapshot, and readers retry until
+ * they copy the snapshot with the same even sequence before and
+ * after. It sits on a cache line of its own so that readers only
+ * contend with the book when it publishes.
+ */
+typedef struct {
+    unsigned long sequence;
+    BookTop top;
+} __attribute__((aligned(BOOK_CACHE_LINE))) BookSnapshot;
+
+/* Running counters, on a cache line of their own. Only the thread
+ * holding matcher_mutex updates them, so they are plain stores that
+ * other threads can read at any time without tearing.
+ */
+typedef struct {
+    BookCounters counters;
+} __attribute__((aligned(BOOK_CACHE_LINE))) BookCounterLine;
+
 struct _book {
+    BookSnapshot snapshot;
+    BookCounterLine line;
+
     String *symbol;
-    Heap *buy;
-    Heap *sell;
+    BookSide buy;
+    BookSide sell;
+
+    /* Stop orders waiting to be triggered, indexed by stop price.
+     * Buy stops trigger from the lowest stop price up, and sell
+     * stops from the highest down.
+     */
+    BookSide buy_stops;
+    BookSide sell_stops;
+
+    /* Price, in whole ticks, of the bottom of the ladder, or -1
+     * until the book is first given a price
+     */
+    long base;
+
+    /* Price of the last trade, or -1 if there has not been one */
+    long last_tick;
+    unsigned long last_quantity;
+
+    /* During an auction call period orders accumulate without
+     * matching, and the indicative price and volume are those the
+     * auction would uncross at now (-1 and 0 if it would not trade).
+     */
+    BOOK_PHASE phase;
+    BOOK_AUCTION auction;
+    long indicative_tick;
+    unsigned long long indicative_volume;
+    int limit_on_close;
+
+    /* Scratch space for the auction's cumulative curves */
+    BookCurvePoint *buy_curve;
+    BookCurvePoint *sell_curve;
+    unsigned long curve_size;
+
+    /* On close orders received outside the closing auction, held
+     * in arrival order until the closing call starts
+     */
+    BookEntry *on_close_head;
+    BookEntry *on_close_tail;
+
+    /* Book-specific sequence number of the last order to enter
+     * the book. Only modified while holding matcher_mutex.
+     */
+    unsigned long long sequence;
+
+    BookEntry *free_entries;
+    DArray *entry_chunks;
+
+    /* Every order in the book by ID, for the orders that are taken
+     * out of it other than by trading
+     */
+    BookIndexSlot *index;
+    unsigned long index_size;
+    unsigned long index_count;
+
+    /* GTD, GTT and Day orders are armed on the expiry wheel while
+     * they rest. Only the book's own clock expires them while
+     * expiry_enabled is set; while the book is rebuilt from the
+     * journal it is cleared, and the journalled expiries are
+     * replayed instead.
+     */
+    TimerWheel *expiry;
+    int expiry_enabled;
+
+    /* Peg groups, in order of side, type and offset so that they are
+     * always repriced in the same order, and the best bid and offer
+     * of unpegged orders they were last priced from
+     */
+    BookPegGroup *pegs;
+    long peg_bid;
+    long peg_ask;
+
+    int book_is_open;
+
+    pthread_t       matcher_thread;
+    pthread_mutex_t matcher_mutex;
+    pthread_cond_t  matcher_cond;
+};
+
+/* A price in whole ticks, or -1 if it is negative or too big to
+ * count in ticks
+ */
+static long _book_ticks(float price)
+{
+    if(!((price >= 0.0f) &&
+                (price < (float)(LONG_MAX / BOOK_TICKS_PER_UNIT)))) {
+        return -1;
+    }
+
+    return (long)((price * BOOK_TICKS_PER_UNIT) + 0.5f);
+}
+
+/* The base the book has, or the one a price would give it */
+static long _book_base_for(const Book *b, float price)
+{
+    long ticks;
+
+    if(b->base >= 0) {
+        return b->base;
+    }
+
+    ticks = _book_ticks(price);
+
+    return (ticks > BOOK_MAX_TICKS / 2) ? ticks - BOOK_MAX_TICKS / 2 : 0;
+}
+
+/* The bottom of the ladder, which is zero until the book is given
+ * a price
+ */
+static long _book_base(const Book *b)
+{
+    return (b->base >= 0) ? b->base : 0;
+}
+
+/* A price's tick on a ladder from base, or -1 if it is below it */
+static long _book_ticks_above(long base, float price)
+{
+    long ticks = _book_ticks(price);
+
+    return (ticks >= base) ? ticks - base : -1;
+}
+
+static long _book_price_to_tick(const Book *b, float price)
+{
+    return _book_ticks_above(_book_base(b), price);
+}
+
+/* Can a limit or stop order be priced at this tick? */
+static int _book_tick_is_valid(long tick)
+{
+    return (tick > BOOK_MARKET_SELL_TICK) && (tick < BOOK_MARKET_BUY_TICK);
+}
+
+static float _book_tick_to_price(const Book *b, long tick)
+{
+    return (float)(_book_base(b) + tick) / BOOK_TICKS_PER_UNIT;
+}
+
+static BookEntry* _book_entry_alloc(Book *b)
+{
+    BookEntry *chunk, *e;
+    unsigned long i;
+
+    if(NULL == b->free_entries) {
+        chunk = malloc(BOOK_ENTRY_CHUNK * sizeof(BookEntry));
+        if(NULL == chunk) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            return NULL;
+        }
+
+        darray_append(b->entry_chunks, chunk);
+
+        for(i = 0; i < BOOK_ENTRY_CHUNK; i++) {
+            chunk[i].next = b->free_entries;
+            b->free_entries = &chunk[i];
+        }
+    }
+
+    e = b->free_entries;
+    b->free_entries = e->next;
+
+    e->side = NULL;
+    e->peg = NULL;
+    timer_init(&e->expiry, NULL, e);
+
+    return e;
+}
+
+static unsigned long _book_index_hash(unsigned long long id)
+{
+    return (unsigned long)((id * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/* The slot holding an order ID, or the empty slot it would go in */
+static BookIndexSlot* _book_index_slot(const Book *b, unsigned long long id)
+{
+    unsigned long i, mask = b->index_size - 1;
+
+    for(i = _book_index_hash(id) & mask;
+            NULL != b->index[i].entry;
+            i = (i + 1) & mask) {
+        if(b->index[i].id == id) {
+            break;
+        }
+    }
+
+    return &b->index[i];
+}
+
+static int _book_index_grow(Book *b)
+{
+    BookIndexSlot *old, *slot;
+    unsigned long i, size;
+
+    old = b->index;
+    size = b->index_size;
+
+    b->index = calloc(size * 2, sizeof(BookIndexSlot));
+    if(NULL == b->index) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        b->index = old;
+        return -1;
+    }
+    b->index_size = size * 2;
+
+    for(i = 0; i < size; i++) {
+        if(NULL != old[i].entry) {
+            slot = _book_index_slot(b, old[i].id);
+            *slot = old[i];
+        }
+    }
+
+    free(old);
+
+    return 0;
+}
+
+static void _book_index_insert(Book *b, BookEntry *e)
+{
+    BookIndexSlot *slot;
+
+    if((b->index_count + 1) * 2 > b->index_size) {
+        if(_book_index_grow(b) < 0) {
+            return;
+        }
+    }
+
+    slot = _book_index_slot(b, e->id);
+    if(NULL == slot->entry) {
+        b->index_count++;
+    }
+
+    slot->id = e->id;
+    slot->entry = e;
+}
+
+/* Empty a slot, then shift back any later entries in its run that
+ * would no longer be found past the gap
+ */
+static void _book_index_remove(Book *b, const BookEntry *e)
+{
+    unsigned long i, j, home, mask = b->index_size - 1;
+    BookIndexSlot *slot;
+
+    slot = _book_index_slot(b, e->id);
+    if(slot->entry != e) {
+        return;
+    }
+
+    i = slot - b->index;
+    b->index[i].entry = NULL;
+    b->index_count--;
+
+    for(j = (i + 1) & mask; NULL != b->index[j].entry; j = (j + 1) & mask) {
+        home = _book_index_hash(b->index[j].id) & mask;
+
+        /* Leave it if its home lies cyclically in (i, j] */
+        if(((j - home) & mask) < ((j - i) & mask)) {
+            continue;
+        }
+
+        b->index[i] = b->index[j];
+        b->index[j].entry = NULL;
+        i = j;
+    }
+}
+
+/* Hand an order to an entry, index it, and arm its expiry if it
+ * rests on a side of the book
+ */
+static void _book_entry_attach(Book *b, BookEntry *e, Order *o,
+        BookSide *side)
+{
+    e->order = o;
+    e->side = side;
+    e->id = order_get_id(o);
+
+    _book_index_insert(b, e);
+
+    if((NULL != side) && (order_get_expire_time(o) > 0)) {
+        timer_wheel_arm(b->expiry, &e->expiry, order_get_expire_time(o));
+    }
+}
+
+static void _book_peg_drop(Book *b, BookPegGroup *g)
+{
+    BookPegGroup **link;
+
+    for(link = &b->pegs; *link != g; link = &(*link)->next) {
+        /* Find the link to the group */
+    }
+    *link = g->next;
+
+    free(g);
+}
+
+/* Take a pegged order out of its group, and drop the group once it
+ * is empty
+ */
+static void _book_peg_leave(Book *b, BookEntry *e)
+{
+    BookPegGroup *g = e->peg;
+
+    if(NULL == e->peg_prev) {
+        g->head = e->peg_next;
+    } else {
+        e->peg_prev->peg_next = e->peg_next;
+    }
+
+    if(NULL == e->peg_next) {
+        g->tail = e->peg_prev;
+    } else {
+        e->peg_next->peg_prev = e->peg_prev;
+    }
+
+    e->peg = NULL;
+
+    if(NULL == g->head) {
+        _book_peg_drop(b, g);
+    }
+}
+
+/* The order may already have been freed */
+static void _book_entry_free(Book *b, BookEntry *e)
+{
+    timer_wheel_cancel(b->expiry, &e->expiry);
+    _book_index_remove(b, e);
+
+    if(NULL != e->peg) {
+        _book_peg_leave(b, e);
+    }
+
+    e->next = b->free_entries;
+    b->free_entries = e;
+}
+
+/* Quantity of a resting order that is displayed in the book. For
+ * an iceberg order this is its current slice.
+ */
+static unsigned long _book_entry_visible(const BookEntry *e)
+{
+    return order_get_quantity(e->order) - order_get_hidden_quantity(e->order);
+}
+
+/* Is tick t1 a better price than tick t2 on this side? */
+static int _book_side_is_better(const BookSide *side, long t1, long t2)
+{
+    return side->ascending ? (t1 < t2) : (t1 > t2);
+}
+
+/* Bits of a word at and above bit, and at and below bit */
+#define BOOK_BITS_FROM(bit)     (~0ULL << (bit))
+#define BOOK_BITS_UPTO(bit)     (~0ULL >> (BOOK_BITMAP_BITS - 1 - (bit)))
+
+/* Lowest and highest set bits of a non-zero word. These compile to
+ * tzcnt and lzcnt where the target has them.
+ */
+#define BOOK_BITS_LOWEST(w)     ((long)__builtin_ctzll(w))
+#define BOOK_BITS_HIGHEST(w)    ((long)(BOOK_BITMAP_BITS - 1 - __builtin_clzll(w)))
+
+static void _book_side_mark(BookSide *side, long tick)
+{
+    long leaf = tick / BOOK_BITMAP_BITS;
+    long group = leaf / BOOK_BITMAP_BITS;
+
+    side->leaves[leaf] |= 1ULL << (tick % BOOK_BITMAP_BITS);
+    side->groups[group] |= 1ULL << (leaf % BOOK_BITMAP_BITS);
+    side->summary |= 1ULL << group;
+}
+
+static void _book_side_unmark(BookSide *side, long tick)
+{
+    long leaf = tick / BOOK_BITMAP_BITS;
+    long group = leaf / BOOK_BITMAP_BITS;
+
+    side->leaves[leaf] &= ~(1ULL << (tick % BOOK_BITMAP_BITS));
+    if(0 != side->leaves[leaf]) {
+        return;
+    }
+
+    side->groups[group] &= ~(1ULL << (leaf % BOOK_BITMAP_BITS));
+    if(0 != side->groups[group]) {
+        return;
+    }
+
+    side->summary &= ~(1ULL << group);
+}
+
+/* Lowest occupied tick above the given tick, or -1 */
+static long _book_side_above(const BookSide *side, long tick)
+{
+    unsigned long long w;
+    long leaf, group;
+
+    tick++;
+    if(tick >= BOOK_MAX_TICKS) {
+        return -1;
+    }
+
+    leaf = tick / BOOK_BITMAP_BITS;
+    w = side->leaves[leaf] & BOOK_BITS_FROM(tick % BOOK_BITMAP_BITS);
+    if(0 == w) {
+        leaf++;
+        if(leaf >= BOOK_BITMAP_LEAVES) {
+            return -1;
+        }
+
+        group = leaf / BOOK_BITMAP_BITS;
+        w = side->groups[group] & BOOK_BITS_FROM(leaf % BOOK_BITMAP_BITS);
+        if(0 == w) {
+            group++;
+            if(group >= BOOK_BITMAP_GROUPS) {
+                return -1;
+            }
+
+            w = side->summary & BOOK_BITS_FROM(group);
+            if(0 == w) {
+                return -1;
+            }
+
+            group = BOOK_BITS_LOWEST(w);
+            w = side->groups[group];
+        }
+
+        leaf = (group * BOOK_BITMAP_BITS) + BOOK_BITS_LOWEST(w);
+        w = side->leaves[leaf];
+    }
+
+    return (leaf * BOOK_BITMAP_BITS) + BOOK_BITS_LOWEST(w);
+}
+
+/* Highest occupied tick below the given tick, or -1 */
+static long _book_side_below(const BookSide *side, long tick)
+{
+    unsigned long long w;
+    long leaf, group;
+
+    tick--;
+    if(tick < 0) {
+        return -1;
+    }
+
+    leaf = tick / BOOK_BITMAP_BITS;
+    w = side->leaves[leaf] & BOOK_BITS_UPTO(tick % BOOK_BITMAP_BITS);
+    if(0 == w) {
+        leaf--;
+        if(leaf < 0) {
+            return -1;
+        }
+
+        group = leaf / BOOK_BITMAP_BITS;
+        w = side->groups[group] & BOOK_BITS_UPTO(leaf % BOOK_BITMAP_BITS);
+        if(0 == w) {
+            group--;
+            if(group < 0) {
+                return -1;
+            }
+
+            w = side->summary & BOOK_BITS_UPTO(group);
+            if(0 == w) {
+                return -1;
+            }
+
+            group = BOOK_BITS_HIGHEST(w);
+            w = side->groups[group];
+        }
+
+        leaf = (group * BOOK_BITMAP_BITS) + BOOK_BITS_HIGHEST(w);
+        w = side->leaves[leaf];
+    }
+
+    return (leaf * BOOK_BITMAP_BITS) + BOOK_BITS_HIGHEST(w);
+}
+
+/* Find the next occupied level that is worse than the given tick,
+ * or -1 if there is none. Walking from the best level this visits
+ * the top levels of the side in order, at a few bit scans each.
+ */
+static long _book_side_next(const BookSide *side, long tick)
+{
+    return side->ascending ?
+        _book_side_above(side, tick) : _book_side_below(side, tick);
+}
+
+/* Does the level at tick trade against an incoming order with the
+ * given limit? The limit is in ticks on the incoming order's side.
+ */
+static int _book_side_crosses(const BookSide *side, long tick, long limit)
+{
+    return side->ascending ? (tick <= limit) : (tick >= limit);
+}
+
+/* The level at a tick whose page has been allocated, which it has
+ * for any level an order rests at
+ */
+static BookLevel* _book_side_level(const BookSide *side, long tick)
+{
+    BookLevel *page = side->pages[tick / BOOK_LEVEL_PAGE];
+
+    assert(page != NULL);
+
+    return &page[tick % BOOK_LEVEL_PAGE];
+}
+
+/* The level at any tick, to look at. Levels in pages that haven't
+ * been allocated are empty.
+ */
+static const BookLevel* _book_side_peek(const BookSide *side, long tick)
+{
+    static const BookLevel empty;
+    const BookLevel *page = side->pages[tick / BOOK_LEVEL_PAGE];
+
+    return (NULL != page) ? &page[tick % BOOK_LEVEL_PAGE] : &empty;
+}
+
+/* Allocate the page holding a tick's level, if it isn't already, so
+ * that an order can rest there
+ */
+static int _book_side_reserve(BookSide *side, long tick)
+{
+    BookLevel **page = &side->pages[tick / BOOK_LEVEL_PAGE];
+
+    if(NULL == *page) {
+        *page = calloc(BOOK_LEVEL_PAGE, sizeof(BookLevel));
+        if(NULL == *page) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int _book_side_init(BookSide *side, int ascending)
+{
+    side->leaves = calloc(BOOK_BITMAP_LEAVES, sizeof(unsigned long long));
+    if(NULL == side->leaves) {
+        return -1;
+    }
+
+    memset(side->pages, 0, sizeof(side->pages));
+
+    memset(side->groups, 0, sizeof(side->groups));
+    side->summary = 0;
+
+    side->best = -1;
+    side->occupied = 0;
+    side->total = 0;
+    side->ascending = ascending;
+
+    return 0;
+}
+
+static void _book_side_release(BookSide *side)
+{
+    unsigned long i;
+
+    for(i = 0; i < BOOK_LEVEL_PAGES; i++) {
+        free(side->pages[i]);
+    }
+    free(side->leaves);
+}
+
+/* Queue an entry at the back of its price level */
+static void _book_side_insert(BookSide *side, BookEntry *e)
+{
+    BookLevel *level = _book_side_level(side, e->tick);
+
+    e->next = NULL;
+    e->prev = level->tail;
+
+    if(NULL == level->tail) {
+        level->head = e;
+        side->occupied++;
+        _book_side_mark(side, e->tick);
+
+        if((side->best < 0) || _book_side_is_better(side, e->tick, side->best)) {
+            side->best = e->tick;
+        }
+    } else {
+        level->tail->next = e;
+    }
+
+    level->tail = e;
+    level->quantity += _book_entry_visible(e);
+    level->hidden += order_get_hidden_quantity(e->order);
+    level->orders++;
+    if(NULL != e->peg) {
+        level->pegged++;
+    }
+
+    side->total += order_get_quantity(e->order);
+}
+
+/* Unlink an entry from its price level */
+static void _book_side_remove(BookSide *side, BookEntry *e)
+{
+    BookLevel *level = _book_side_level(side, e->tick);
+
+    if(NULL == e->prev) {
+        level->head = e->next;
+    } else {
+        e->prev->next = e->next;
+    }
+
+    if(NULL == e->next) {
+        level->tail = e->prev;
+    } else {
+        e->next->prev = e->prev;
+    }
+
+    level->quantity -= _book_entry_visible(e);
+    level->hidden -= order_get_hidden_quantity(e->order);
+    level->orders--;
+    if(NULL != e->peg) {
+        level->pegged--;
+    }
+
+    side->total -= order_get_quantity(e->order);
+
+    if(NULL == level->head) {
+        side->occupied--;
+        _book_side_unmark(side, e->tick);
+
+        if(e->tick == side->best) {
+            side->best = (side->occupied > 0) ?
+                _book_side_next(side, e->tick) : -1;
+        }
+    }
+}
+
+/* Is there at least the needed quantity resting on this side, at
+ * prices that trade against the limit? Walks the level aggregates
+ * rather than the orders, and counts iceberg reserves since they
+ * are filled as their slices trade.
+ */
+static int _book_side_available(const BookSide *side, long limit,
+        unsigned long needed)
+{
+    const BookLevel *level;
+    unsigned long long available;
+    long t;
+
+    available = 0;
+
+    for(t = side->best;
+            (t >= 0) && _book_side_crosses(side, t, limit);
+            t = _book_side_next(side, t)) {
+        level = _book_side_level(side, t);
+        available += level->quantity + level->hidden;
+        if(available >= needed) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Add to one of the book's counters. Called with matcher_mutex held. */
+static void _book_count(unsigned long long *counter, unsigned long long n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static void _book_trade(Book *b, const Order *buy, const Order *sell,
+        long tick, unsigned long quantity)
+{
+    journal_execution(b->symbol, buy, sell, _book_tick_to_price(b, tick),
+            quantity);
+
+    DBG("(%s:%d) Filled %lu of \"%s\" at price $%f\n",
+            __FUNCTION__, __LINE__, quantity,
+            string_get_chars(b->symbol),
+            _book_tick_to_price(b, tick));
+
+    trace_event(TRACE_EVENT_TRADE, tick, quantity);
+
+    _book_count(&b->line.counters.volume, quantity);
+    b->last_tick = tick;
+    b->last_quantity = quantity;
+}
+
+/* Show the next slice of an iceberg order whose displayed quantity
+ * has been filled. The slice loses time priority, so the entry is
+ * moved to the back of its level.
+ */
+static void _book_replenish(Book *b, BookSide *side, BookEntry *e)
+{
+    BookLevel *level = _book_side_level(side, e->tick);
+    unsigned long hidden, slice;
+
+    hidden = order_get_hidden_quantity(e->order);
+
+    slice = order_get_display_quantity(e->order);
+    if(slice > hidden) {
+        slice = hidden;
+    }
+
+    order_set_hidden_quantity(e->order, hidden - slice);
+    order_set_sequence(e->order, ++b->sequence);
+
+    level->quantity += slice;
+    level->hidden -= slice;
+
+    if(e != level->tail) {
+        if(NULL == e->prev) {
+            level->head = e->next;
+        } else {
+            e->prev->next = e->next;
+        }
+        e->next->prev = e->prev;
+
+        e->prev = level->tail;
+        e->next = NULL;
+        level->tail->next = e;
+        level->tail = e;
+    }
+}
+
+/* Fill part or all of a resting order's displayed quantity. The
+ * order is removed from the book and freed once it is completely
+ * filled.
+ */
+static void _book_fill(Book *b, BookSide *side, BookEntry *e,
+        unsigned long quantity)
+{
+    unsigned long remaining;
+
+    remaining = order_get_quantity(e->order) - quantity;
+
+    if(0 == remaining) {
+        _book_count(&b->line.counters.orders_filled, 1);
+
+        _book_side_remove(side, e);
+        order_free(e->order);
+        _book_entry_free(b, e);
+    } else {
+        _book_side_level(side, e->tick)->quantity -= quantity;
+        side->total -= quantity;
+        order_set_quantity(e->order, remaining);
+
+        if(0 == _book_entry_visible(e)) {
+            _book_replenish(b, side, e);
+        }
+    }
+}
+
+/* Match an incoming order against the opposite side of the book,
+ * down to its limit. Returns the quantity left unfilled.
+ */
+static unsigned long _book_match(Book *b, Order *o, long limit)
+{
+    unsigned long remaining, fill;
+    BookSide *contra;
+    BookEntry *e;
+
+    contra = (ORDER_SIDE_BUY == order_get_side(o)) ? &b->sell : &b->buy;
+
+    remaining = order_get_quantity(o);
+
+    while((remaining > 0) && (contra->best >= 0) &&
+            _book_side_crosses(contra, contra->best, limit)) {
+        e = _book_side_level(contra, contra->best)->head;
+
+        fill = _book_entry_visible(e);
+        if(fill > remaining) {
+            fill = remaining;
+        }
+
+        /* Trades at the resting order's price */
+        if(ORDER_SIDE_BUY == order_get_side(o)) {
+            _book_trade(b, o, e->order, contra->best, fill);
+        } else {
+            _book_trade(b, e->order, o, contra->best, fill);
+        }
+        _book_fill(b, contra, e, fill);
+
+        remaining -= fill;
+    }
+
+    if(0 == remaining) {
+        _book_count(&b->line.counters.orders_filled, 1);
+    }
+
+    order_set_quantity(o, remaining);
+
+    return remaining;
+}
+
+/* Limit of an order, in ticks, for matching against the other
+ * side. Market orders trade at any price on the other side.
+ */
+static long _book_order_limit(const Book *b, const Order *o)
+{
+    if((ORDER_TYPE_MARKET == order_get_type(o)) ||
+            (ORDER_TYPE_MARKET_ON_CLOSE == order_get_type(o))) {
+        return (ORDER_SIDE_BUY == order_get_side(o)) ?
+            BOOK_MARKET_BUY_TICK : BOOK_MARKET_SELL_TICK;
+    }
+
+    return _book_price_to_tick(b, order_get_price(o));
+}
+
+/* Rest an order at the back of its level. Iceberg orders only
+ * display part of their quantity, and keep the rest in reserve.
+ */
+static BookEntry* _book_rest_order(Book *b, BookSide *side, Order *o,
+        long tick)
+{
+    BookEntry *e;
+
+    if(_book_side_reserve(side, tick) < 0) {
+        order_free(o);
+        return NULL;
+    }
+
+    e = _book_entry_alloc(b);
+    if(NULL == e) {
+        order_free(o);
+        return NULL;
+    }
+
+    DBG("Adding %s order\n", (side == &b->buy) ? "buy" : "sell");
+
+    if((order_get_display_quantity(o) > 0) &&
+            (order_get_quantity(o) > order_get_display_quantity(o))) {
+        order_set_hidden_quantity(o,
+                order_get_quantity(o) - order_get_display_quantity(o));
+    }
+
+    e->tick = tick;
+    _book_entry_attach(b, e, o, side);
+    _book_side_insert(side, e);
+
+    return e;
+}
+
+/* Record the cumulative quantity on one side of an auction, level
+ * by level from its best price, for as long as the levels can trade
+ * against the other side. The walk stops once the cumulative
+ * quantity covers everything on the other side, since worse prices
+ * can not trade any more volume. Returns the number of points.
+ */
+static unsigned long _book_auction_curve(const BookSide *side,
+        const BookSide *contra, BookCurvePoint *curve)
+{
+    const BookLevel *level;
+    unsigned long long cumulative;
+    unsigned long n;
+    long t;
+
+    cumulative = 0;
+    n = 0;
+
+    if(contra->best < 0) {
+        return 0;
+    }
+
+    for(t = side->best;
+            (t >= 0) && _book_side_crosses(contra, contra->best, t);
+            t = _book_side_next(side, t)) {
+        level = _book_side_level(side, t);
+        cumulative += level->quantity + level->hidden;
+
+        curve[n].tick = t;
+        curve[n].quantity = cumulative;
+        n++;
+
+        if(cumulative >= contra->total) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+/* Find the auction's equilibrium price from one pass over the
+ * cumulative buy and sell curves: the price that trades the most
+ * volume, then leaves the smallest surplus, then is closest to the
+ * last trade price. The work is linear in the number of price
+ * levels in the crossed region, whatever the number of orders.
+ */
+static void _book_auction_equilibrium(Book *b)
+{
+    unsigned long long cum_buy, cum_sell, volume, imbalance;
+    unsigned long long best_volume, best_imbalance;
+    unsigned long nb, ns, i, j, size;
+    long floor, ceiling, p, best_tick;
+    const BookLevel *level;
+    BookCurvePoint *curve;
+
+    b->indicative_tick = -1;
+    b->indicative_volume = 0;
+
+    size = (b->buy.occupied > b->sell.occupied) ?
+        b->buy.occupied : b->sell.occupied;
+
+    if(size > b->curve_size) {
+        curve = realloc(b->buy_curve, size * sizeof(BookCurvePoint));
+        if(NULL == curve) {
+            return;
+        }
+        b->buy_curve = curve;
+
+        curve = realloc(b->sell_curve, size * sizeof(BookCurvePoint));
+        if(NULL == curve) {
+            return;
+        }
+        b->sell_curve = curve;
+
+        b->curve_size = size;
+    }
+
+    nb = _book_auction_curve(&b->buy, &b->sell, b->buy_curve);
+    ns = _book_auction_curve(&b->sell, &b->buy, b->sell_curve);
+
+    /* Prices beyond where a curve was cut short never beat the
+     * price it was cut at, and its quantities aren't known there.
+     * Where both curves are cut short, every price in between
+     * trades everything.
+     */
+    floor = ((nb > 0) && (b->buy_curve[nb - 1].quantity >= b->sell.total)) ?
+        b->buy_curve[nb - 1].tick : BOOK_MARKET_SELL_TICK;
+    ceiling = ((ns > 0) && (b->sell_curve[ns - 1].quantity >= b->buy.total)) ?
+        b->sell_curve[ns - 1].tick : BOOK_MARKET_BUY_TICK;
+
+    if(floor > ceiling) {
+        p = floor;
+        floor = ceiling;
+        ceiling = p;
+    }
+
+    best_tick = -1;
+    best_volume = 0;
+    best_imbalance = 0;
+
+    /* Merge the two curves, visiting candidate prices from the
+     * highest down. The buy curve is in descending price order and
+     * the sell curve in ascending order, so it is walked backwards.
+     */
+    i = 0;
+    j = ns;
+
+    while((i < nb) || (j > 0)) {
+        if((j == 0) || ((i < nb) &&
+                    (b->buy_curve[i].tick >= b->sell_curve[j - 1].tick))) {
+            p = b->buy_curve[i].tick;
+        } else {
+            p = b->sell_curve[j - 1].tick;
+        }
+
+        cum_sell = (j > 0) ? b->sell_curve[j - 1].quantity : 0;
+
+        if((i < nb) && (b->buy_curve[i].tick == p)) {
+            i++;
+        }
+        if((j > 0) && (b->sell_curve[j - 1].tick == p)) {
+            j--;
+        }
+
+        cum_buy = (i > 0) ? b->buy_curve[i - 1].quantity : 0;
+
+        /* Market orders aren't a price to uncross at */
+        if((BOOK_MARKET_SELL_TICK == p) || (BOOK_MARKET_BUY_TICK == p) ||
+                (p < floor) || (p > ceiling)) {
+            continue;
+        }
+
+        volume = (cum_buy < cum_sell) ? cum_buy : cum_sell;
+        imbalance = (cum_buy > cum_sell) ?
+            (cum_buy - cum_sell) : (cum_sell - cum_buy);
+
+        if((0 == volume) || (volume < best_volume)) {
+            continue;
+        }
+
+        if((volume > best_volume) || (imbalance < best_imbalance) ||
+                ((imbalance == best_imbalance) && (b->last_tick >= 0) &&
+                 (labs(p - b->last_tick) < labs(best_tick - b->last_tick)))) {
+            best_tick = p;
+            best_volume = volume;
+            best_imbalance = imbalance;
+        }
+    }
+
+    /* With only market orders crossing, uncross at the last price */
+    if((best_tick < 0) && (b->last_tick >= 0)) {
+        level = _book_side_peek(&b->buy, BOOK_MARKET_BUY_TICK);
+        cum_buy = level->quantity + level->hidden;
+        level = _book_side_peek(&b->sell, BOOK_MARKET_SELL_TICK);
+        cum_sell = level->quantity + level->hidden;
+
+        best_volume = (cum_buy < cum_sell) ? cum_buy : cum_sell;
+        if(best_volume > 0) {
+            best_tick = b->last_tick;
+        }
+    }
+
+    if(best_tick >= 0) {
+        b->indicative_tick = best_tick;
+        b->indicative_volume = best_volume;
+    }
+}
+
+/* Enter an order into the auction's call period. Orders accumulate
+ * without matching, and the indicative price is only recalculated
+ * when the new order could trade against the other side.
+ */
+static void _book_auction_enter(Book *b, Order *o)
+{
+    BookSide *side, *contra;
+    long tick;
+
+    if((ORDER_TIME_IN_FORCE_IOC == order_get_time_in_force(o)) ||
+            (ORDER_TIME_IN_FORCE_FOK == order_get_time_in_force(o))) {
+        /* Nothing to trade against immediately during the call */
+        DBG("Cancelled immediate order during auction\n");
+        order_free(o);
+        return;
+    }
+
+    if(ORDER_SIDE_BUY == order_get_side(o)) {
+        side = &b->buy;
+        contra = &b->sell;
+    } else {
+        side = &b->sell;
+        contra = &b->buy;
+    }
+
+    tick = _book_order_limit(b, o);
+
+    if(NULL == _book_rest_order(b, side, o, tick)) {
+        return;
+    }
+
+    if(ORDER_TYPE_LIMIT_ON_CLOSE == order_get_type(o)) {
+        b->limit_on_close = 1;
+    }
+
+    if((contra->best >= 0) && _book_side_crosses(contra, contra->best, tick)) {
+        _book_auction_equilibrium(b);
+    }
+}
+
+/* Enter a market or limit order into the book. The order is
+ * matched on arrival, and only a limit order's unfilled remainder
+ * ever rests in the book.
+ */
+static void _book_enter_order(Book *b, Order *o)
+{
+    unsigned long remaining;
+    BookSide *side, *contra;
+    long limit;
+
+    if(BOOK_PHASE_AUCTION == b->phase) {
+        _book_auction_enter(b, o);
+        return;
+    }
+
+    if(ORDER_SIDE_BUY == order_get_side(o)) {
+        side = &b->buy;
+        contra = &b->sell;
+    } else {
+        side = &b->sell;
+        contra = &b->buy;
+    }
+
+    limit = _book_order_limit(b, o);
+
+    /* Fill-or-kill orders are killed up front, without touching any
+     * resting orders, unless there is enough quantity available
+     * within their limit to fill them completely.
+     */
+    if((ORDER_TIME_IN_FORCE_FOK == order_get_time_in_force(o)) &&
+            !_book_side_available(contra, limit, order_get_quantity(o))) {
+        DBG("Killed fill-or-kill order\n");
+        order_free(o);
+        return;
+    }
+
+    /* Aggressive orders are matched right away, and never rest in
+     * the book once they stop crossing it.
+     */
+    remaining = _book_match(b, o, limit);
+
+    if((0 == remaining) ||
+            (ORDER_TYPE_MARKET == order_get_type(o)) ||
+            (ORDER_TIME_IN_FORCE_IOC == order_get_time_in_force(o)) ||
+            (ORDER_TIME_IN_FORCE_FOK == order_get_time_in_force(o))) {
+        /* Filled, or the unfilled remainder is cancelled */
+        order_free(o);
+        return;
+    }
+
+    _book_rest_order(b, side, o, limit);
+}
+
+/* Hold an on close order until the closing auction's call period */
+static void _book_hold_on_close(Book *b, Order *o)
+{
+    BookEntry *e;
+
+    e = _book_entry_alloc(b);
+    if(NULL == e) {
+        order_free(o);
+        return;
+    }
+
+    _book_entry_attach(b, e, o, NULL);
+    e->prev = b->on_close_tail;
+    e->next = NULL;
+
+    if(NULL == b->on_close_tail) {
+        b->on_close_head = e;
+    } else {
+        b->on_close_tail->next = e;
+    }
+    b->on_close_tail = e;
+}
+
+/* Cancel every order resting at one price level */
+static void _book_side_purge(Book *b, BookSide *side, long tick)
+{
+    BookEntry *e;
+
+    while(NULL != (e = _book_side_peek(side, tick)->head)) {
+        _book_side_remove(side, e);
+        order_free(e->order);
+        _book_entry_free(b, e);
+    }
+}
+
+/* Cancel the limit on close orders left over after the close */
+static void _book_side_purge_on_close(Book *b, BookSide *side)
+{
+    BookEntry *e, *next;
+    long t, t_next;
+
+    for(t = side->best; t >= 0; t = t_next) {
+        t_next = _book_side_next(side, t);
+
+        for(e = _book_side_level(side, t)->head; NULL != e; e = next) {
+            next = e->next;
+
+            if(ORDER_TYPE_LIMIT_ON_CLOSE == order_get_type(e->order)) {
+                _book_side_remove(side, e);
+                order_free(e->order);
+                _book_entry_free(b, e);
+            }
+        }
+    }
+}
+
+/* Detach every level of a stop side that is triggered by the last
+ * trade price, appending their orders to the triggered list in
+ * trigger price and then time order.
+ */
+static void _book_stops_detach(BookSide *stops, long last,
+        BookEntry **head, BookEntry **tail)
+{
+    BookLevel *level;
+    long t;
+
+    while(((t = stops->best) >= 0) && _book_side_crosses(stops, t, last)) {
+        level = _book_side_level(stops, t);
+
+        if(NULL == *tail) {
+            *head = level->head;
+        } else {
+            (*tail)->next = level->head;
+            level->head->prev = *tail;
+        }
+        *tail = level->tail;
+
+        stops->total -= level->quantity + level->hidden;
+
+        level->head = level->tail = NULL;
+        level->quantity = 0;
+        level->hidden = 0;
+        level->orders = 0;
+        level->pegged = 0;
+
+        stops->occupied--;
+        _book_side_unmark(stops, t);
+        stops->best = (stops->occupied > 0) ? _book_side_next(stops, t) : -1;
+    }
+}
+
+/* Release all stop orders triggered by trading since the last call.
+ * Buy stops trigger at or above their stop price, and sell stops at
+ * or below it, so each side is released by one scan of its levels
+ * from the best stop price up to the last trade price. Triggered
+ * orders re-enter matching one at a time, buy stops before sell
+ * stops, and any stops triggered in turn by their trades are
+ * released by the next pass.
+ */
+static void _book_release_stops(Book *b)
+{
+    BookEntry *head, *tail, *e;
+    Order *o;
+
+    while(b->last_tick >= 0) {
+        head = tail = NULL;
+
+        _book_stops_detach(&b->buy_stops, b->last_tick, &head, &tail);
+        _book_stops_detach(&b->sell_stops, b->last_tick, &head, &tail);
+
+        if(NULL == head) {
+            break;
+        }
+
+        while(NULL != head) {
+            e = head;
+            head = e->next;
+
+            o = e->order;
+            _book_entry_free(b, e);
+
+            DBG("Triggered stop order %llu\n", order_get_id(o));
+
+            order_set_type(o, (ORDER_TYPE_STOP_LIMIT == order_get_type(o)) ?
+                    ORDER_TYPE_LIMIT : ORDER_TYPE_MARKET);
+            order_set_sequence(o, ++b->sequence);
+
+            _book_enter_order(b, o);
+        }
+    }
+}
+
+/* Rest a stop or stop limit order until the market trades through
+ * its stop price.
+ */
+static void _book_enter_stop(Book *b, Order *o)
+{
+    BookSide *side;
+    BookEntry *e;
+    long tick;
+
+    side = (ORDER_SIDE_BUY == order_get_side(o)) ?
+        &b->buy_stops : &b->sell_stops;
+    tick = _book_price_to_tick(b, order_get_stop_price(o));
+
+    if(_book_side_reserve(side, tick) < 0) {
+        order_free(o);
+        return;
+    }
+
+    e = _book_entry_alloc(b);
+    if(NULL == e) {
+        order_free(o);
+        return;
+    }
+
+    e->tick = tick;
+    _book_entry_attach(b, e, o, side);
+    _book_side_insert(side, e);
+}
+
+/* Best level of a side with a price, skipping market orders resting
+ * in an auction, or -1 if there is none
+ */
+static long _book_side_best_priced(const BookSide *side)
+{
+    long t = side->best;
+
+    if((BOOK_MARKET_SELL_TICK == t) || (BOOK_MARKET_BUY_TICK == t)) {
+        t = _book_side_next(side, t);
+    }
+
+    return t;
+}
+
+static int _book_is_crossed(const Book *b)
+{
+    return (BOOK_PHASE_CONTINUOUS == b->phase) &&
+        (b->buy.best >= 0) && (b->sell.best >= 0) &&
+        (b->buy.best >= b->sell.best);
+}
+
+/* Fill the best bid against the best offer, at the offer's price */
+static void _book_uncross_top(Book *b)
+{
+    unsigned long bid_quantity, quote_quantity, fill;
+    BookEntry *bid, *quote;
+    long price;
+
+    bid   = _book_side_level(&b->buy, b->buy.best)->head;
+    quote = _book_side_level(&b->sell, b->sell.best)->head;
+    price = b->sell.best;
+
+    bid_quantity    = _book_entry_visible(bid);
+    quote_quantity  = _book_entry_visible(quote);
+
+    fill = (bid_quantity < quote_quantity) ? bid_quantity : quote_quantity;
+
+    trace_event(TRACE_EVENT_UNCROSS, price, fill);
+
+    _book_trade(b, bid->order, quote->order, price, fill);
+    _book_fill(b, &b->buy, bid, fill);
+    _book_fill(b, &b->sell, quote, fill);
+}
+
+static int _book_order_is_pegged(const Order *o)
+{
+    return (ORDER_TYPE_PEG_PRIMARY == order_get_type(o)) ||
+        (ORDER_TYPE_PEG_MARKET == order_get_type(o)) ||
+        (ORDER_TYPE_PEG_MIDPOINT == order_get_type(o));
+}
+
+/* A pegged order's offset in ticks, which may be negative */
+static long _book_peg_offset(const Order *o)
+{
+    float offset = order_get_peg_offset(o);
+
+    return (offset < 0.0f) ?
+        -_book_ticks(-offset) : _book_ticks(offset);
+}
+
+/* Best price on a side that isn't set only by pegged orders, or -1.
+ * Pegs follow these prices, so they never follow each other.
+ */
+static long _book_side_reference(const BookSide *side)
+{
+    const BookLevel *level;
+    long t;
+
+    for(t = _book_side_best_priced(side); t >= 0;
+            t = _book_side_next(side, t)) {
+        level = _book_side_level(side, t);
+        if(level->orders > level->pegged) {
+            break;
+        }
+    }
+
+    return t;
+}
+
+/* Price of a peg, given the reference bid and ask, or -1 if it
+ * can't be priced. Pegs are kept from reaching the other side's
+ * reference price, so they never take liquidity when they move.
+ */
+static long _book_peg_tick(const Book *b, const BookSide *side,
+        ORDER_TYPE type, long offset, long bid, long ask)
+{
+    int is_buy = (side == &b->buy);
+    long ref;
+
+    switch(type) {
+        case ORDER_TYPE_PEG_PRIMARY:
+            ref = is_buy ? bid : ask;
+            break;
+
+        case ORDER_TYPE_PEG_MARKET:
+            ref = is_buy ? ask : bid;
+            break;
+
+        case ORDER_TYPE_PEG_MIDPOINT:
+            if((bid < 0) || (ask < 0)) {
+                return -1;
+            }
+            /* Rounded away from the other side */
+            ref = is_buy ? ((bid + ask) / 2) : ((bid + ask + 1) / 2);
+            break;
+
+        default:
+            return -1;
+    }
+
+    if(ref < 0) {
+        return -1;
+    }
+
+    ref += offset;
+
+    if(is_buy && (ask >= 0) && (ref >= ask)) {
+        ref = ask - 1;
+    } else if(!is_buy && (bid >= 0) && (ref <= bid)) {
+        ref = bid + 1;
+    }
+
+    return _book_tick_is_valid(ref) ? ref : -1;
+}
+
+/* Find the group for a peg, or add it, priced at tick, in its place
+ * in the book's list of groups
+ */
+static BookPegGroup* _book_peg_group(Book *b, BookSide *side,
+        ORDER_TYPE type, long offset, long tick)
+{
+    BookPegGroup **link, *g;
+    int cmp;
+
+    for(link = &b->pegs; NULL != (g = *link); link = &g->next) {
+        cmp = (side != g->side) ? ((side == &b->buy) ? -1 : 1) :
+            (type != g->type) ? ((type < g->type) ? -1 : 1) :
+            (offset != g->offset) ? ((offset < g->offset) ? -1 : 1) : 0;
+
+        if(0 == cmp) {
+            return g;
+        }
+        if(cmp < 0) {
+            break;
+        }
+    }
+
+    g = malloc(sizeof(BookPegGroup));
+    if(NULL == g) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    g->side = side;
+    g->type = type;
+    g->offset = offset;
+    g->tick = tick;
+    g->head = NULL;
+    g->tail = NULL;
+
+    g->next = *link;
+    *link = g;
+
+    return g;
+}
+
+/* Add a pegged order's entry to the back of its group, and of the
+ * group's level unless the group is parked
+ */
+static void _book_peg_join(const Book *b, BookPegGroup *g, BookEntry *e,
+        Order *o)
+{
+    e->tick = g->tick;
+    e->peg = g;
+    e->peg_next = NULL;
+    e->peg_prev = g->tail;
+
+    if(NULL == g->tail) {
+        g->head = e;
+    } else {
+        g->tail->peg_next = e;
+    }
+    g->tail = e;
+
+    order_set_price(o,
+            (g->tick >= 0) ? _book_tick_to_price(b, g->tick) : 0.0f);
+}
+
+/* Move a whole group to a new price, in one pass over its orders.
+ * They leave their old level and join the back of the new one in
+ * the same order, and each level's aggregates are updated once.
+ */
+static void _book_peg_move(Book *b, BookPegGroup *g, long tick)
+{
+    unsigned long long visible, hidden;
+    BookLevel *from, *to;
+    BookSide *side;
+    unsigned long count;
+    int was_empty;
+    BookEntry *e;
+    float price;
+
+    side = g->side;
+
+    /* With no memory for the new level, the group is parked */
+    if((tick >= 0) && (_book_side_reserve(side, tick) < 0)) {
+        tick = -1;
+    }
+
+    from = (g->tick >= 0) ? _book_side_level(side, g->tick) : NULL;
+    to = (tick >= 0) ? _book_side_level(side, tick) : NULL;
+    was_empty = (NULL != to) && (NULL == to->head);
+    price = (tick >= 0) ? _book_tick_to_price(b, tick) : 0.0f;
+
+    visible = hidden = 0;
+    count = 0;
+
+    for(e = g->head; NULL != e; e = e->peg_next) {
+        if(NULL != from) {
+            if(NULL == e->prev) {
+                from->head = e->next;
+            } else {
+                e->prev->next = e->next;
+            }
+
+            if(NULL == e->next) {
+                from->tail = e->prev;
+            } else {
+                e->next->prev = e->prev;
+            }
+        }
+
+        if(NULL != to) {
+            e->next = NULL;
+            e->prev = to->tail;
+
+            if(NULL == to->tail) {
+                to->head = e;
+            } else {
+                to->tail->next = e;
+            }
+            to->tail = e;
+
+            order_set_sequence(e->order, ++b->sequence);
+        }
+
+        e->tick = tick;
+        order_set_price(e->order, price);
+
+        visible += _book_entry_visible(e);
+        hidden += order_get_hidden_quantity(e->order);
+        count++;
+    }
+
+    if(NULL != from) {
+        from->quantity -= visible;
+        from->hidden -= hidden;
+        from->orders -= count;
+        from->pegged -= count;
+        side->total -= visible + hidden;
+
+        if(NULL == from->head) {
+            side->occupied--;
+            _book_side_unmark(side, g->tick);
+
+            if(g->tick == side->best) {
+                side->best = (side->occupied > 0) ?
+                    _book_side_next(side, g->tick) : -1;
+            }
+        }
+    }
+
+    if(NULL != to) {
+        to->quantity += visible;
+        to->hidden += hidden;
+        to->orders += count;
+        to->pegged += count;
+        side->total += visible + hidden;
+
+        if(was_empty) {
+            side->occupied++;
+            _book_side_mark(side, tick);
+
+            if((side->best < 0) ||
+                    _book_side_is_better(side, tick, side->best)) {
+                side->best = tick;
+            }
+        }
+    }
+
+    g->tick = tick;
+}
+
+/* Pegs are kept off the unpegged orders on the other side, but a
+ * buy peg can still cross a sell peg. Those are filled at once, in
+ * the command that crossed them, so what trades doesn't depend on
+ * when the matcher thread next runs.
+ */
+static void _book_cross_pegs(Book *b)
+{
+    if(!_book_is_crossed(b)) {
+        return;
+    }
+
+    while(_book_is_crossed(b)) {
+        _book_uncross_top(b);
+    }
+
+    _book_release_stops(b);
+}
+
+/* Reprice the peg groups if the best unpegged bid or offer has
+ * moved. Each group moves as a whole, and only if its own price has
+ * changed, so the cost is per group rather than per order. Pegs are
+ * left where they are during an auction's call period.
+ */
+static void _book_reprice_pegs(Book *b)
+{
+    BookPegGroup *g;
+    long bid, ask, tick;
+
+    if((NULL == b->pegs) || (BOOK_PHASE_AUCTION == b->phase)) {
+        return;
+    }
+
+    /* Stops triggered by pegs trading can move the prices again */
+    for(;;) {
+        bid = _book_side_reference(&b->buy);
+        ask = _book_side_reference(&b->sell);
+
+        if((bid == b->peg_bid) && (ask == b->peg_ask)) {
+            return;
+        }
+
+        b->peg_bid = bid;
+        b->peg_ask = ask;
+
+        for(g = b->pegs; NULL != g; g = g->next) {
+            tick = _book_peg_tick(b, g->side, g->type, g->offset, bid, ask);
+            if(tick != g->tick) {
+                trace_event(TRACE_EVENT_REPRICE, tick, g->offset);
+                _book_peg_move(b, g, tick);
+            }
+        }
+
+        _book_cross_pegs(b);
+    }
+}
+
+/* Rest a pegged order at the back of its group. Pegs only ever rest,
+ * so the order isn't matched on arrival.
+ */
+static void _book_enter_peg(Book *b, Order *o)
+{
+    BookPegGroup *g;
+    BookSide *side;
+    BookEntry *e;
+    long offset;
+
+    side = (ORDER_SIDE_BUY == order_get_side(o)) ? &b->buy : &b->sell;
+    offset = _book_peg_offset(o);
+
+    /* Bring the groups up to date, so a new group is priced from the
+     * same prices as the rest
+     */
+    _book_reprice_pegs(b);
+    b->peg_bid = _book_side_reference(&b->buy);
+    b->peg_ask = _book_side_reference(&b->sell);
+
+    g = _book_peg_group(b, side, order_get_type(o), offset,
+            _book_peg_tick(b, side, order_get_type(o), offset,
+                b->peg_bid, b->peg_ask));
+    if(NULL == g) {
+        order_free(o);
+        return;
+    }
+
+    if((g->tick >= 0) && (_book_side_reserve(side, g->tick) < 0)) {
+        e = NULL;
+    } else {
+        e = _book_entry_alloc(b);
+    }
+
+    if(NULL == e) {
+        if(NULL == g->head) {
+            _book_peg_drop(b, g);
+        }
+        order_free(o);
+        return;
+    }
+
+    if((order_get_display_quantity(o) > 0) &&
+            (order_get_quantity(o) > order_get_display_quantity(o))) {
+        order_set_hidden_quantity(o,
+                order_get_quantity(o) - order_get_display_quantity(o));
+    }
+
+    _book_peg_join(b, g, e, o);
+    _book_entry_attach(b, e, o, side);
+
+    if(g->tick >= 0) {
+        _book_side_insert(side, e);
+        _book_cross_pegs(b);
+    }
+}
+
+/* Publish a new top of book snapshot. Called with matcher_mutex
+ * held after every change to the book, so pegged orders are first
+ * moved to follow any change in the prices they are pegged to.
+ */
+static void _book_publish(Book *b)
+{
+    BookTop *top = &b->snapshot.top;
+    unsigned long sequence;
+    long bid, ask;
+
+    _book_reprice_pegs(b);
+
+    bid = _book_side_best_priced(&b->buy);
+    ask = _book_side_best_priced(&b->sell);
+
+    sequence = b->snapshot.sequence;
+    __atomic_store_n(&b->snapshot.sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    top->bid_price = (bid >= 0) ? _book_tick_to_price(b, bid) : 0.0f;
+    top->bid_quantity = (bid >= 0) ?
+        _book_side_level(&b->buy, bid)->quantity : 0;
+    top->ask_price = (ask >= 0) ? _book_tick_to_price(b, ask) : 0.0f;
+    top->ask_quantity = (ask >= 0) ?
+        _book_side_level(&b->sell, ask)->quantity : 0;
+    top->last_price = (b->last_tick >= 0) ?
+        _book_tick_to_price(b, b->last_tick) : 0.0f;
+    top->last_quantity = b->last_quantity;
+    top->volume = b->line.counters.volume;
+    top->orders_filled = b->line.counters.orders_filled;
+
+    __atomic_store_n(&b->snapshot.sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Take an order out of the book without trading it, wherever it is
+ * held, and free it. Each removal is journalled as a command of its
+ * own, so pegs follow it straight away, as they do on replay.
+ */
+static void _book_remove_entry(Book *b, BookEntry *e)
+{
+    if(NULL != e->side) {
+        /* A parked pegged order isn't in any level */
+        if(e->tick >= 0) {
+            _book_side_remove(e->side, e);
+        }
+    } else {
+        if(NULL == e->prev) {
+            b->on_close_head = e->next;
+        } else {
+            e->prev->next = e->next;
+        }
+
+        if(NULL == e->next) {
+            b->on_close_tail = e->prev;
+        } else {
+            e->next->prev = e->prev;
+        }
+    }
+
+    order_free(e->order);
+    _book_entry_free(b, e);
+
+    _book_reprice_pegs(b);
+}
+
+/* Cut an order's quantity down in place. It keeps its place in the
+ * queue, and an iceberg order gives up its reserve first.
+ */
+static void _book_amend_entry(BookEntry *e, unsigned long quantity)
+{
+    unsigned long cut, hidden, from_hidden;
+    BookLevel *level;
+
+    cut = order_get_quantity(e->order) - quantity;
+    hidden = order_get_hidden_quantity(e->order);
+    from_hidden = (cut < hidden) ? cut : hidden;
+
+    if((NULL != e->side) && (e->tick >= 0)) {
+        level = _book_side_level(e->side, e->tick);
+        level->quantity -= cut - from_hidden;
+        level->hidden -= from_hidden;
+        e->side->total -= cut;
+    }
+
+    order_set_hidden_quantity(e->order, hidden - from_hidden);
+    order_set_quantity(e->order, quantity);
+
+    DBG("Amended order %llu to %lu\n", e->id, quantity);
+
+    journal_amend(e->order);
+    trace_event(TRACE_EVENT_AMEND, e->id, quantity);
+}
+
+/* Take an expired order out of the book */
+static void _book_expire_entry(Book *b, BookEntry *e)
+{
+    Order *o = e->order;
+
+    DBG("Expired order %llu\n", order_get_id(o));
+
+    journal_expire(o);
+    trace_event(TRACE_EVENT_EXPIRE, order_get_id(o), order_get_quantity(o));
+
+    _book_remove_entry(b, e);
+}
+
+/* Expire every order that is due by now. The wheel hands back all
+ * of a tick's orders at once, so however many orders expire together
+ * the book is never searched for them.
+ */
+static void _book_expire(Book *b, unsigned long long now)
+{
+    unsigned long expired;
+    Timer *timer;
+
+    timer_wheel_advance(b->expiry, now);
+
+    expired = 0;
+
+    while(NULL != (timer = timer_wheel_next_expired(b->expiry))) {
+        _book_expire_entry(b, (BookEntry *)timer->data);
+        expired++;
+    }
+
+    if(expired > 0) {
+        if(BOOK_PHASE_AUCTION == b->phase) {
+            _book_auction_equilibrium(b);
+        }
+        _book_publish(b);
+    }
+}
+
+/* Incoming orders are matched on arrival, so outside of an auction
+ * the book is only ever left crossed transiently. The matcher thread
+ * uncrosses it, filling at the quote's price, whenever it is
+ * signalled that it is. It also expires orders, a tick's worth at a
+ * time.
+ */
+void* _book_fill_orders(void *arg)
+{
+    unsigned long long now;
+    struct timespec tick;
+    char name[32];
+    Book *b;
+
+    if(NULL == arg) {
+        LOG_ERROR("(%s:%d) Matcher thread received invalid Book.",
+                __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    b = (Book *)arg;
+
+    snprintf(name, sizeof(name), "matcher %s", string_get_chars(b->symbol));
+    trace_set_thread_name(name);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    while(b->book_is_open) {
+        if(_book_is_crossed(b)) {
+            _book_uncross_top(b);
+            _book_release_stops(b);
+            _book_publish(b);
+        } else if(b->expiry_enabled &&
+                (timer_wheel_get_armed(b->expiry) > 0)) {
+            /* Orders are waiting to expire, so wake up every tick */
+            now = timestamp_now();
+            _book_expire(b, now);
+
+            now += BOOK_EXPIRY_TICK_MS * 1000000ULL;
+            tick.tv_sec = now / 1000000000ULL;
+            tick.tv_nsec = now % 1000000000ULL;
+
+            pthread_cond_timedwait(&b->matcher_cond, &b->matcher_mutex, &tick);
+        } else {
+            pthread_cond_wait(&b->matcher_cond, &b->matcher_mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return NULL;
+}
+
+Book* book_open(const String *symbol)
+{
+    struct sched_param sched;
+    pthread_attr_t attr;
+    Book *new_book;
+
+    assert(symbol != NULL);
+
+    if(string_length(symbol) > BOOK_SYMBOL_LEN) {
+        LOG_WARNING("(%s:%d) Symbol '%s' is longer than %d characters",
+                __FUNCTION__, __LINE__, string_get_chars(symbol),
+                BOOK_SYMBOL_LEN);
+        return NULL;
+    }
+
+    LOG_INFO("Book: Open new book for: '%s'", string_get_chars(symbol));
+
+    if(posix_memalign((void **)&new_book, BOOK_CACHE_LINE,
+                sizeof(struct _book)) != 0) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    new_book->symbol = string_duplicate(symbol);
+    memset(&new_book->line, 0, sizeof(new_book->line));
+    new_book->sequence = 0;
+
+    new_book->free_entries = NULL;
+    new_book->entry_chunks = darray_create();
+
+    if(_book_side_init(&new_book->buy, 0) < 0) {
+        LOG_ERROR("(%s:%d) Couldn't create buy side",
+                __FUNCTION__, __LINE__);
+        free(new_book);
+        return NULL;
+    }
+
+    if(_book_side_init(&new_book->sell, 1) < 0) {
+        LOG_ERROR("(%s:%d) Couldn't create sell side",
+                __FUNCTION__, __LINE__);
+        _book_side_release(&new_book->buy);
+        free(new_book);
+        return NULL;
+    }
+
+    if(_book_side_init(&new_book->buy_stops, 1) < 0) {
+        LOG_ERROR("(%s:%d) Couldn't create stop sides",
+                __FUNCTION__, __LINE__);
+        _book_side_release(&new_book->sell);
+        _book_side_release(&new_book->buy);
+        free(new_book);
+        return NULL;
+    }
+
+    if(_book_side_init(&new_book->sell_stops, 0) < 0) {
+        LOG_ERROR("(%s:%d) Couldn't create stop sides",
+                __FUNCTION__, __LINE__);
+        _book_side_release(&new_book->buy_stops);
+        _book_side_release(&new_book->sell);
+        _book_side_release(&new_book->buy);
+        free(new_book);
+        return NULL;
+    }
+
+    new_book->base = -1;
+    new_book->last_tick = -1;
+    new_book->last_quantity = 0;
+
+    memset(&new_book->snapshot, 0, sizeof(new_book->snapshot));
+
+    new_book->phase = BOOK_PHASE_CONTINUOUS;
+    new_book->auction = BOOK_AUCTION_OPEN;
+    new_book->indicative_tick = -1;
+    new_book->indicative_volume = 0;
+    new_book->limit_on_close = 0;
+
+    new_book->buy_curve = NULL;
+    new_book->sell_curve = NULL;
+    new_book->curve_size = 0;
+
+    new_book->on_close_head = NULL;
+    new_book->on_close_tail = NULL;
+
+    new_book->index_size = BOOK_INDEX_SIZE;
+    new_book->index_count = 0;
+    new_book->index = calloc(BOOK_INDEX_SIZE, sizeof(BookIndexSlot));
+
+    new_book->expiry = timer_wheel_create(BOOK_EXPIRY_TICK_MS * 1000000ULL,
+            timestamp_now());
+    new_book->expiry_enabled = 1;
+
+    /* Not priced from anything yet */
+    new_book->pegs = NULL;
+    new_book->peg_bid = -2;
+    new_book->peg_ask = -2;
+
+    if((NULL == new_book->index) || (NULL == new_book->expiry)) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        if(NULL != new_book->expiry) {
+            timer_wheel_free(new_book->expiry);
+        }
+        free(new_book->index);
+        _book_side_release(&new_book->sell_stops);
+        _book_side_release(&new_book->buy_stops);
+        _book_side_release(&new_book->sell);
+        _book_side_release(&new_book->buy);
+        free(new_book);
+        return NULL;
+    }
+
+    new_book->book_is_open = 1;
+
+    pthread_mutex_init(&new_book->matcher_mutex, NULL);
+    pthread_cond_init(&new_book->matcher_cond, NULL);
+
+    /* Create matcher thread with a high priority */
+    pthread_attr_init(&attr);
+    pthread_attr_setschedpolicy(&attr, SCHED_RR);
+    pthread_attr_getschedparam(&attr, &sched);
+    sched.sched_priority = sched_get_priority_max(SCHED_RR) - 1;
+    assert(pthread_attr_setschedparam(&attr, &sched) == 0);
+
+    assert(pthread_create(&new_book->matcher_thread,
+                &attr, _book_fill_orders, new_book) == 0);
+
+    return new_book;
+}
+
+static void _book_side_free(BookSide *side)
+{
+    BookEntry *e;
+
+    while(side->best >= 0) {
+        e = _book_side_level(side, side->best)->head;
+        _book_side_remove(side, e);
+        order_free(e->order);
+    }
+
+    _book_side_release(side);
+}
+
+void book_close(Book *b)
+{
+    BookPegGroup *g;
+    BookEntry *e;
+
+    assert(b != NULL);
+
+    LOG_INFO("Book: Closing book for: '%s'", string_get_chars(b->symbol));
+
+    /* Tell the matcher thread that the book is closing */
+    pthread_mutex_lock(&b->matcher_mutex);
+    b->book_is_open = 0;
+    pthread_cond_signal(&b->matcher_cond);
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    pthread_join(b->matcher_thread, NULL);
+
+    pthread_cond_destroy(&b->matcher_cond);
+    pthread_mutex_destroy(&b->matcher_mutex);
+
+    string_free(b->symbol);
+
+    _book_side_free(&b->buy);
+    _book_side_free(&b->sell);
+    _book_side_free(&b->buy_stops);
+    _book_side_free(&b->sell_stops);
+
+    while(NULL != b->on_close_head) {
+        order_free(b->on_close_head->order);
+        b->on_close_head = b->on_close_head->next;
+    }
+
+    /* Parked pegged orders aren't on either side */
+    while(NULL != (g = b->pegs)) {
+        b->pegs = g->next;
+
+        for(e = g->head; (g->tick < 0) && (NULL != e); e = e->peg_next) {
+            order_free(e->order);
+        }
+        free(g);
+    }
+
+    free(b->buy_curve);
+    free(b->sell_curve);
+    free(b->index);
+    timer_wheel_free(b->expiry);
+    darray_free_all(b->entry_chunks, (FreeFn)free);
+
+    free(b);
+}
+
+/* Log a price that lies off the ladder the book has, or would have
+ * from base
+ */
+static void _book_range_warning(const Book *b, const char *what,
+        float price, long base)
+{
+    LOG_WARNING("(%s:%d) %s price %.2f is outside %.2f to %.2f for %s",
+            __FUNCTION__, __LINE__, what, price,
+            (float)(base + 1) / BOOK_TICKS_PER_UNIT,
+            (float)(base + BOOK_MAX_TICKS - 2) / BOOK_TICKS_PER_UNIT,
+            string_get_chars(b->symbol));
+}
+
+/* Check that an order can enter the book, and work out when it
+ * expires. Called with matcher_mutex held. Returns -1 if the order
+ * is rejected, which leaves it with the caller.
+ */
+static int _book_check_order(Book *b, Order *o)
+{
+    unsigned long long now;
+    long base = -1;
+    long tick;
+
+    if(string_compare(order_get_symbol(o), b->symbol) != 0) {
+        /* ERROR: Symbols don't match. Wrong book? */
+        LOG_WARNING("(%s:%d) Symbols don't match: Book=\"%s\" Order=\"%s\"",
+                __FUNCTION__, __LINE__,
+                string_get_chars(b->symbol),
+                string_get_chars(order_get_symbol(o)));
+        return -1;
+    }
+
+    if((ORDER_SIDE_BUY != order_get_side(o)) &&
+            (ORDER_SIDE_SELL != order_get_side(o))) {
+        /* ERROR: Unknown order side */
+        LOG_WARNING("Unknown order side");
+        return -1;
+    }
+
+    if(0 == order_get_quantity(o)) {
+        LOG_WARNING("Invalid order quantity");
+        return -1;
+    }
+
+    switch(order_get_type(o)) {
+        case ORDER_TYPE_MARKET:
+        case ORDER_TYPE_MARKET_ON_CLOSE:
+            break;
+
+        case ORDER_TYPE_STOP:
+        case ORDER_TYPE_STOP_LIMIT:
+            /* A stop order's first price is its stop price */
+            base = _book_base_for(b, order_get_stop_price(o));
+            tick = _book_ticks_above(base, order_get_stop_price(o));
+            if(!_book_tick_is_valid(tick)) {
+                _book_range_warning(b, "Stop", order_get_stop_price(o),
+                        base);
+                return -1;
+            }
+
+            if(ORDER_TYPE_STOP == order_get_type(o)) {
+                break;
+            }
+
+            /* Stop limit orders also need a valid limit price, so
+             * fall through to check it.
+             */
+
+        case ORDER_TYPE_LIMIT:
+        case ORDER_TYPE_LIMIT_ON_CLOSE:
+            if(base < 0) {
+                base = _book_base_for(b, order_get_price(o));
+            }
+            tick = _book_ticks_above(base, order_get_price(o));
+            if(!_book_tick_is_valid(tick)) {
+                _book_range_warning(b, "Limit", order_get_price(o), base);
+                return -1;
+            }
+            break;
+
+        case ORDER_TYPE_PEG_PRIMARY:
+        case ORDER_TYPE_PEG_MARKET:
+        case ORDER_TYPE_PEG_MIDPOINT:
+            /* Pegs only rest, and the prices they follow are frozen
+             * during an auction call
+             */
+            if((ORDER_TIME_IN_FORCE_IOC == order_get_time_in_force(o)) ||
+                    (ORDER_TIME_IN_FORCE_FOK == order_get_time_in_force(o))) {
+                LOG_WARNING("Pegged orders can't be immediate");
+                return -1;
+            }
+            if(BOOK_PHASE_AUCTION == b->phase) {
+                LOG_WARNING("Pegged orders aren't accepted during an auction");
+                return -1;
+            }
+            break;
+
+        case ORDER_TYPE_CANCEL:
+        case ORDER_TYPE_REPLACE:
+        default:
+            /* ERROR: Unsupported order type */
+            LOG_WARNING("Unsupported order type");
+            return -1;
+            break;
+    }
+
+    /* Day orders expire at the end of the day they were entered. The
+     * expire time is journalled with the order, so it is only worked
+     * out the first time round.
+     */
+    switch(order_get_time_in_force(o)) {
+        case ORDER_TIME_IN_FORCE_DAY:
+            if(0 == order_get_expire_time(o)) {
+                order_set_expire_time(o, order_day_end(order_get_timestamp(o)));
+            }
+            break;
+
+        case ORDER_TIME_IN_FORCE_GTD:
+        case ORDER_TIME_IN_FORCE_GTT:
+            if(0 == order_get_expire_time(o)) {
+                LOG_WARNING("Order has no expire time");
+                return -1;
+            }
+            break;
+
+        default:
+            order_set_expire_time(o, 0);
+            break;
+    }
+
+    /* Expire anything due before the order arrives, so that it never
+     * trades with an order whose time has passed
+     */
+    if(b->expiry_enabled) {
+        now = timestamp_now();
+        _book_expire(b, now);
+
+        if((order_get_expire_time(o) > 0) && (order_get_expire_time(o) <= now)) {
+            LOG_WARNING("Order has already expired");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Place the ladder around the first priced order the book is given.
+ * The checks have already made sure the order's prices fit on it.
+ */
+static void _book_anchor(Book *b, const Order *o)
+{
+    switch(order_get_type(o)) {
+        case ORDER_TYPE_STOP:
+        case ORDER_TYPE_STOP_LIMIT:
+            b->base = _book_base_for(b, order_get_stop_price(o));
+            break;
+
+        case ORDER_TYPE_LIMIT:
+        case ORDER_TYPE_LIMIT_ON_CLOSE:
+            b->base = _book_base_for(b, order_get_price(o));
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* Sequence, journal and enter an order that has passed its checks.
+ * Called with matcher_mutex held. The order may be filled and freed
+ * before this returns.
+ */
+static void _book_add_order(Book *b, Order *o)
+{
+    order_set_sequence(o, ++b->sequence);
+    _book_count(&b->line.counters.orders, 1);
+
+    journal_order(o);
+
+    _book_anchor(b, o);
+
+    if((ORDER_TYPE_STOP == order_get_type(o)) ||
+            (ORDER_TYPE_STOP_LIMIT == order_get_type(o))) {
+        /* A stop that the last trade has already gone through is
+         * triggered straight away by the release below.
+         */
+        _book_enter_stop(b, o);
+    } else if(_book_order_is_pegged(o)) {
+        _book_enter_peg(b, o);
+    } else if(((ORDER_TYPE_MARKET_ON_CLOSE == order_get_type(o)) ||
+                (ORDER_TYPE_LIMIT_ON_CLOSE == order_get_type(o))) &&
+            !((BOOK_PHASE_AUCTION == b->phase) &&
+              (BOOK_AUCTION_CLOSE == b->auction))) {
+        _book_hold_on_close(b, o);
+    } else {
+        _book_enter_order(b, o);
+    }
+
+    _book_release_stops(b);
+    _book_reprice_pegs(b);
+}
+
+/* Signal the matcher thread if the book is crossed, or if it now has
+ * orders to expire when it had none before
+ */
+static void _book_wake_matcher(Book *b, unsigned long armed)
+{
+    if(_book_is_crossed(b) ||
+            ((0 == armed) && (timer_wheel_get_armed(b->expiry) > 0))) {
+        pthread_cond_signal(&b->matcher_cond);
+    }
+}
+
+/* On success the book takes ownership of the order: it either rests
+ * in the book, or is freed once filled or cancelled. On failure the
+ * order still belongs to the caller.
+ */
+int book_process_order(Book *b, Order *o)
+{
+    unsigned long long id;
+    unsigned long armed;
+    LatencyTrace trace;
+
+    assert(b != NULL);
+    assert(o != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    latency_stamp(order_get_latency(o), LATENCY_STAGE_MATCHER_DEQUEUE);
+
+    if(_book_check_order(b, o) < 0) {
+        pthread_mutex_unlock(&b->matcher_mutex);
+        return -1;
+    }
+
+    armed = timer_wheel_get_armed(b->expiry);
+
+    /* The order may be filled and freed while it is entered */
+    trace = *order_get_latency(o);
+    id = order_get_id(o);
+
+    trace_event(TRACE_EVENT_ORDER_BEGIN, id, order_get_quantity(o));
+
+    _book_add_order(b, o);
+    _book_publish(b);
+    _book_wake_matcher(b, armed);
+
+    latency_stamp(&trace, LATENCY_STAGE_MATCH_COMPLETE);
+    trace_event(TRACE_EVENT_ORDER_END, id, b->sequence);
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    latency_record(&trace);
+
+    return 0;
+}
+
+/* Start an auction's call period. For the closing auction, the on
+ * close orders held back during continuous trading join the call.
+ */
+int book_auction_start(Book *b, BOOK_AUCTION auction)
+{
+    unsigned long armed;
+    BookEntry *e;
+    Order *o;
+
+    assert(b != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    if(BOOK_PHASE_AUCTION == b->phase) {
+        pthread_mutex_unlock(&b->matcher_mutex);
+        return -1;
+    }
+
+    b->phase = BOOK_PHASE_AUCTION;
+    b->auction = auction;
+
+    journal_auction(b->symbol, JOURNAL_RECORD_AUCTION_START, auction);
+
+    armed = timer_wheel_get_armed(b->expiry);
+
+    if(BOOK_AUCTION_CLOSE == auction) {
+        while(NULL != (e = b->on_close_head)) {
+            b->on_close_head = e->next;
+
+            o = e->order;
+            _book_entry_free(b, e);
+            _book_auction_enter(b, o);
+        }
+        b->on_close_tail = NULL;
+    }
+
+    _book_auction_equilibrium(b);
+    _book_publish(b);
+
+    /* The on close orders may have brought expiry times with them */
+    if((0 == armed) && (timer_wheel_get_armed(b->expiry) > 0)) {
+        pthread_cond_signal(&b->matcher_cond);
+    }
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return 0;
+}
+
+/* Uncross the auction at its equilibrium price, executing the whole
+ * auction volume as one batch, and return to continuous trading.
+ * Unfilled market orders are cancelled, as are limit on close
+ * orders after the closing auction.
+ */
+int book_auction_uncross(Book *b)
+{
+    unsigned long long remaining;
+    BookEntry *bid, *quote;
+    unsigned long fill;
+    long price;
+
+    assert(b != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    if(BOOK_PHASE_AUCTION != b->phase) {
+        pthread_mutex_unlock(&b->matcher_mutex);
+        return -1;
+    }
+
+    journal_auction(b->symbol, JOURNAL_RECORD_AUCTION_UNCROSS, b->auction);
+
+    _book_auction_equilibrium(b);
+
+    price = b->indicative_tick;
+    remaining = b->indicative_volume;
+
+    trace_event(TRACE_EVENT_UNCROSS, price, remaining);
+
+    DBG("Uncrossing %llu of \"%s\" at price $%f\n",
+            remaining, string_get_chars(b->symbol),
+            _book_tick_to_price(b, price));
+
+    /* Orders trade in price then time priority, all at the one
+     * equilibrium price.
+     */
+    while((remaining > 0) && (b->buy.best >= 0) && (b->sell.best >= 0)) {
+        bid   = _book_side_level(&b->buy, b->buy.best)->head;
+        quote = _book_side_level(&b->sell, b->sell.best)->head;
+
+        fill = _book_entry_visible(bid);
+        if(fill > _book_entry_visible(quote)) {
+            fill = _book_entry_visible(quote);
+        }
+        if(fill > remaining) {
+            fill = remaining;
+        }
+
+        _book_trade(b, bid->order, quote->order, price, fill);
+        _book_fill(b, &b->buy, bid, fill);
+        _book_fill(b, &b->sell, quote, fill);
+
+        remaining -= fill;
+    }
+
+    _book_side_purge(b, &b->buy, BOOK_MARKET_BUY_TICK);
+    _book_side_purge(b, &b->sell, BOOK_MARKET_SELL_TICK);
+
+    if((BOOK_AUCTION_CLOSE == b->auction) && b->limit_on_close) {
+        _book_side_purge_on_close(b, &b->buy);
+        _book_side_purge_on_close(b, &b->sell);
+    }
+
+    b->phase = BOOK_PHASE_CONTINUOUS;
+    b->indicative_tick = -1;
+    b->indicative_volume = 0;
+    b->limit_on_close = 0;
+
+    _book_release_stops(b);
+    _book_publish(b);
+
+    if(_book_is_crossed(b)) {
+        pthread_cond_signal(&b->matcher_cond);
+    }
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return 0;
+}
+
+/* Turn the book's own expiry on or off. Orders keep their places
+ * on the expiry wheel while it is off, and any that fell due in the
+ * meantime expire as soon as it is turned back on.
+ */
+void book_set_expiry(Book *b, int enabled)
+{
+    assert(b != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    b->expiry_enabled = enabled;
+    pthread_cond_signal(&b->matcher_cond);
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+}
+
+/* Expire one order, as a journalled expiry is replayed. Returns -1
+ * if the order isn't resting in the book.
+ */
+int book_expire_order(Book *b, unsigned long long id)
+{
+    BookIndexSlot *slot;
+
+    assert(b != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    slot = _book_index_slot(b, id);
+    if((NULL == slot->entry) || (NULL == slot->entry->side)) {
+        pthread_mutex_unlock(&b->matcher_mutex);
+        return -1;
+    }
+
+    _book_expire_entry(b, slot->entry);
+
+    if(BOOK_PHASE_AUCTION == b->phase) {
+        _book_auction_equilibrium(b);
+    }
+    _book_publish(b);
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return 0;
+}
+
+/* Cancel a batch of orders by ID, all under one hold of the lock.
+ * Orders that have already left the book are skipped. Returns how
+ * many were cancelled.
+ */
+unsigned long book_cancel_orders(Book *b, const unsigned long long *ids,
+        unsigned long count)
+{
+    BookIndexSlot *slot;
+    unsigned long i, n;
+    Order *o;
+
+    assert(b != NULL);
+    assert((ids != NULL) || (0 == count));
+
+    n = 0;
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    for(i = 0; i < count; i++) {
+        slot = _book_index_slot(b, ids[i]);
+        if(NULL == slot->entry) {
+            continue;
+        }
+
+        o = slot->entry->order;
+
+        DBG("Cancelled order %llu\n", ids[i]);
+
+        journal_cancel(o);
+        trace_event(TRACE_EVENT_CANCEL, ids[i], order_get_quantity(o));
+
+        _book_remove_entry(b, slot->entry);
+        n++;
+    }
+
+    if(n > 0) {
+        if(BOOK_PHASE_AUCTION == b->phase) {
+            _book_auction_equilibrium(b);
+        }
+        _book_publish(b);
+    }
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return n;
+}
+
+/* Cut an order's quantity down in place, keeping its time priority.
+ * Returns -1 if the order isn't in the book, or the quantity isn't
+ * less than it has left.
+ */
+int book_amend_order(Book *b, unsigned long long id, unsigned long quantity)
+{
+    BookIndexSlot *slot;
+
+    assert(b != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    slot = _book_index_slot(b, id);
+    if((NULL == slot->entry) || (0 == quantity) ||
+            (quantity >= order_get_quantity(slot->entry->order))) {
+        pthread_mutex_unlock(&b->matcher_mutex);
+        return -1;
+    }
 
-    unsigned long orders_filled;
-    unsigned long long volume;
+    _book_amend_entry(slot->entry, quantity);
 
-    int book_is_open;
+    if(BOOK_PHASE_AUCTION == b->phase) {
+        _book_auction_equilibrium(b);
+    }
+    _book_publish(b);
 
-    pthread_t       matcher_thread;
-    pthread_mutex_t matcher_mutex;
-    pthread_cond_t  matcher_cond;
-};
+    pthread_mutex_unlock(&b->matcher_mutex);
 
-/* The buy order heap is a max-heap, with the highest
- * bid at the top of the heap. If two or more orders have
- * the highest bid, then we compare the timestamps to
- * place the oldest order at the top of the heap.
+    return 0;
+}
+
+/* Can an order be replaced by o just by cutting its quantity? Only
+ * if nothing but the quantity changes, and it doesn't go up.
  */
-int _book_buy_compare(const Order *o1, const Order *o2)
+static int _book_can_amend(const Book *b, const BookEntry *e,
+        const Order *o)
 {
-    float price_diff = fabsf(order_get_price(o1) - order_get_price(o2));
-    int ret;
+    const Order *old = e->order;
+
+    if((order_get_type(o) != order_get_type(old)) ||
+            (order_get_side(o) != order_get_side(old)) ||
+            (order_get_time_in_force(o) != order_get_time_in_force(old)) ||
+            (order_get_display_quantity(o) !=
+             order_get_display_quantity(old)) ||
+            (0 == order_get_quantity(o)) ||
+            (order_get_quantity(o) > order_get_quantity(old))) {
+        return 0;
+    }
 
-    if(price_diff < FLT_EPSILON) {
-        /* Prices are equal, so compare timestamps */
-        if(order_get_timestamp(o1) < order_get_timestamp(o2)) {
-            ret = 1;
-        } else {
-            ret = -1;
-        }
-    } else if(order_get_price(o1) > order_get_price(o2)) {
-        ret = 1;
-    } else {
-        ret = -1;
+    /* Day orders are given their expire time by the book */
+    if(((ORDER_TIME_IN_FORCE_GTD == order_get_time_in_force(o)) ||
+                (ORDER_TIME_IN_FORCE_GTT == order_get_time_in_force(o))) &&
+            (order_get_expire_time(o) != order_get_expire_time(old))) {
+        return 0;
     }
 
-    return ret;
+    if(_book_order_is_pegged(o)) {
+        return _book_peg_offset(o) == _book_peg_offset(old);
+    }
+
+    return (_book_order_limit(b, o) == _book_order_limit(b, old)) &&
+        (_book_price_to_tick(b, order_get_stop_price(o)) ==
+         _book_price_to_tick(b, order_get_stop_price(old)));
 }
 
-/* The sell order heap is a min-heap, with the lowest
- * quote at the top of the heap. If two or more orders have
- * the lowest quote, then we compare the timestamps to
- * place the oldest order at the top of the heap.
+/* Replace the order with the given id by o. If only its quantity
+ * comes down, the order is amended in place and keeps its time
+ * priority, and o takes over its id and place in the book. Otherwise
+ * it is cancelled and o is entered as a new order, under the same
+ * hold of the lock. Returns -1 if the order isn't in the book, or o
+ * can't enter it, in which case the order is left as it was and o
+ * still belongs to the caller.
  */
-int _book_sell_compare(const Order *o1, const Order *o2)
+int book_replace_order(Book *b, unsigned long long id, Order *o)
 {
-    float price_diff = fabsf(order_get_price(o1) - order_get_price(o2));
-    int ret;
+    BookIndexSlot *slot;
+    unsigned long armed;
+    LatencyTrace trace;
+    BookEntry *e;
+    Order *old;
 
-    if(price_diff < FLT_EPSILON) {
-        /* Prices are equal, so compare timestamps */
-        if(order_get_timestamp(o1) < order_get_timestamp(o2)) {
-            ret = 1;
-        } else {
-            ret = -1;
+    assert(b != NULL);
+    assert(o != NULL);
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    latency_stamp(order_get_latency(o), LATENCY_STAGE_MATCHER_DEQUEUE);
+
+    slot = _book_index_slot(b, id);
+    e = slot->entry;
+
+    if(NULL == e) {
+        pthread_mutex_unlock(&b->matcher_mutex);
+        return -1;
+    }
+
+    trace = *order_get_latency(o);
+
+    if(_book_can_amend(b, e, o)) {
+        old = e->order;
+
+        if(order_get_quantity(o) < order_get_quantity(old)) {
+            _book_amend_entry(e, order_get_quantity(o));
+        }
+
+        order_set_id(o, order_get_id(old));
+        order_set_sequence(o, order_get_sequence(old));
+        order_set_price(o, order_get_price(old));
+        order_set_hidden_quantity(o, order_get_hidden_quantity(old));
+        order_set_expire_time(o, order_get_expire_time(old));
+
+        e->order = o;
+        order_free(old);
+
+        if(BOOK_PHASE_AUCTION == b->phase) {
+            _book_auction_equilibrium(b);
         }
-    } else if(order_get_price(o1) < order_get_price(o2)) {
-        ret = 1;
+        _book_publish(b);
     } else {
-        ret = -1;
+        /* Checking the order expires anything that is due, which
+         * may include the order being replaced
+         */
+        if(_book_check_order(b, o) < 0) {
+            pthread_mutex_unlock(&b->matcher_mutex);
+            return -1;
+        }
+
+        e = _book_index_slot(b, id)->entry;
+        if(NULL == e) {
+            pthread_mutex_unlock(&b->matcher_mutex);
+            return -1;
+        }
+
+        armed = timer_wheel_get_armed(b->expiry);
+
+        DBG("Replacing order %llu\n", id);
+
+        journal_cancel(e->order);
+        trace_event(TRACE_EVENT_CANCEL, id, order_get_quantity(e->order));
+
+        _book_remove_entry(b, e);
+
+        id = order_get_id(o);
+
+        trace_event(TRACE_EVENT_ORDER_BEGIN, id, order_get_quantity(o));
+
+        _book_add_order(b, o);
+
+        if(BOOK_PHASE_AUCTION == b->phase) {
+            _book_auction_equilibrium(b);
+        }
+        _book_publish(b);
+        _book_wake_matcher(b, armed);
+
+        trace_event(TRACE_EVENT_ORDER_END, id, b->sequence);
     }
 
-    return ret;
+    latency_stamp(&trace, LATENCY_STAGE_MATCH_COMPLETE);
+
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    latency_record(&trace);
+
+    return 0;
 }
 
-void* _book_fill_orders(void *arg)
+/* Apply one side of a quote. The order resting for it is cut down in
+ * place if the price stays the same and the size doesn't go up, and
+ * is otherwise cancelled and replaced by the quote's new order.
+ * Returns -1 if the new order is rejected, which leaves the side
+ * pulled.
+ */
+static int _book_quote(Book *b, BookQuote *q)
 {
-    unsigned long bid_quantity, quote_quantity;
-    Order *bid, *quote;
-    float price_diff;
-    Book *b;
+    BookIndexSlot *slot;
+    BookSide *side;
+    BookEntry *e;
+    Order *o;
 
-    if(NULL == arg) {
-        fprintf(stderr, "(%s:%d) ERROR: Matcher thread received invalid Book.\n",
-                __FUNCTION__, __LINE__);
-        return NULL;
+    o = q->order;
+    q->order = NULL;
+
+    side = (ORDER_SIDE_BUY == order_get_side(o)) ? &b->buy : &b->sell;
+
+    e = NULL;
+    if(q->resting) {
+        slot = _book_index_slot(b, q->id);
+        if((NULL != slot->entry) && (side == slot->entry->side)) {
+            e = slot->entry;
+        }
     }
 
-    b = (Book *)arg;
+    if((NULL != e) && (order_get_quantity(o) > 0) &&
+            (ORDER_TYPE_LIMIT == order_get_type(o)) &&
+            (_book_price_to_tick(b, order_get_price(o)) == e->tick) &&
+            (order_get_quantity(o) <= order_get_quantity(e->order))) {
+        if(order_get_quantity(o) < order_get_quantity(e->order)) {
+            _book_amend_entry(e, order_get_quantity(o));
+        }
+        order_free(o);
+        return 0;
+    }
 
-    pthread_mutex_lock(&b->matcher_mutex);
+    if(NULL != e) {
+        journal_cancel(e->order);
+        trace_event(TRACE_EVENT_CANCEL, e->id, order_get_quantity(e->order));
 
-    while(b->book_is_open) {
-        bid   = (Order *)heap_top(b->buy);
-        quote = (Order *)heap_top(b->sell);
+        _book_remove_entry(b, e);
+    }
 
-        if((NULL != bid) && (NULL != quote) &&
-            (((price_diff =
-               fabsf(order_get_price(bid) - order_get_price(quote))) < FLT_EPSILON) ||
-             (order_get_price(bid) > order_get_price(quote)))) {
+    q->resting = 0;
 
-            bid_quantity    = order_get_quantity(bid);
-            quote_quantity  = order_get_quantity(quote);
+    /* No size pulls the quote */
+    if(0 == order_get_quantity(o)) {
+        order_free(o);
+        return 0;
+    }
 
-            if(bid_quantity == quote_quantity) {
-                /* Bid and quote orders can be completely filled */
+    if(_book_check_order(b, o) < 0) {
+        order_free(o);
+        return -1;
+    }
 
-                /* TODO Create new transaction record and log it */
-                DBG("(%s:%d) Filled %lu of \"%s\" at price $%f\n",
-                        __FUNCTION__, __LINE__, bid_quantity,
-                        string_get_chars(b->symbol),
-                        order_get_price(quote));
+    q->id = order_get_id(o);
 
-                b->orders_filled += 2;
-                b->volume += bid_quantity;
+    trace_event(TRACE_EVENT_ORDER_BEGIN, q->id, order_get_quantity(o));
+    _book_add_order(b, o);
+    trace_event(TRACE_EVENT_ORDER_END, q->id, b->sequence);
 
-                order_free((Order *)heap_pop(b->buy));
-                order_free((Order *)heap_pop(b->sell));
-            } else if(bid_quantity > quote_quantity) {
-                /* Quote order can be completely filled */
+    /* The new order may have traded away on arrival */
+    slot = _book_index_slot(b, q->id);
+    q->resting = (NULL != slot->entry);
 
-                /* TODO Create new transaction record and log it */
-                DBG("(%s:%d) Filled %lu of \"%s\" at price $%f\n",
-                       __FUNCTION__, __LINE__, (bid_quantity - quote_quantity),
-                        string_get_chars(b->symbol),
-                        order_get_price(quote));
+    return 0;
+}
 
-                b->orders_filled++;
-                b->volume += quote_quantity;
+/* Apply a batch of quote updates, all under one hold of the lock.
+ * The book takes over each quote's order, and updates its id and
+ * resting flag to the order that rests for it now. Returns -1 if any
+ * of the new orders was rejected; the rest are still applied.
+ */
+int book_process_quotes(Book *b, BookQuote *quotes, unsigned long count)
+{
+    unsigned long i, armed;
+    int ret;
 
-                order_set_quantity(bid, (bid_quantity - quote_quantity));
-                order_free((Order *)heap_pop(b->sell));
-            } else {
-                /* Bid order can be completely filled */
+    assert(b != NULL);
+    assert((quotes != NULL) || (0 == count));
 
-                /* TODO Create new transaction record and log it */
-                DBG("(%s:%d) Filled %lu of \"%s\" at price $%f\n",
-                        __FUNCTION__, __LINE__, (quote_quantity - bid_quantity),
-                        string_get_chars(b->symbol),
-                        order_get_price(quote));
+    pthread_mutex_lock(&b->matcher_mutex);
 
-                b->orders_filled++;
-                b->volume += bid_quantity;
+    armed = timer_wheel_get_armed(b->expiry);
+    ret = 0;
 
-                order_set_quantity(quote, (quote_quantity - bid_quantity));
-                order_free((Order *)heap_pop(b->buy));
-            }
-        } else {
-            pthread_cond_wait(&b->matcher_cond, &b->matcher_mutex);
+    for(i = 0; i < count; i++) {
+        assert(quotes[i].order != NULL);
+        if(_book_quote(b, &quotes[i]) < 0) {
+            ret = -1;
         }
     }
 
+    if(BOOK_PHASE_AUCTION == b->phase) {
+        _book_auction_equilibrium(b);
+    }
+    _book_publish(b);
+    _book_wake_matcher(b, armed);
+
     pthread_mutex_unlock(&b->matcher_mutex);
 
-    return NULL;
+    return ret;
 }
 
-Book* book_open(const String *symbol)
+/* Copy up to levels price levels of one side of the book into
+ * depth, best price first, and return how many were copied. Only
+ * displayed quantity is reported. This reads the per-level
+ * aggregates, so it costs the same however many orders rest.
+ */
+int book_get_depth(Book *b, ORDER_SIDE side, int levels, BookDepth *depth)
 {
-    struct sched_param sched;
-    pthread_attr_t attr;
-    Book *new_book;
+    const BookSide *s;
+    const BookLevel *level;
+    long t;
+    int n;
 
-    assert(symbol != NULL);
+    assert(b != NULL);
+    assert(levels >= 0);
+    assert((depth != NULL) || (0 == levels));
 
-    printf("Book: Open new book for: '%s'\n", string_get_chars(symbol));
+    s = (ORDER_SIDE_BUY == side) ? &b->buy : &b->sell;
+    n = 0;
 
-    new_book = malloc(sizeof(struct _book));
-    if(NULL == new_book) {
-        fprintf(stderr, "(%s:%d) Out of memory\n", __FUNCTION__, __LINE__);
-        return NULL;
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    for(t = s->best; (t >= 0) && (n < levels); t = _book_side_next(s, t)) {
+        level = _book_side_level(s, t);
+
+        /* Market orders resting in an auction have no price */
+        if((BOOK_MARKET_SELL_TICK == t) || (BOOK_MARKET_BUY_TICK == t)) {
+            continue;
+        }
+
+        depth[n].price = _book_tick_to_price(b, t);
+        depth[n].quantity = level->quantity;
+        depth[n].orders = level->orders;
+        n++;
     }
 
-    new_book->symbol = string_duplicate(symbol);
-    new_book->orders_filled = 0;
-    new_book->volume = 0;
+    pthread_mutex_unlock(&b->matcher_mutex);
 
-    new_book->buy  = heap_create((CompareFn)_book_buy_compare);
-    if(NULL == new_book->buy) {
-        fprintf(stderr, "(%s:%d) Couldn't create buy heap\n",
-                __FUNCTION__, __LINE__);
-        free(new_book);
-        return NULL;
+    return n;
+}
+
+/* The price and volume the auction would uncross at right now */
+int book_get_indicative(Book *b, float *price, unsigned long long *volume)
+{
+    int ret;
+
+    assert(b != NULL);
+    assert(price != NULL);
+    assert(volume != NULL);
+
+    ret = -1;
+
+    pthread_mutex_lock(&b->matcher_mutex);
+
+    if((BOOK_PHASE_AUCTION == b->phase) && (b->indicative_tick >= 0)) {
+        *price = _book_tick_to_price(b, b->indicative_tick);
+        *volume = b->indicative_volume;
+        ret = 0;
     }
 
-    new_book->sell = heap_create((CompareFn)_book_sell_compare);
-    if(NULL == new_book->sell) {
-        fprintf(stderr, "(%s:%d) Couldn't create sell heap\n",
-                __FUNCTION__, __LINE__);
-        free(new_book);
-        return NULL;
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return ret;
+}
+
+String* book_get_symbol(const Book *b)
+{
+    assert(b != NULL);
+
+    return b->symbol;
+}
+
+unsigned long long book_get_sequence(const Book *b)
+{
+    assert(b != NULL);
+
+    return b->sequence;
+}
+
+/* Read the latest top of book snapshot. Never takes the matcher's
+ * lock, so it is safe to call from any thread at any rate.
+ */
+void book_get_top(const Book *b, BookTop *top)
+{
+    unsigned long before, after;
+
+    assert(b != NULL);
+    assert(top != NULL);
+
+    do {
+        before = __atomic_load_n(&b->snapshot.sequence, __ATOMIC_ACQUIRE);
+
+        *top = b->snapshot.top;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&b->snapshot.sequence, __ATOMIC_RELAXED);
+    } while((before & 1) || (before != after));
+}
+
+/* Read the book's running counters. Never takes the matcher's lock. */
+void book_get_counters(const Book *b, BookCounters *counters)
+{
+    assert(b != NULL);
+    assert(counters != NULL);
+
+    counters->orders = __atomic_load_n(&b->line.counters.orders,
+            __ATOMIC_RELAXED);
+    counters->orders_filled = __atomic_load_n(&b->line.counters.orders_filled,
+            __ATOMIC_RELAXED);
+    counters->volume = __atomic_load_n(&b->line.counters.volume,
+            __ATOMIC_RELAXED);
+}
+
+/* Append one order to a growing array of saved orders. Returns -1
+ * if the array couldn't be grown.
+ */
+static int _book_save_order(const Order *o, BOOK_ENTRY entry,
+        BookSavedOrder **orders, unsigned long long *count,
+        unsigned long long *size)
+{
+    BookSavedOrder *s;
+
+    if(*count == *size) {
+        *size = (0 == *size) ? BOOK_ENTRY_CHUNK : (*size * 2);
+
+        s = realloc(*orders, *size * sizeof(BookSavedOrder));
+        if(NULL == s) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            return -1;
+        }
+        *orders = s;
     }
 
-    new_book->book_is_open = 1;
+    s = &(*orders)[(*count)++];
+
+    s->id = order_get_id(o);
+    s->sequence = order_get_sequence(o);
+    s->quantity = order_get_quantity(o);
+    s->hidden_quantity = order_get_hidden_quantity(o);
+    s->display_quantity = order_get_display_quantity(o);
+    s->price = order_get_price(o);
+    s->stop_price = order_get_stop_price(o);
+    s->peg_offset = order_get_peg_offset(o);
+    s->side = (unsigned char)order_get_side(o);
+    s->type = (unsigned char)order_get_type(o);
+    s->expire_time = order_get_expire_time(o);
+    s->time_in_force = (unsigned char)order_get_time_in_force(o);
+    s->entry = (unsigned char)entry;
 
-    pthread_mutex_init(&new_book->matcher_mutex, NULL);
-    pthread_cond_init(&new_book->matcher_cond, NULL);
+    return 0;
+}
 
-    /* Create matcher thread with a high priority */
-    pthread_attr_init(&attr);
-    pthread_attr_setschedpolicy(&attr, SCHED_RR);
-    pthread_attr_getschedparam(&attr, &sched);
-    sched.sched_priority = sched_get_priority_max(SCHED_RR) - 1;
-    assert(pthread_attr_setschedparam(&attr, &sched) == 0);
+/* Save every order on one side, best level first and in time order
+ * within each level
+ */
+static int _book_save_side(const BookSide *side, BOOK_ENTRY entry,
+        BookSavedOrder **orders, unsigned long long *count,
+        unsigned long long *size)
+{
+    BookEntry *e;
+    long t;
 
-    assert(pthread_create(&new_book->matcher_thread,
-                &attr, _book_fill_orders, new_book) == 0);
+    for(t = side->best; t >= 0; t = _book_side_next(side, t)) {
+        for(e = _book_side_level(side, t)->head; NULL != e; e = e->next) {
+            if(_book_save_order(e->order, entry, orders, count, size) < 0) {
+                return -1;
+            }
+        }
+    }
 
-    return new_book;
+    return 0;
 }
 
-void book_close(Book *b)
+/* Copy the book's state and every order in it, for a snapshot. The
+ * book is only locked while it is copied; the caller writes the copy
+ * out and frees *orders.
+ */
+int book_save(Book *b, BookSavedState *state, BookSavedOrder **orders)
 {
+    unsigned long long count, size;
+    BookPegGroup *g;
+    BookEntry *e;
+    int rc;
+
     assert(b != NULL);
+    assert(state != NULL);
+    assert(orders != NULL);
 
-    printf("Book: Closing book for: '%s'\n", string_get_chars(b->symbol));
+    *orders = NULL;
+    count = size = 0;
 
-    /* Tell the matcher thread that the book is closing */
-    b->book_is_open = 0;
-    pthread_cond_signal(&b->matcher_cond);
+    pthread_mutex_lock(&b->matcher_mutex);
 
-    pthread_join(b->matcher_thread, NULL);
+    memset(state, 0, sizeof(BookSavedState));
+
+    state->sequence = b->sequence;
+    state->journal_sequence = journal_get_sequence();
+    state->counters = b->line.counters;
+    state->base_tick = b->base;
+    state->last_tick = b->last_tick;
+    state->last_quantity = b->last_quantity;
+    state->phase = b->phase;
+    state->auction = b->auction;
+    state->limit_on_close = b->limit_on_close;
+
+    rc = _book_save_side(&b->buy, BOOK_ENTRY_RESTING, orders, &count, &size);
+    if(0 == rc) {
+        rc = _book_save_side(&b->sell, BOOK_ENTRY_RESTING,
+                orders, &count, &size);
+    }
+    if(0 == rc) {
+        rc = _book_save_side(&b->buy_stops, BOOK_ENTRY_STOP,
+                orders, &count, &size);
+    }
+    if(0 == rc) {
+        rc = _book_save_side(&b->sell_stops, BOOK_ENTRY_STOP,
+                orders, &count, &size);
+    }
 
-    pthread_cond_destroy(&b->matcher_cond);
-    pthread_mutex_destroy(&b->matcher_mutex);
+    for(e = b->on_close_head; (0 == rc) && (NULL != e); e = e->next) {
+        rc = _book_save_order(e->order, BOOK_ENTRY_ON_CLOSE,
+                orders, &count, &size);
+    }
 
-    string_free(b->symbol);
-    heap_free(b->buy);
-    heap_free(b->sell);
+    /* Priced pegs are saved with their levels, and parked ones here */
+    for(g = b->pegs; (0 == rc) && (NULL != g); g = g->next) {
+        for(e = g->head; (0 == rc) && (g->tick < 0) && (NULL != e);
+                e = e->peg_next) {
+            rc = _book_save_order(e->order, BOOK_ENTRY_PARKED,
+                    orders, &count, &size);
+        }
+    }
 
-    free(b);
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    if(rc < 0) {
+        free(*orders);
+        *orders = NULL;
+        return -1;
+    }
+
+    state->order_count = count;
+
+    return 0;
 }
 
-int book_process_order(Book *b, Order *o)
+/* Load a saved state and its orders into a new, empty book. The
+ * orders go straight back to where they were saved, without being
+ * matched, so they keep their priority.
+ */
+int book_restore(Book *b, const BookSavedState *state,
+        const BookSavedOrder *orders)
 {
+    const BookSavedOrder *s;
+    unsigned long long i;
+    BookPegGroup *g;
+    BookSide *side;
+    BookEntry *e;
+    Order *o;
+    long tick;
+
     assert(b != NULL);
-    assert(o != NULL);
+    assert(state != NULL);
+    assert((orders != NULL) || (0 == state->order_count));
+
+    /* The saved ticks are counted from the saved base */
+    b->base = (long)state->base_tick;
 
     pthread_mutex_lock(&b->matcher_mutex);
 
-    if(string_compare(order_get_symbol(o), b->symbol) != 0) {
-        /* ERROR: Symbols don't match. Wrong book? */
-        fprintf(stderr, "(%s:%d) Symbols don't match: Book=\"%s\" Order=\"%s\"\n",
-                __FUNCTION__, __LINE__,
-                string_get_chars(b->symbol),
-                string_get_chars(order_get_symbol(o)));
+    if(0 != b->sequence) {
         pthread_mutex_unlock(&b->matcher_mutex);
         return -1;
     }
 
-    switch(order_get_type(o)) {
-        case ORDER_TYPE_LIMIT:
-            switch(order_get_side(o)) {
-                case ORDER_SIDE_BUY:
-                    DBG("Adding buy order\n");
-                    heap_push(b->buy, o);
-                    break;
-                case ORDER_SIDE_SELL:
-                    DBG("Adding sell order\n");
-                    heap_push(b->sell, o);
-                    break;
-                default:
-                    /* ERROR: Unknown order side */
-                    fprintf(stderr, "Unknown order side\n");
-                    pthread_mutex_unlock(&b->matcher_mutex);
-                    return -1;
-                    break;
-            }
+    for(i = 0; i < state->order_count; i++) {
+        s = &orders[i];
 
-            /* Signal the matcher thread */
-            pthread_cond_signal(&b->matcher_cond);
+        o = order_create((ORDER_TYPE)s->type, (ORDER_SIDE)s->side,
+                string_duplicate(b->symbol), s->price, s->quantity);
+        if(NULL == o) {
             break;
+        }
 
-        case ORDER_TYPE_CANCEL:
-        case ORDER_TYPE_REPLACE:
-        default:
-            /* ERROR: Unsupported order type */
-            fprintf(stderr, "Unsupported order type\n");
-            pthread_mutex_unlock(&b->matcher_mutex);
-            return -1;
+        order_set_id(o, s->id);
+        order_set_sequence(o, s->sequence);
+        order_set_stop_price(o, s->stop_price);
+        order_set_peg_offset(o, s->peg_offset);
+        order_set_display_quantity(o, s->display_quantity);
+        order_set_hidden_quantity(o, s->hidden_quantity);
+        order_set_time_in_force(o, (ORDER_TIME_IN_FORCE)s->time_in_force);
+        order_set_expire_time(o, s->expire_time);
+
+        if(BOOK_ENTRY_ON_CLOSE == s->entry) {
+            _book_hold_on_close(b, o);
+            continue;
+        }
+
+        if(BOOK_ENTRY_STOP == s->entry) {
+            side = (ORDER_SIDE_BUY == s->side) ? &b->buy_stops : &b->sell_stops;
+            tick = _book_price_to_tick(b, s->stop_price);
+        } else {
+            side = (ORDER_SIDE_BUY == s->side) ? &b->buy : &b->sell;
+            tick = (BOOK_ENTRY_PARKED == s->entry) ?
+                -1 : _book_order_limit(b, o);
+        }
+
+        if((tick >= 0) && (_book_side_reserve(side, tick) < 0)) {
+            order_free(o);
+            break;
+        }
+
+        e = _book_entry_alloc(b);
+        if(NULL == e) {
+            order_free(o);
             break;
+        }
+        e->tick = tick;
+
+        /* Pegs rejoin their groups in the order they were saved */
+        if(_book_order_is_pegged(o)) {
+            g = _book_peg_group(b, side, order_get_type(o),
+                    _book_peg_offset(o), e->tick);
+            if(NULL == g) {
+                order_free(o);
+                break;
+            }
+            _book_peg_join(b, g, e, o);
+        }
+
+        _book_entry_attach(b, e, o, side);
+        if(e->tick >= 0) {
+            _book_side_insert(side, e);
+        }
     }
 
-    pthread_mutex_unlock(&b->matcher_mutex);
+    b->sequence = state->sequence;
+    b->line.counters = state->counters;
+    b->last_tick = (long)state->last_tick;
+    b->last_quantity = (unsigned long)state->last_quantity;
+    b->phase = (BOOK_PHASE)state->phase;
+    b->auction = (BOOK_AUCTION)state->auction;
+    b->limit_on_close = (int)state->limit_on_close;
 
-    return 0;
-}
+    if(BOOK_PHASE_AUCTION == b->phase) {
+        _book_auction_equilibrium(b);
+    }
 
-String* book_get_symbol(const Book *b)
-{
-    assert(b != NULL);
+    _book_publish(b);
 
-    return b->symbol;
+    pthread_mutex_unlock(&b->matcher_mutex);
+
+    return (i == state->order_count) ? 0 : -1;
 }
 
 unsigned long long book_get_volume(const Book *b)
 {
-    assert(b != NULL);
+    BookTop top;
+
+    book_get_top(b, &top);
 
-    return b->volume;
+    return top.volume;
 }
 
 unsigned long book_get_orders_filled(const Book *b)
 {
-    assert(b != NULL);
+    BookTop top;
+
+    book_get_top(b, &top);
 
-    return b->orders_filled;
+    return top.orders_filled;
 }
@@ -36,15 +36,152 @@ extern "C" {
 
 #include "order.h"
 
+/* Longest symbol a book is opened for. The journal and snapshots
+ * keep symbols of up to this length in full.
+ */
+#define BOOK_SYMBOL_LEN     16
+
 /* Opaque forward declaration */
 typedef struct _book Book;
 
+/* Aggregate quantity and order count at one price level */
+typedef struct {
+    float price;
+    unsigned long long quantity;
+    unsigned long orders;
+} BookDepth;
+
+/* Top of book, as last published by the book. Prices and sizes are
+ * zero for an empty side, and the last trade is zero before the
+ * first trade.
+ */
+typedef struct {
+    unsigned long long bid_quantity;
+    unsigned long long ask_quantity;
+    unsigned long long volume;
+    unsigned long orders_filled;
+    unsigned long last_quantity;
+    float bid_price;
+    float ask_price;
+    float last_price;
+} BookTop;
+
+/* Running totals of orders accepted, orders filled and volume */
+typedef struct {
+    unsigned long long orders;
+    unsigned long long orders_filled;
+    unsigned long long volume;
+} BookCounters;
+
+typedef enum {
+    BOOK_PHASE_CONTINUOUS,
+    BOOK_PHASE_AUCTION
+} BOOK_PHASE;
+
+typedef enum {
+    BOOK_AUCTION_OPEN,
+    BOOK_AUCTION_CLOSE
+} BOOK_AUCTION;
+
+/* One side of a market maker's quote. The book takes over order,
+ * which carries the quote's new price and size, or no quantity to
+ * pull it. If resting is set, id is the order resting for the quote
+ * so far; afterwards they say what rests for it now.
+ */
+typedef struct {
+    Order *order;
+    unsigned long long id;
+    int resting;
+} BookQuote;
+
+/* Where a saved order was held in the book */
+typedef enum {
+    BOOK_ENTRY_RESTING,
+    BOOK_ENTRY_STOP,
+    BOOK_ENTRY_ON_CLOSE,
+
+    /* A pegged order with no price to peg to */
+    BOOK_ENTRY_PARKED
+} BOOK_ENTRY;
+
+/* An order as saved by book_save, in the order it must be restored
+ * to keep its time priority
+ */
+typedef struct {
+    unsigned long long id;
+    unsigned long long sequence;
+    unsigned long long quantity;
+    unsigned long long hidden_quantity;
+    unsigned long long display_quantity;
+    float price;
+    float stop_price;
+    float peg_offset;
+    unsigned char side;
+    unsigned char type;
+    unsigned char time_in_force;
+    unsigned char entry;
+    unsigned long long expire_time;
+} BookSavedOrder;
+
+/* Everything about a book apart from its orders. journal_sequence
+ * is the journal's sequence when the book was saved: the book's
+ * journal records after it are not reflected in the saved state.
+ */
+typedef struct {
+    unsigned long long sequence;
+    unsigned long long journal_sequence;
+    unsigned long long order_count;
+
+    BookCounters counters;
+
+    long long base_tick;
+    long long last_tick;
+    unsigned long long last_quantity;
+
+    unsigned int phase;
+    unsigned int auction;
+    unsigned int limit_on_close;
+    unsigned int reserved;
+} BookSavedState;
+
 Book*   book_open   (const String *symbol);
 void    book_close  (Book *b);
 
 int     book_process_order  (Book *b, Order *o);
 
+/* Orders expire on the book's own clock, unless expiry is turned off
+ * to replay the journal, when book_expire_order applies the
+ * journalled expiries instead
+ */
+void    book_set_expiry         (Book *b, int enabled);
+int     book_expire_order       (Book *b, unsigned long long id);
+
+unsigned long   book_cancel_orders  (Book *b, const unsigned long long *ids,
+                                     unsigned long count);
+int     book_amend_order        (Book *b, unsigned long long id,
+                                 unsigned long quantity);
+int     book_replace_order      (Book *b, unsigned long long id, Order *o);
+
+int     book_process_quotes     (Book *b, BookQuote *quotes,
+                                 unsigned long count);
+
+int     book_auction_start      (Book *b, BOOK_AUCTION auction);
+int     book_auction_uncross    (Book *b);
+int     book_get_indicative     (Book *b, float *price,
+                                 unsigned long long *volume);
+
+int     book_get_depth  (Book *b, ORDER_SIDE side, int levels,
+                         BookDepth *depth);
+void    book_get_top    (const Book *b, BookTop *top);
+void    book_get_counters   (const Book *b, BookCounters *counters);
+
+int     book_save       (Book *b, BookSavedState *state,
+                         BookSavedOrder **orders);
+int     book_restore    (Book *b, const BookSavedState *state,
+                         const BookSavedOrder *orders);
+
 String*             book_get_symbol         (const Book *b);
+unsigned long long  book_get_sequence       (const Book *b);
 unsigned long long  book_get_volume         (const Book *b);
 unsigned long       book_get_orders_filled  (const Book *b);
 
@@ -0,0 +1,323 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* engine-stat: attach read-only to the stats region published by a
+ * running trading-engine, and either render it live or dump it once
+ * as JSON.
+ *
+ * Usage: engine-stat [-j] [-i interval_ms]
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define DEFAULT_INTERVAL_MS     1000
+
+/* How many times to look for the engine between updates before
+ * giving up on a copy of the region
+ */
+#define COPY_RETRIES            100000
+
+static volatile sig_atomic_t done = 0;
+
+/* Copy taken from the region, so it can be printed at leisure */
+static StatsRegion snapshot;
+
+void sigint_handler(int sig)
+{
+    done = 1;
+}
+
+static const StatsRegion* _engine_stat_attach(void)
+{
+    const StatsRegion *r;
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0);
+    if(fd < 0) {
+        fprintf(stderr, "No stats region at %s. Is the engine running?\n",
+                STATS_SHM_NAME);
+        return NULL;
+    }
+
+    if((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(StatsRegion))) {
+        fprintf(stderr, "Stats region has an unexpected size\n");
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(NULL, sizeof(StatsRegion), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(MAP_FAILED == p) {
+        fprintf(stderr, "Couldn't map stats region\n");
+        return NULL;
+    }
+
+    r = (const StatsRegion *)p;
+
+    if((__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC) ||
+            (r->version != STATS_VERSION) ||
+            (r->size != sizeof(StatsRegion))) {
+        fprintf(stderr, "Stats region version %u not supported (want %u)\n",
+                r->version, STATS_VERSION);
+        munmap(p, sizeof(StatsRegion));
+        return NULL;
+    }
+
+    return r;
+}
+
+/* Take a consistent copy of the region, retrying while the engine
+ * is part way through an update. Only the books in use are copied.
+ * Returns -1 if the engine never finishes an update, which it won't
+ * if it died part way through one.
+ */
+static int _engine_stat_copy(const StatsRegion *r)
+{
+    unsigned long before, after, n;
+    unsigned int tries;
+
+    for(tries = 0; tries < COPY_RETRIES; tries++) {
+        before = __atomic_load_n(&r->sequence, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(&snapshot, r, offsetof(StatsRegion, books));
+
+        n = snapshot.book_count;
+        if(n > STATS_MAX_BOOKS) {
+            n = STATS_MAX_BOOKS;
+        }
+        memcpy(snapshot.books, r->books, n * sizeof(StatsBook));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&r->sequence, __ATOMIC_RELAXED);
+
+        if(before == after) {
+            snapshot.book_count = n;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Stats region is stale: the engine is stuck part way "
+            "through an update\n");
+
+    return -1;
+}
+
+static void _engine_stat_json_book(const StatsBook *b)
+{
+    const char *c;
+
+    printf("{\"symbol\":\"");
+    for(c = b->symbol; *c != '\0'; c++) {
+        if((*c == '"') || (*c == '\\')) {
+            putchar('\\');
+        }
+        putchar(*c);
+    }
+    printf("\",");
+
+    printf("\"orders\":%llu,\"orders_filled\":%llu,\"volume\":%llu,",
+            b->counters.orders, b->counters.orders_filled,
+            b->counters.volume);
+    printf("\"orders_per_second\":%.1f,\"fills_per_second\":%.1f,"
+            "\"volume_per_second\":%.1f,",
+            b->orders_per_second, b->fills_per_second,
+            b->volume_per_second);
+    printf("\"bid_price\":%.2f,\"bid_quantity\":%llu,"
+            "\"ask_price\":%.2f,\"ask_quantity\":%llu,"
+            "\"last_price\":%.2f,\"last_quantity\":%lu}",
+            b->top.bid_price, b->top.bid_quantity,
+            b->top.ask_price, b->top.ask_quantity,
+            b->top.last_price, b->top.last_quantity);
+}
+
+static void _engine_stat_json(void)
+{
+    const StatsSessions *s = &snapshot.sessions;
+    const LatencySummary *l;
+    unsigned long i;
+
+    printf("{\"version\":%u,\"start_time\":%llu,\"update_time\":%llu,",
+            snapshot.version, snapshot.start_time, snapshot.update_time);
+
+    printf("\"market\":");
+    _engine_stat_json_book(&snapshot.market);
+
+    printf(",\"sessions\":{\"sessions\":%llu,\"active\":%llu,"
+            "\"rx_messages\":%llu,\"tx_messages\":%llu,"
+            "\"rx_queue_depth\":%llu,\"tx_queue_depth\":%llu,"
+            "\"rx_per_second\":%.1f,\"tx_per_second\":%.1f}",
+            s->sessions, s->active,
+            s->counters.rx_messages, s->counters.tx_messages,
+            s->rx_queue_depth, s->tx_queue_depth,
+            s->rx_per_second, s->tx_per_second);
+
+    printf(",\"latencies\":[");
+    for(i = 0; i < snapshot.latency_count; i++) {
+        l = &snapshot.latencies[i].summary;
+
+        printf("%s{\"stage\":\"%s\",\"count\":%llu,\"mean_ns\":%llu,"
+                "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+                "\"max_ns\":%llu}",
+                (i > 0) ? "," : "", snapshot.latencies[i].name,
+                l->count, l->mean, l->p50, l->p99, l->p999, l->max);
+    }
+    printf("]");
+
+    printf(",\"books\":[");
+    for(i = 0; i < snapshot.book_count; i++) {
+        if(i > 0) {
+            putchar(',');
+        }
+        _engine_stat_json_book(&snapshot.books[i]);
+    }
+    printf("]}\n");
+}
+
+static void _engine_stat_render(void)
+{
+    const StatsSessions *s = &snapshot.sessions;
+    const LatencySummary *l;
+    const StatsBook *b;
+    unsigned long i;
+
+    /* Clear the screen and home the cursor */
+    printf("\033[H\033[2J");
+
+    printf("Market: orders %llu (%.0f/s)  filled %llu (%.0f/s)  "
+            "volume %llu (%.0f/s)\n",
+            snapshot.market.counters.orders,
+            snapshot.market.orders_per_second,
+            snapshot.market.counters.orders_filled,
+            snapshot.market.fills_per_second,
+            snapshot.market.counters.volume,
+            snapshot.market.volume_per_second);
+
+    printf("Sessions: %llu active of %llu  rx %.0f/s (queued %llu)  "
+            "tx %.0f/s (queued %llu)\n\n",
+            s->active, s->sessions,
+            s->rx_per_second, s->rx_queue_depth,
+            s->tx_per_second, s->tx_queue_depth);
+
+    printf("%-15s %12s %10s %10s %10s %10s %10s  (microseconds)\n",
+            "Latency", "Count", "Mean", "p50", "p99", "p99.9", "Max");
+
+    for(i = 0; i < snapshot.latency_count; i++) {
+        l = &snapshot.latencies[i].summary;
+
+        printf("%-15s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                snapshot.latencies[i].name, l->count,
+                l->mean / 1e3, l->p50 / 1e3, l->p99 / 1e3,
+                l->p999 / 1e3, l->max / 1e3);
+    }
+    printf("\n");
+
+    printf("%-15s %12s %12s %14s %21s %21s %10s\n",
+            "Symbol", "Orders/s", "Fills/s", "Volume/s",
+            "Bid", "Ask", "Last");
+
+    for(i = 0; i < snapshot.book_count; i++) {
+        b = &snapshot.books[i];
+
+        printf("%-15s %12.0f %12.0f %14.0f %10llu @ %8.2f %10llu @ %8.2f %10.2f\n",
+                b->symbol, b->orders_per_second, b->fills_per_second,
+                b->volume_per_second,
+                b->top.bid_quantity, b->top.bid_price,
+                b->top.ask_quantity, b->top.ask_price,
+                b->top.last_price);
+    }
+
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    const StatsRegion *r;
+    int json, interval_ms, c;
+
+    json = 0;
+    interval_ms = DEFAULT_INTERVAL_MS;
+
+    while((c = getopt(argc, argv, "ji:")) != -1) {
+        switch(c) {
+            case 'j':
+                json = 1;
+                break;
+            case 'i':
+                interval_ms = atoi(optarg);
+                if(interval_ms < STATS_INTERVAL_MS) {
+                    interval_ms = STATS_INTERVAL_MS;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j] [-i interval_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    r = _engine_stat_attach();
+    if(NULL == r) {
+        return 1;
+    }
+
+    if(json) {
+        if(_engine_stat_copy(r) < 0) {
+            return 1;
+        }
+        _engine_stat_json();
+        return 0;
+    }
+
+    signal(SIGINT, sigint_handler);
+
+    while(!done) {
+        if(_engine_stat_copy(r) == 0) {
+            _engine_stat_render();
+        }
+
+        usleep(interval_ms * 1000);
+    }
+
+    return 0;
+}
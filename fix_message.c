@@ -177,9 +177,14 @@ unsigned long fix_message_generate_checksum(const char *buf, unsigned long len)
     return (unsigned long)(cks % 256);
 }
 
-String* fix_message_generate_header(FIX_MSG_TYPE MsgType,
+/* A header for a message sent for the first time, or resent as a
+ * possible duplicate if is_resend is set. A resent message keeps its
+ * OrigSendingTime, which is now if it wasn't sent before.
+ */
+static String* _fix_message_generate_header(FIX_MSG_TYPE MsgType,
         unsigned long payload_length, const String *SenderCompId,
-        const String *TargetCompId, unsigned long MsgSeqNum)
+        const String *TargetCompId, unsigned long MsgSeqNum,
+        int is_resend, const String *OrigSendingTime)
 {
     unsigned long BodyLength, i;
     String *now, *header;
@@ -196,7 +201,14 @@ String* fix_message_generate_header(FIX_MSG_TYPE MsgType,
     darray_append(fields, _make_field_from_string(FIX_TAG_SENDER_COMP_ID, SenderCompId));
     darray_append(fields, _make_field_from_string(FIX_TAG_TARGET_COMP_ID, TargetCompId));
     darray_append(fields, _make_field_from_ulong(FIX_TAG_MSG_SEQ_NUM, MsgSeqNum));
+    if(is_resend) {
+        darray_append(fields, _make_field_from_char(FIX_TAG_POSS_DUP_FLAG, 'Y'));
+    }
     darray_append(fields, _make_field_from_string(FIX_TAG_SENDING_TIME, now));
+    if(is_resend) {
+        darray_append(fields, _make_field_from_string(FIX_TAG_ORIG_SENDING_TIME,
+                    (NULL != OrigSendingTime) ? OrigSendingTime : now));
+    }
 
     for(i = 1; i < darray_size(fields); i++) {
         BodyLength += string_length((String *)darray_index(fields, i));
@@ -214,6 +226,29 @@ String* fix_message_generate_header(FIX_MSG_TYPE MsgType,
     return header;
 }
 
+String* fix_message_generate_header(FIX_MSG_TYPE MsgType,
+        unsigned long payload_length, const String *SenderCompId,
+        const String *TargetCompId, unsigned long MsgSeqNum)
+{
+    return _fix_message_generate_header(MsgType, payload_length,
+            SenderCompId, TargetCompId, MsgSeqNum, 0, NULL);
+}
+
+String* fix_message_generate_resend_header(FIX_MSG_TYPE MsgType,
+        unsigned long payload_length, const String *SenderCompId,
+        const String *TargetCompId, unsigned long MsgSeqNum,
+        const String *OrigSendingTime)
+{
+    return _fix_message_generate_header(MsgType, payload_length,
+            SenderCompId, TargetCompId, MsgSeqNum, 1, OrigSendingTime);
+}
+
+/* For a message whose checksum was summed in parts */
+String* fix_message_generate_trailer_from_checksum(unsigned long checksum)
+{
+    return _make_field_from_checksum(FIX_TAG_CHECKSUM, checksum % 256);
+}
+
 String* fix_message_generate_trailer(const String *header_and_payload)
 {
     unsigned int checksum;
@@ -229,7 +264,7 @@ String* fix_message_generate_trailer(const String *header_and_payload)
 }
 
 String* fix_message_generate_logon(FIX_ENCRYPT_METHOD encrypt_method,
-        int heart_bt_int)
+        int heart_bt_int, int reset_seq_num)
 {
     DArray *fields;
     String *logon;
@@ -238,6 +273,9 @@ String* fix_message_generate_logon(FIX_ENCRYPT_METHOD encrypt_method,
 
     darray_append(fields, _make_field_from_int(FIX_TAG_ENCRYPT_METHOD, (int)encrypt_method));
     darray_append(fields, _make_field_from_int(FIX_TAG_HEARTBTINT, (int)heart_bt_int));
+    if(reset_seq_num) {
+        darray_append(fields, _make_field_from_char(FIX_TAG_RESET_SEQ_NUM_FLAG, 'Y'));
+    }
 
     logon = string_join(fields);
 
@@ -246,6 +284,143 @@ String* fix_message_generate_logon(FIX_ENCRYPT_METHOD encrypt_method,
     return logon;
 }
 
+/* A Heartbeat answering a TestRequest carries its TestReqID. Other
+ * heartbeats have no body, and this returns NULL.
+ */
+String* fix_message_generate_heartbeat(const String *test_req_id)
+{
+    if(NULL == test_req_id) {
+        return NULL;
+    }
+
+    return _make_field_from_string(FIX_TAG_TEST_REQ_ID, test_req_id);
+}
+
+String* fix_message_generate_test_request(const String *test_req_id)
+{
+    return _make_field_from_string(FIX_TAG_TEST_REQ_ID, test_req_id);
+}
+
+/* An EndSeqNo of 0 asks for everything from BeginSeqNo on */
+String* fix_message_generate_resend_request(unsigned long begin_seq_no,
+        unsigned long end_seq_no)
+{
+    DArray *fields;
+    String *resend;
+
+    fields = darray_create();
+
+    darray_append(fields, _make_field_from_ulong(FIX_TAG_BEGIN_SEQ_NO, begin_seq_no));
+    darray_append(fields, _make_field_from_ulong(FIX_TAG_END_SEQ_NO, end_seq_no));
+
+    resend = string_join(fields);
+
+    darray_free_all(fields, (FreeFn)string_free);
+
+    return resend;
+}
+
+String* fix_message_generate_sequence_reset(unsigned long new_seq_no,
+        int gap_fill)
+{
+    DArray *fields;
+    String *reset;
+
+    fields = darray_create();
+
+    if(gap_fill) {
+        darray_append(fields, _make_field_from_char(FIX_TAG_GAP_FILL_FLAG, 'Y'));
+    }
+    darray_append(fields, _make_field_from_ulong(FIX_TAG_NEW_SEQ_NO, new_seq_no));
+
+    reset = string_join(fields);
+
+    darray_free_all(fields, (FreeFn)string_free);
+
+    return reset;
+}
+
+String* fix_message_generate_mass_quote_ack(const String *quote_id,
+        FIX_QUOTE_ACK_STATUS status)
+{
+    DArray *fields;
+    String *ack;
+
+    fields = darray_create();
+
+    if(NULL != quote_id) {
+        darray_append(fields, _make_field_from_string(FIX_TAG_QUOTE_ID, quote_id));
+    }
+    darray_append(fields, _make_field_from_int(FIX_TAG_QUOTE_ACK_STATUS,
+                (int)status));
+
+    ack = string_join(fields);
+
+    darray_free_all(fields, (FreeFn)string_free);
+
+    return ack;
+}
+
+/* The order's status is always reported as rejected, since the
+ * session doesn't track it
+ */
+String* fix_message_generate_order_cancel_reject(const String *cl_ord_id,
+        const String *orig_cl_ord_id, FIX_CXL_REJ_RESPONSE_TO response_to)
+{
+    DArray *fields;
+    String *reject;
+
+    fields = darray_create();
+
+    darray_append(fields, _make_field_from_chars(FIX_TAG_ORDER_ID, "NONE"));
+    if(NULL != cl_ord_id) {
+        darray_append(fields, _make_field_from_string(FIX_TAG_CLORDID, cl_ord_id));
+    }
+    if(NULL != orig_cl_ord_id) {
+        darray_append(fields, _make_field_from_string(FIX_TAG_ORIG_CLORDID,
+                    orig_cl_ord_id));
+    }
+    darray_append(fields, _make_field_from_char(FIX_TAG_ORD_STATUS, '8'));
+    darray_append(fields, _make_field_from_char(FIX_TAG_CXL_REJ_RESPONSE_TO,
+                '0' + (int)response_to));
+
+    reject = string_join(fields);
+
+    darray_free_all(fields, (FreeFn)string_free);
+
+    return reject;
+}
+
+/* MassCancelResponse echoes the request type if the request was
+ * accepted, and is 0 if it was rejected
+ */
+String* fix_message_generate_order_mass_cancel_report(const String *cl_ord_id,
+        FIX_MASS_CANCEL_REQUEST_TYPE type, int accepted,
+        unsigned long affected)
+{
+    DArray *fields;
+    String *report;
+
+    fields = darray_create();
+
+    if(NULL != cl_ord_id) {
+        darray_append(fields, _make_field_from_string(FIX_TAG_CLORDID, cl_ord_id));
+    }
+    darray_append(fields, _make_field_from_chars(FIX_TAG_ORDER_ID, "NONE"));
+    darray_append(fields, _make_field_from_char(FIX_TAG_MASS_CANCEL_REQUEST_TYPE,
+                '0' + (int)type));
+    darray_append(fields, _make_field_from_char(FIX_TAG_MASS_CANCEL_RESPONSE,
+                accepted ? ('0' + (int)type) : '0'));
+    darray_append(fields, _make_field_from_ulong(FIX_TAG_TOTAL_AFFECTED_ORDERS,
+                affected));
+
+    report = string_join(fields);
+
+    darray_free_all(fields, (FreeFn)string_free);
+
+    return report;
+}
+
 String* fix_message_generate_new_order_single(String *cl_ord_id,
         FIX_HANDL_INST handl_inst,
         String *symbol,
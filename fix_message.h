@@ -36,19 +36,29 @@ extern "C" {
  * page 192 of the FIX 4.2 spec.
  */
 typedef enum {
+    FIX_TAG_BEGIN_SEQ_NO = 7,
     FIX_TAG_BEGIN_STRING = 8,
     FIX_TAG_BODY_LENGTH = 9,
     FIX_TAG_CHECKSUM = 10,
     FIX_TAG_CLORDID = 11,
 
+    FIX_TAG_END_SEQ_NO = 16,
+
+    FIX_TAG_EXEC_INST = 18,
+
     FIX_TAG_HANDLINST = 21,
 
     FIX_TAG_MSG_SEQ_NUM = 34,
     FIX_TAG_MSG_TYPE = 35,
+    FIX_TAG_NEW_SEQ_NO = 36,
 
+    FIX_TAG_ORDER_ID = 37,
     FIX_TAG_ORDER_QTY = 38,
-
+    FIX_TAG_ORD_STATUS = 39,
     FIX_TAG_ORDER_TYPE = 40,
+    FIX_TAG_ORIG_CLORDID = 41,
+
+    FIX_TAG_POSS_DUP_FLAG = 43,
 
     FIX_TAG_PRICE = 44,
     FIX_TAG_SENDER_COMP_ID = 49,
@@ -57,11 +67,45 @@ typedef enum {
     FIX_TAG_SYMBOL = 55,
     FIX_TAG_TARGET_COMP_ID = 56,
 
+    FIX_TAG_TIME_IN_FORCE = 59,
+
     FIX_TAG_TRANSACT_TIME = 60,
 
     FIX_TAG_ENCRYPT_METHOD = 98,
 
-    FIX_TAG_HEARTBTINT = 108
+    FIX_TAG_STOP_PX = 99,
+
+    FIX_TAG_HEARTBTINT = 108,
+
+    FIX_TAG_MAX_FLOOR = 111,
+    FIX_TAG_TEST_REQ_ID = 112,
+
+    FIX_TAG_QUOTE_ID = 117,
+
+    FIX_TAG_ORIG_SENDING_TIME = 122,
+
+    FIX_TAG_GAP_FILL_FLAG = 123,
+
+    FIX_TAG_EXPIRE_TIME = 126,
+
+    FIX_TAG_BID_PX = 132,
+    FIX_TAG_OFFER_PX = 133,
+    FIX_TAG_BID_SIZE = 134,
+    FIX_TAG_OFFER_SIZE = 135,
+
+    FIX_TAG_RESET_SEQ_NUM_FLAG = 141,
+
+    FIX_TAG_PEG_DIFFERENCE = 211,
+
+    FIX_TAG_QUOTE_ACK_STATUS = 297,
+
+    FIX_TAG_EXPIRE_DATE = 432,
+
+    FIX_TAG_CXL_REJ_RESPONSE_TO = 434,
+
+    FIX_TAG_MASS_CANCEL_REQUEST_TYPE = 530,
+    FIX_TAG_MASS_CANCEL_RESPONSE = 531,
+    FIX_TAG_TOTAL_AFFECTED_ORDERS = 533
 } FIX_TAG;
 
 /* Message types in FIX.4.2 are enumerated from 0-9,A-Z,a-m (see
@@ -95,8 +139,18 @@ typedef enum {
     FIX_MSG_TYPE_ORDER_CANCEL_REPLACE_REQUEST,
     FIX_MSG_TYPE_ORDER_STATUS_REQUEST,
 
+    FIX_MSG_TYPE_QUOTE = 35,
+
     FIX_MSG_TYPE_PRIVATE = 37,
 
+    FIX_MSG_TYPE_MASS_QUOTE_ACK = 50,
+
+    FIX_MSG_TYPE_MASS_QUOTE = 57,
+
+    /* From FIX 4.3, for mass cancels */
+    FIX_MSG_TYPE_ORDER_MASS_CANCEL_REQUEST = 65,
+    FIX_MSG_TYPE_ORDER_MASS_CANCEL_REPORT,
+
     /* No new messages after this point */
     FIX_MSG_TYPE_LAST,
 
@@ -149,6 +203,61 @@ typedef enum {
     FIX_ORDER_TYPE_INVALID
 } FIX_ORDER_TYPE;
 
+typedef enum {
+    FIX_TIME_IN_FORCE_DAY = 0,
+    FIX_TIME_IN_FORCE_GTC,
+    FIX_TIME_IN_FORCE_OPG,
+    FIX_TIME_IN_FORCE_IOC,
+    FIX_TIME_IN_FORCE_FOK,
+    FIX_TIME_IN_FORCE_GTX,
+    FIX_TIME_IN_FORCE_GTD,
+
+    /* No new time in force values after this point */
+    FIX_TIME_IN_FORCE_LAST,
+
+    FIX_TIME_IN_FORCE_INVALID
+} FIX_TIME_IN_FORCE;
+
+/* The ExecInst values for pegged orders. Like message types, each
+ * is the instruction's character less '0'.
+ */
+typedef enum {
+    FIX_EXEC_INST_MID_PRICE_PEG = 29,
+    FIX_EXEC_INST_MARKET_PEG = 32,
+    FIX_EXEC_INST_PRIMARY_PEG = 34,
+
+    FIX_EXEC_INST_INVALID
+} FIX_EXEC_INST;
+
+/* Which orders an OrderMassCancelRequest covers. Only orders in a
+ * security, and all orders, are supported.
+ */
+typedef enum {
+    FIX_MASS_CANCEL_REQUEST_TYPE_SECURITY = 1,
+    FIX_MASS_CANCEL_REQUEST_TYPE_UNDERLYING,
+    FIX_MASS_CANCEL_REQUEST_TYPE_PRODUCT,
+    FIX_MASS_CANCEL_REQUEST_TYPE_CFICODE,
+    FIX_MASS_CANCEL_REQUEST_TYPE_SECURITY_TYPE,
+    FIX_MASS_CANCEL_REQUEST_TYPE_TRADING_SESSION,
+    FIX_MASS_CANCEL_REQUEST_TYPE_ALL_ORDERS,
+
+    /* No new request types after this point */
+    FIX_MASS_CANCEL_REQUEST_TYPE_LAST,
+
+    FIX_MASS_CANCEL_REQUEST_TYPE_INVALID
+} FIX_MASS_CANCEL_REQUEST_TYPE;
+
+/* Which request an OrderCancelReject answers */
+typedef enum {
+    FIX_CXL_REJ_RESPONSE_TO_CANCEL = 1,
+    FIX_CXL_REJ_RESPONSE_TO_CANCEL_REPLACE
+} FIX_CXL_REJ_RESPONSE_TO;
+
+typedef enum {
+    FIX_QUOTE_ACK_STATUS_ACCEPTED = 0,
+    FIX_QUOTE_ACK_STATUS_REJECTED = 5
+} FIX_QUOTE_ACK_STATUS;
+
 typedef enum {
     FIX_ENCRYPT_METHOD_NONE = 0,
     FIX_ENCRYPT_METHOD_PKCS,
@@ -183,9 +292,37 @@ String* fix_message_generate_header     (FIX_MSG_TYPE MsgType,
                                          const String *TargetCompId,
                                          unsigned long MsgSeqNum);
 
+String* fix_message_generate_resend_header
+                                        (FIX_MSG_TYPE MsgType,
+                                         unsigned long payload_length,
+                                         const String *SenderCompId,
+                                         const String *TargetCompId,
+                                         unsigned long MsgSeqNum,
+                                         const String *OrigSendingTime);
+
 String* fix_message_generate_trailer    (const String *header_and_payload);
+String* fix_message_generate_trailer_from_checksum
+                                        (unsigned long checksum);
 String* fix_message_generate_logon      (FIX_ENCRYPT_METHOD encrypt_method,
-                                         int heart_bt_int);
+                                         int heart_bt_int,
+                                         int reset_seq_num);
+String* fix_message_generate_heartbeat  (const String *test_req_id);
+String* fix_message_generate_test_request   (const String *test_req_id);
+String* fix_message_generate_resend_request (unsigned long begin_seq_no,
+                                             unsigned long end_seq_no);
+String* fix_message_generate_sequence_reset (unsigned long new_seq_no,
+                                             int gap_fill);
+String* fix_message_generate_mass_quote_ack (const String *quote_id,
+                                             FIX_QUOTE_ACK_STATUS status);
+String* fix_message_generate_order_cancel_reject
+                                    (const String *cl_ord_id,
+                                     const String *orig_cl_ord_id,
+                                     FIX_CXL_REJ_RESPONSE_TO response_to);
+String* fix_message_generate_order_mass_cancel_report
+                                    (const String *cl_ord_id,
+                                     FIX_MASS_CANCEL_REQUEST_TYPE type,
+                                     int accepted,
+                                     unsigned long affected);
 
 String* fix_message_generate_new_order_single   (String *cl_ord_id,
                                                  FIX_HANDL_INST handl_inst,
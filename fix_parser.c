@@ -26,10 +26,13 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <libcore/string.h>
 
@@ -119,11 +122,17 @@ int fix_parse_is_msg_valid(String *msg)
 
 Order* fix_parse_order(String *msg)
 {
+    ORDER_TIME_IN_FORCE time_in_force;
+    unsigned long long expire_time;
     ORDER_TYPE type;
     ORDER_SIDE side;
     Order *o;
 
-    type = order_convert_from_fix_ordtype(fix_parse_OrdType(msg));
+    if(FIX_ORDER_TYPE_PEGGED == fix_parse_OrdType(msg)) {
+        type = order_convert_from_fix_exec_inst(fix_parse_ExecInst(msg));
+    } else {
+        type = order_convert_from_fix_ordtype(fix_parse_OrdType(msg));
+    }
     if(ORDER_TYPE_INVALID == type) {
         return NULL;
     }
@@ -133,14 +142,160 @@ Order* fix_parse_order(String *msg)
         return NULL;
     }
 
+    time_in_force = order_convert_from_fix_time_in_force(
+            fix_parse_TimeInForce(msg));
+    if(ORDER_TIME_IN_FORCE_INVALID == time_in_force) {
+        return NULL;
+    }
+
+    /* GTD orders expire at the end of their ExpireDate, or are GTT
+     * if they give an ExpireTime instead
+     */
+    expire_time = 0;
+
+    if(ORDER_TIME_IN_FORCE_GTD == time_in_force) {
+        if((expire_time = fix_parse_ExpireTime(msg)) > 0) {
+            time_in_force = ORDER_TIME_IN_FORCE_GTT;
+        } else if((expire_time = fix_parse_ExpireDate(msg)) > 0) {
+            expire_time = order_day_end(expire_time);
+        } else {
+            return NULL;
+        }
+    }
+
     o = order_create(type, side,
             fix_parse_Symbol(msg),
             fix_parse_Price(msg),
             fix_parse_OrderQty(msg));
 
+    if(NULL != o) {
+        order_set_time_in_force(o, time_in_force);
+        order_set_expire_time(o, expire_time);
+
+        if((ORDER_TYPE_STOP == type) || (ORDER_TYPE_STOP_LIMIT == type)) {
+            order_set_stop_price(o, fix_parse_StopPx(msg));
+        }
+
+        if((ORDER_TYPE_PEG_PRIMARY == type) ||
+                (ORDER_TYPE_PEG_MARKET == type) ||
+                (ORDER_TYPE_PEG_MIDPOINT == type)) {
+            order_set_peg_offset(o, fix_parse_PegDifference(msg));
+        }
+
+        if(fix_parse_MaxFloor(msg) > 0) {
+            order_set_display_quantity(o, fix_parse_MaxFloor(msg));
+        }
+
+        order_set_cl_ord_id(o, fix_parse_ClOrdId(msg));
+    }
+
     return o;
 }
 
+/* Start of the value of a field found between start and end, or
+ * NULL if the field isn't there
+ */
+static const char* _fix_parse_field_in(String *msg, const char *prefix,
+        unsigned long start, unsigned long end)
+{
+    unsigned long index;
+
+    if((string_find_after(msg, prefix, start, &index) != 0) ||
+            (index >= end)) {
+        return NULL;
+    }
+
+    return string_get_chars(msg) + index + strlen(prefix);
+}
+
+/* One side of a quote entry. A side with no price or no size is
+ * left at zero. Returns -1 if the price or size isn't a whole,
+ * non-negative number.
+ */
+static int _fix_parse_quote_side(String *msg, const char *px_prefix,
+        const char *size_prefix, unsigned long start, unsigned long end,
+        float *px, unsigned long *size)
+{
+    const char *px_value, *size_value;
+    char *px_end, *size_end;
+
+    *px = 0.0f;
+    *size = 0;
+
+    px_value = _fix_parse_field_in(msg, px_prefix, start, end);
+    size_value = _fix_parse_field_in(msg, size_prefix, start, end);
+
+    if((NULL == px_value) || (NULL == size_value)) {
+        return 0;
+    }
+
+    /* strtoul would take a sign, and wrap a negative size round */
+    if(!isdigit((unsigned char)*size_value)) {
+        return -1;
+    }
+
+    errno = 0;
+    *px = strtof(px_value, &px_end);
+    *size = strtoul(size_value, &size_end, 10);
+
+    if((0 != errno) || ('\001' != *px_end) || ('\001' != *size_end) ||
+            !(*px >= 0.0f)) {
+        *px = 0.0f;
+        *size = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse the quote entries of a Quote, or of every quote set in a
+ * MassQuote, up to max of them. Each entry runs from its Symbol to
+ * the next one. Returns the number of entries; the caller owns their
+ * symbols. truncated is set if there were more than max.
+ */
+unsigned long fix_parse_quotes(String *msg, FixQuote *quotes,
+        unsigned long max, int *truncated)
+{
+    unsigned long start, next, end, symbol_end, n;
+    int more, bid, offer;
+
+    assert(msg != NULL);
+    assert(quotes != NULL);
+    assert(truncated != NULL);
+
+    n = 0;
+    next = 0;
+    *truncated = 0;
+
+    if(string_find(msg, "\00155=", &start) != 0) {
+        return 0;
+    }
+
+    do {
+        more = (string_find_after(msg, "\00155=", start + 1, &next) == 0);
+        end = more ? next : string_length(msg);
+
+        if(string_find_after(msg, "\001", start + 1, &symbol_end) != 0) {
+            break;
+        }
+
+        quotes[n].symbol = string_substring(msg, start + 4, symbol_end - 1);
+
+        bid = _fix_parse_quote_side(msg, "\001132=", "\001134=",
+                start, end, &quotes[n].bid_px, &quotes[n].bid_size);
+        offer = _fix_parse_quote_side(msg, "\001133=", "\001135=",
+                start, end, &quotes[n].offer_px, &quotes[n].offer_size);
+        quotes[n].is_valid = (0 == bid) && (0 == offer);
+
+        n++;
+        start = next;
+    } while(more && (n < max));
+
+    *truncated = more && (n == max);
+
+    return n;
+}
+
 /* 8: BeginString, must be first field in message */
 String* fix_parse_BeginString(String *msg)
 {
@@ -313,6 +468,114 @@ int fix_parse_HeartBtInt(String *msg)
     return heartBtInt;
 }
 
+/* Session Fields */
+
+/* Value of an unsigned integer field, found by its "<SOH>tag="
+ * prefix. Returns 0 if the field is missing.
+ */
+static unsigned long _fix_parse_ulong(String *msg, const char *prefix)
+{
+    unsigned long start_index, end_index, value;
+    String *tmp;
+
+    value = 0;
+
+    if(string_find(msg, prefix, &start_index) == 0) {
+        if(string_find_after(msg, "\001", start_index + 1, &end_index) == 0) {
+            tmp = string_substring(msg, start_index + strlen(prefix),
+                    end_index - 1);
+            /* TODO Should check errno here */
+            value = strtoul(string_get_chars(tmp), NULL, 10);
+            string_free(tmp);
+        }
+    }
+
+    return value;
+}
+
+/* Whether a Boolean field is present and set to 'Y' */
+static int _fix_parse_flag(String *msg, const char *prefix)
+{
+    unsigned long start_index;
+
+    if(string_find(msg, prefix, &start_index) == 0) {
+        return string_char_at(msg, start_index + strlen(prefix)) == 'Y';
+    }
+
+    return 0;
+}
+
+/* 7: First message to be resent */
+unsigned long fix_parse_BeginSeqNo(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_ulong(msg, "\0017=");
+}
+
+/* 16: Last message to be resent, or 0 for all messages after
+ * BeginSeqNo
+ */
+unsigned long fix_parse_EndSeqNo(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_ulong(msg, "\00116=");
+}
+
+/* 36: Sequence number of the next message to be sent */
+unsigned long fix_parse_NewSeqNo(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_ulong(msg, "\00136=");
+}
+
+/* 43: Message may be a duplicate of one already sent */
+int fix_parse_PossDupFlag(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_flag(msg, "\00143=");
+}
+
+/* 123: Sequence Reset is replacing administrative or outdated
+ * messages
+ */
+int fix_parse_GapFillFlag(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_flag(msg, "\001123=");
+}
+
+/* 112: Identifier echoed in the Heartbeat answering a TestRequest */
+String* fix_parse_TestReqID(String *msg)
+{
+    unsigned long start_index, end_index;
+    String *testReqId;
+
+    assert(msg != NULL);
+
+    testReqId = NULL;
+
+    if(string_find(msg, "\001112=", &start_index) == 0) {
+        if(string_find_after(msg, "\001", start_index + 1, &end_index) == 0) {
+            testReqId = string_substring(msg, start_index + 5, end_index - 1);
+        }
+    }
+
+    return testReqId;
+}
+
+/* 141: Both sides should reset their sequence numbers at Logon */
+int fix_parse_ResetSeqNumFlag(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_flag(msg, "\001141=");
+}
+
 
 /* New Order Fields */
 
@@ -337,6 +600,25 @@ String* fix_parse_ClOrdId(String *msg)
     return clOrdId;
 }
 
+/* 41: ClOrdID of the order that a cancel or replace applies to */
+String* fix_parse_OrigClOrdID(String *msg)
+{
+    unsigned long start_index, end_index;
+    String *origClOrdId;
+
+    assert(msg != NULL);
+
+    origClOrdId = NULL;
+
+    if(string_find(msg, "\00141=", &start_index) == 0) {
+        if(string_find_after(msg, "\001", start_index + 1, &end_index) == 0) {
+            origClOrdId = string_substring(msg, start_index + 4, end_index - 1);
+        }
+    }
+
+    return origClOrdId;
+}
+
 /* 21: Instructions for order handling on Broker trading floor */
 /*
 char fix_parse_HandlInst(String *msg)
@@ -345,6 +627,25 @@ char fix_parse_HandlInst(String *msg)
 }
 */
 
+/* 117: Unique identifier for a quote */
+String* fix_parse_QuoteID(String *msg)
+{
+    unsigned long start_index, end_index;
+    String *quoteId;
+
+    assert(msg != NULL);
+
+    quoteId = NULL;
+
+    if(string_find(msg, "\001117=", &start_index) == 0) {
+        if(string_find_after(msg, "\001", start_index + 1, &end_index) == 0) {
+            quoteId = string_substring(msg, start_index + 5, end_index - 1);
+        }
+    }
+
+    return quoteId;
+}
+
 /* 55: Ticker symbol */
 String* fix_parse_Symbol(String *msg)
 {
@@ -440,3 +741,191 @@ float fix_parse_Price(String *msg)
 
     return price;
 }
+
+/* 99: Price per share at which a stop order is triggered */
+float fix_parse_StopPx(String *msg)
+{
+    unsigned long start_index;
+    float stopPx;
+
+    assert(msg != NULL);
+
+    stopPx = -1.0;
+
+    if(string_find(msg, "\00199=", &start_index) == 0) {
+        /* TODO Should check errno here */
+        stopPx = strtof(string_get_chars(msg) + (start_index + 4), NULL);
+    }
+
+    return stopPx;
+}
+
+/* 111: Maximum number of shares within an order to be shown on
+ * the exchange floor at any given time
+ */
+float fix_parse_MaxFloor(String *msg)
+{
+    unsigned long start_index;
+    float maxFloor;
+
+    assert(msg != NULL);
+
+    maxFloor = -1.0;
+
+    if(string_find(msg, "\001111=", &start_index) == 0) {
+        /* TODO Should check errno here */
+        maxFloor = strtof(string_get_chars(msg) + (start_index + 5), NULL);
+    }
+
+    return maxFloor;
+}
+
+/* 59: Specifies how long the order remains in effect. Absence
+ * of this field indicates a Day order.
+ */
+FIX_TIME_IN_FORCE fix_parse_TimeInForce(String *msg)
+{
+    unsigned long start_index;
+    FIX_TIME_IN_FORCE ret;
+
+    assert(msg != NULL);
+
+    ret = FIX_TIME_IN_FORCE_DAY;
+
+    if(string_find(msg, "\00159=", &start_index) == 0) {
+        ret = (FIX_TIME_IN_FORCE)(string_char_at(msg, (start_index + 4)) - '0');
+    }
+
+    return ret;
+}
+
+/* 18: Instructions for order handling. Only the peg instructions
+ * are supported, and the first one given is returned.
+ */
+FIX_EXEC_INST fix_parse_ExecInst(String *msg)
+{
+    unsigned long start_index, i;
+    char c;
+
+    assert(msg != NULL);
+
+    if(string_find(msg, "\00118=", &start_index) != 0) {
+        return FIX_EXEC_INST_INVALID;
+    }
+
+    for(i = start_index + 4; i < string_length(msg); i++) {
+        c = string_char_at(msg, i);
+        if('\001' == c) {
+            break;
+        }
+
+        switch(c - '0') {
+            case FIX_EXEC_INST_MID_PRICE_PEG:
+            case FIX_EXEC_INST_MARKET_PEG:
+            case FIX_EXEC_INST_PRIMARY_PEG:
+                return (FIX_EXEC_INST)(c - '0');
+            default:
+                break;
+        }
+    }
+
+    return FIX_EXEC_INST_INVALID;
+}
+
+/* 211: Amount added to the price a pegged order is pegged to */
+float fix_parse_PegDifference(String *msg)
+{
+    unsigned long start_index;
+    float pegDifference;
+
+    assert(msg != NULL);
+
+    pegDifference = 0.0f;
+
+    if(string_find(msg, "\001211=", &start_index) == 0) {
+        /* TODO Should check errno here */
+        pegDifference = strtof(string_get_chars(msg) + (start_index + 5), NULL);
+    }
+
+    return pegDifference;
+}
+
+/* 530: Specifies the scope of an OrderMassCancelRequest */
+FIX_MASS_CANCEL_REQUEST_TYPE fix_parse_MassCancelRequestType(String *msg)
+{
+    unsigned long start_index;
+    FIX_MASS_CANCEL_REQUEST_TYPE ret;
+
+    assert(msg != NULL);
+
+    ret = FIX_MASS_CANCEL_REQUEST_TYPE_INVALID;
+
+    if(string_find(msg, "\001530=", &start_index) == 0) {
+        ret = (FIX_MASS_CANCEL_REQUEST_TYPE)(string_char_at(msg,
+                    (start_index + 5)) - '0');
+        if((ret < FIX_MASS_CANCEL_REQUEST_TYPE_SECURITY) ||
+                (ret >= FIX_MASS_CANCEL_REQUEST_TYPE_LAST)) {
+            ret = FIX_MASS_CANCEL_REQUEST_TYPE_INVALID;
+        }
+    }
+
+    return ret;
+}
+
+/* A UTC date, YYYYMMDD, optionally followed by a time, -HH:MM:SS
+ * with optional milliseconds, in nanoseconds since the Epoch. Returns
+ * 0 if the field is missing or malformed.
+ */
+static unsigned long long _fix_parse_utc(String *msg, const char *prefix)
+{
+    unsigned long start_index;
+    unsigned int ms;
+    struct tm tm;
+    time_t t;
+    int n;
+
+    if(string_find(msg, prefix, &start_index) != 0) {
+        return 0;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    ms = 0;
+
+    n = sscanf(string_get_chars(msg) + start_index + strlen(prefix),
+            "%4d%2d%2d-%2d:%2d:%2d.%3u", &tm.tm_year, &tm.tm_mon,
+            &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms);
+    if((3 != n) && (n < 6)) {
+        return 0;
+    }
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+
+    t = timegm(&tm);
+    if(t <= 0) {
+        return 0;
+    }
+
+    return ((unsigned long long)t * 1000000000ULL) +
+        ((unsigned long long)ms * 1000000ULL);
+}
+
+/* 126: Time the order expires, in nanoseconds since the Epoch, or
+ * 0 if there is none
+ */
+unsigned long long fix_parse_ExpireTime(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_utc(msg, "\001126=");
+}
+
+/* 432: Date the order expires on, as the midnight UTC starting it in
+ * nanoseconds since the Epoch, or 0 if there is none
+ */
+unsigned long long fix_parse_ExpireDate(String *msg)
+{
+    assert(msg != NULL);
+
+    return _fix_parse_utc(msg, "\001432=");
+}
@@ -37,8 +37,26 @@ extern "C" {
 #include "fix_message.h"
 #include "order.h"
 
+/* Most quote entries taken from one Quote or MassQuote */
+#define FIX_QUOTES_MAX  128
+
+/* A two-sided quote in one symbol, from a Quote or from a MassQuote
+ * QuoteEntry. A side that isn't quoted has no price or size. An
+ * entry with a price or size that can't be read isn't valid.
+ */
+typedef struct {
+    String *symbol;
+    float bid_px;
+    float offer_px;
+    unsigned long bid_size;
+    unsigned long offer_size;
+    int is_valid;
+} FixQuote;
+
 int             fix_parse_is_msg_valid  (String *msg);
 Order*          fix_parse_order         (String *msg);
+unsigned long   fix_parse_quotes        (String *msg, FixQuote *quotes,
+                                         unsigned long max, int *truncated);
 
 /* Header and Trailer Fields */
 String*         fix_parse_BeginString   (String *msg);
@@ -51,14 +69,35 @@ unsigned long   fix_parse_MsgSeqNum     (String *msg);
 //UTCTimestamp    fix_parse_SendingTime   (String *msg);
 int             fix_parse_HeartBtInt    (String *msg);
 
+/* Session Fields */
+unsigned long   fix_parse_BeginSeqNo    (String *msg);
+unsigned long   fix_parse_EndSeqNo      (String *msg);
+unsigned long   fix_parse_NewSeqNo      (String *msg);
+int             fix_parse_PossDupFlag   (String *msg);
+int             fix_parse_GapFillFlag   (String *msg);
+String*         fix_parse_TestReqID     (String *msg);
+int             fix_parse_ResetSeqNumFlag (String *msg);
+
 /* New Order Fields */
 String*         fix_parse_ClOrdId       (String *msg);
+String*         fix_parse_OrigClOrdID   (String *msg);
 String*         fix_parse_Symbol        (String *msg);
 FIX_ORDER_SIDE  fix_parse_Side          (String *msg);
 //UTCTimestamp    fix_parse_TransactTime  (String *msg);
 float           fix_parse_OrderQty      (String *msg);
 FIX_ORDER_TYPE  fix_parse_OrdType       (String *msg);
 float           fix_parse_Price         (String *msg);
+float           fix_parse_StopPx        (String *msg);
+float           fix_parse_MaxFloor      (String *msg);
+FIX_TIME_IN_FORCE fix_parse_TimeInForce (String *msg);
+FIX_MASS_CANCEL_REQUEST_TYPE fix_parse_MassCancelRequestType (String *msg);
+unsigned long long fix_parse_ExpireTime (String *msg);
+unsigned long long fix_parse_ExpireDate (String *msg);
+FIX_EXEC_INST   fix_parse_ExecInst      (String *msg);
+float           fix_parse_PegDifference (String *msg);
+
+/* Quote Fields */
+String*         fix_parse_QuoteID       (String *msg);
 
 #if __cplusplus
 }
@@ -33,6 +33,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include <libcore/string.h>
@@ -41,6 +42,7 @@
 #include "fix_server.h"
 #include "fix_session.h"
 #include "fix_session_manager.h"
+#include "log.h"
 
 #define DEBUG   0
 #define DBG(...) \
@@ -58,13 +60,20 @@ static void fix_server_read_logon(int socket)
 {
     unsigned long msg_start_idx, msg_end_idx;
     String *buffer, *fix_msg;
+    struct timeval timeout;
     FixSession *session;
     char buf[BUFSZ];
+    int done, handed;
     ssize_t n;
-    int done;
 
     session = NULL;
     done = 0;
+    handed = 0;
+
+    /* Don't let a client that never logs on hold up the others */
+    timeout.tv_sec = FIX_SESSION_LOGON_TIMEOUT_S;
+    timeout.tv_usec = 0;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
     buffer = string_create();
     fix_msg = NULL;
@@ -97,9 +106,20 @@ static void fix_server_read_logon(int socket)
                                 done = 1;
                             } else {
                                 if(!fix_session_is_active(session)) {
+                                    timeout.tv_sec = 0;
+                                    setsockopt(socket, SOL_SOCKET,
+                                            SO_RCVTIMEO, &timeout,
+                                            sizeof(timeout));
+
+                                    /* Queue the logon first, so it's
+                                     * processed before anything the
+                                     * session reads itself
+                                     */
                                     fix_session_set_socket(session, socket);
+                                    fix_session_receive_message(session,
+                                            fix_msg, NULL);
                                     fix_session_activate(session);
-                                    fix_session_receive_message(session, fix_msg);
+                                    handed = 1;
                                 }
 
                                 done = 1;
@@ -125,6 +145,14 @@ static void fix_server_read_logon(int socket)
      */
     string_free(buffer);
 
+    if(!handed) {
+        DBG("Closing connection that didn't log on\n");
+        if(NULL != fix_msg) {
+            string_free(fix_msg);
+        }
+        close(socket);
+    }
+
     DBG("Server is done waiting for data from client\n");
 }
 
@@ -158,7 +186,7 @@ static void* _fix_server(void *data)
 
 void fix_server_init(void)
 {
-    printf("FIX Server init\n");
+    LOG_INFO("FIX Server: Starting");
 
     fix_server_id = string_create_from_buf(FIX_SERVER_ID,
             strlen(FIX_SERVER_ID));
@@ -168,7 +196,7 @@ void fix_server_init(void)
 
 void fix_server_destroy(void)
 {
-    printf("FIX Server destroy\n");
+    LOG_INFO("FIX Server: Stopping");
 
     server_done = 1;
 
@@ -28,19 +28,29 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <unistd.h>
 
+#include <libcore/darray.h>
 #include <libcore/string.h>
 #include <libcore/queue.h>
 
 #include "fix_session.h"
 #include "fix_parser.h"
 #include "fix_server.h"
+#include "fix_session_manager.h"
+#include "fix_store.h"
 
+#include "latency.h"
+#include "log.h"
 #include "order.h"
 #include "market.h"
+#include "timer.h"
+#include "timestamp.h"
+#include "trace.h"
 
 #define DEBUG   0
 #define DBG(...) \
@@ -53,6 +63,9 @@ struct _fix_session {
 
     int is_active;
 
+    /* Set when the rx thread is to deactivate its own session */
+    int deactivate_pending;
+
     Queue *rx_queue;
     Queue *tx_queue;
 
@@ -66,69 +79,989 @@ struct _fix_session {
 
     unsigned long rx_seq_num;
     unsigned long tx_seq_num;
+
+    /* Sent messages and sequence numbers, kept across restarts.
+     * NULL if the store couldn't be opened.
+     */
+    FixStore *store;
+
+    /* A resend has been asked for, to fill the gap up to here */
+    int resend_pending;
+    unsigned long resend_until;
+
+    /* Heartbeat interval in seconds, or 0 for none */
+    int heart_bt_int;
+    int is_logged_on;
+    int logout_sent;
+
+    /* When the unanswered TestRequest was sent, or 0 */
+    unsigned long long test_request_sent;
+
+    /* Run on the session manager's timer thread. The heartbeat timer
+     * sends heartbeats, the idle timer sends a TestRequest and then
+     * gives up on a silent client, and the deadline timer bounds
+     * logon and logout.
+     */
+    Timer heartbeat_timer;
+    Timer idle_timer;
+    Timer deadline_timer;
+
+    /* Times of the last read from and write to the socket. Traffic
+     * only updates these; the timers look at them when they go off.
+     */
+    unsigned long long last_rx;
+    unsigned long long last_tx;
+
+    /* Live orders entered on this session, across all books */
+    OrderList *orders;
+
+    /* Pull the session's orders when it disconnects */
+    int cancel_on_disconnect;
+
+    /* Standing quotes, one per symbol quoted */
+    DArray *quotes;
+
+    /* Only updated while holding mutex, but read without it */
+    FixSessionCounters counters;
 };
 
-static void _fix_session_message_process(FixSession *session, String *msg)
+/* A received message waiting to be processed, with the times it
+ * was read off the socket and framed
+ */
+typedef struct {
+    String *msg;
+    LatencyTrace trace;
+} FixSessionRxMessage;
+
+/* A message waiting to be sent. Messages in the store are sent
+ * straight from it, a range at a time, so msg is only set when the
+ * message couldn't be stored.
+ */
+typedef struct {
+    String *msg;
+
+    unsigned long begin;
+    unsigned long end;
+
+    /* Answering a ResendRequest */
+    int is_resend;
+} FixSessionTxMessage;
+
+/* A market maker's standing quote in one symbol. Its bid and ask are
+ * updated in place in the book for as long as they keep resting.
+ */
+typedef struct {
+    String *symbol;
+    BookQuote sides[2];
+} FixSessionQuote;
+
+static void _fix_session_quote_free(FixSessionQuote *quote)
+{
+    string_free(quote->symbol);
+    free(quote);
+}
+
+static void _fix_session_rx_message_free(FixSessionRxMessage *rx)
+{
+    string_free(rx->msg);
+    free(rx);
+}
+
+static void _fix_session_tx_message_free(FixSessionTxMessage *tx)
+{
+    if(NULL != tx->msg) {
+        string_free(tx->msg);
+    }
+    free(tx);
+}
+
+/* Add one to a session counter. Called with the session mutex held. */
+static void _fix_session_count(unsigned long long *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Session-level messages are never resent. A gap fill replaces
+ * them instead.
+ */
+static int _fix_session_is_admin(FIX_MSG_TYPE type)
+{
+    switch(type) {
+        case FIX_MSG_TYPE_HEARTBEAT:
+        case FIX_MSG_TYPE_TEST_REQUEST:
+        case FIX_MSG_TYPE_RESEND_REQUEST:
+        case FIX_MSG_TYPE_SEQ_RESET:
+        case FIX_MSG_TYPE_LOGOUT:
+        case FIX_MSG_TYPE_LOGON:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Wrap a payload in a header and trailer, marked as a possible
+ * duplicate if it is being resent. Takes ownership of the payload,
+ * which may be NULL.
+ */
+static String* _fix_session_build_message(FixSession *session,
+        FIX_MSG_TYPE type, String *payload, unsigned long seq_num,
+        int is_resend)
+{
+    String *header_and_payload, *trailer;
+    String *fix_msg, *header;
+    unsigned long length;
+
+    length = (NULL == payload) ? 0 : string_length(payload);
+
+    if(is_resend) {
+        header = fix_message_generate_resend_header(type, length,
+                fix_server_get_id(), session->SenderCompId, seq_num, NULL);
+    } else {
+        header = fix_message_generate_header(type, length,
+                fix_server_get_id(), session->SenderCompId, seq_num);
+    }
+
+    if(0 == length) {
+        header_and_payload = string_duplicate(header);
+    } else {
+        header_and_payload = string_concat(header, payload);
+    }
+
+    trailer = fix_message_generate_trailer(header_and_payload);
+
+    fix_msg = string_concat(header_and_payload, trailer);
+
+    string_free(header);
+    string_free(payload);
+    string_free(header_and_payload);
+    string_free(trailer);
+
+    return fix_msg;
+}
+
+/* Hand a message to the tx thread */
+static int _fix_session_enqueue_tx(FixSession *session, String *msg,
+        unsigned long begin, unsigned long end, int is_resend)
+{
+    FixSessionTxMessage *tx;
+
+    tx = malloc(sizeof(FixSessionTxMessage));
+    if(NULL == tx) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        if(NULL != msg) {
+            string_free(msg);
+        }
+        return -1;
+    }
+
+    tx->msg = msg;
+    tx->begin = begin;
+    tx->end = end;
+    tx->is_resend = is_resend;
+
+    pthread_mutex_lock(&session->mutex);
+
+    queue_enqueue(session->tx_queue, tx);
+    _fix_session_count(&session->counters.tx_messages);
+
+    pthread_cond_signal(&session->tx_cond);
+    pthread_mutex_unlock(&session->mutex);
+
+    return 0;
+}
+
+/* Called with the session mutex held */
+static void _fix_session_set_rx_seq_num(FixSession *session,
+        unsigned long seq_num)
+{
+    session->rx_seq_num = seq_num;
+
+    if(NULL != session->store) {
+        fix_store_set_rx_seq_num(session->store, seq_num);
+    }
+
+    if(session->resend_pending && (seq_num > session->resend_until)) {
+        LOG_INFO("FIX Session: Gap filled for '%s'",
+                string_get_chars(session->SenderCompId));
+        session->resend_pending = 0;
+    }
+}
+
+/* Both sides start again from 1. Called with the session mutex
+ * held.
+ */
+static void _fix_session_reset(FixSession *session)
+{
+    LOG_INFO("FIX Session: Resetting sequence numbers for '%s'",
+            string_get_chars(session->SenderCompId));
+
+    if(NULL != session->store) {
+        fix_store_reset(session->store);
+    }
+
+    session->tx_seq_num = 1;
+    session->resend_pending = 0;
+    _fix_session_set_rx_seq_num(session, 1);
+}
+
+static void _fix_session_sequence_reset(FixSession *session,
+        unsigned long new_seq_no)
+{
+    if(new_seq_no < session->rx_seq_num) {
+        LOG_WARNING("Sequence reset would go back: expect %lu got %lu",
+                session->rx_seq_num, new_seq_no);
+        return;
+    }
+
+    _fix_session_set_rx_seq_num(session, new_seq_no);
+}
+
+/* Queue the messages asked for by a ResendRequest. An end of 0
+ * means everything sent so far.
+ */
+static void _fix_session_resend(FixSession *session, unsigned long begin,
+        unsigned long end)
+{
+    if((0 == end) || (end >= session->tx_seq_num)) {
+        end = session->tx_seq_num - 1;
+    }
+
+    if((0 == begin) || (begin > end)) {
+        LOG_WARNING("Can't resend %lu to %lu, last sent is %lu",
+                begin, end, session->tx_seq_num - 1);
+        return;
+    }
+
+    LOG_INFO("FIX Session: Resending %lu to %lu to '%s'", begin, end,
+            string_get_chars(session->SenderCompId));
+
+    _fix_session_enqueue_tx(session, NULL, begin, end, 1);
+}
+
+static unsigned long long _fix_session_interval_ns(FixSession *session)
+{
+    return session->heart_bt_int * 1000000000ULL;
+}
+
+/* Send a heartbeat if nothing has been sent for a whole interval */
+static void _fix_session_heartbeat_timeout(void *data)
+{
+    FixSession *session = (FixSession *)data;
+    unsigned long long now, last;
+
+    pthread_mutex_lock(&session->mutex);
+
+    if(session->is_active && session->is_logged_on &&
+            (session->heart_bt_int > 0)) {
+        now = timestamp_now();
+        last = __atomic_load_n(&session->last_tx, __ATOMIC_RELAXED);
+
+        if(now - last >= _fix_session_interval_ns(session)) {
+            fix_session_send_message(session, FIX_MSG_TYPE_HEARTBEAT,
+                    fix_message_generate_heartbeat(NULL));
+            last = now;
+        }
+
+        fix_session_manager_arm_timer(&session->heartbeat_timer,
+                last + _fix_session_interval_ns(session));
+    }
+
+    pthread_mutex_unlock(&session->mutex);
+}
+
+/* Have the rx thread deactivate the session once it is done with
+ * the message it is on. Deactivating joins the session's threads and
+ * cancels its orders, which mustn't hold up the timer thread or the
+ * rx thread's own message. Called with the session mutex held.
+ */
+static void _fix_session_deactivate_later(FixSession *session)
+{
+    session->deactivate_pending = 1;
+    pthread_cond_signal(&session->rx_cond);
+}
+
+/* Nothing has been heard for an interval, and a bit for the
+ * message to arrive. Send a TestRequest the first time, and give
+ * up on the client if it doesn't answer.
+ */
+static void _fix_session_idle_timeout(void *data)
+{
+    FixSession *session = (FixSession *)data;
+    unsigned long long now, last, allowed;
+    char buf[32];
+    String *id;
+    int n;
+
+    pthread_mutex_lock(&session->mutex);
+
+    if(!session->is_active || !session->is_logged_on ||
+            (0 == session->heart_bt_int)) {
+        pthread_mutex_unlock(&session->mutex);
+        return;
+    }
+
+    now = timestamp_now();
+    last = __atomic_load_n(&session->last_rx, __ATOMIC_RELAXED);
+    allowed = _fix_session_interval_ns(session);
+    allowed += allowed / 5;
+
+    /* Anything heard since the TestRequest answers it */
+    if((now - last < allowed) ||
+            ((0 != session->test_request_sent) &&
+             (last >= session->test_request_sent))) {
+        session->test_request_sent = 0;
+        fix_session_manager_arm_timer(&session->idle_timer, last + allowed);
+    } else if(0 == session->test_request_sent) {
+        n = snprintf(buf, sizeof(buf), "TEST%llu", now);
+        id = string_create_from_buf(buf, n);
+        fix_session_send_message(session, FIX_MSG_TYPE_TEST_REQUEST,
+                fix_message_generate_test_request(id));
+        string_free(id);
+
+        session->test_request_sent = now;
+        fix_session_manager_arm_timer(&session->idle_timer, now + allowed);
+    } else {
+        LOG_WARNING("FIX Session: No answer to TestRequest from '%s'",
+                string_get_chars(session->SenderCompId));
+        _fix_session_deactivate_later(session);
+    }
+
+    pthread_mutex_unlock(&session->mutex);
+}
+
+/* The client didn't log on, or didn't go away after a Logout */
+static void _fix_session_deadline_timeout(void *data)
 {
+    FixSession *session = (FixSession *)data;
+
+    pthread_mutex_lock(&session->mutex);
+
+    if(session->is_active &&
+            (!session->is_logged_on || session->logout_sent)) {
+        LOG_WARNING("FIX Session: Timed out %s '%s'",
+                session->logout_sent ? "logging out" : "waiting for logon",
+                string_get_chars(session->SenderCompId));
+        _fix_session_deactivate_later(session);
+    }
+
+    pthread_mutex_unlock(&session->mutex);
+}
+
+/* Accept a Logon, and start heartbeating at the interval it asks
+ * for. Called with the session mutex held.
+ */
+static void _fix_session_logon(FixSession *session, String *msg, int reset)
+{
+    unsigned long long now;
+    int heart_bt_int;
+
+    heart_bt_int = fix_parse_HeartBtInt(msg);
+    if(heart_bt_int < 0) {
+        heart_bt_int = 0;
+    }
+
+    session->heart_bt_int = heart_bt_int;
+    session->is_logged_on = 1;
+    session->test_request_sent = 0;
+
+    fix_session_manager_cancel_timer(&session->deadline_timer);
+
+    fix_session_send_message(session, FIX_MSG_TYPE_LOGON,
+            fix_message_generate_logon(FIX_ENCRYPT_METHOD_NONE,
+                    heart_bt_int, reset));
+
+    if(heart_bt_int > 0) {
+        now = timestamp_now();
+        fix_session_manager_arm_timer(&session->heartbeat_timer,
+                now + _fix_session_interval_ns(session));
+        fix_session_manager_arm_timer(&session->idle_timer,
+                now + _fix_session_interval_ns(session));
+    }
+}
+
+/* A message arrived ahead of the one expected. The client is asked
+ * once for everything from the one expected; the messages after the
+ * gap are dropped, as they will be resent.
+ */
+static void _fix_session_gap(FixSession *session, String *msg,
+        FIX_MSG_TYPE type, unsigned long seq_num)
+{
+    if(FIX_MSG_TYPE_LOGON == type) {
+        _fix_session_logon(session, msg, 0);
+    } else if(FIX_MSG_TYPE_RESEND_REQUEST == type) {
+        _fix_session_resend(session, fix_parse_BeginSeqNo(msg),
+                fix_parse_EndSeqNo(msg));
+    }
+
+    if(session->resend_pending) {
+        if(seq_num > session->resend_until) {
+            session->resend_until = seq_num;
+        }
+        return;
+    }
+
+    LOG_WARNING("Sequence gap: expect %lu got %lu, asking for a resend",
+            session->rx_seq_num, seq_num);
+
+    session->resend_pending = 1;
+    session->resend_until = seq_num;
+
+    fix_session_send_message(session, FIX_MSG_TYPE_RESEND_REQUEST,
+            fix_message_generate_resend_request(session->rx_seq_num, 0));
+}
+
+/* Is cancel on disconnect set for this CompID? FIX_CANCEL_ON_DISCONNECT
+ * is a comma separated list of CompIDs, or "*" for every session.
+ */
+static int _fix_session_cancel_on_disconnect(const String *SenderCompId)
+{
+    const char *env, *id, *end;
+    unsigned long len;
+
+    env = getenv("FIX_CANCEL_ON_DISCONNECT");
+    if(NULL == env) {
+        return 0;
+    }
+
+    id = string_get_chars(SenderCompId);
+    len = string_length(SenderCompId);
+
+    while('\0' != *env) {
+        end = strchr(env, ',');
+        if(NULL == end) {
+            end = env + strlen(env);
+        }
+
+        if(((1 == end - env) && ('*' == *env)) ||
+                (((unsigned long)(end - env) == len) &&
+                 (strncmp(env, id, len) == 0))) {
+            return 1;
+        }
+
+        env = ('\0' == *end) ? end : end + 1;
+    }
+
+    return 0;
+}
+
+/* Cancel this session's orders, in one symbol or in all of them */
+static void _fix_session_mass_cancel(FixSession *session, String *msg)
+{
+    FIX_MASS_CANCEL_REQUEST_TYPE type;
+    String *cl_ord_id, *symbol;
+    unsigned long affected;
+    int accepted;
+
+    type = fix_parse_MassCancelRequestType(msg);
+    cl_ord_id = fix_parse_ClOrdId(msg);
+    symbol = fix_parse_Symbol(msg);
+
+    affected = 0;
+    accepted = 1;
+
+    if((FIX_MASS_CANCEL_REQUEST_TYPE_SECURITY == type) && (NULL != symbol)) {
+        affected = market_cancel_orders(session->orders, symbol);
+    } else if(FIX_MASS_CANCEL_REQUEST_TYPE_ALL_ORDERS == type) {
+        affected = market_cancel_orders(session->orders, NULL);
+    } else {
+        LOG_WARNING("Unsupported mass cancel request type %d", (int)type);
+        accepted = 0;
+    }
+
+    fix_session_send_message(session, FIX_MSG_TYPE_ORDER_MASS_CANCEL_REPORT,
+            fix_message_generate_order_mass_cancel_report(cl_ord_id,
+                type, accepted, affected));
+
+    if(NULL != cl_ord_id) {
+        string_free(cl_ord_id);
+    }
+    if(NULL != symbol) {
+        string_free(symbol);
+    }
+}
+
+/* Replace one of this session's orders. The replacement is tracked
+ * under its own ClOrdID, and the original stays as it was if it
+ * can't be replaced.
+ */
+static void _fix_session_replace(FixSession *session, String *msg,
+        const LatencyTrace *trace)
+{
+    String *cl_ord_id, *orig_cl_ord_id;
     Order *o;
 
-    DBG("Processing message: '%s'\n", string_get_chars(msg));
+    orig_cl_ord_id = fix_parse_OrigClOrdID(msg);
+    o = fix_parse_order(msg);
 
-    if(fix_parse_is_msg_valid(msg)) {
-        /* Validate the RX sequence number */
-        if(session->rx_seq_num != fix_parse_MsgSeqNum(msg)) {
-            fprintf(stderr, "Sequence number doesn't match: expect %lu got %lu\n",
-                    session->rx_seq_num, fix_parse_MsgSeqNum(msg));
-            /* TODO Should do a Sequence Reset-Gap Fill/Reset here */
-            fix_session_deactivate(session);
+    if((NULL != o) && (NULL != orig_cl_ord_id)) {
+        *order_get_latency(o) = *trace;
+        latency_stamp(order_get_latency(o), LATENCY_STAGE_PARSE_COMPLETE);
+
+        order_list_add(session->orders, o);
+
+        if(market_replace_order(session->orders, orig_cl_ord_id, o) == 0) {
+            string_free(orig_cl_ord_id);
             return;
         }
+    }
+
+    cl_ord_id = fix_parse_ClOrdId(msg);
+
+    fix_session_send_message(session, FIX_MSG_TYPE_ORDER_CANCEL_REJECT,
+            fix_message_generate_order_cancel_reject(cl_ord_id,
+                orig_cl_ord_id, FIX_CXL_REJ_RESPONSE_TO_CANCEL_REPLACE));
+
+    if(NULL != o) {
+        order_free(o);
+    }
+    if(NULL != cl_ord_id) {
+        string_free(cl_ord_id);
+    }
+    if(NULL != orig_cl_ord_id) {
+        string_free(orig_cl_ord_id);
+    }
+}
+
+/* The session's standing quote in a symbol, made on first use */
+static FixSessionQuote* _fix_session_find_quote(FixSession *session,
+        const String *symbol)
+{
+    FixSessionQuote *quote;
+    unsigned long i;
+
+    for(i = 0; i < darray_size(session->quotes); i++) {
+        quote = (FixSessionQuote *)darray_index(session->quotes, i);
+        if(string_compare(quote->symbol, symbol) == 0) {
+            return quote;
+        }
+    }
+
+    quote = malloc(sizeof(FixSessionQuote));
+    if(NULL == quote) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    memset(quote, 0, sizeof(FixSessionQuote));
+    quote->symbol = string_duplicate(symbol);
+
+    darray_append(session->quotes, quote);
+
+    return quote;
+}
+
+/* An order for one side of a quote, owned by the session unless it
+ * only pulls the side
+ */
+static Order* _fix_session_quote_order(FixSession *session, ORDER_SIDE side,
+        const String *symbol, float price, unsigned long size)
+{
+    Order *o;
+
+    o = order_create(ORDER_TYPE_LIMIT, side, string_duplicate(symbol),
+            price, size);
+    if((NULL != o) && (size > 0)) {
+        order_list_add(session->orders, o);
+    }
+
+    return o;
+}
+
+/* Update the session's standing quotes from a Quote or MassQuote.
+ * Each symbol's bid and ask go to its book together. Nothing is
+ * applied from a message with more than FIX_QUOTES_MAX entries, or
+ * with one that can't be read. A MassQuote is only acknowledged as
+ * accepted if every one of its entries was.
+ */
+static void _fix_session_quotes(FixSession *session, String *msg,
+        FIX_MSG_TYPE type)
+{
+    FixQuote quotes[FIX_QUOTES_MAX];
+    FixSessionQuote *quote;
+    int truncated, rejected, apply;
+    String *quote_id;
+    Order *bid, *ask;
+    unsigned long i, n;
+
+    n = fix_parse_quotes(msg, quotes, FIX_QUOTES_MAX, &truncated);
+
+    rejected = truncated;
+    for(i = 0; i < n; i++) {
+        if(!quotes[i].is_valid) {
+            rejected = 1;
+        }
+    }
 
-        /* Increment RX sequence number */
-        session->rx_seq_num++;
-
-        switch(fix_parse_MsgType(msg)) {
-            /* Session Messages */
-            case FIX_MSG_TYPE_LOGON:
-                DBG("Received logon message\n");
-                fix_session_send_message(session, FIX_MSG_TYPE_LOGON,
-                        fix_message_generate_logon(FIX_ENCRYPT_METHOD_NONE, 0));
-                break;
-            case FIX_MSG_TYPE_LOGOUT:
-                DBG("Received logout message\n");
-                fix_session_send_message(session, FIX_MSG_TYPE_LOGOUT, NULL);
-                break;
-
-            /* TODO Other session-level messages here */
-
-
-            /* Administrative and Application Messages */
-            case FIX_MSG_TYPE_NEW_ORDER_SINGLE:
-                DBG("Parsing new order\n");
-                o = fix_parse_order(msg);
-                if(NULL != o) {
-                    DBG("Sending order into the market\n");
-                    /* Send the order into the market */
-                    market_process_order(o);
+    if(rejected) {
+        LOG_WARNING("FIX Session: Rejected quotes from '%s': %s",
+                string_get_chars(session->SenderCompId),
+                truncated ? "Too many entries" : "Unreadable entry");
+    }
+
+    apply = !rejected;
+
+    for(i = 0; i < n; i++) {
+        if(apply) {
+            quote = _fix_session_find_quote(session, quotes[i].symbol);
+
+            bid = _fix_session_quote_order(session, ORDER_SIDE_BUY,
+                    quotes[i].symbol, quotes[i].bid_px, quotes[i].bid_size);
+            ask = _fix_session_quote_order(session, ORDER_SIDE_SELL,
+                    quotes[i].symbol, quotes[i].offer_px,
+                    quotes[i].offer_size);
+
+            if((NULL != quote) && (NULL != bid) && (NULL != ask)) {
+                quote->sides[0].order = bid;
+                quote->sides[1].order = ask;
+                if(market_process_quotes(quote->sides, 2) < 0) {
+                    rejected = 1;
+                }
+            } else {
+                if(NULL != bid) {
+                    order_free(bid);
                 }
-                break;
+                if(NULL != ask) {
+                    order_free(ask);
+                }
+                rejected = 1;
+            }
+        }
+
+        string_free(quotes[i].symbol);
+    }
+
+    if(FIX_MSG_TYPE_MASS_QUOTE == type) {
+        quote_id = fix_parse_QuoteID(msg);
 
-            default:
-                fprintf(stderr, "Received unsupported message\n");
-                fix_session_deactivate(session);
-                break;
+        fix_session_send_message(session, FIX_MSG_TYPE_MASS_QUOTE_ACK,
+                fix_message_generate_mass_quote_ack(quote_id,
+                    ((n > 0) && !rejected) ? FIX_QUOTE_ACK_STATUS_ACCEPTED :
+                    FIX_QUOTE_ACK_STATUS_REJECTED));
+
+        if(NULL != quote_id) {
+            string_free(quote_id);
         }
-    } else {
-        fprintf(stderr, "Received invalid message\n");
+    }
+}
+
+static void _fix_session_message_process(FixSession *session, String *msg,
+        const LatencyTrace *trace)
+{
+    unsigned long seq_num;
+    String *test_req_id;
+    FIX_MSG_TYPE type;
+    int reset;
+    Order *o;
+
+    DBG("Processing message: '%s'\n", string_get_chars(msg));
+
+    if(!fix_parse_is_msg_valid(msg)) {
+        LOG_WARNING("Received invalid message");
         fix_session_deactivate(session);
+        return;
+    }
+
+    seq_num = fix_parse_MsgSeqNum(msg);
+    type = fix_parse_MsgType(msg);
+
+    if(!session->is_logged_on && (FIX_MSG_TYPE_LOGON != type)) {
+        LOG_WARNING("Received message before logon");
+        fix_session_deactivate(session);
+        return;
+    }
+
+    /* A Logon can ask for both sides to start again from 1 */
+    reset = (FIX_MSG_TYPE_LOGON == type) && fix_parse_ResetSeqNumFlag(msg);
+    if(reset) {
+        _fix_session_reset(session);
+    }
+
+    /* A Sequence Reset-Reset applies whatever its sequence number */
+    if((FIX_MSG_TYPE_SEQ_RESET == type) && !fix_parse_GapFillFlag(msg)) {
+        _fix_session_sequence_reset(session, fix_parse_NewSeqNo(msg));
+        return;
+    }
+
+    /* Validate the RX sequence number */
+    if(seq_num > session->rx_seq_num) {
+        _fix_session_gap(session, msg, type, seq_num);
+        return;
+    }
+
+    if(seq_num < session->rx_seq_num) {
+        /* Already seen, and resent in case it was lost */
+        if(fix_parse_PossDupFlag(msg)) {
+            return;
+        }
+
+        LOG_WARNING("Sequence number too low: expect %lu got %lu",
+                session->rx_seq_num, seq_num);
+        fix_session_deactivate(session);
+        return;
+    }
+
+    /* A Sequence Reset-Gap Fill stands in for the messages up to
+     * NewSeqNo
+     */
+    if(FIX_MSG_TYPE_SEQ_RESET == type) {
+        _fix_session_sequence_reset(session, fix_parse_NewSeqNo(msg));
+        return;
+    }
+
+    /* Increment RX sequence number */
+    _fix_session_set_rx_seq_num(session, seq_num + 1);
+
+    switch(type) {
+        /* Session Messages */
+        case FIX_MSG_TYPE_LOGON:
+            DBG("Received logon message\n");
+            _fix_session_logon(session, msg, reset);
+            break;
+        case FIX_MSG_TYPE_LOGOUT:
+            DBG("Received logout message\n");
+            fix_session_send_message(session, FIX_MSG_TYPE_LOGOUT, NULL);
+            session->logout_sent = 1;
+            fix_session_manager_arm_timer(&session->deadline_timer,
+                    timestamp_now() +
+                    FIX_SESSION_LOGOUT_TIMEOUT_S * 1000000000ULL);
+            break;
+        case FIX_MSG_TYPE_HEARTBEAT:
+            DBG("Received heartbeat\n");
+            break;
+        case FIX_MSG_TYPE_TEST_REQUEST:
+            DBG("Received test request\n");
+            test_req_id = fix_parse_TestReqID(msg);
+            fix_session_send_message(session, FIX_MSG_TYPE_HEARTBEAT,
+                    fix_message_generate_heartbeat(test_req_id));
+            if(NULL != test_req_id) {
+                string_free(test_req_id);
+            }
+            break;
+        case FIX_MSG_TYPE_RESEND_REQUEST:
+            DBG("Received resend request\n");
+            _fix_session_resend(session, fix_parse_BeginSeqNo(msg),
+                    fix_parse_EndSeqNo(msg));
+            break;
+
+        /* TODO Other session-level messages here */
+
+
+        /* Administrative and Application Messages */
+        case FIX_MSG_TYPE_NEW_ORDER_SINGLE:
+            DBG("Parsing new order\n");
+            o = fix_parse_order(msg);
+            if(NULL != o) {
+                *order_get_latency(o) = *trace;
+                latency_stamp(order_get_latency(o),
+                        LATENCY_STAGE_PARSE_COMPLETE);
+
+                /* Track it before the book can fill or cancel it,
+                 * either of which takes it off the list again
+                 */
+                order_list_add(session->orders, o);
+
+                DBG("Sending order into the market\n");
+                /* Send the order into the market. The order is
+                 * still ours if the market rejects it.
+                 */
+                if(market_process_order(o) < 0) {
+                    order_free(o);
+                }
+            }
+            break;
+        case FIX_MSG_TYPE_QUOTE:
+        case FIX_MSG_TYPE_MASS_QUOTE:
+            DBG("Received quotes\n");
+            _fix_session_quotes(session, msg, type);
+            break;
+        case FIX_MSG_TYPE_ORDER_CANCEL_REPLACE_REQUEST:
+            DBG("Received cancel/replace request\n");
+            _fix_session_replace(session, msg, trace);
+            break;
+        case FIX_MSG_TYPE_ORDER_MASS_CANCEL_REQUEST:
+            DBG("Received mass cancel request\n");
+            _fix_session_mass_cancel(session, msg);
+            break;
+
+        default:
+            LOG_WARNING("Received unsupported message");
+            fix_session_deactivate(session);
+            break;
     }
 }
 
-static void _fix_session_message_send(FixSession *session, String *msg)
+static void _fix_session_write(FixSession *session, const char *buf,
+        unsigned long len)
 {
-    DBG("Sending message: '%s'\n", string_get_chars(msg));
+    DBG("Sending message: '%.*s'\n", (int)len, buf);
+
+    send(session->socket, buf, len, 0);
+    __atomic_store_n(&session->last_tx, timestamp_now(), __ATOMIC_RELAXED);
+}
+
+/* Stand in for messages begin up to new_seq_no that can't be sent */
+static void _fix_session_send_gap_fill(FixSession *session,
+        unsigned long begin, unsigned long new_seq_no)
+{
+    String *msg;
+
+    msg = _fix_session_build_message(session, FIX_MSG_TYPE_SEQ_RESET,
+            fix_message_generate_sequence_reset(new_seq_no, 1), begin, 1);
 
-    send(session->socket, string_get_chars(msg), string_length(msg), 0);
+    _fix_session_write(session, string_get_chars(msg), string_length(msg));
+
+    string_free(msg);
+}
+
+/* Start of the first field in a raw message that starts with
+ * prefix, or NULL if there isn't one
+ */
+static const char* _fix_session_find_field(const char *buf,
+        unsigned long len, const char *prefix)
+{
+    unsigned long n = strlen(prefix);
+    const char *p, *end;
+
+    end = buf + len;
+
+    for(p = buf; (NULL != p) && (end - p >= (long)n);
+            p = memchr(p + 1, '\001', end - p - 1)) {
+        if(memcmp(p, prefix, n) == 0) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/* Resend a stored message as a possible duplicate. Its header is
+ * rewritten with PossDupFlag and its OrigSendingTime, and its body
+ * goes out straight from the store.
+ */
+static void _fix_session_resend_stored(FixSession *session,
+        FIX_MSG_TYPE type, unsigned long seq_num, const char *buf,
+        unsigned long len)
+{
+    const char *sending_time, *body, *end;
+    String *orig_sending_time, *header, *trailer;
+    struct iovec iov[3];
+    unsigned long checksum;
+
+    /* Messages are stored as this engine wrote them, with
+     * SendingTime last in the header and CheckSum last of all
+     */
+    sending_time = _fix_session_find_field(buf, len, "\00152=");
+    end = _fix_session_find_field(buf, len, "\00110=");
+    if((NULL == sending_time) || (NULL == end)) {
+        LOG_ERROR("(%s:%d) Stored message %lu is malformed",
+                __FUNCTION__, __LINE__, seq_num);
+        return;
+    }
+
+    sending_time += 4;
+    body = memchr(sending_time, '\001', end - sending_time);
+    if(NULL == body) {
+        LOG_ERROR("(%s:%d) Stored message %lu is malformed",
+                __FUNCTION__, __LINE__, seq_num);
+        return;
+    }
+    body++;
+    end++;
+
+    orig_sending_time = string_create_from_buf(sending_time,
+            body - 1 - sending_time);
+
+    header = fix_message_generate_resend_header(type, end - body,
+            fix_server_get_id(), session->SenderCompId, seq_num,
+            orig_sending_time);
+
+    checksum = fix_message_generate_checksum(string_get_chars(header),
+            string_length(header)) +
+        fix_message_generate_checksum(body, end - body);
+    trailer = fix_message_generate_trailer_from_checksum(checksum);
+
+    iov[0].iov_base = (void *)string_get_chars(header);
+    iov[0].iov_len = string_length(header);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = end - body;
+    iov[2].iov_base = (void *)string_get_chars(trailer);
+    iov[2].iov_len = string_length(trailer);
+
+    DBG("Resending message %lu\n", seq_num);
+
+    writev(session->socket, iov, 3);
+    __atomic_store_n(&session->last_tx, timestamp_now(), __ATOMIC_RELAXED);
+
+    string_free(orig_sending_time);
+    string_free(header);
+    string_free(trailer);
+}
+
+/* Send stored messages straight from the mapped store. Messages
+ * that sit next to each other in the store go out in one write.
+ * Resent messages go out one at a time, rewritten as possible
+ * duplicates. Messages no longer stored, and session-level ones
+ * being resent, are replaced by gap fills.
+ */
+static void _fix_session_send_stored(FixSession *session,
+        unsigned long begin, unsigned long end, int is_resend)
+{
+    unsigned long seq_num, gap, run_len, len;
+    const char *run, *buf;
+    FIX_MSG_TYPE type;
+
+    run = NULL;
+    run_len = 0;
+    gap = 0;
+
+    for(seq_num = begin; seq_num <= end; seq_num++) {
+        if((NULL != session->store) &&
+                (fix_store_get(session->store, seq_num,
+                               &type, &buf, &len) == 0) &&
+                !(is_resend && _fix_session_is_admin(type))) {
+            if(0 != gap) {
+                _fix_session_send_gap_fill(session, gap, seq_num);
+                gap = 0;
+            }
+
+            if(is_resend) {
+                _fix_session_resend_stored(session, type, seq_num, buf, len);
+            } else if((NULL != run) && (run + run_len == buf)) {
+                run_len += len;
+            } else {
+                if(NULL != run) {
+                    _fix_session_write(session, run, run_len);
+                }
+                run = buf;
+                run_len = len;
+            }
+        } else if(0 == gap) {
+            if(NULL != run) {
+                _fix_session_write(session, run, run_len);
+                run = NULL;
+            }
+            gap = seq_num;
+        }
+    }
+
+    if(NULL != run) {
+        _fix_session_write(session, run, run_len);
+    }
+
+    if(0 != gap) {
+        _fix_session_send_gap_fill(session, gap, end + 1);
+    }
+}
+
+static void _fix_session_message_send(FixSession *session,
+        FixSessionTxMessage *tx)
+{
+    if(NULL != tx->msg) {
+        _fix_session_write(session, string_get_chars(tx->msg),
+                string_length(tx->msg));
+    } else {
+        _fix_session_send_stored(session, tx->begin, tx->end, tx->is_resend);
+    }
 }
 
 #define BUFSZ           256
@@ -136,26 +1069,46 @@ static void* _fix_session_socket_thread(void *data)
 {
     unsigned long msg_start_idx, msg_end_idx;
     FixSession *session = (FixSession *)data;
+    unsigned long long read_time, now;
     String *buffer, *fix_msg;
+    LatencyTrace trace;
     char buf[BUFSZ];
+    char name[32];
     ssize_t n;
 
     if(NULL == session) {
         /* TODO Proper error log message */
-        fprintf(stderr, "Valid session object not passed to _fix_session_thread\n");
+        LOG_ERROR("Valid session object not passed to _fix_session_thread");
         return NULL;
     }
 
     if(fix_session_get_socket(session) < 0) {
-        fprintf(stderr, "Session has invalid socket\n");
+        LOG_ERROR("Session has invalid socket");
         return NULL;
     }
 
+    snprintf(name, sizeof(name), "socket %s",
+            string_get_chars(session->SenderCompId));
+    trace_set_thread_name(name);
+
     buffer = string_create();
     fix_msg = NULL;
+    read_time = 0;
 
     while(fix_session_is_active(session)) {
         if((n = recv(fix_session_get_socket(session), buf, BUFSZ, 0)) > 0) {
+            now = timestamp_now();
+            __atomic_store_n(&session->last_rx, now, __ATOMIC_RELAXED);
+
+            /* A message is timed from the read that brought in
+             * its first bytes
+             */
+            if(string_is_empty(buffer)) {
+                read_time = now;
+            }
+
+            trace_event(TRACE_EVENT_SOCKET_READ, n, 0);
+
             string_append_buf(buffer, buf, n);
             /* Find BeginString tag and CheckSum tag */
             if((string_find(buffer, "8=", &msg_start_idx) == 0) &&
@@ -169,7 +1122,14 @@ static void* _fix_session_socket_thread(void *data)
                             (msg_end_idx + 7));
 
                     DBG("New msg: '%s'\n", string_get_chars(fix_msg));
-                    fix_session_receive_message(session, fix_msg);
+
+                    trace_event(TRACE_EVENT_FRAME, string_length(fix_msg), 0);
+
+                    memset(&trace, 0, sizeof(trace));
+                    trace.stamp[LATENCY_STAGE_SOCKET_READ] = read_time;
+                    latency_stamp(&trace, LATENCY_STAGE_FRAME_COMPLETE);
+
+                    fix_session_receive_message(session, fix_msg, &trace);
 
                     /* Clear out buffer for new message */
                     if(msg_start_idx > 0) {
@@ -193,24 +1153,98 @@ static void* _fix_session_socket_thread(void *data)
     return NULL;
 }
 
+static int _fix_session_deactivate(FixSession *session)
+{
+    pthread_mutex_lock(&session->mutex);
+
+    if(session->is_active) {
+        session->is_active = 0;
+        session->is_logged_on = 0;
+        _fix_session_count(&session->counters.deactivations);
+
+        fix_session_manager_cancel_timer(&session->heartbeat_timer);
+        fix_session_manager_cancel_timer(&session->idle_timer);
+        fix_session_manager_cancel_timer(&session->deadline_timer);
+
+        LOG_INFO("FIX Session: Deactivating session for '%s'",
+                string_get_chars(session->SenderCompId));
+
+        pthread_cond_signal(&session->tx_cond);
+        pthread_cond_signal(&session->rx_cond);
+        pthread_mutex_unlock(&session->mutex);
+
+        if(pthread_equal(pthread_self(), session->rx_thread) == 0) {
+            pthread_join(session->rx_thread, NULL);
+        } else {
+            /* Nothing else will join an rx thread that deactivates
+             * its own session
+             */
+            pthread_detach(session->rx_thread);
+        }
+
+        /* No more orders can come in now the rx thread is done */
+        if(session->cancel_on_disconnect) {
+            LOG_INFO("FIX Session: Cancelled %lu orders for '%s'",
+                    market_cancel_orders(session->orders, NULL),
+                    string_get_chars(session->SenderCompId));
+        }
+
+        if(pthread_equal(pthread_self(), session->tx_thread) == 0) {
+            pthread_join(session->tx_thread, NULL);
+        }
+
+        shutdown(session->socket, SHUT_RDWR);
+        close(session->socket);
+        session->socket = -1;
+
+        if(pthread_equal(pthread_self(), session->socket_thread) == 0) {
+            pthread_join(session->socket_thread, NULL);
+        }
+    } else {
+        pthread_mutex_unlock(&session->mutex);
+    }
+
+    return 0;
+}
+
 void* _fix_session_rx_thread(void *data)
 {
     FixSession *session = (FixSession *)data;
-    String *msg;
+    FixSessionRxMessage *rx;
+    unsigned long seq_num;
+    char name[32];
 
     if(NULL == session) {
         /* TODO Proper error log message */
-        fprintf(stderr, "Invalid session object passed to _fix_session_tx_thread\n");
+        LOG_ERROR("Invalid session object passed to _fix_session_tx_thread");
         return NULL;
     }
 
+    snprintf(name, sizeof(name), "rx %s",
+            string_get_chars(session->SenderCompId));
+    trace_set_thread_name(name);
+
     pthread_mutex_lock(&session->mutex);
 
     while(session->is_active) {
-        while(!queue_is_empty(session->rx_queue)) {
-            msg = (String *)queue_dequeue(session->rx_queue);
-            _fix_session_message_process(session, msg);
-            string_free(msg);
+        while(!queue_is_empty(session->rx_queue) &&
+                !session->deactivate_pending) {
+            rx = (FixSessionRxMessage *)queue_dequeue(session->rx_queue);
+            seq_num = session->rx_seq_num;
+
+            trace_event(TRACE_EVENT_RX_BEGIN, seq_num, 0);
+            _fix_session_message_process(session, rx->msg, &rx->trace);
+            trace_event(TRACE_EVENT_RX_END, seq_num, 0);
+            _fix_session_rx_message_free(rx);
+            _fix_session_count(&session->counters.rx_processed);
+        }
+
+        if(session->deactivate_pending) {
+            session->deactivate_pending = 0;
+            pthread_mutex_unlock(&session->mutex);
+            _fix_session_deactivate(session);
+            pthread_mutex_lock(&session->mutex);
+            break;
         }
 
         pthread_cond_wait(&session->rx_cond, &session->mutex);
@@ -226,21 +1260,28 @@ void* _fix_session_rx_thread(void *data)
 void* _fix_session_tx_thread(void *data)
 {
     FixSession *session = (FixSession *)data;
-    String *msg;
+    FixSessionTxMessage *tx;
+    char name[32];
 
     if(NULL == session) {
         /* TODO Proper error log message */
-        fprintf(stderr, "Invalid session object passed to _fix_session_rx_thread\n");
+        LOG_ERROR("Invalid session object passed to _fix_session_rx_thread");
         return NULL;
     }
 
+    snprintf(name, sizeof(name), "tx %s",
+            string_get_chars(session->SenderCompId));
+    trace_set_thread_name(name);
+
     pthread_mutex_lock(&session->mutex);
 
     while(session->is_active) {
         while(!queue_is_empty(session->tx_queue)) {
-            msg = (String *)queue_dequeue(session->tx_queue);
-            _fix_session_message_send(session, msg);
-            string_free(msg);
+            tx = (FixSessionTxMessage *)queue_dequeue(session->tx_queue);
+            trace_event(TRACE_EVENT_TX_SEND, tx->begin, tx->end);
+            _fix_session_message_send(session, tx);
+            _fix_session_tx_message_free(tx);
+            _fix_session_count(&session->counters.tx_sent);
         }
 
         pthread_cond_wait(&session->tx_cond, &session->mutex);
@@ -271,6 +1312,7 @@ FixSession* fix_session_create(String *SenderCompId,
     session->SenderCompId = SenderCompId;
     session->socket = -1;
     session->is_active = 0;
+    session->deactivate_pending = 0;
 
     session->rx_queue = queue_create();
     session->tx_queue = queue_create();
@@ -283,8 +1325,41 @@ FixSession* fix_session_create(String *SenderCompId,
     pthread_cond_init(&session->rx_cond, NULL);
     pthread_cond_init(&session->tx_cond, NULL);
 
-    session->rx_seq_num = 1;
-    session->tx_seq_num = 1;
+    /* Carry on from the sequence numbers of the last run */
+    session->store = fix_store_open(NULL, SenderCompId);
+    if(NULL != session->store) {
+        session->rx_seq_num = fix_store_get_rx_seq_num(session->store);
+        session->tx_seq_num = fix_store_get_tx_seq_num(session->store);
+    } else {
+        LOG_WARNING("FIX Session: No message store for '%s', resends "
+                "will be gap filled", string_get_chars(SenderCompId));
+        session->rx_seq_num = 1;
+        session->tx_seq_num = 1;
+    }
+
+    session->resend_pending = 0;
+    session->resend_until = 0;
+
+    session->heart_bt_int = 0;
+    session->is_logged_on = 0;
+    session->logout_sent = 0;
+    session->test_request_sent = 0;
+
+    timer_init(&session->heartbeat_timer, _fix_session_heartbeat_timeout,
+            session);
+    timer_init(&session->idle_timer, _fix_session_idle_timeout, session);
+    timer_init(&session->deadline_timer, _fix_session_deadline_timeout,
+            session);
+
+    session->last_rx = 0;
+    session->last_tx = 0;
+
+    session->orders = order_list_create();
+    session->cancel_on_disconnect =
+        _fix_session_cancel_on_disconnect(SenderCompId);
+    session->quotes = darray_create();
+
+    memset(&session->counters, 0, sizeof(session->counters));
 
     return session;
 }
@@ -301,8 +1376,15 @@ void fix_session_free(FixSession *session)
 
     string_free(session->SenderCompId);
 
-    queue_free_all(session->rx_queue, (FreeFn)string_free);
-    queue_free_all(session->tx_queue, (FreeFn)string_free);
+    queue_free_all(session->rx_queue, (FreeFn)_fix_session_rx_message_free);
+    queue_free_all(session->tx_queue, (FreeFn)_fix_session_tx_message_free);
+
+    if(NULL != session->store) {
+        fix_store_close(session->store);
+    }
+
+    darray_free_all(session->quotes, (FreeFn)_fix_session_quote_free);
+    order_list_free(session->orders);
 
     free(session);
 }
@@ -328,7 +1410,18 @@ int fix_session_activate(FixSession *session)
     if(!session->is_active) {
         session->is_active = 1;
 
-        printf("FIX Session: Activating session for '%s'\n",
+        session->is_logged_on = 0;
+        session->logout_sent = 0;
+        session->test_request_sent = 0;
+        session->resend_pending = 0;
+        session->last_rx = timestamp_now();
+        session->last_tx = session->last_rx;
+
+        fix_session_manager_arm_timer(&session->deadline_timer,
+                session->last_rx +
+                FIX_SESSION_LOGON_TIMEOUT_S * 1000000000ULL);
+
+        LOG_INFO("FIX Session: Activating session for '%s'",
                 string_get_chars(session->SenderCompId));
 
         if(pthread_create(&session->socket_thread, NULL,
@@ -353,6 +1446,8 @@ int fix_session_activate(FixSession *session)
             pthread_mutex_unlock(&session->mutex);
             return -1;
         }
+
+        _fix_session_count(&session->counters.activations);
     }
 
     pthread_mutex_unlock(&session->mutex);
@@ -366,49 +1461,54 @@ int fix_session_deactivate(FixSession *session)
 
     pthread_mutex_lock(&session->mutex);
 
-    if(session->is_active) {
-        session->is_active = 0;
-
-        printf("FIX Session: Deactivating session for '%s'\n",
-                string_get_chars(session->SenderCompId));
-
-        pthread_cond_signal(&session->tx_cond);
-        pthread_cond_signal(&session->rx_cond);
-        pthread_mutex_unlock(&session->mutex);
-
-        if(pthread_equal(pthread_self(), session->rx_thread) == 0) {
-            pthread_join(session->rx_thread, NULL);
-        }
-
-        if(pthread_equal(pthread_self(), session->tx_thread) == 0) {
-            pthread_join(session->tx_thread, NULL);
-        }
-
-        shutdown(session->socket, SHUT_RDWR);
-        close(session->socket);
-        session->socket = -1;
-
-        if(pthread_equal(pthread_self(), session->socket_thread) == 0) {
-            pthread_join(session->socket_thread, NULL);
-        }
-    } else {
+    /* The rx thread holds the mutex while it processes a message,
+     * so it can't wait for the other threads to stop. It finishes
+     * the deactivation once it lets go.
+     */
+    if(session->is_active &&
+            pthread_equal(pthread_self(), session->rx_thread)) {
+        _fix_session_deactivate_later(session);
         pthread_mutex_unlock(&session->mutex);
+        return 0;
     }
 
-    return 0;
+    pthread_mutex_unlock(&session->mutex);
+
+    return _fix_session_deactivate(session);
 }
 
-int fix_session_receive_message(FixSession *session, String *message)
+/* Queue a received message for processing. The session takes
+ * ownership of the message on success. The trace holds the times
+ * the message was read and framed, and may be NULL.
+ */
+int fix_session_receive_message(FixSession *session, String *message,
+        const LatencyTrace *trace)
 {
+    FixSessionRxMessage *rx;
+
     if((NULL == session) ||
             (NULL == message) ||
             string_is_empty(message)) {
         return -1;
     }
 
+    rx = malloc(sizeof(FixSessionRxMessage));
+    if(NULL == rx) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return -1;
+    }
+
+    rx->msg = message;
+    if(NULL != trace) {
+        rx->trace = *trace;
+    } else {
+        memset(&rx->trace, 0, sizeof(rx->trace));
+    }
+
     pthread_mutex_lock(&session->mutex);
 
-    queue_enqueue(session->rx_queue, message);
+    queue_enqueue(session->rx_queue, rx);
+    _fix_session_count(&session->counters.rx_messages);
 
     pthread_cond_signal(&session->rx_cond);
     pthread_mutex_unlock(&session->mutex);
@@ -416,11 +1516,16 @@ int fix_session_receive_message(FixSession *session, String *message)
     return 0;
 }
 
+/* Send a message to the client. The session takes ownership of the
+ * payload, which may be NULL. The message is stored for resending
+ * before it is queued.
+ */
 int fix_session_send_message(FixSession *session,
         FIX_MSG_TYPE type, String *payload)
 {
-    String *header_and_payload, *trailer;
-    String *fix_msg, *header;
+    unsigned long seq_num;
+    String *fix_msg;
+    int ret;
 
     DBG("Sending message\n");
 
@@ -429,43 +1534,25 @@ int fix_session_send_message(FixSession *session,
         return -1;
     }
 
-    fix_msg = NULL;
-
     pthread_mutex_lock(&session->mutex);
 
-    if((NULL == payload) || (string_length(payload) == 0)) {
-        header = fix_message_generate_header(type,
-                0, /* payload length */
-                fix_server_get_id(),
-                session->SenderCompId,
-                session->tx_seq_num++);
+    seq_num = session->tx_seq_num++;
 
-        header_and_payload = string_duplicate(header);
-    } else {
-        header = fix_message_generate_header(type,
-                string_length(payload),
-                fix_server_get_id(),
-                session->SenderCompId,
-                session->tx_seq_num++);
+    fix_msg = _fix_session_build_message(session, type, payload, seq_num, 0);
 
-        header_and_payload = string_concat(header, payload);
+    if((NULL != session->store) &&
+            (fix_store_append(session->store, seq_num, type,
+                              string_get_chars(fix_msg),
+                              string_length(fix_msg)) == 0)) {
+        string_free(fix_msg);
+        ret = _fix_session_enqueue_tx(session, NULL, seq_num, seq_num, 0);
+    } else {
+        ret = _fix_session_enqueue_tx(session, fix_msg, seq_num, seq_num, 0);
     }
 
-    trailer = fix_message_generate_trailer(header_and_payload);
-
-    fix_msg = string_concat(header_and_payload, trailer);
-
-    queue_enqueue(session->tx_queue, fix_msg);
-
-    pthread_cond_signal(&session->tx_cond);
     pthread_mutex_unlock(&session->mutex);
 
-    string_free(header);
-    string_free(payload);
-    string_free(header_and_payload);
-    string_free(trailer);
-
-    return 0;
+    return ret;
 }
 
 const String* fix_session_get_SenderCompId(FixSession *session)
@@ -506,3 +1593,24 @@ int fix_session_get_socket(FixSession *session)
 
     return ret;
 }
+
+/* Read the session's message counters without taking its lock */
+void fix_session_get_counters(FixSession *session,
+        FixSessionCounters *counters)
+{
+    assert(session != NULL);
+    assert(counters != NULL);
+
+    counters->activations = __atomic_load_n(&session->counters.activations,
+            __ATOMIC_RELAXED);
+    counters->deactivations = __atomic_load_n(&session->counters.deactivations,
+            __ATOMIC_RELAXED);
+    counters->rx_messages = __atomic_load_n(&session->counters.rx_messages,
+            __ATOMIC_RELAXED);
+    counters->rx_processed = __atomic_load_n(&session->counters.rx_processed,
+            __ATOMIC_RELAXED);
+    counters->tx_messages = __atomic_load_n(&session->counters.tx_messages,
+            __ATOMIC_RELAXED);
+    counters->tx_sent = __atomic_load_n(&session->counters.tx_sent,
+            __ATOMIC_RELAXED);
+}
@@ -35,10 +35,32 @@ extern "C" {
 #include <libcore/string.h>
 
 #include "fix_message.h"
+#include "latency.h"
+
+/* Seconds a client has to log on once connected, and to close the
+ * connection once sent a Logout
+ */
+#define FIX_SESSION_LOGON_TIMEOUT_S     10
+#define FIX_SESSION_LOGOUT_TIMEOUT_S    2
 
 /* Opaque forward declaration */
 typedef struct _fix_session FixSession;
 
+/* Running counts for a session. The session is active if it has
+ * been activated more often than deactivated. The difference
+ * between messages received and processed is the depth of the
+ * receive queue, and between queued and sent the depth of the send
+ * queue.
+ */
+typedef struct {
+    unsigned long long activations;
+    unsigned long long deactivations;
+    unsigned long long rx_messages;
+    unsigned long long rx_processed;
+    unsigned long long tx_messages;
+    unsigned long long tx_sent;
+} FixSessionCounters;
+
 FixSession* fix_session_create      (String *SenderCompId,
                                      unsigned long client_seq_start);
 
@@ -49,7 +71,8 @@ int         fix_session_set_socket  (FixSession *session, int socket);
 int         fix_session_activate    (FixSession *session);
 int         fix_session_deactivate  (FixSession *session);
 
-int         fix_session_receive_message (FixSession *session, String *message);
+int         fix_session_receive_message (FixSession *session, String *message,
+                                         const LatencyTrace *trace);
 int         fix_session_send_message    (FixSession *session,
                                          FIX_MSG_TYPE type,
                                          String *payload);
@@ -57,6 +80,8 @@ int         fix_session_send_message    (FixSession *session,
 const String*   fix_session_get_SenderCompId    (FixSession *session);
 int             fix_session_is_active           (FixSession *session);
 int             fix_session_get_socket          (FixSession *session);
+void            fix_session_get_counters        (FixSession *session,
+                                                 FixSessionCounters *counters);
 
 #if __cplusplus
 }
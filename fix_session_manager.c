@@ -27,6 +27,8 @@
 
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <libcore/map.h>
 #include <libcore/string.h>
@@ -34,24 +36,85 @@
 #include "fix_session.h"
 #include "fix_session_manager.h"
 #include "fix_parser.h"
+#include "log.h"
+#include "timer.h"
+#include "timestamp.h"
+#include "trace.h"
 
 #define DEBUG   0
 #define DBG(...) \
     do { if(DEBUG) fprintf(stderr, __VA_ARGS__); } while(0)
 
+/* Maximum number of sessions kept for stats */
+#define FIX_SESSION_MANAGER_MAX_SESSIONS    1024
+
 /* Private scope */
 static Map *sessions = NULL;
+
+/* Every session created, in creation order. Entries below
+ * session_count are published and never change until the manager
+ * is destroyed, so stats can be gathered without mgr_mutex.
+ */
+static FixSession *session_list[FIX_SESSION_MANAGER_MAX_SESSIONS];
+static unsigned long session_count = 0;
 static int is_initialized = 0;
 static pthread_mutex_t mgr_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* One wheel, on one thread, times every session. Sessions arm and
+ * cancel from their own threads, so it's guarded by timer_mutex,
+ * which is never held while a timer runs.
+ */
+static TimerWheel *timer_wheel = NULL;
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t timer_thread;
+static int timer_running = 0;
+
+static void* _fix_session_manager_timer_thread(void *data)
+{
+    Timer *timer;
+
+    trace_set_thread_name("fix timers");
+
+    while(__atomic_load_n(&timer_running, __ATOMIC_ACQUIRE)) {
+        usleep(FIX_SESSION_TIMER_TICK_MS * 1000);
+
+        pthread_mutex_lock(&timer_mutex);
+
+        timer_wheel_advance(timer_wheel, timestamp_now());
+
+        while(NULL != (timer = timer_wheel_next_expired(timer_wheel))) {
+            pthread_mutex_unlock(&timer_mutex);
+            timer->fn(timer->data);
+            pthread_mutex_lock(&timer_mutex);
+        }
+
+        pthread_mutex_unlock(&timer_mutex);
+    }
+
+    return NULL;
+}
+
 void fix_session_manager_init(void)
 {
-    printf("FIX Session Manager init\n");
+    LOG_INFO("FIX Session Manager: Starting");
 
     pthread_mutex_lock(&mgr_mutex);
 
     if(!is_initialized) {
         sessions = map_create((CompareFn)string_compare);
+
+        timer_wheel = timer_wheel_create(FIX_SESSION_TIMER_TICK_MS *
+                1000000ULL, timestamp_now());
+        if(NULL != timer_wheel) {
+            timer_running = 1;
+            if(pthread_create(&timer_thread, NULL,
+                        &_fix_session_manager_timer_thread, NULL) != 0) {
+                LOG_ERROR("(%s:%d) Couldn't start session timer thread",
+                        __FUNCTION__, __LINE__);
+                timer_running = 0;
+            }
+        }
+
         is_initialized = 1;
     }
 
@@ -60,13 +123,26 @@ void fix_session_manager_init(void)
 
 void fix_session_manager_destroy(void)
 {
-    printf("FIX Session Manager destroy\n");
+    LOG_INFO("FIX Session Manager: Stopping");
 
     pthread_mutex_lock(&mgr_mutex);
 
     if(is_initialized) {
         is_initialized = 0;
+        __atomic_store_n(&session_count, 0, __ATOMIC_RELEASE);
+
+        /* Timers may deactivate sessions, so stop them first */
+        if(timer_running) {
+            __atomic_store_n(&timer_running, 0, __ATOMIC_RELEASE);
+            pthread_join(timer_thread, NULL);
+        }
+
         map_free_all(sessions, (FreeFn)fix_session_free);
+
+        if(NULL != timer_wheel) {
+            timer_wheel_free(timer_wheel);
+            timer_wheel = NULL;
+        }
     }
 
     pthread_mutex_unlock(&mgr_mutex);
@@ -105,6 +181,18 @@ int fix_session_manager_lookup_session(String *fix_msg, FixSession **session)
                     /* Store new session object in the table */
                     map_insert(sessions, fix_session_get_SenderCompId(*session),
                             *session);
+
+                    if(session_count < FIX_SESSION_MANAGER_MAX_SESSIONS) {
+                        session_list[session_count] = *session;
+                        __atomic_store_n(&session_count, session_count + 1,
+                                __ATOMIC_RELEASE);
+                    } else {
+                        LOG_WARNING("(%s:%d) Session '%s' left out of the "
+                                "stats, which only cover %d sessions",
+                                __FUNCTION__, __LINE__,
+                                string_get_chars(senderCompId),
+                                FIX_SESSION_MANAGER_MAX_SESSIONS);
+                    }
                 }
             }
         }
@@ -116,3 +204,54 @@ int fix_session_manager_lookup_session(String *fix_msg, FixSession **session)
 
     return ret;
 }
+
+/* Sum the counters of every session without taking any lock.
+ * Returns the number of sessions.
+ */
+unsigned long fix_session_manager_get_counters(FixSessionCounters *counters)
+{
+    FixSessionCounters c;
+    unsigned long i, n;
+
+    memset(counters, 0, sizeof(FixSessionCounters));
+
+    n = __atomic_load_n(&session_count, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < n; i++) {
+        fix_session_get_counters(session_list[i], &c);
+
+        counters->activations += c.activations;
+        counters->deactivations += c.deactivations;
+        counters->rx_messages += c.rx_messages;
+        counters->rx_processed += c.rx_processed;
+        counters->tx_messages += c.tx_messages;
+        counters->tx_sent += c.tx_sent;
+    }
+
+    return n;
+}
+
+/* Arm a session timer to go off at a time in nanoseconds. Without a
+ * timer thread, session timers never go off.
+ */
+void fix_session_manager_arm_timer(Timer *timer, unsigned long long when)
+{
+    pthread_mutex_lock(&timer_mutex);
+
+    if(NULL != timer_wheel) {
+        timer_wheel_arm(timer_wheel, timer, when);
+    }
+
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+void fix_session_manager_cancel_timer(Timer *timer)
+{
+    pthread_mutex_lock(&timer_mutex);
+
+    if(NULL != timer_wheel) {
+        timer_wheel_cancel(timer_wheel, timer);
+    }
+
+    pthread_mutex_unlock(&timer_mutex);
+}
@@ -35,10 +35,18 @@ extern "C" {
 #include <libcore/string.h>
 
 #include "fix_session.h"
+#include "timer.h"
+
+/* Resolution of session timers */
+#define FIX_SESSION_TIMER_TICK_MS   10
 
 void fix_session_manager_init(void);
 void fix_session_manager_destroy(void);
 int fix_session_manager_lookup_session(String *fix_msg, FixSession **session);
+unsigned long fix_session_manager_get_counters(FixSessionCounters *counters);
+
+void fix_session_manager_arm_timer(Timer *timer, unsigned long long when);
+void fix_session_manager_cancel_timer(Timer *timer);
 
 #if __cplusplus
 }
@@ -0,0 +1,321 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libcore/string.h>
+
+#include "fix_store.h"
+#include "log.h"
+
+/* Room for the directory and a session file name */
+#define FIX_STORE_PATH_LEN      (PATH_MAX + 64)
+
+typedef struct {
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int message_count;
+    unsigned long long data_size;
+
+    /* Next sequence numbers expected from and sent to the client */
+    unsigned long long rx_seq_num;
+    unsigned long long tx_seq_num;
+
+    /* Bytes ever appended to the data ring */
+    unsigned long long head;
+
+    unsigned char reserved[16];
+} FixStoreHeader;
+
+/* Where a sent message is in the data ring. A slot whose seq_num
+ * doesn't match the one looked up holds another message, or none.
+ */
+typedef struct {
+    unsigned long long seq_num;
+    unsigned long long offset;
+    unsigned int length;
+    unsigned int type;
+} FixStoreIndex;
+
+#define FIX_STORE_SIZE \
+    (sizeof(FixStoreHeader) + \
+     ((size_t)FIX_STORE_MESSAGES * sizeof(FixStoreIndex)) + \
+     FIX_STORE_DATA_SIZE)
+
+/* Keep the file format honest if the structures change */
+typedef char FixStoreHeaderSizeCheck[(sizeof(FixStoreHeader) == 64) ? 1 : -1];
+typedef char FixStoreIndexSizeCheck[(sizeof(FixStoreIndex) == 24) ? 1 : -1];
+
+struct _fix_store {
+    FixStoreHeader *header;
+    FixStoreIndex *index;
+    char *data;
+
+    int fd;
+};
+
+/* Session file name, with anything unsafe in a path replaced */
+static void _fix_store_path(const char *dir, const String *SenderCompId,
+        char *path, size_t size)
+{
+    const char *id;
+    size_t n, i;
+
+    n = (size_t)snprintf(path, size, "%s/session-", dir);
+    id = string_get_chars(SenderCompId);
+
+    for(i = 0; ('\0' != id[i]) && (n + i + 5 < size); i++) {
+        if(isalnum((unsigned char)id[i]) || ('-' == id[i])) {
+            path[n + i] = id[i];
+        } else {
+            path[n + i] = '_';
+        }
+    }
+
+    snprintf(path + n + i, size - n - i, ".bin");
+}
+
+static void _fix_store_init(FixStore *store)
+{
+    memset(store->header, 0, sizeof(FixStoreHeader));
+
+    store->header->magic = FIX_STORE_MAGIC;
+    store->header->version = FIX_STORE_VERSION;
+    store->header->message_count = FIX_STORE_MESSAGES;
+    store->header->data_size = FIX_STORE_DATA_SIZE;
+    store->header->rx_seq_num = 1;
+    store->header->tx_seq_num = 1;
+}
+
+/* Open a session's store, creating it if this is the session's
+ * first run. The file is sparse, so only the messages written take
+ * up space.
+ */
+FixStore* fix_store_open(const char *dir, const String *SenderCompId)
+{
+    char path[FIX_STORE_PATH_LEN];
+    FixStore *store;
+    struct stat st;
+    int fd, created;
+    void *p;
+
+    assert(SenderCompId != NULL);
+
+    if(NULL == dir) {
+        dir = FIX_STORE_DIR;
+    }
+
+    if((mkdir(dir, 0755) < 0) && (EEXIST != errno)) {
+        LOG_ERROR("(%s:%d) Couldn't create %s: %s",
+                __FUNCTION__, __LINE__, dir, strerror(errno));
+        return NULL;
+    }
+
+    _fix_store_path(dir, SenderCompId, path, sizeof(path));
+
+    fd = open(path, O_CREAT | O_RDWR, 0644);
+    if(fd < 0) {
+        LOG_ERROR("(%s:%d) Couldn't open %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &st) < 0) {
+        LOG_ERROR("(%s:%d) Couldn't stat %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    created = (0 == st.st_size);
+    if(created) {
+        if(ftruncate(fd, FIX_STORE_SIZE) < 0) {
+            LOG_ERROR("(%s:%d) Couldn't size %s: %s",
+                    __FUNCTION__, __LINE__, path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    } else if((size_t)st.st_size != FIX_STORE_SIZE) {
+        LOG_ERROR("(%s:%d) %s is not a session store",
+                __FUNCTION__, __LINE__, path);
+        close(fd);
+        return NULL;
+    }
+
+    p = mmap(NULL, FIX_STORE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(MAP_FAILED == p) {
+        LOG_ERROR("(%s:%d) Couldn't map %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    store = malloc(sizeof(FixStore));
+    if(NULL == store) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        munmap(p, FIX_STORE_SIZE);
+        close(fd);
+        return NULL;
+    }
+
+    store->fd = fd;
+    store->header = (FixStoreHeader *)p;
+    store->index = (FixStoreIndex *)(store->header + 1);
+    store->data = (char *)(store->index + FIX_STORE_MESSAGES);
+
+    if(created) {
+        _fix_store_init(store);
+    } else if((FIX_STORE_MAGIC != store->header->magic) ||
+            (FIX_STORE_VERSION != store->header->version) ||
+            (FIX_STORE_MESSAGES != store->header->message_count) ||
+            (FIX_STORE_DATA_SIZE != store->header->data_size)) {
+        LOG_ERROR("(%s:%d) %s is not a session store",
+                __FUNCTION__, __LINE__, path);
+        fix_store_close(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+/* Write the store back to disk and unmap it */
+void fix_store_close(FixStore *store)
+{
+    assert(store != NULL);
+
+    if(msync(store->header, FIX_STORE_SIZE, MS_SYNC) < 0) {
+        LOG_ERROR("(%s:%d) Session store sync failed: %s",
+                __FUNCTION__, __LINE__, strerror(errno));
+    }
+
+    munmap(store->header, FIX_STORE_SIZE);
+    close(store->fd);
+
+    free(store);
+}
+
+int fix_store_append(FixStore *store, unsigned long MsgSeqNum,
+        FIX_MSG_TYPE type, const char *buf, unsigned long len)
+{
+    unsigned long long head, position;
+    FixStoreIndex *entry;
+
+    assert(store != NULL);
+    assert(MsgSeqNum > 0);
+    assert(buf != NULL);
+
+    if(len > FIX_STORE_DATA_SIZE) {
+        return -1;
+    }
+
+    /* A message never wraps, so it can be sent with a single write */
+    head = store->header->head;
+    position = head % FIX_STORE_DATA_SIZE;
+    if(position + len > FIX_STORE_DATA_SIZE) {
+        head += FIX_STORE_DATA_SIZE - position;
+        position = 0;
+    }
+
+    memcpy(store->data + position, buf, len);
+
+    entry = &store->index[MsgSeqNum % FIX_STORE_MESSAGES];
+    entry->offset = head;
+    entry->length = (unsigned int)len;
+    entry->type = (unsigned int)type;
+    entry->seq_num = MsgSeqNum;
+
+    store->header->head = head + len;
+    store->header->tx_seq_num = MsgSeqNum + 1;
+
+    return 0;
+}
+
+int fix_store_get(FixStore *store, unsigned long MsgSeqNum,
+        FIX_MSG_TYPE *type, const char **buf, unsigned long *len)
+{
+    const FixStoreIndex *entry;
+
+    assert(store != NULL);
+
+    entry = &store->index[MsgSeqNum % FIX_STORE_MESSAGES];
+
+    if((0 == MsgSeqNum) || (entry->seq_num != MsgSeqNum)) {
+        return -1;
+    }
+
+    /* Later messages have wrapped round over this one */
+    if(store->header->head - entry->offset > FIX_STORE_DATA_SIZE) {
+        return -1;
+    }
+
+    *type = (FIX_MSG_TYPE)entry->type;
+    *buf = store->data + (entry->offset % FIX_STORE_DATA_SIZE);
+    *len = entry->length;
+
+    return 0;
+}
+
+void fix_store_reset(FixStore *store)
+{
+    assert(store != NULL);
+
+    memset(store->index, 0, FIX_STORE_MESSAGES * sizeof(FixStoreIndex));
+
+    store->header->rx_seq_num = 1;
+    store->header->tx_seq_num = 1;
+}
+
+unsigned long fix_store_get_rx_seq_num(FixStore *store)
+{
+    assert(store != NULL);
+
+    return (unsigned long)store->header->rx_seq_num;
+}
+
+unsigned long fix_store_get_tx_seq_num(FixStore *store)
+{
+    assert(store != NULL);
+
+    return (unsigned long)store->header->tx_seq_num;
+}
+
+void fix_store_set_rx_seq_num(FixStore *store, unsigned long seq_num)
+{
+    assert(store != NULL);
+
+    store->header->rx_seq_num = seq_num;
+}
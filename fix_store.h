@@ -0,0 +1,86 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FIX_STORE_H__
+#define __FIX_STORE_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#include <libcore/string.h>
+
+#include "fix_message.h"
+
+/* Each session keeps the messages it has sent, and its sequence
+ * numbers, in a mapped file, session-<SenderCompId>.bin, next to the
+ * journal. The last FIX_STORE_MESSAGES messages, up to
+ * FIX_STORE_DATA_SIZE bytes of them, can be resent. Any change to
+ * the layout must bump FIX_STORE_VERSION.
+ */
+#define FIX_STORE_MAGIC         0x78667374726fULL
+#define FIX_STORE_VERSION       1
+
+#define FIX_STORE_MESSAGES      (1 << 16)
+#define FIX_STORE_DATA_SIZE     (16 << 20)
+
+#define FIX_STORE_DIR           "journal"
+
+/* Opaque forward declaration */
+typedef struct _fix_store FixStore;
+
+FixStore*   fix_store_open      (const char *dir,
+                                 const String *SenderCompId);
+void        fix_store_close     (FixStore *store);
+
+/* Store a sent message. The next outbound sequence number becomes
+ * MsgSeqNum + 1.
+ */
+int         fix_store_append    (FixStore *store, unsigned long MsgSeqNum,
+                                 FIX_MSG_TYPE type, const char *buf,
+                                 unsigned long len);
+
+/* Find a sent message in the mapped file. Returns -1 if it was
+ * never stored or has since been overwritten.
+ */
+int         fix_store_get       (FixStore *store, unsigned long MsgSeqNum,
+                                 FIX_MSG_TYPE *type, const char **buf,
+                                 unsigned long *len);
+
+/* Forget every message and start both sequences again from 1 */
+void        fix_store_reset     (FixStore *store);
+
+unsigned long   fix_store_get_rx_seq_num    (FixStore *store);
+unsigned long   fix_store_get_tx_seq_num    (FixStore *store);
+void            fix_store_set_rx_seq_num    (FixStore *store,
+                                             unsigned long seq_num);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,369 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* journal-replay: feed the order commands recorded in a journal
+ * straight into the market and books, with no sockets, and check
+ * that the executions they produce match the recorded ones. The
+ * replay journals what it does, like the engine, to a directory of
+ * its own. Orders expire as the journal says they did, rather than
+ * by the clock, so expiries are checked too.
+ *
+ * Usage: journal-replay [-s speed] [-f sequence] [-o dir] journal_dir
+ *
+ * With no speed, or a speed of 0, commands are fed as fast as
+ * possible. Otherwise they are paced as they were recorded, sped up
+ * by that factor.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libcore/string.h>
+
+#include "journal.h"
+#include "latency.h"
+#include "log.h"
+#include "market.h"
+#include "timestamp.h"
+
+typedef struct {
+    unsigned long long commands;
+    unsigned long long orders;
+    unsigned long long rejected;
+    unsigned long long elapsed_ns;
+} ReplayResult;
+
+/* Wait until a record is due, at the given speed, for a replay that
+ * started at start with a first record recorded at first
+ */
+static void _replay_pace(unsigned long long first, unsigned long long start,
+        unsigned long long recorded, double speed)
+{
+    unsigned long long due, now;
+
+    due = start + (unsigned long long)((recorded - first) / speed);
+
+    while((now = timestamp_now()) < due) {
+        /* Sleep most of the way, then spin */
+        if(due - now > 200000) {
+            usleep((useconds_t)((due - now - 100000) / 1000));
+        }
+    }
+}
+
+static int _replay_feed(const char *dir, unsigned long long from,
+        double speed, ReplayResult *result)
+{
+    unsigned long long first, start;
+    const JournalRecord *r;
+    JournalReader *reader;
+    String *symbol;
+    Book *b;
+    int rc;
+
+    reader = journal_reader_open(dir, from);
+    if(NULL == reader) {
+        return -1;
+    }
+
+    memset(result, 0, sizeof(ReplayResult));
+
+    first = 0;
+    start = timestamp_now();
+
+    while(NULL != (r = journal_reader_next(reader))) {
+        if(JOURNAL_RECORD_EXECUTION == r->type) {
+            continue;
+        }
+
+        if(speed > 0) {
+            if(0 == first) {
+                first = r->time;
+            }
+            _replay_pace(first, start, r->time, speed);
+        }
+
+        symbol = string_create_from_buf(r->symbol,
+                strnlen(r->symbol, JOURNAL_SYMBOL_LEN));
+        b = market_get_book(symbol);
+        string_free(symbol);
+
+        if(NULL == b) {
+            journal_reader_close(reader);
+            return -1;
+        }
+
+        book_set_expiry(b, 0);
+
+        rc = journal_apply(b, r);
+        if(rc < 0) {
+            result->rejected++;
+        }
+
+        result->commands++;
+        if(JOURNAL_RECORD_ORDER == r->type) {
+            result->orders++;
+        }
+    }
+
+    result->elapsed_ns = timestamp_now() - start;
+
+    journal_reader_close(reader);
+
+    return 0;
+}
+
+/* Next execution or expiry */
+static const JournalRecord* _replay_next_execution(JournalReader *reader)
+{
+    const JournalRecord *r;
+
+    while(NULL != (r = journal_reader_next(reader))) {
+        if((JOURNAL_RECORD_EXECUTION == r->type) ||
+                (JOURNAL_RECORD_EXPIRE == r->type)) {
+            break;
+        }
+    }
+
+    return r;
+}
+
+static void _replay_print_execution(const char *which, const JournalRecord *r)
+{
+    if(NULL == r) {
+        printf("  %-9s none\n", which);
+        return;
+    }
+
+    if(JOURNAL_RECORD_EXPIRE == r->type) {
+        printf("  %-9s #%llu %.*s expired %llu with %llu left\n", which,
+                r->sequence, JOURNAL_SYMBOL_LEN, r->symbol, r->id,
+                r->quantity);
+        return;
+    }
+
+    printf("  %-9s #%llu %.*s buy %llu sell %llu %llu @ %.2f\n", which,
+            r->sequence, JOURNAL_SYMBOL_LEN, r->symbol, r->id,
+            r->aux, r->quantity, r->price);
+}
+
+/* Compare the executions and expiries recorded in one journal with
+ * those in another, in order. Returns 0 if they are identical.
+ */
+static int _replay_verify(const char *recorded_dir, unsigned long long from,
+        const char *replay_dir, unsigned long long replay_from)
+{
+    const JournalRecord *recorded, *replayed;
+    JournalReader *a, *b;
+    unsigned long long n;
+    int rc;
+
+    a = journal_reader_open(recorded_dir, from);
+    b = journal_reader_open(replay_dir, replay_from);
+    if((NULL == a) || (NULL == b)) {
+        if(NULL != a) {
+            journal_reader_close(a);
+        }
+        if(NULL != b) {
+            journal_reader_close(b);
+        }
+        return -1;
+    }
+
+    rc = 0;
+
+    for(n = 0; ; n++) {
+        recorded = _replay_next_execution(a);
+        replayed = _replay_next_execution(b);
+
+        if((NULL == recorded) && (NULL == replayed)) {
+            break;
+        }
+
+        if((NULL == recorded) || (NULL == replayed) ||
+                (recorded->type != replayed->type) ||
+                (memcmp(recorded->symbol, replayed->symbol,
+                        JOURNAL_SYMBOL_LEN) != 0) ||
+                (recorded->id != replayed->id) ||
+                (recorded->aux != replayed->aux) ||
+                (recorded->quantity != replayed->quantity) ||
+                (recorded->price != replayed->price)) {
+            printf("Executions differ at outcome %llu:\n", n + 1);
+            _replay_print_execution("recorded", recorded);
+            _replay_print_execution("replayed", replayed);
+            rc = -1;
+            break;
+        }
+    }
+
+    if(0 == rc) {
+        printf("Executions and expiries: %llu, all match\n", n);
+    }
+
+    journal_reader_close(a);
+    journal_reader_close(b);
+
+    return rc;
+}
+
+static void _replay_print_latency(void)
+{
+    LatencySummary s;
+    int i;
+
+    printf("%-16s %10s %10s %10s %10s %10s\n",
+            "latency (ns)", "count", "p50", "p99", "p99.9", "max");
+
+    for(i = 0; i < LATENCY_HISTOGRAMS; i++) {
+        latency_get_summary(i, &s);
+        if(0 == s.count) {
+            continue;
+        }
+
+        printf("%-16s %10llu %10llu %10llu %10llu %10llu\n",
+                latency_get_name(i), s.count, s.p50, s.p99, s.p999, s.max);
+    }
+}
+
+/* Remove a temporary replay journal */
+static void _replay_remove(const char *dir)
+{
+    char path[PATH_MAX + 64];
+    struct dirent *entry;
+    DIR *d;
+
+    d = opendir(dir);
+    if(NULL == d) {
+        return;
+    }
+
+    while(NULL != (entry = readdir(d))) {
+        if(strncmp(entry->d_name, "journal-", 8) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+
+    closedir(d);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    char tmp[] = "/tmp/journal-replay-XXXXXX";
+    unsigned long long from, replay_from;
+    const char *dir, *out;
+    ReplayResult result;
+    double speed;
+    int c, rc;
+
+    speed = 0;
+    from = 1;
+    out = NULL;
+
+    while((c = getopt(argc, argv, "s:f:o:")) != -1) {
+        switch(c) {
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'f':
+                from = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-s speed] [-f sequence] [-o dir] "
+                "journal_dir\n", argv[0]);
+        return 1;
+    }
+
+    dir = argv[optind];
+
+    if(NULL == out) {
+        out = mkdtemp(tmp);
+        if(NULL == out) {
+            fprintf(stderr, "Couldn't create a directory for the replay\n");
+            return 1;
+        }
+    } else if(strcmp(out, dir) == 0) {
+        fprintf(stderr, "The replay can't journal into the journal it reads\n");
+        return 1;
+    }
+
+    timestamp_init();
+    log_init();
+    log_set_level(LOG_LEVEL_WARNING);
+
+    market_open();
+
+    if(journal_open(out) < 0) {
+        market_close();
+        log_close();
+        return 1;
+    }
+
+    replay_from = journal_get_sequence() + 1;
+
+    rc = _replay_feed(dir, from, speed, &result);
+
+    /* Closing the books waits for their matchers to finish */
+    market_close();
+    journal_close();
+    log_close();
+
+    if(rc < 0) {
+        fprintf(stderr, "Couldn't replay %s\n", dir);
+        return 1;
+    }
+
+    printf("Replayed %llu commands (%llu orders, %llu rejected) in %.3fms, "
+            "%.0f commands/s\n", result.commands, result.orders,
+            result.rejected, result.elapsed_ns / 1e6,
+            (result.elapsed_ns > 0) ?
+            (result.commands * 1e9 / result.elapsed_ns) : 0.0);
+
+    _replay_print_latency();
+
+    rc = _replay_verify(dir, from, out, replay_from);
+
+    if(out == tmp) {
+        _replay_remove(out);
+    }
+
+    return (0 == rc) ? 0 : 1;
+}
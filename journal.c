@@ -0,0 +1,1048 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "log.h"
+#include "timestamp.h"
+
+/* Segments kept mapped at once. The sync thread creates the next
+ * segment ahead of the writers, and a segment is only unmapped once
+ * everything in it is durable.
+ */
+#define JOURNAL_SEGMENTS_MAPPED 4
+
+/* Room for the directory and a segment file name */
+#define JOURNAL_PATH_LEN        (PATH_MAX + 64)
+
+#define JOURNAL_SEGMENT_SIZE \
+    (sizeof(JournalSegmentHeader) + \
+     ((size_t)JOURNAL_SEGMENT_RECORDS * sizeof(JournalRecord)))
+
+/* Keep the file format honest if the structures change */
+typedef char JournalRecordSizeCheck
+    [(sizeof(JournalRecord) == JOURNAL_RECORD_SIZE) ? 1 : -1];
+typedef char JournalHeaderSizeCheck
+    [(sizeof(JournalSegmentHeader) == JOURNAL_RECORD_SIZE) ? 1 : -1];
+
+typedef struct {
+    /* Segment number plus one, so zero means the slot is empty */
+    unsigned long long number;
+
+    JournalSegmentHeader *header;
+    JournalRecord *records;
+    int fd;
+} JournalSegment;
+
+static char journal_dir[PATH_MAX];
+
+static int is_open = 0;
+
+/* This run's records start at first_sequence, in segment
+ * first_segment
+ */
+static unsigned long long first_sequence = 1;
+static unsigned long long first_segment = 0;
+
+/* Last sequence handed to a writer, and the last one synced */
+static unsigned long long sequence __attribute__((aligned(64))) = 0;
+static unsigned long long durable __attribute__((aligned(64))) = 0;
+
+struct _journal_reader {
+    char dir[PATH_MAX];
+
+    /* Segment numbers found, in ascending order */
+    unsigned long long *numbers;
+    unsigned long count;
+    unsigned long next;
+
+    /* The segment being read, if any */
+    JournalSegmentHeader *header;
+    JournalRecord *records;
+    unsigned long long position;
+
+    unsigned long long from;
+
+    /* Sequence the next record must have, or 0 before the first */
+    unsigned long long expected;
+};
+
+static JournalSegment segments[JOURNAL_SEGMENTS_MAPPED];
+static pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long sync_interval_ns =
+    JOURNAL_SYNC_INTERVAL_US * 1000ULL;
+static unsigned long long sync_records = JOURNAL_SYNC_RECORDS;
+
+static JournalCounters counters;
+
+/* Everything up to here is known to be committed. Only used by the
+ * sync thread.
+ */
+static unsigned long long committed = 0;
+
+static pthread_t sync_thread;
+static int running = 0;
+
+static unsigned long long _journal_segment_of(unsigned long long seq)
+{
+    return first_segment + ((seq - first_sequence) / JOURNAL_SEGMENT_RECORDS);
+}
+
+static unsigned long long _journal_segment_first(unsigned long long segment)
+{
+    return first_sequence +
+        ((segment - first_segment) * JOURNAL_SEGMENT_RECORDS);
+}
+
+static void _journal_segment_path(unsigned long long segment, char *path,
+        size_t size)
+{
+    snprintf(path, size, "%s/journal-%08llu.bin", journal_dir, segment);
+}
+
+static void _journal_segment_unmap(JournalSegment *s)
+{
+    munmap(s->header, JOURNAL_SEGMENT_SIZE);
+    close(s->fd);
+
+    s->header = NULL;
+    s->records = NULL;
+    s->fd = -1;
+}
+
+/* Create, preallocate and map a segment file. Called with
+ * segment_mutex held.
+ */
+static int _journal_segment_create(JournalSegment *s,
+        unsigned long long segment)
+{
+    char path[JOURNAL_PATH_LEN];
+    void *p;
+    int fd, err;
+
+    _journal_segment_path(segment, path, sizeof(path));
+
+    fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0) {
+        LOG_ERROR("(%s:%d) Couldn't create %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        return -1;
+    }
+
+    /* Allocate the blocks up front so that appends never have to */
+    err = posix_fallocate(fd, 0, JOURNAL_SEGMENT_SIZE);
+    if(0 != err) {
+        LOG_ERROR("(%s:%d) Couldn't allocate %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(err));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    p = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, 0);
+    if(MAP_FAILED == p) {
+        LOG_ERROR("(%s:%d) Couldn't map %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    s->fd = fd;
+    s->header = (JournalSegmentHeader *)p;
+    s->records = (JournalRecord *)(s->header + 1);
+
+    s->header->magic = JOURNAL_MAGIC;
+    s->header->version = JOURNAL_VERSION;
+    s->header->record_size = JOURNAL_RECORD_SIZE;
+    s->header->segment = segment;
+    s->header->first_sequence = _journal_segment_first(segment);
+    s->header->record_count = JOURNAL_SEGMENT_RECORDS;
+
+    counters.segments++;
+
+    __atomic_store_n(&s->number, segment + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Make sure a segment is mapped, replacing the segment in its slot
+ * if that one is all durable. Returns -1 if the slot is still in
+ * use, or the segment couldn't be created.
+ */
+static int _journal_segment_prepare(unsigned long long segment)
+{
+    JournalSegment *s;
+    unsigned long long old;
+    int rc;
+
+    s = &segments[segment % JOURNAL_SEGMENTS_MAPPED];
+
+    pthread_mutex_lock(&segment_mutex);
+
+    old = __atomic_load_n(&s->number, __ATOMIC_ACQUIRE);
+    if(old == segment + 1) {
+        pthread_mutex_unlock(&segment_mutex);
+        return 0;
+    }
+
+    if(0 != old) {
+        /* The old segment's last record is just before the first
+         * record of the segment after it, which is numbered old
+         */
+        if(_journal_segment_first(old) - 1 >
+                __atomic_load_n(&durable, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&segment_mutex);
+            return -1;
+        }
+
+        __atomic_store_n(&s->number, 0, __ATOMIC_RELEASE);
+        _journal_segment_unmap(s);
+    }
+
+    rc = _journal_segment_create(s, segment);
+
+    pthread_mutex_unlock(&segment_mutex);
+
+    return rc;
+}
+
+/* The record slot for a sequence, or NULL if its segment isn't
+ * mapped yet
+ */
+static JournalRecord* _journal_slot(unsigned long long seq)
+{
+    unsigned long long segment;
+    JournalSegment *s;
+
+    segment = _journal_segment_of(seq);
+    s = &segments[segment % JOURNAL_SEGMENTS_MAPPED];
+
+    if(__atomic_load_n(&s->number, __ATOMIC_ACQUIRE) != segment + 1) {
+        return NULL;
+    }
+
+    return &s->records[(seq - first_sequence) % JOURNAL_SEGMENT_RECORDS];
+}
+
+/* Claim the next record. The caller fills it in and then commits
+ * it. This only waits if the sync thread has fallen so far behind
+ * that every mapped segment still has records waiting for the disk.
+ */
+static JournalRecord* _journal_reserve(unsigned long long *seq)
+{
+    JournalRecord *r;
+
+    if(!__atomic_load_n(&is_open, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    *seq = __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED);
+
+    while(NULL == (r = _journal_slot(*seq))) {
+        if(_journal_segment_prepare(_journal_segment_of(*seq)) < 0) {
+            usleep(100);
+        }
+    }
+
+    memset(r, 0, sizeof(JournalRecord));
+    r->time = timestamp_now();
+
+    return r;
+}
+
+/* Publish a record to the sync thread. The sequence is written last,
+ * so a record with the right sequence is complete.
+ */
+static void _journal_commit(JournalRecord *r, unsigned long long seq)
+{
+    __atomic_store_n(&r->sequence, seq, __ATOMIC_RELEASE);
+}
+
+static void _journal_symbol(JournalRecord *r, const String *symbol)
+{
+    const char *s = string_get_chars(symbol);
+    size_t len;
+
+    len = strlen(s);
+    if(len > JOURNAL_SYMBOL_LEN) {
+        len = JOURNAL_SYMBOL_LEN;
+    }
+
+    /* The record was zeroed when it was reserved */
+    memcpy(r->symbol, s, len);
+}
+
+/* Sync the records after durable up to and including last, one
+ * msync per segment they touch
+ */
+static void _journal_sync(unsigned long long last)
+{
+    unsigned long long seq, end, segment, start_ns, ns;
+    unsigned long page;
+    char *from, *to;
+    JournalRecord *r;
+
+    page = (unsigned long)sysconf(_SC_PAGESIZE);
+
+    start_ns = timestamp_now();
+
+    for(seq = durable + 1; seq <= last; seq = end + 1) {
+        segment = _journal_segment_of(seq);
+
+        end = _journal_segment_first(segment + 1) - 1;
+        if(end > last) {
+            end = last;
+        }
+
+        r = _journal_slot(seq);
+        from = (char *)r;
+        to = (char *)(r + (end - seq + 1));
+
+        if(seq == _journal_segment_first(segment)) {
+            /* Include the segment header */
+            from = (char *)segments[segment % JOURNAL_SEGMENTS_MAPPED].header;
+        }
+
+        from = (char *)((unsigned long)from & ~(page - 1));
+
+        if(msync(from, to - from, MS_SYNC) < 0) {
+            LOG_ERROR("(%s:%d) Journal sync failed: %s",
+                    __FUNCTION__, __LINE__, strerror(errno));
+        }
+    }
+
+    ns = timestamp_now() - start_ns;
+
+    __atomic_store_n(&durable, last, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&counters.durable, last - (first_sequence - 1),
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&counters.syncs, counters.syncs + 1, __ATOMIC_RELAXED);
+    if(ns > counters.max_sync_ns) {
+        __atomic_store_n(&counters.max_sync_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+/* Last sequence such that it and every record before it has been
+ * committed
+ */
+static unsigned long long _journal_complete(void)
+{
+    unsigned long long seq, last;
+    JournalRecord *r;
+
+    last = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE);
+
+    for(seq = committed + 1; seq <= last; seq++) {
+        r = _journal_slot(seq);
+        if((NULL == r) ||
+                (__atomic_load_n(&r->sequence, __ATOMIC_ACQUIRE) != seq)) {
+            break;
+        }
+    }
+
+    committed = seq - 1;
+
+    return committed;
+}
+
+/* Group commit. Committed records are synced together once the
+ * oldest has waited sync_interval_ns, or sync_records are waiting,
+ * whichever comes first. The next segment is created ahead of time
+ * so that writers rarely have to.
+ */
+static void* _journal_sync_thread(void *arg)
+{
+    unsigned long long complete, waiting_since, now;
+    unsigned long poll_us;
+
+    poll_us = (unsigned long)(sync_interval_ns / 4000);
+    if(0 == poll_us) {
+        poll_us = 1;
+    }
+
+    waiting_since = 0;
+
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        complete = _journal_complete();
+
+        if(complete > durable) {
+            now = timestamp_now();
+            if(0 == waiting_since) {
+                waiting_since = now;
+            }
+
+            if((complete - durable >= sync_records) ||
+                    (now - waiting_since >= sync_interval_ns)) {
+                _journal_sync(complete);
+                waiting_since = 0;
+                continue;
+            }
+        }
+
+        _journal_segment_prepare(_journal_segment_of(
+                    __atomic_load_n(&sequence, __ATOMIC_RELAXED) + 1) + 1);
+
+        usleep(poll_us);
+    }
+
+    /* Whatever was committed before journal_close stopped us */
+    complete = _journal_complete();
+    if(complete > durable) {
+        _journal_sync(complete);
+    }
+
+    return NULL;
+}
+
+/* Read a segment's first sequence and count the records in it up
+ * to the first gap. Records after a gap were never durable.
+ */
+static int _journal_segment_scan(unsigned long long segment,
+        unsigned long long *first, unsigned long long *count)
+{
+    JournalSegmentHeader *header;
+    JournalRecord *records;
+    char path[JOURNAL_PATH_LEN];
+    unsigned long long i;
+    void *p;
+    int fd;
+
+    _journal_segment_path(segment, path, sizeof(path));
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        LOG_ERROR("(%s:%d) Couldn't open %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        return -1;
+    }
+
+    p = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(MAP_FAILED == p) {
+        LOG_ERROR("(%s:%d) Couldn't map %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        return -1;
+    }
+
+    header = (JournalSegmentHeader *)p;
+    records = (JournalRecord *)(header + 1);
+
+    if((JOURNAL_MAGIC != header->magic) ||
+            (JOURNAL_VERSION != header->version) ||
+            (JOURNAL_SEGMENT_RECORDS != header->record_count)) {
+        LOG_ERROR("(%s:%d) %s is not a journal segment",
+                __FUNCTION__, __LINE__, path);
+        munmap(p, JOURNAL_SEGMENT_SIZE);
+        return -1;
+    }
+
+    *first = header->first_sequence;
+
+    for(i = 0; i < JOURNAL_SEGMENT_RECORDS; i++) {
+        if(records[i].sequence != *first + i) {
+            break;
+        }
+    }
+
+    *count = i;
+
+    munmap(p, JOURNAL_SEGMENT_SIZE);
+
+    return 0;
+}
+
+/* Find where the previous run left off, so this run appends after
+ * it rather than overwriting it. A run always starts a new segment.
+ * Empty segments at the end, which were created ahead of time, are
+ * removed and their numbers reused.
+ */
+static int _journal_recover(void)
+{
+    unsigned long long segment, found, first, count;
+    char path[JOURNAL_PATH_LEN];
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int exists;
+
+    dir = opendir(journal_dir);
+    if(NULL == dir) {
+        LOG_ERROR("(%s:%d) Couldn't open %s: %s",
+                __FUNCTION__, __LINE__, journal_dir, strerror(errno));
+        return -1;
+    }
+
+    exists = 0;
+    found = 0;
+
+    while(NULL != (entry = readdir(dir))) {
+        if(1 == sscanf(entry->d_name, "journal-%llu.bin", &segment)) {
+            if(!exists || (segment > found)) {
+                found = segment;
+            }
+            exists = 1;
+        }
+    }
+
+    closedir(dir);
+
+    while(exists) {
+        if(_journal_segment_scan(found, &first, &count) < 0) {
+            return -1;
+        }
+
+        first_segment = found + 1;
+        first_sequence = first + count;
+
+        if(count > 0) {
+            break;
+        }
+
+        _journal_segment_path(found, path, sizeof(path));
+        unlink(path);
+
+        first_segment = found;
+
+        /* Carry on back while the previous segment is there */
+        if(0 == found) {
+            break;
+        }
+
+        found--;
+        _journal_segment_path(found, path, sizeof(path));
+        exists = (0 == stat(path, &st));
+    }
+
+    return 0;
+}
+
+/* Open the journal in dir, or JOURNAL_DIR if it is NULL, appending
+ * after any segments already there. The sync interval and batch size
+ * can be set with the JOURNAL_SYNC_US and JOURNAL_SYNC_RECORDS
+ * environment variables. Until this succeeds nothing is journalled.
+ */
+int journal_open(const char *dir)
+{
+    const char *env;
+    int i;
+
+    assert(!is_open);
+
+    if(NULL == dir) {
+        dir = JOURNAL_DIR;
+    }
+
+    strncpy(journal_dir, dir, sizeof(journal_dir) - 1);
+    journal_dir[sizeof(journal_dir) - 1] = '\0';
+
+    env = getenv("JOURNAL_SYNC_US");
+    if(NULL != env) {
+        sync_interval_ns = strtoull(env, NULL, 10) * 1000;
+    }
+
+    env = getenv("JOURNAL_SYNC_RECORDS");
+    if(NULL != env) {
+        sync_records = strtoull(env, NULL, 10);
+        if(0 == sync_records) {
+            sync_records = 1;
+        }
+    }
+
+    if((mkdir(journal_dir, 0755) < 0) && (EEXIST != errno)) {
+        LOG_ERROR("(%s:%d) Couldn't create %s: %s",
+                __FUNCTION__, __LINE__, journal_dir, strerror(errno));
+        return -1;
+    }
+
+    if(_journal_recover() < 0) {
+        return -1;
+    }
+
+    memset(&counters, 0, sizeof(counters));
+    for(i = 0; i < JOURNAL_SEGMENTS_MAPPED; i++) {
+        segments[i].number = 0;
+        segments[i].fd = -1;
+    }
+
+    sequence = first_sequence - 1;
+    durable = first_sequence - 1;
+    committed = first_sequence - 1;
+
+    if(_journal_segment_prepare(first_segment) < 0) {
+        return -1;
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+    if(pthread_create(&sync_thread, NULL, _journal_sync_thread, NULL) != 0) {
+        LOG_ERROR("(%s:%d) Couldn't start journal sync thread",
+                __FUNCTION__, __LINE__);
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        _journal_segment_unmap(&segments[first_segment %
+                JOURNAL_SEGMENTS_MAPPED]);
+        segments[first_segment % JOURNAL_SEGMENTS_MAPPED].number = 0;
+        return -1;
+    }
+
+    __atomic_store_n(&is_open, 1, __ATOMIC_RELEASE);
+
+    LOG_INFO("Journal: Appending to %s from sequence %llu, sync every %lluus "
+            "or %llu records", journal_dir, first_sequence,
+            sync_interval_ns / 1000, sync_records);
+
+    return 0;
+}
+
+/* Sync everything journalled so far and close the segments. The
+ * books must already be closed.
+ */
+void journal_close(void)
+{
+    int i;
+
+    if(!__atomic_load_n(&is_open, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&is_open, 0, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(sync_thread, NULL);
+
+    for(i = 0; i < JOURNAL_SEGMENTS_MAPPED; i++) {
+        if(0 != segments[i].number) {
+            _journal_segment_unmap(&segments[i]);
+            segments[i].number = 0;
+        }
+    }
+
+    LOG_INFO("Journal: %llu records in %llu syncs, longest sync %lluus",
+            counters.durable, counters.syncs, counters.max_sync_ns / 1000);
+}
+
+int journal_order(const Order *o)
+{
+    unsigned long long seq;
+    JournalRecord *r;
+
+    assert(o != NULL);
+
+    r = _journal_reserve(&seq);
+    if(NULL == r) {
+        return -1;
+    }
+
+    r->type = JOURNAL_RECORD_ORDER;
+    r->id = order_get_id(o);
+    r->aux = order_get_expire_time(o);
+    r->quantity = order_get_quantity(o);
+    r->price = order_get_price(o);
+    r->stop_price = order_get_stop_price(o);
+    r->peg_offset = order_get_peg_offset(o);
+    r->display_quantity = order_get_display_quantity(o);
+    r->side = (unsigned char)order_get_side(o);
+    r->order_type = (unsigned char)order_get_type(o);
+    r->time_in_force = (unsigned char)order_get_time_in_force(o);
+    _journal_symbol(r, order_get_symbol(o));
+
+    _journal_commit(r, seq);
+
+    return 0;
+}
+
+int journal_execution(const String *symbol, const Order *buy,
+        const Order *sell, float price, unsigned long quantity)
+{
+    unsigned long long seq;
+    JournalRecord *r;
+
+    assert(symbol != NULL);
+    assert(buy != NULL);
+    assert(sell != NULL);
+
+    r = _journal_reserve(&seq);
+    if(NULL == r) {
+        return -1;
+    }
+
+    r->type = JOURNAL_RECORD_EXECUTION;
+    r->id = order_get_id(buy);
+    r->aux = order_get_id(sell);
+    r->quantity = quantity;
+    r->price = price;
+    _journal_symbol(r, symbol);
+
+    _journal_commit(r, seq);
+
+    return 0;
+}
+
+int journal_auction(const String *symbol, JOURNAL_RECORD type,
+        BOOK_AUCTION auction)
+{
+    unsigned long long seq;
+    JournalRecord *r;
+
+    assert(symbol != NULL);
+    assert((JOURNAL_RECORD_AUCTION_START == type) ||
+            (JOURNAL_RECORD_AUCTION_UNCROSS == type));
+
+    r = _journal_reserve(&seq);
+    if(NULL == r) {
+        return -1;
+    }
+
+    r->type = (unsigned char)type;
+    r->side = (unsigned char)auction;
+    _journal_symbol(r, symbol);
+
+    _journal_commit(r, seq);
+
+    return 0;
+}
+
+/* An order taken out of its book, or cut down in it, other than by
+ * trading
+ */
+static int _journal_change(const Order *o, JOURNAL_RECORD type)
+{
+    unsigned long long seq;
+    JournalRecord *r;
+
+    r = _journal_reserve(&seq);
+    if(NULL == r) {
+        return -1;
+    }
+
+    r->type = (unsigned char)type;
+    r->id = order_get_id(o);
+    r->quantity = order_get_quantity(o);
+    r->price = order_get_price(o);
+    r->side = (unsigned char)order_get_side(o);
+    r->order_type = (unsigned char)order_get_type(o);
+    r->time_in_force = (unsigned char)order_get_time_in_force(o);
+    _journal_symbol(r, order_get_symbol(o));
+
+    _journal_commit(r, seq);
+
+    return 0;
+}
+
+int journal_expire(const Order *o)
+{
+    assert(o != NULL);
+
+    return _journal_change(o, JOURNAL_RECORD_EXPIRE);
+}
+
+int journal_cancel(const Order *o)
+{
+    assert(o != NULL);
+
+    return _journal_change(o, JOURNAL_RECORD_CANCEL);
+}
+
+int journal_amend(const Order *o)
+{
+    assert(o != NULL);
+
+    return _journal_change(o, JOURNAL_RECORD_AMEND);
+}
+
+unsigned long long journal_get_sequence(void)
+{
+    return __atomic_load_n(&sequence, __ATOMIC_RELAXED);
+}
+
+unsigned long long journal_get_durable(void)
+{
+    return __atomic_load_n(&durable, __ATOMIC_ACQUIRE);
+}
+
+void journal_get_counters(JournalCounters *c)
+{
+    assert(c != NULL);
+
+    c->records = __atomic_load_n(&sequence, __ATOMIC_RELAXED) -
+        (first_sequence - 1);
+    c->durable = __atomic_load_n(&counters.durable, __ATOMIC_RELAXED);
+    c->syncs = __atomic_load_n(&counters.syncs, __ATOMIC_RELAXED);
+    c->segments = __atomic_load_n(&counters.segments, __ATOMIC_RELAXED);
+    c->max_sync_ns = __atomic_load_n(&counters.max_sync_ns, __ATOMIC_RELAXED);
+}
+
+static int _journal_number_compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Open a reader on the journal in dir, or JOURNAL_DIR if it is NULL,
+ * starting at sequence from
+ */
+JournalReader* journal_reader_open(const char *dir, unsigned long long from)
+{
+    unsigned long long segment, *numbers;
+    struct dirent *entry;
+    JournalReader *reader;
+    unsigned long size;
+    DIR *d;
+
+    if(NULL == dir) {
+        dir = JOURNAL_DIR;
+    }
+
+    reader = calloc(1, sizeof(JournalReader));
+    if(NULL == reader) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    strncpy(reader->dir, dir, sizeof(reader->dir) - 1);
+    reader->from = from;
+
+    d = opendir(dir);
+    if(NULL == d) {
+        /* No journal yet, so nothing to read */
+        return reader;
+    }
+
+    size = 0;
+
+    while(NULL != (entry = readdir(d))) {
+        if(1 != sscanf(entry->d_name, "journal-%llu.bin", &segment)) {
+            continue;
+        }
+
+        if(reader->count == size) {
+            size = (0 == size) ? 64 : (size * 2);
+            numbers = realloc(reader->numbers,
+                    size * sizeof(unsigned long long));
+            if(NULL == numbers) {
+                LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+                closedir(d);
+                journal_reader_close(reader);
+                return NULL;
+            }
+            reader->numbers = numbers;
+        }
+
+        reader->numbers[reader->count++] = segment;
+    }
+
+    closedir(d);
+
+    qsort(reader->numbers, reader->count, sizeof(unsigned long long),
+            _journal_number_compare);
+
+    return reader;
+}
+
+static void _journal_reader_unmap(JournalReader *reader)
+{
+    if(NULL != reader->header) {
+        munmap(reader->header, JOURNAL_SEGMENT_SIZE);
+        reader->header = NULL;
+        reader->records = NULL;
+    }
+}
+
+/* Map the next segment with records at or after the reader's start.
+ * Returns -1 when there are no more segments.
+ */
+static int _journal_reader_advance(JournalReader *reader)
+{
+    char path[JOURNAL_PATH_LEN];
+    JournalSegmentHeader *h;
+    void *p;
+    int fd;
+
+    _journal_reader_unmap(reader);
+
+    while(reader->next < reader->count) {
+        snprintf(path, sizeof(path), "%s/journal-%08llu.bin",
+                reader->dir, reader->numbers[reader->next++]);
+
+        fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            continue;
+        }
+
+        p = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if(MAP_FAILED == p) {
+            continue;
+        }
+
+        h = (JournalSegmentHeader *)p;
+
+        if((JOURNAL_MAGIC != h->magic) || (JOURNAL_VERSION != h->version) ||
+                (JOURNAL_SEGMENT_RECORDS != h->record_count) ||
+                (h->first_sequence + JOURNAL_SEGMENT_RECORDS <= reader->from)) {
+            /* Not a segment, or all of it is before the start */
+            munmap(p, JOURNAL_SEGMENT_SIZE);
+            continue;
+        }
+
+        reader->header = h;
+        reader->records = (JournalRecord *)(h + 1);
+        reader->position = (reader->from > h->first_sequence) ?
+            (reader->from - h->first_sequence) : 0;
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/* The next record, or NULL at the end of the journal. The journal
+ * ends at the first gap in its sequence, even if later segments have
+ * records. The record is only valid until the next call.
+ */
+const JournalRecord* journal_reader_next(JournalReader *reader)
+{
+    JournalRecord *r;
+
+    assert(reader != NULL);
+
+    for(;;) {
+        if((NULL == reader->header) && (_journal_reader_advance(reader) < 0)) {
+            return NULL;
+        }
+
+        if(reader->position < JOURNAL_SEGMENT_RECORDS) {
+            r = &reader->records[reader->position];
+
+            /* A gap ends the records in a segment */
+            if(r->sequence == reader->header->first_sequence +
+                    reader->position) {
+                if((0 != reader->expected) &&
+                        (r->sequence != reader->expected)) {
+                    /* Records were lost between segments */
+                    LOG_WARNING("(%s:%d) Journal ends at %llu: found %llu",
+                            __FUNCTION__, __LINE__, reader->expected - 1,
+                            r->sequence);
+                    _journal_reader_unmap(reader);
+                    reader->next = reader->count;
+                    return NULL;
+                }
+
+                reader->expected = r->sequence + 1;
+                reader->position++;
+                return r;
+            }
+        }
+
+        _journal_reader_unmap(reader);
+    }
+}
+
+void journal_reader_close(JournalReader *reader)
+{
+    assert(reader != NULL);
+
+    _journal_reader_unmap(reader);
+    free(reader->numbers);
+    free(reader);
+}
+
+/* Apply a journalled order, cancel, amend or auction command to its
+ * book, as it was applied when it was journalled. Executions aren't
+ * commands; they are reproduced by matching the orders. Expiries are
+ * applied like commands, since when they happened depends on the
+ * clock; the book's own expiry should be off. Returns 1 if the
+ * record was applied, 0 if it isn't a command and -1 on error.
+ */
+int journal_apply(Book *b, const JournalRecord *r)
+{
+    Order *o;
+
+    assert(b != NULL);
+    assert(r != NULL);
+
+    switch(r->type) {
+        case JOURNAL_RECORD_ORDER:
+            o = order_create((ORDER_TYPE)r->order_type, (ORDER_SIDE)r->side,
+                    string_duplicate(book_get_symbol(b)), r->price,
+                    r->quantity);
+            if(NULL == o) {
+                return -1;
+            }
+
+            order_set_id(o, r->id);
+            order_set_stop_price(o, r->stop_price);
+            order_set_peg_offset(o, r->peg_offset);
+            order_set_display_quantity(o, r->display_quantity);
+            order_set_time_in_force(o, (ORDER_TIME_IN_FORCE)r->time_in_force);
+            order_set_expire_time(o, r->aux);
+
+            /* The order is still ours if the book rejects it */
+            if(book_process_order(b, o) < 0) {
+                order_free(o);
+                return -1;
+            }
+            return 1;
+
+        case JOURNAL_RECORD_AUCTION_START:
+            return (book_auction_start(b, (BOOK_AUCTION)r->side) < 0) ? -1 : 1;
+
+        case JOURNAL_RECORD_AUCTION_UNCROSS:
+            return (book_auction_uncross(b) < 0) ? -1 : 1;
+
+        case JOURNAL_RECORD_EXPIRE:
+            return (book_expire_order(b, r->id) < 0) ? -1 : 1;
+
+        case JOURNAL_RECORD_CANCEL:
+            return (book_cancel_orders(b, &r->id, 1) == 1) ? 1 : -1;
+
+        case JOURNAL_RECORD_AMEND:
+            return (book_amend_order(b, r->id, r->quantity) < 0) ? -1 : 1;
+
+        default:
+            return 0;
+    }
+}
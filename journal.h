@@ -0,0 +1,191 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#include <libcore/string.h>
+
+#include "book.h"
+#include "order.h"
+
+/* The journal is a series of segment files, journal-<n>.bin, each a
+ * JournalSegmentHeader followed by JOURNAL_SEGMENT_RECORDS records.
+ * Records are numbered from 1 across all segments; a slot whose
+ * sequence doesn't match its position was never written. Any change
+ * to the layout must bump JOURNAL_VERSION.
+ */
+#define JOURNAL_MAGIC           0x6a726e6c656e67ULL
+#define JOURNAL_VERSION         4
+
+/* Records divide a page, so none is ever split across two */
+#define JOURNAL_RECORD_SIZE     128
+#define JOURNAL_SEGMENT_RECORDS (1 << 18)
+
+#define JOURNAL_SYMBOL_LEN      BOOK_SYMBOL_LEN
+
+#define JOURNAL_DIR             "journal"
+
+/* Records are made durable in batches, at least this often and
+ * whenever this many are waiting
+ */
+#define JOURNAL_SYNC_INTERVAL_US    1000
+#define JOURNAL_SYNC_RECORDS        4096
+
+typedef enum {
+    JOURNAL_RECORD_NONE,
+
+    /* An order accepted by a book. id is the order ID, and aux
+     * the time it expires, or 0 if it never does.
+     */
+    JOURNAL_RECORD_ORDER,
+
+    /* A trade. id is the buy order and aux the sell order. */
+    JOURNAL_RECORD_EXECUTION,
+
+    /* side holds the BOOK_AUCTION */
+    JOURNAL_RECORD_AUCTION_START,
+    JOURNAL_RECORD_AUCTION_UNCROSS,
+
+    /* An order that expired, with the quantity it had left */
+    JOURNAL_RECORD_EXPIRE,
+
+    /* An order that was cancelled, with the quantity it had left */
+    JOURNAL_RECORD_CANCEL,
+
+    /* An order whose quantity was cut in place, keeping its time
+     * priority, with the quantity it has now
+     */
+    JOURNAL_RECORD_AMEND,
+
+    JOURNAL_RECORD_LAST
+} JOURNAL_RECORD;
+
+typedef struct {
+    unsigned long long sequence;
+
+    /* Nanoseconds since the Epoch */
+    unsigned long long time;
+
+    unsigned long long id;
+
+    /* Depends on the type of record: the expiry time of an order and
+     * the sell order of a trade. Unused by the other types.
+     */
+    unsigned long long aux;
+
+    unsigned long long quantity;
+    unsigned long long display_quantity;
+
+    float price;
+    float stop_price;
+    float peg_offset;
+
+    unsigned char type;
+    unsigned char side;
+    unsigned char order_type;
+    unsigned char time_in_force;
+
+    /* Zero padded, and not terminated if it fills the field */
+    char symbol[JOURNAL_SYMBOL_LEN];
+
+    unsigned char reserved[48];
+} JournalRecord;
+
+typedef struct {
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int record_size;
+
+    unsigned long long segment;
+    unsigned long long first_sequence;
+    unsigned long long record_count;
+
+    unsigned char reserved[JOURNAL_RECORD_SIZE - 40];
+} JournalSegmentHeader;
+
+typedef struct {
+    /* Records written, and made durable, so far */
+    unsigned long long records;
+    unsigned long long durable;
+
+    unsigned long long syncs;
+    unsigned long long segments;
+
+    /* Longest sync, in nanoseconds */
+    unsigned long long max_sync_ns;
+} JournalCounters;
+
+int     journal_open        (const char *dir);
+void    journal_close       (void);
+
+/* Append a record. These only copy the record into the mapped
+ * segment and never wait for the disk. They are called with the
+ * book's lock held, so each book's records are in book order.
+ */
+int     journal_order       (const Order *o);
+int     journal_execution   (const String *symbol, const Order *buy,
+                             const Order *sell, float price,
+                             unsigned long quantity);
+int     journal_auction     (const String *symbol, JOURNAL_RECORD type,
+                             BOOK_AUCTION auction);
+int     journal_expire      (const Order *o);
+int     journal_cancel      (const Order *o);
+int     journal_amend       (const Order *o);
+
+/* Sequence of the last record written, and of the last one known
+ * to be on disk. Everything up to the durable sequence survives a
+ * crash, so acknowledgements can be held back until it passes the
+ * record they depend on.
+ */
+unsigned long long  journal_get_sequence    (void);
+unsigned long long  journal_get_durable     (void);
+
+void    journal_get_counters(JournalCounters *counters);
+
+/* Reads a journal back in sequence order, from any run, without it
+ * being open. Each reader is independent, so several threads can
+ * read the same journal at once.
+ */
+typedef struct _journal_reader JournalReader;
+
+JournalReader*          journal_reader_open (const char *dir,
+                                             unsigned long long from);
+const JournalRecord*    journal_reader_next (JournalReader *reader);
+void                    journal_reader_close(JournalReader *reader);
+
+int     journal_apply       (Book *b, const JournalRecord *r);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,331 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+#include "log.h"
+#include "timestamp.h"
+#include "trace.h"
+
+/* Histograms are log-linear: values below 2^LATENCY_SUB_BITS get a
+ * bucket each, and every power of two above that is split into
+ * 2^LATENCY_SUB_BITS equal buckets. That keeps every bucket within
+ * 1/32 of its value across the whole 64 bit range, in a fixed 15KB
+ * per histogram.
+ */
+#define LATENCY_SUB_BITS        5
+#define LATENCY_SUB_BUCKETS     (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS         ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+} LatencyHistogram;
+
+typedef struct _latency_block LatencyBlock;
+
+/* One thread's histograms. Only the owning thread writes them, and
+ * readers merge them without a lock. Blocks are never freed: when a
+ * thread exits its block is released, keeping its counts, for the
+ * next new thread to carry on with.
+ */
+struct _latency_block {
+    LatencyHistogram histograms[LATENCY_HISTOGRAMS];
+
+    int in_use;
+    LatencyBlock *next;
+};
+
+static const char *histogram_names[LATENCY_HISTOGRAMS] = {
+    "socket_read",
+    "frame_complete",
+    "parse_complete",
+    "market_enqueue",
+    "matcher_dequeue",
+    "match_complete",
+    "report_sent",
+    "end_to_end"
+};
+
+static LatencyBlock *blocks = NULL;
+
+static __thread LatencyBlock *local_block = NULL;
+
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+static void _latency_block_release(void *data)
+{
+    LatencyBlock *block = (LatencyBlock *)data;
+
+    __atomic_store_n(&block->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _latency_block_key_create(void)
+{
+    pthread_key_create(&block_key, _latency_block_release);
+}
+
+/* Find this thread a block, reusing one released by a thread that
+ * has exited before allocating a new one
+ */
+static LatencyBlock* _latency_block_claim(void)
+{
+    LatencyBlock *block;
+    int unused;
+
+    pthread_once(&block_key_once, _latency_block_key_create);
+
+    for(block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+            NULL != block;
+            block = block->next) {
+        unused = 0;
+        if(__atomic_compare_exchange_n(&block->in_use, &unused, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if(NULL == block) {
+        block = calloc(1, sizeof(LatencyBlock));
+        if(NULL == block) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            return NULL;
+        }
+
+        block->in_use = 1;
+        block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&blocks, &block->next, block, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            /* block->next now holds the new head, so try again */
+        }
+    }
+
+    pthread_setspecific(block_key, block);
+
+    return block;
+}
+
+static unsigned long _latency_bucket(unsigned long long value)
+{
+    unsigned long shift;
+
+    if(value < LATENCY_SUB_BUCKETS) {
+        return value;
+    }
+
+    shift = (63 - __builtin_clzll(value)) - LATENCY_SUB_BITS;
+
+    return ((shift + 1) << LATENCY_SUB_BITS) +
+        ((value >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+/* Highest value that falls in a bucket */
+static unsigned long long _latency_bucket_value(unsigned long bucket)
+{
+    unsigned long shift;
+
+    if(bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+
+    return (((unsigned long long)(bucket & (LATENCY_SUB_BUCKETS - 1)) +
+                LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/* Add to a histogram value. Only the owning thread writes, so a
+ * plain store is enough to keep readers from seeing a torn value.
+ */
+static void _latency_add(unsigned long long *p, unsigned long long n)
+{
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static void _latency_histogram_add(LatencyHistogram *h,
+        unsigned long long value)
+{
+    _latency_add(&h->counts[_latency_bucket(value)], 1);
+    _latency_add(&h->count, 1);
+    _latency_add(&h->sum, value);
+
+    if(value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+void latency_stamp(LatencyTrace *trace, LATENCY_STAGE stage)
+{
+    assert(trace != NULL);
+    assert(stage < LATENCY_STAGE_LAST);
+
+    trace->stamp[stage] = timestamp_now();
+}
+
+/* Record the time between each pair of consecutive stages the order
+ * reached, and between the first and last, in this thread's
+ * histograms. Orders that were never stamped are ignored.
+ */
+void latency_record(const LatencyTrace *trace)
+{
+    unsigned long long first, last;
+    LatencyBlock *block;
+    int s;
+
+    assert(trace != NULL);
+
+    block = local_block;
+    if(NULL == block) {
+        block = local_block = _latency_block_claim();
+        if(NULL == block) {
+            return;
+        }
+    }
+
+    first = last = 0;
+
+    for(s = 0; s < LATENCY_STAGE_LAST; s++) {
+        if(0 == trace->stamp[s]) {
+            continue;
+        }
+
+        if(0 == first) {
+            first = trace->stamp[s];
+        } else if(trace->stamp[s] >= last) {
+            _latency_histogram_add(&block->histograms[s],
+                    trace->stamp[s] - last);
+        }
+
+        last = trace->stamp[s];
+    }
+
+    if(last > first) {
+        _latency_histogram_add(&block->histograms[LATENCY_END_TO_END],
+                last - first);
+        trace_latency(last - first);
+    }
+}
+
+/* Merge one histogram over every thread and summarise it. Threads
+ * carry on recording while this runs, so the summary is only as
+ * consistent as the moment each bucket was read.
+ */
+void latency_get_summary(int histogram, LatencySummary *summary)
+{
+    unsigned long long counts[LATENCY_BUCKETS];
+    unsigned long long count, sum, max, seen;
+    unsigned long long p50, p99, p999;
+    const LatencyHistogram *h;
+    LatencyBlock *block;
+    unsigned long i;
+
+    assert((histogram >= 0) && (histogram < LATENCY_HISTOGRAMS));
+    assert(summary != NULL);
+
+    memset(counts, 0, sizeof(counts));
+    count = sum = max = 0;
+
+    for(block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+            NULL != block;
+            block = block->next) {
+        h = &block->histograms[histogram];
+
+        for(i = 0; i < LATENCY_BUCKETS; i++) {
+            counts[i] += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        }
+
+        sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&h->max, __ATOMIC_RELAXED) > max) {
+            max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        }
+    }
+
+    for(i = 0; i < LATENCY_BUCKETS; i++) {
+        count += counts[i];
+    }
+
+    memset(summary, 0, sizeof(LatencySummary));
+    if(0 == count) {
+        return;
+    }
+
+    /* Ranks of the percentiles, rounded up */
+    p50 = (count * 500 + 999) / 1000;
+    p99 = (count * 990 + 999) / 1000;
+    p999 = (count * 999 + 999) / 1000;
+
+    /* Each percentile is in the bucket where the running count
+     * first reaches its rank
+     */
+    seen = 0;
+    for(i = 0; (i < LATENCY_BUCKETS) && (seen < p999); i++) {
+        if(0 == counts[i]) {
+            continue;
+        }
+
+        if((seen < p50) && (seen + counts[i] >= p50)) {
+            summary->p50 = _latency_bucket_value(i);
+        }
+        if((seen < p99) && (seen + counts[i] >= p99)) {
+            summary->p99 = _latency_bucket_value(i);
+        }
+        if(seen + counts[i] >= p999) {
+            summary->p999 = _latency_bucket_value(i);
+        }
+
+        seen += counts[i];
+    }
+
+    summary->count = count;
+    summary->mean = sum / count;
+    summary->max = max;
+
+    /* Bucket values round up, but never past the largest seen */
+    if(summary->p50 > max) {
+        summary->p50 = max;
+    }
+    if(summary->p99 > max) {
+        summary->p99 = max;
+    }
+    if(summary->p999 > max) {
+        summary->p999 = max;
+    }
+}
+
+const char* latency_get_name(int histogram)
+{
+    assert((histogram >= 0) && (histogram < LATENCY_HISTOGRAMS));
+
+    return histogram_names[histogram];
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/* Points in an order's life that are timestamped, in order */
+typedef enum {
+    LATENCY_STAGE_SOCKET_READ,
+    LATENCY_STAGE_FRAME_COMPLETE,
+    LATENCY_STAGE_PARSE_COMPLETE,
+    LATENCY_STAGE_MARKET_ENQUEUE,
+    LATENCY_STAGE_MATCHER_DEQUEUE,
+    LATENCY_STAGE_MATCH_COMPLETE,
+    LATENCY_STAGE_REPORT_SENT,
+
+    /* Add new stages before this point */
+    LATENCY_STAGE_LAST
+} LATENCY_STAGE;
+
+/* Histogram n, for a stage n other than the first, holds the time
+ * taken to reach that stage from the one before it. The extra one
+ * at the end holds the end-to-end latency.
+ */
+#define LATENCY_END_TO_END      LATENCY_STAGE_LAST
+#define LATENCY_HISTOGRAMS      (LATENCY_STAGE_LAST + 1)
+
+/* Timestamps, in nanoseconds, of the stages an order has reached.
+ * Stages not reached are zero.
+ */
+typedef struct {
+    unsigned long long stamp[LATENCY_STAGE_LAST];
+} LatencyTrace;
+
+/* Summary of one histogram, merged over every thread. Latencies
+ * are in nanoseconds, accurate to within about 3%.
+ */
+typedef struct {
+    unsigned long long count;
+    unsigned long long mean;
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long max;
+} LatencySummary;
+
+void    latency_stamp   (LatencyTrace *trace, LATENCY_STAGE stage);
+void    latency_record  (const LatencyTrace *trace);
+
+void        latency_get_summary (int histogram, LatencySummary *summary);
+const char* latency_get_name    (int histogram);
+
+#if __cplusplus
+}
+#endif
+
+#endif
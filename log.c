@@ -0,0 +1,713 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "timestamp.h"
+#include "log.h"
+
+/* Records kept per thread. Must be a power of two. */
+#define LOG_RING_RECORDS    1024
+
+/* Size of one record, including its copies of string arguments */
+#define LOG_RECORD_SIZE     256
+
+/* Arguments kept per record; any more are left out */
+#define LOG_MAX_ARGS        8
+
+/* Records written by one call site in a second before the rest
+ * are suppressed
+ */
+#define LOG_RATE_LIMIT      100
+
+/* How long the logger thread sleeps when every ring is empty */
+#define LOG_POLL_US         1000
+
+#define LOG_LINE_LEN        1024
+
+#define NSEC_PER_SEC        1000000000ULL
+
+typedef union {
+    long long i;
+    unsigned long long u;
+    double f;
+    const void *p;
+} LogArg;
+
+#define LOG_HEADER_SIZE \
+    (sizeof(unsigned long long) + sizeof(const char *) + \
+     sizeof(unsigned int) + 4 + (LOG_MAX_ARGS * sizeof(LogArg)))
+
+/* A message as written by the calling thread: the format string,
+ * which must outlive the logger (it is always a literal), and the
+ * arguments it refers to. String arguments are copied into strings
+ * and their arg holds the offset of the copy.
+ */
+typedef struct {
+    unsigned long long time;
+    const char *fmt;
+    unsigned int suppressed;
+    unsigned char level;
+    unsigned char nargs;
+    unsigned char used;
+    unsigned char truncated;
+    LogArg args[LOG_MAX_ARGS];
+    char strings[LOG_RECORD_SIZE - LOG_HEADER_SIZE];
+} LogRecord;
+
+/* Keep the record size honest if the header changes */
+typedef char LogRecordSizeCheck[(sizeof(LogRecord) == LOG_RECORD_SIZE) ? 1 : -1];
+
+typedef struct _log_ring LogRing;
+
+/* One thread's records. The owning thread is the only writer of
+ * head and the logger thread the only writer of tail. Rings are
+ * never freed: when a thread exits its ring is released for the
+ * next new thread to use, and anything left in it is still written.
+ */
+struct _log_ring {
+    LogRecord records[LOG_RING_RECORDS];
+
+    unsigned long long head __attribute__((aligned(64)));
+    unsigned long dropped;
+
+    unsigned long long tail __attribute__((aligned(64)));
+    unsigned long dropped_reported;
+
+    int in_use;
+    LogRing *next;
+};
+
+static const char *level_names[LOG_LEVEL_LAST] = {
+    "DEBUG",
+    "INFO",
+    "WARNING",
+    "ERROR"
+};
+
+static LogRing *rings = NULL;
+
+static __thread LogRing *local_ring = NULL;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static LOG_LEVEL min_level = LOG_LEVEL_INFO;
+
+static pthread_t log_thread;
+static int running = 0;
+
+/* Serialises the synchronous writes made before log_init and after
+ * log_close
+ */
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void _log_ring_release(void *data)
+{
+    LogRing *ring = (LogRing *)data;
+
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _log_ring_key_create(void)
+{
+    pthread_key_create(&ring_key, _log_ring_release);
+}
+
+/* Find this thread a ring, reusing one released by a thread that
+ * has exited before allocating a new one
+ */
+static LogRing* _log_ring_claim(void)
+{
+    LogRing *ring;
+    int unused;
+
+    pthread_once(&ring_key_once, _log_ring_key_create);
+
+    for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+            NULL != ring;
+            ring = ring->next) {
+        unused = 0;
+        if(__atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if(NULL == ring) {
+        ring = calloc(1, sizeof(LogRing));
+        if(NULL == ring) {
+            return NULL;
+        }
+
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            /* ring->next now holds the new head, so try again */
+        }
+    }
+
+    pthread_setspecific(ring_key, ring);
+
+    return ring;
+}
+
+/* Skip the flags, width and precision of a conversion, pulling any
+ * '*' arguments. Returns a pointer to the length modifier.
+ */
+static const char* _log_skip_spec(const char *c, LogRecord *r, va_list *ap)
+{
+    while((*c != '\0') && (NULL != strchr("-+ #0'", *c))) {
+        c++;
+    }
+
+    if('*' == *c) {
+        if(r->nargs < LOG_MAX_ARGS) {
+            r->args[r->nargs].i = va_arg(*ap, int);
+        }
+        r->nargs++;
+        c++;
+    } else {
+        while((*c >= '0') && (*c <= '9')) {
+            c++;
+        }
+    }
+
+    if('.' == *c) {
+        c++;
+        if('*' == *c) {
+            if(r->nargs < LOG_MAX_ARGS) {
+                r->args[r->nargs].i = va_arg(*ap, int);
+            }
+            r->nargs++;
+            c++;
+        } else {
+            while((*c >= '0') && (*c <= '9')) {
+                c++;
+            }
+        }
+    }
+
+    return c;
+}
+
+/* Copy the arguments the format refers to into the record, with
+ * integers widened to long long and floats to double, so that the
+ * logger thread can format them later without the va_list
+ */
+static void _log_capture(LogRecord *r, const char *fmt, va_list *ap)
+{
+    const char *c, *s;
+    LogArg arg;
+    size_t len;
+    int longs;
+
+    r->nargs = 0;
+    r->used = 0;
+    r->truncated = 0;
+
+    for(c = fmt; *c != '\0'; c++) {
+        if('%' != *c) {
+            continue;
+        }
+
+        c = _log_skip_spec(c + 1, r, ap);
+
+        longs = 0;
+        while((*c != '\0') && (NULL != strchr("hlLqjzt", *c))) {
+            if('l' == *c) {
+                longs++;
+            } else if(NULL != strchr("qjzt", *c)) {
+                longs = 3;
+            }
+            c++;
+        }
+
+        switch(*c) {
+        case '\0':
+            return;
+        case '%':
+            continue;
+        case 'd':
+        case 'i':
+            if(3 == longs) {
+                arg.i = (long long)va_arg(*ap, intmax_t);
+            } else if(2 == longs) {
+                arg.i = va_arg(*ap, long long);
+            } else if(1 == longs) {
+                arg.i = va_arg(*ap, long);
+            } else {
+                arg.i = va_arg(*ap, int);
+            }
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            if(3 == longs) {
+                arg.u = (unsigned long long)va_arg(*ap, uintmax_t);
+            } else if(2 == longs) {
+                arg.u = va_arg(*ap, unsigned long long);
+            } else if(1 == longs) {
+                arg.u = va_arg(*ap, unsigned long);
+            } else {
+                arg.u = va_arg(*ap, unsigned int);
+            }
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if('L' == c[-1]) {
+                arg.f = (double)va_arg(*ap, long double);
+            } else {
+                arg.f = va_arg(*ap, double);
+            }
+            break;
+        case 's':
+            s = va_arg(*ap, const char *);
+            if(NULL == s) {
+                s = "(null)";
+            }
+
+            len = strlen(s);
+            if(r->used + len >= sizeof(r->strings)) {
+                len = (r->used < sizeof(r->strings)) ?
+                    (sizeof(r->strings) - r->used - 1) : 0;
+                r->truncated = 1;
+            }
+
+            if(0 == len) {
+                /* Empty, or no room left: point at the last byte,
+                 * which is always the terminator
+                 */
+                arg.u = sizeof(r->strings) - 1;
+                r->strings[sizeof(r->strings) - 1] = '\0';
+                break;
+            }
+
+            memcpy(&r->strings[r->used], s, len);
+            r->strings[r->used + len] = '\0';
+            arg.u = r->used;
+            r->used += len + 1;
+            break;
+        default:
+            arg.p = va_arg(*ap, const void *);
+            break;
+        }
+
+        if(r->nargs < LOG_MAX_ARGS) {
+            r->args[r->nargs] = arg;
+        }
+        r->nargs++;
+    }
+}
+
+/* Format a captured record into line. Returns the length. */
+static size_t _log_format(LogRecord *r, char *line, size_t size)
+{
+    char spec[32];
+    const char *c, *start;
+    struct tm tm;
+    time_t secs;
+    size_t len, n;
+    int arg, star;
+
+    secs = (time_t)(r->time / NSEC_PER_SEC);
+    localtime_r(&secs, &tm);
+
+    len = strftime(line, size, "[%H:%M:%S", &tm);
+    len += snprintf(line + len, size - len, ".%06llu] %-7s ",
+            (r->time % NSEC_PER_SEC) / 1000, level_names[r->level]);
+
+    arg = 0;
+
+    for(c = r->fmt; (*c != '\0') && (len < size - 1); c++) {
+        if('%' != *c) {
+            line[len++] = *c;
+            continue;
+        }
+
+        if('%' == c[1]) {
+            line[len++] = '%';
+            c++;
+            continue;
+        }
+
+        /* Rebuild the conversion with any '*' filled in and the
+         * length modifier changed to suit the captured argument
+         */
+        start = c;
+        n = 0;
+        spec[n++] = *c++;
+
+        for(; (*c != '\0') && (n < sizeof(spec) - 16) &&
+                (NULL != strchr("-+ #0'123456789.*hlLqjzt", *c)); c++) {
+            if(NULL != strchr("hlLqjzt", *c)) {
+                continue;
+            }
+
+            if('*' == *c) {
+                star = (arg < LOG_MAX_ARGS) ? (int)r->args[arg].i : 0;
+                arg++;
+                n += snprintf(&spec[n], sizeof(spec) - n, "%d", star);
+                continue;
+            }
+
+            spec[n++] = *c;
+        }
+
+        if(('\0' == *c) || (NULL == strchr("diuxXocfFeEgGaAsp", *c)) ||
+                (arg >= LOG_MAX_ARGS)) {
+            /* Unknown conversion, or an argument that wasn't kept */
+            n = strlen(start);
+            if(n > size - 1 - len) {
+                n = size - 1 - len;
+            }
+            memcpy(line + len, start, n);
+            len += n;
+            break;
+        }
+
+        switch(*c) {
+        case 'd':
+        case 'i':
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = *c;
+            spec[n] = '\0';
+            len += snprintf(line + len, size - len, spec, r->args[arg].i);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            spec[n++] = 'l';
+            spec[n++] = 'l';
+            spec[n++] = *c;
+            spec[n] = '\0';
+            len += snprintf(line + len, size - len, spec, r->args[arg].u);
+            break;
+        case 'c':
+            spec[n++] = *c;
+            spec[n] = '\0';
+            len += snprintf(line + len, size - len, spec,
+                    (int)r->args[arg].u);
+            break;
+        case 's':
+            spec[n++] = *c;
+            spec[n] = '\0';
+            len += snprintf(line + len, size - len, spec,
+                    &r->strings[r->args[arg].u]);
+            break;
+        case 'p':
+            spec[n++] = *c;
+            spec[n] = '\0';
+            len += snprintf(line + len, size - len, spec, r->args[arg].p);
+            break;
+        default:
+            spec[n++] = *c;
+            spec[n] = '\0';
+            len += snprintf(line + len, size - len, spec, r->args[arg].f);
+            break;
+        }
+
+        arg++;
+
+        if(len > size - 1) {
+            len = size - 1;
+        }
+    }
+
+    /* Messages may or may not end in a newline; always add one */
+    while((len > 0) && ('\n' == line[len - 1])) {
+        len--;
+    }
+
+    if(r->truncated && (len + 4 < size)) {
+        memcpy(line + len, "...", 3);
+        len += 3;
+    }
+
+    if(r->suppressed > 0) {
+        len += snprintf(line + len, size - len,
+                " (%u similar messages suppressed)", r->suppressed);
+        if(len > size - 1) {
+            len = size - 1;
+        }
+    }
+
+    if(len > size - 2) {
+        len = size - 2;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+
+    return len;
+}
+
+/* Write out everything waiting in the rings, oldest first. Returns
+ * the number of records written.
+ */
+static unsigned long _log_drain(char *line)
+{
+    unsigned long long tail;
+    unsigned long dropped, written;
+    LogRing *ring, *oldest;
+    LogRecord *r, *next;
+    size_t len;
+
+    written = 0;
+
+    for(;;) {
+        oldest = NULL;
+        r = NULL;
+
+        for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+                NULL != ring;
+                ring = ring->next) {
+            tail = ring->tail;
+            if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+
+            next = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+            if((NULL == r) || (next->time < r->time)) {
+                oldest = ring;
+                r = next;
+            }
+        }
+
+        if(NULL == oldest) {
+            break;
+        }
+
+        len = _log_format(r, line, LOG_LINE_LEN);
+        fwrite(line, 1, len, stderr);
+
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+
+    for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+            NULL != ring;
+            ring = ring->next) {
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if(dropped != ring->dropped_reported) {
+            fprintf(stderr, "Log: Dropped %lu messages, ring full\n",
+                    dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+            written++;
+        }
+    }
+
+    if(written > 0) {
+        fflush(stderr);
+    }
+
+    return written;
+}
+
+static void* _log_thread(void *arg)
+{
+    char line[LOG_LINE_LEN];
+
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        if(0 == _log_drain(line)) {
+            usleep(LOG_POLL_US);
+        }
+    }
+
+    /* Anything written before log_close stopped us */
+    _log_drain(line);
+
+    return NULL;
+}
+
+/* Start the logger thread. Until this is called, and again after
+ * log_close, messages are written directly by the calling thread.
+ * The level to log from can be set with the LOG_LEVEL environment
+ * variable.
+ */
+void log_init(void)
+{
+    const char *env;
+    int i;
+
+    env = getenv("LOG_LEVEL");
+    if(NULL != env) {
+        for(i = 0; i < LOG_LEVEL_LAST; i++) {
+            if(strcasecmp(env, level_names[i]) == 0) {
+                log_set_level((LOG_LEVEL)i);
+            }
+        }
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+    if(pthread_create(&log_thread, NULL, _log_thread, NULL) != 0) {
+        fprintf(stderr, "(%s:%d) Couldn't start logger thread\n",
+                __FUNCTION__, __LINE__);
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* Write out everything logged so far and stop the logger thread.
+ * Messages logged by other threads while this runs may be lost.
+ */
+void log_close(void)
+{
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+}
+
+void log_set_level(LOG_LEVEL level)
+{
+    assert(level < LOG_LEVEL_LAST);
+
+    __atomic_store_n(&min_level, level, __ATOMIC_RELAXED);
+}
+
+LOG_LEVEL log_get_level(void)
+{
+    return __atomic_load_n(&min_level, __ATOMIC_RELAXED);
+}
+
+/* Count a message against its call site. Returns -1 if it is over
+ * the limit, otherwise the number suppressed since the last one
+ * that got through. Sites shared between threads are only counted
+ * approximately.
+ */
+static int _log_site_limit(LogSite *site, unsigned long long now)
+{
+    unsigned long long window;
+
+    window = now / NSEC_PER_SEC;
+
+    if(__atomic_load_n(&site->window, __ATOMIC_RELAXED) != window) {
+        __atomic_store_n(&site->window, window, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if(__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) >
+            LOG_RATE_LIMIT) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return (int)__atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+static void _log_write_sync(LogRecord *r)
+{
+    char line[LOG_LINE_LEN];
+    size_t len;
+
+    len = _log_format(r, line, sizeof(line));
+
+    pthread_mutex_lock(&sync_mutex);
+    fwrite(line, 1, len, stderr);
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+void log_write(LogSite *site, LOG_LEVEL level, const char *fmt, ...)
+{
+    unsigned long long head, now;
+    LogRecord *r, local;
+    LogRing *ring;
+    int suppressed;
+    va_list ap;
+
+    assert(site != NULL);
+    assert(level < LOG_LEVEL_LAST);
+    assert(fmt != NULL);
+
+    now = timestamp_now();
+
+    suppressed = _log_site_limit(site, now);
+    if(suppressed < 0) {
+        return;
+    }
+
+    ring = NULL;
+    if(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        ring = local_ring;
+        if(NULL == ring) {
+            ring = local_ring = _log_ring_claim();
+        }
+    }
+
+    if(NULL == ring) {
+        /* No logger thread, so format and write it here */
+        r = &local;
+    } else {
+        head = ring->head;
+        if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+                LOG_RING_RECORDS) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        r = &ring->records[head & (LOG_RING_RECORDS - 1)];
+    }
+
+    r->time = now;
+    r->fmt = fmt;
+    r->suppressed = (unsigned int)suppressed;
+    r->level = (unsigned char)level;
+
+    va_start(ap, fmt);
+    _log_capture(r, fmt, &ap);
+    va_end(ap);
+
+    if(NULL == ring) {
+        _log_write_sync(r);
+        return;
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR,
+
+    LOG_LEVEL_LAST
+} LOG_LEVEL;
+
+/* Rate limiting state for one call site. Each LOG() call site gets
+ * its own, so a flood from one site doesn't silence the others.
+ */
+typedef struct {
+    unsigned long long window;
+    unsigned int count;
+    unsigned int suppressed;
+} LogSite;
+
+/* Log a printf-style message. The calling thread only copies the
+ * arguments into a record on its own ring; formatting and writing
+ * happen on the logger's background thread. Records are dropped,
+ * never waited for, if the ring is full.
+ */
+#define LOG(level, ...) \
+    do { \
+        static LogSite _log_site; \
+        if((level) >= log_get_level()) { \
+            log_write(&_log_site, (level), __VA_ARGS__); \
+        } \
+    } while(0)
+
+#define LOG_DEBUG(...)      LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)       LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(...)    LOG(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...)      LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+void        log_init        (void);
+void        log_close       (void);
+
+void        log_set_level   (LOG_LEVEL level);
+LOG_LEVEL   log_get_level   (void);
+
+void        log_write       (LogSite *site, LOG_LEVEL level,
+                             const char *fmt, ...)
+                            __attribute__((format(printf, 3, 4)));
+
+#if __cplusplus
+}
+#endif
+
+#endif
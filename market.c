@@ -27,124 +27,647 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
-#include <libcore/map.h>
 #include <libcore/string.h>
 
 #include "market.h"
 #include "book.h"
+#include "latency.h"
+#include "log.h"
+#include "timestamp.h"
 
-static Map *book_table = NULL;
+/* Maximum number of books (symbols) in the market. Must be a
+ * power of two, since the directory is an open-addressing
+ * table that is indexed by masking the symbol hash.
+ */
+#define MARKET_MAX_BOOKS    4096
+
+/* Symbol directory entry. A slot is empty until its book pointer
+ * is published, and once published it never changes until the
+ * market is closed. Readers can therefore probe the directory
+ * without taking any lock.
+ */
+typedef struct {
+    unsigned long hash;
+    Book *book;
+} BookSlot;
+
+/* Order IDs are handed out to routing threads in blocks, so the
+ * shared counter is only touched once per block. IDs are unique
+ * and increasing per thread; time priority within a book comes
+ * from the book's own sequence number, not from the order ID.
+ */
+#define MARKET_ORDER_ID_BLOCK   1024
+
+static BookSlot book_table[MARKET_MAX_BOOKS];
 static int is_open = 0;
+
+/* Every open book, in the order they were opened. Entries below
+ * book_count are published and never change until the market is
+ * closed, so stats can be gathered by walking the list without
+ * taking any lock.
+ */
+static Book *book_list[MARKET_MAX_BOOKS];
+static unsigned long book_count = 0;
+
+/* Counters at the last rate sample, per book and market-wide */
+static BookCounters book_samples[MARKET_MAX_BOOKS];
+static BookCounters market_sample;
+static unsigned long long sample_time = 0;
+
+/* Serialises rate sampling. Never taken by routing or matching. */
+static pthread_mutex_t sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long order_id_next_block = 0;
+static __thread unsigned long long order_id = 0;
+static __thread unsigned long long order_id_limit = 0;
+
+/* An order to cancel or replace, and the book it rests in */
+typedef struct {
+    Book *book;
+    unsigned long long id;
+} MarketCancel;
+
+/* The cancels gathered from an owner's list, for orders in symbol,
+ * or in every book if symbol is NULL
+ */
+typedef struct {
+    const String *symbol;
+
+    MarketCancel *cancels;
+    unsigned long count;
+    unsigned long size;
+} MarketCancelBatch;
+
+/* Serialises opening and closing the market, and creating new
+ * books. Routing orders to an existing book never takes it.
+ */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static unsigned long long order_id = 0;
+
+/* FNV-1a hash of the symbol characters */
+static unsigned long _market_symbol_hash(const String *symbol)
+{
+    const char *c;
+    unsigned long hash;
+
+    hash = 14695981039346656037UL;
+
+    for(c = string_get_chars(symbol); *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+}
+
+static unsigned long long _market_next_order_id(void)
+{
+    if(order_id == order_id_limit) {
+        order_id = __atomic_fetch_add(&order_id_next_block,
+                MARKET_ORDER_ID_BLOCK, __ATOMIC_RELAXED);
+        order_id_limit = order_id + MARKET_ORDER_ID_BLOCK;
+    }
+
+    return order_id++;
+}
+
+/* Lock-free lookup of the book for a symbol. Returns NULL if
+ * there is no book open for the symbol.
+ */
+static Book* _market_find_book(const String *symbol, unsigned long hash)
+{
+    unsigned long i, n;
+    Book *b;
+
+    for(i = hash & (MARKET_MAX_BOOKS - 1), n = 0;
+            n < MARKET_MAX_BOOKS;
+            i = (i + 1) & (MARKET_MAX_BOOKS - 1), n++) {
+        /* Pairs with the release store in _market_open_book */
+        b = __atomic_load_n(&book_table[i].book, __ATOMIC_ACQUIRE);
+        if(NULL == b) {
+            break;
+        }
+
+        if((book_table[i].hash == hash) &&
+                (string_compare(book_get_symbol(b), symbol) == 0)) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+/* Open a new book for a symbol and publish it in the directory.
+ * Only book creation is serialised; readers probing for other
+ * symbols carry on while the new book is being opened.
+ */
+static Book* _market_open_book(const String *symbol, unsigned long hash)
+{
+    unsigned long i, n;
+    Book *b;
+
+    pthread_mutex_lock(&mutex);
+
+    /* Another thread may have opened the book while we waited */
+    b = _market_find_book(symbol, hash);
+    if(NULL != b) {
+        pthread_mutex_unlock(&mutex);
+        return b;
+    }
+
+    for(i = hash & (MARKET_MAX_BOOKS - 1), n = 0;
+            n < MARKET_MAX_BOOKS;
+            i = (i + 1) & (MARKET_MAX_BOOKS - 1), n++) {
+        if(NULL == book_table[i].book) {
+            break;
+        }
+    }
+
+    if(n == MARKET_MAX_BOOKS) {
+        LOG_ERROR("(%s:%d) Too many books open",
+                __FUNCTION__, __LINE__);
+        pthread_mutex_unlock(&mutex);
+        return NULL;
+    }
+
+    b = book_open(symbol);
+    if(NULL != b) {
+        book_table[i].hash = hash;
+        __atomic_store_n(&book_table[i].book, b, __ATOMIC_RELEASE);
+
+        book_list[book_count] = b;
+        __atomic_store_n(&book_count, book_count + 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return b;
+}
 
 void market_open(void)
 {
-    printf("Market Open\n");
+    LOG_INFO("Market Open");
 
     pthread_mutex_lock(&mutex);
 
     if(!is_open) {
-        book_table = map_create((CompareFn)string_compare);
-        is_open = 1;
+        memset(book_table, 0, sizeof(book_table));
+        book_count = 0;
+
+        pthread_mutex_lock(&sample_mutex);
+        memset(book_samples, 0, sizeof(book_samples));
+        memset(&market_sample, 0, sizeof(market_sample));
+        sample_time = timestamp_now();
+        pthread_mutex_unlock(&sample_mutex);
+
+        __atomic_store_n(&is_open, 1, __ATOMIC_RELEASE);
     }
 
     pthread_mutex_unlock(&mutex);
 }
 
+/* Books are only freed here, so the caller must make sure that
+ * nothing is still routing orders into the market (i.e. the FIX
+ * sessions have been torn down) before closing it.
+ */
 void market_close(void)
 {
-    printf("Market Close\n");
+    unsigned long i;
+
+    LOG_INFO("Market Close");
 
     pthread_mutex_lock(&mutex);
 
     if(is_open) {
-        is_open = 0;
-        map_free_all(book_table, (FreeFn)book_close);
+        __atomic_store_n(&is_open, 0, __ATOMIC_RELEASE);
+
+        for(i = 0; i < MARKET_MAX_BOOKS; i++) {
+            if(NULL != book_table[i].book) {
+                book_close(book_table[i].book);
+                book_table[i].book = NULL;
+            }
+        }
+
+        __atomic_store_n(&book_count, 0, __ATOMIC_RELEASE);
     }
 
     pthread_mutex_unlock(&mutex);
 }
 
+/* The book for a symbol, opening one if there isn't one yet */
+Book* market_get_book(const String *symbol)
+{
+    unsigned long hash;
+    Book *b;
+
+    assert(symbol != NULL);
+
+    if(!market_is_open()) {
+        LOG_ERROR("Market not open");
+        return NULL;
+    }
+
+    hash = _market_symbol_hash(symbol);
+
+    b = _market_find_book(symbol, hash);
+    if(NULL == b) {
+        /* New ticker symbol, so lets open a new book */
+        b = _market_open_book(symbol, hash);
+    }
+
+    return b;
+}
+
+/* Copy up to max of the open books into books, in the order they
+ * were opened, and return how many were copied
+ */
+unsigned long market_get_books(Book **books, unsigned long max)
+{
+    unsigned long n;
+
+    assert(books != NULL);
+
+    n = __atomic_load_n(&book_count, __ATOMIC_ACQUIRE);
+    if(n > max) {
+        n = max;
+    }
+
+    memcpy(books, book_list, n * sizeof(Book *));
+
+    return n;
+}
+
+/* Make sure order IDs below next are never handed out again, for
+ * orders recovered from a previous run. Must be called before any
+ * orders are routed.
+ */
+void market_reserve_order_ids(unsigned long long next)
+{
+    unsigned long long block;
+
+    block = __atomic_load_n(&order_id_next_block, __ATOMIC_RELAXED);
+
+    while((block < next) &&
+            !__atomic_compare_exchange_n(&order_id_next_block, &block,
+                next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* block now holds the current value, so try again */
+    }
+}
+
 int market_process_order(Order *o)
 {
-    MapIterator *it;
     Book *b;
-    int ret;
 
     assert(o != NULL);
 
+    latency_stamp(order_get_latency(o), LATENCY_STAGE_MARKET_ENQUEUE);
+
+    b = market_get_book(order_get_symbol(o));
+    if(NULL == b) {
+        return -1;
+    }
+
+    /* Market-specifc order ID */
+    order_set_id(o, _market_next_order_id());
+
+    return book_process_order(b, o);
+}
+
+/* Route a batch of quotes to their books. Consecutive quotes in the
+ * same symbol go to their book as one batch. The quotes' orders are
+ * freed if there is no book to take them. Returns -1 if a symbol has
+ * no book, or a book rejects one of its quotes.
+ */
+int market_process_quotes(BookQuote *quotes, unsigned long count)
+{
+    unsigned long i, j, k;
+    const String *symbol;
+    Book *b;
+    int ret;
+
+    assert((quotes != NULL) || (0 == count));
+
     ret = 0;
 
-    pthread_mutex_lock(&mutex);
+    for(i = 0; i < count; i = j) {
+        symbol = order_get_symbol(quotes[i].order);
 
-    if(is_open) {
-        it = map_find(book_table, order_get_symbol(o));
-        if(NULL == it) {
-            /* New ticker symbol, so lets open a new book */
-            b = book_open(order_get_symbol(o));
-            map_insert(book_table, book_get_symbol(b), b);
-        } else {
-            b = map_get_value(it);
+        for(j = i + 1; (j < count) &&
+                (string_compare(order_get_symbol(quotes[j].order),
+                                symbol) == 0); j++) {
+            /* Find the end of the symbol's run */
         }
 
-        /* Market-specifc order ID */
-        order_set_id(o, order_id++);
-        ret = book_process_order(b, o);
-    } else {
-        fprintf(stderr, "ERROR: Market not open\n");
-    }
+        b = market_get_book(symbol);
+        if(NULL == b) {
+            for(k = i; k < j; k++) {
+                order_free(quotes[k].order);
+                quotes[k].order = NULL;
+            }
+            ret = -1;
+            continue;
+        }
 
-    pthread_mutex_unlock(&mutex);
+        for(k = i; k < j; k++) {
+            if(order_get_quantity(quotes[k].order) > 0) {
+                order_set_id(quotes[k].order, _market_next_order_id());
+            }
+        }
+
+        if(book_process_quotes(b, &quotes[i], j - i) < 0) {
+            ret = -1;
+        }
+    }
 
     return ret;
 }
 
 int market_is_open(void)
 {
-    int ret;
+    return __atomic_load_n(&is_open, __ATOMIC_ACQUIRE);
+}
 
-    pthread_mutex_lock(&mutex);
-    ret = is_open;
-    pthread_mutex_unlock(&mutex);
+/* Gather one order from an owner's list. Books are looked up
+ * without opening them, so an order that hasn't reached its book
+ * yet is left alone.
+ */
+static void _market_gather_cancel(const Order *o, void *data)
+{
+    MarketCancelBatch *batch = (MarketCancelBatch *)data;
+    MarketCancel *cancels;
+    const String *symbol;
+    Book *b;
 
-    return ret;
+    symbol = order_get_symbol(o);
+
+    if((NULL != batch->symbol) &&
+            (string_compare(symbol, batch->symbol) != 0)) {
+        return;
+    }
+
+    b = _market_find_book(symbol, _market_symbol_hash(symbol));
+    if(NULL == b) {
+        return;
+    }
+
+    if(batch->count == batch->size) {
+        cancels = realloc(batch->cancels,
+                (batch->size * 2 + 64) * sizeof(MarketCancel));
+        if(NULL == cancels) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            return;
+        }
+        batch->cancels = cancels;
+        batch->size = batch->size * 2 + 64;
+    }
+
+    batch->cancels[batch->count].book = b;
+    batch->cancels[batch->count].id = order_get_id(o);
+    batch->count++;
 }
 
-unsigned long long market_get_total_volume(void)
+static int _market_cancel_compare(const void *a, const void *b)
 {
-    unsigned long long volume;
-    MapIterator *it;
+    const MarketCancel *x = (const MarketCancel *)a;
+    const MarketCancel *y = (const MarketCancel *)b;
 
-    volume = 0;
+    if(x->book != y->book) {
+        return (x->book < y->book) ? -1 : 1;
+    }
 
-    pthread_mutex_lock(&mutex);
-    if(is_open) {
-        for(it = map_begin(book_table); it != NULL; it = map_next(it)) {
-            volume += book_get_volume((const Book *)map_get_value(it));
+    return (x->id < y->id) ? -1 : (x->id > y->id);
+}
+
+/* Cancel the orders in an owner's list that are resting in the
+ * books, only those in one symbol's book unless symbol is NULL.
+ * Each book gets its share as one batch. Returns how many orders
+ * were cancelled.
+ */
+unsigned long market_cancel_orders(OrderList *list, const String *symbol)
+{
+    MarketCancelBatch batch;
+    unsigned long long *ids;
+    unsigned long i, j, cancelled;
+
+    assert(list != NULL);
+
+    if(!market_is_open()) {
+        return 0;
+    }
+
+    batch.symbol = symbol;
+    batch.cancels = NULL;
+    batch.count = 0;
+    batch.size = 0;
+
+    order_list_foreach(list, _market_gather_cancel, &batch);
+
+    if(0 == batch.count) {
+        free(batch.cancels);
+        return 0;
+    }
+
+    qsort(batch.cancels, batch.count, sizeof(MarketCancel),
+            _market_cancel_compare);
+
+    cancelled = 0;
+
+    ids = malloc(batch.count * sizeof(unsigned long long));
+    if(NULL == ids) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        free(batch.cancels);
+        return 0;
+    }
+
+    for(i = 0; i < batch.count; i = j) {
+        for(j = i; (j < batch.count) &&
+                (batch.cancels[j].book == batch.cancels[i].book); j++) {
+            ids[j - i] = batch.cancels[j].id;
         }
+
+        cancelled += book_cancel_orders(batch.cancels[i].book, ids, j - i);
     }
-    pthread_mutex_unlock(&mutex);
 
-    return volume;
+    free(ids);
+    free(batch.cancels);
+
+    return cancelled;
 }
 
-unsigned long long market_get_total_orders_filled(void)
+/* Note where an order being replaced rests */
+static void _market_find_replaced(const Order *o, void *data)
 {
-    unsigned long long orders;
-    MapIterator *it;
+    MarketCancel *replaced = (MarketCancel *)data;
+    const String *symbol;
 
-    orders = 0;
+    symbol = order_get_symbol(o);
 
-    pthread_mutex_lock(&mutex);
-    if(is_open) {
-        for(it = map_begin(book_table); it != NULL; it = map_next(it)) {
-            orders += book_get_orders_filled((const Book *)map_get_value(it));
+    replaced->book = _market_find_book(symbol, _market_symbol_hash(symbol));
+    replaced->id = order_get_id(o);
+}
+
+/* Replace the live order in list with the ClOrdID orig_cl_ord_id by
+ * o, in the same book. Returns -1 if there is no such order, and o
+ * still belongs to the caller.
+ */
+int market_replace_order(OrderList *list, const String *orig_cl_ord_id,
+        Order *o)
+{
+    MarketCancel replaced;
+    const String *symbol;
+
+    assert(list != NULL);
+    assert(orig_cl_ord_id != NULL);
+    assert(o != NULL);
+
+    latency_stamp(order_get_latency(o), LATENCY_STAGE_MARKET_ENQUEUE);
+
+    replaced.book = NULL;
+
+    if(order_list_find(list, orig_cl_ord_id, _market_find_replaced,
+                &replaced) < 0) {
+        return -1;
+    }
+
+    symbol = order_get_symbol(o);
+
+    if((NULL == replaced.book) ||
+            (replaced.book != _market_find_book(symbol,
+                                                _market_symbol_hash(symbol)))) {
+        return -1;
+    }
+
+    order_set_id(o, _market_next_order_id());
+
+    return book_replace_order(replaced.book, replaced.id, o);
+}
+
+/* Start an auction call period in every open book */
+void market_auction_start(BOOK_AUCTION auction)
+{
+    unsigned long i, n;
+
+    n = __atomic_load_n(&book_count, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < n; i++) {
+        book_auction_start(book_list[i], auction);
+    }
+}
+
+/* Uncross the auction in every open book */
+void market_auction_uncross(void)
+{
+    unsigned long i, n;
+
+    n = __atomic_load_n(&book_count, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < n; i++) {
+        book_auction_uncross(book_list[i]);
+    }
+}
+
+/* Sum the counters of every open book */
+void market_get_counters(BookCounters *counters)
+{
+    BookCounters c;
+    unsigned long i, n;
+
+    assert(counters != NULL);
+
+    memset(counters, 0, sizeof(BookCounters));
+
+    n = __atomic_load_n(&book_count, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < n; i++) {
+        book_get_counters(book_list[i], &c);
+
+        counters->orders += c.orders;
+        counters->orders_filled += c.orders_filled;
+        counters->volume += c.volume;
+    }
+}
+
+static void _market_rates(MarketRates *rates, const String *symbol,
+        const BookCounters *now, const BookCounters *then, double seconds)
+{
+    rates->symbol = symbol;
+    rates->counters = *now;
+    memset(&rates->top, 0, sizeof(rates->top));
+
+    rates->orders_per_second = (now->orders - then->orders) / seconds;
+    rates->fills_per_second = (now->orders_filled - then->orders_filled) /
+        seconds;
+    rates->volume_per_second = (now->volume - then->volume) / seconds;
+}
+
+/* Sample every book's counters and work out the rates since the
+ * previous sample, or since the market opened for the first one.
+ * Fills in market-wide rates, and per-book rates and top of book
+ * for up to max_books books. Returns the number of open books.
+ */
+unsigned long market_sample_rates(MarketRates *market, MarketRates *books,
+        unsigned long max_books)
+{
+    BookCounters c, total;
+    unsigned long long now;
+    unsigned long i, n;
+    double seconds;
+
+    assert(market != NULL);
+    assert((books != NULL) || (0 == max_books));
+
+    pthread_mutex_lock(&sample_mutex);
+
+    now = timestamp_now();
+    seconds = (now > sample_time) ? (now - sample_time) / 1e9 : 1e-9;
+
+    memset(&total, 0, sizeof(total));
+
+    n = __atomic_load_n(&book_count, __ATOMIC_ACQUIRE);
+
+    for(i = 0; i < n; i++) {
+        book_get_counters(book_list[i], &c);
+
+        total.orders += c.orders;
+        total.orders_filled += c.orders_filled;
+        total.volume += c.volume;
+
+        if(i < max_books) {
+            _market_rates(&books[i], book_get_symbol(book_list[i]),
+                    &c, &book_samples[i], seconds);
+            book_get_top(book_list[i], &books[i].top);
         }
+
+        book_samples[i] = c;
     }
-    pthread_mutex_unlock(&mutex);
 
-    return orders;
+    _market_rates(market, NULL, &total, &market_sample, seconds);
+
+    market_sample = total;
+    sample_time = now;
+
+    pthread_mutex_unlock(&sample_mutex);
+
+    return n;
+}
+
+unsigned long long market_get_total_volume(void)
+{
+    BookCounters counters;
+
+    market_get_counters(&counters);
+
+    return counters.volume;
+}
+
+unsigned long long market_get_total_orders_filled(void)
+{
+    BookCounters counters;
+
+    market_get_counters(&counters);
+
+    return counters.orders_filled;
 }
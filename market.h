@@ -29,14 +29,47 @@
 #define __MARKET_H__
 
 #include "order.h"
+#include "book.h"
+
+/* Counters, per-second rates since the previous sample and top of
+ * book for one book, or for the whole market with a NULL symbol
+ * and an empty top of book
+ */
+typedef struct {
+    const String *symbol;
+    BookCounters counters;
+    BookTop top;
+
+    double orders_per_second;
+    double fills_per_second;
+    double volume_per_second;
+} MarketRates;
 
 void market_open            (void);
 void market_close           (void);
 
 int market_process_order    (Order *o);
+int market_process_quotes   (BookQuote *quotes, unsigned long count);
+
+unsigned long   market_cancel_orders    (OrderList *list,
+                                         const String *symbol);
+int             market_replace_order    (OrderList *list,
+                                         const String *orig_cl_ord_id,
+                                         Order *o);
+
+Book*           market_get_book     (const String *symbol);
+unsigned long   market_get_books    (Book **books, unsigned long max);
+void            market_reserve_order_ids    (unsigned long long next);
 
 int market_is_open          (void);
 
+void market_auction_start   (BOOK_AUCTION auction);
+void market_auction_uncross (void);
+
+void            market_get_counters (BookCounters *counters);
+unsigned long   market_sample_rates (MarketRates *market, MarketRates *books,
+                                     unsigned long max_books);
+
 unsigned long long market_get_total_volume          (void);
 unsigned long long market_get_total_orders_filled   (void);
 
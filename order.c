@@ -26,28 +26,78 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stddef.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 
+#include <libcore/map.h>
 #include <libcore/string.h>
 
+#include "log.h"
 #include "order.h"
+#include "timestamp.h"
 
 #define MAX_SYMBOL_LEN  4
 
+/* Owner lists are guarded by a fixed set of locks, picked by the
+ * list's address. The locks are never freed, so an order being
+ * freed in one thread can safely lock its list while the list is
+ * being freed in another, and then find that it has been detached.
+ */
+#define ORDER_LIST_LOCKS    64
+
+struct _order_list {
+    Order *head;
+    unsigned long count;
+
+    /* Live orders by ClOrdID, for the orders that have one */
+    Map *cl_ord_ids;
+};
+
+static pthread_mutex_t order_list_locks[ORDER_LIST_LOCKS] = {
+    [0 ... ORDER_LIST_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
 struct _order {
-    unsigned long timestamp;
+    unsigned long long timestamp;
     unsigned long long id;
+    unsigned long long sequence;
 
     String *symbol;
+    String *cl_ord_id;
     float price;
+    float stop_price;
+
+    /* Added to the price a pegged order is pegged to */
+    float peg_offset;
     unsigned long quantity;
 
+    /* Iceberg orders display at most display_quantity at a time,
+     * and the hidden quantity is the part of the order's quantity
+     * held in reserve.
+     */
+    unsigned long display_quantity;
+    unsigned long hidden_quantity;
+
     ORDER_TYPE type;
     ORDER_SIDE side;
+    ORDER_TIME_IN_FORCE time_in_force;
+
+    /* When the order leaves the book, in nanoseconds since the
+     * Epoch, or 0 if it never expires
+     */
+    unsigned long long expire_time;
+
+    /* The owner's list, and the order's links in it. Only changed
+     * with the list's lock held.
+     */
+    OrderList *owner;
+    Order *owner_prev;
+    Order *owner_next;
+
+    /* Stage timestamps for latency measurement */
+    LatencyTrace latency;
 };
 
 
@@ -59,50 +109,114 @@ Order* order_create(ORDER_TYPE type,
         float price,
         unsigned long quantity)
 {
-    struct timeval tv;
     Order *new_order;
 
     assert(symbol != NULL);
 
     new_order = malloc(sizeof(struct _order));
     if(NULL == new_order) {
-        fprintf(stderr, "Out of memory (%s:%d)\n", __FUNCTION__, __LINE__);
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
         return NULL;
     }
 
-    /* Order ID is assigned on Market entry */
+    /* Order ID is assigned on Market entry, and the sequence
+     * number on Book entry
+     */
+    new_order->id           = 0;
+    new_order->sequence     = 0;
 
-    /* Current time, in milliseconds
-     *
-     * FIXME Probably want to use a more reliable mechanism than
-     * gettimeofday. Also, need to understand securities exchange
-     * business requirements in more detail to see how order time
-     * plays a role
+    /* Current time, in nanoseconds. This is informational only;
+     * time priority within a book comes from the sequence number.
      */
-    gettimeofday(&tv, NULL);
-    new_order->timestamp    = (tv.tv_sec * 1000) + (tv.tv_usec / 1000) ;
+    new_order->timestamp    = timestamp_now();
 
     new_order->symbol       = symbol;
+    new_order->cl_ord_id    = NULL;
     new_order->price        = price;
+    new_order->stop_price   = 0.0f;
+    new_order->peg_offset   = 0.0f;
     new_order->quantity     = quantity;
+    new_order->display_quantity = 0;
+    new_order->hidden_quantity  = 0;
     new_order->type         = type;
     new_order->side         = side;
+    new_order->time_in_force = ORDER_TIME_IN_FORCE_DAY;
+    new_order->expire_time  = 0;
+
+    new_order->owner        = NULL;
+    new_order->owner_prev   = NULL;
+    new_order->owner_next   = NULL;
+
+    memset(&new_order->latency, 0, sizeof(new_order->latency));
 
     return new_order;
 }
 
+static pthread_mutex_t* _order_list_lock(const OrderList *list)
+{
+    return &order_list_locks[((unsigned long)list >> 4) % ORDER_LIST_LOCKS];
+}
+
+/* Called with the list's lock held */
+static void _order_list_unlink(Order *o)
+{
+    OrderList *list = o->owner;
+    MapIterator *it;
+
+    /* A reused ClOrdID still belongs to the order that had it first */
+    if(NULL != o->cl_ord_id) {
+        it = map_find(list->cl_ord_ids, o->cl_ord_id);
+        if((NULL != it) && (map_get_value(it) == o)) {
+            map_remove(list->cl_ord_ids, o->cl_ord_id);
+        }
+    }
+
+    if(NULL == o->owner_prev) {
+        list->head = o->owner_next;
+    } else {
+        o->owner_prev->owner_next = o->owner_next;
+    }
+
+    if(NULL != o->owner_next) {
+        o->owner_next->owner_prev = o->owner_prev;
+    }
+
+    list->count--;
+
+    o->owner_prev = NULL;
+    o->owner_next = NULL;
+    __atomic_store_n(&o->owner, NULL, __ATOMIC_RELAXED);
+}
+
 void order_free(Order *o)
 {
+    pthread_mutex_t *lock;
+    OrderList *list;
+
     assert(o != NULL);
 
+    list = __atomic_load_n(&o->owner, __ATOMIC_RELAXED);
+    if(NULL != list) {
+        lock = _order_list_lock(list);
+
+        pthread_mutex_lock(lock);
+        if(o->owner == list) {
+            _order_list_unlink(o);
+        }
+        pthread_mutex_unlock(lock);
+    }
+
     string_free(o->symbol);
+    if(NULL != o->cl_ord_id) {
+        string_free(o->cl_ord_id);
+    }
     free(o);
 }
 
 
 /* Accessors */
 
-unsigned long order_get_timestamp(const Order *o)
+unsigned long long order_get_timestamp(const Order *o)
 {
     assert(o != NULL);
 
@@ -116,6 +230,13 @@ unsigned long long order_get_id(const Order *o)
     return o->id;
 }
 
+unsigned long long order_get_sequence(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->sequence;
+}
+
 const String* order_get_symbol(const Order *o)
 {
     assert(o != NULL);
@@ -123,6 +244,13 @@ const String* order_get_symbol(const Order *o)
     return o->symbol;
 }
 
+const String* order_get_cl_ord_id(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->cl_ord_id;
+}
+
 float order_get_price(const Order *o)
 {
     assert(o != NULL);
@@ -130,6 +258,20 @@ float order_get_price(const Order *o)
     return o->price;
 }
 
+float order_get_stop_price(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->stop_price;
+}
+
+float order_get_peg_offset(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->peg_offset;
+}
+
 unsigned long order_get_quantity(const Order *o)
 {
     assert(o != NULL);
@@ -137,6 +279,20 @@ unsigned long order_get_quantity(const Order *o)
     return o->quantity;
 }
 
+unsigned long order_get_display_quantity(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->display_quantity;
+}
+
+unsigned long order_get_hidden_quantity(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->hidden_quantity;
+}
+
 ORDER_TYPE order_get_type(const Order *o)
 {
     assert(o != NULL);
@@ -151,6 +307,27 @@ ORDER_SIDE order_get_side(const Order *o)
     return o->side;
 }
 
+ORDER_TIME_IN_FORCE order_get_time_in_force(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->time_in_force;
+}
+
+unsigned long long order_get_expire_time(const Order *o)
+{
+    assert(o != NULL);
+
+    return o->expire_time;
+}
+
+LatencyTrace* order_get_latency(Order *o)
+{
+    assert(o != NULL);
+
+    return &o->latency;
+}
+
 
 /* Mutators */
 
@@ -163,6 +340,15 @@ int order_set_id(Order *o, unsigned long long id)
     return 0;
 }
 
+int order_set_sequence(Order *o, unsigned long long sequence)
+{
+    assert(o != NULL);
+
+    o->sequence = sequence;
+
+    return 0;
+}
+
 int order_set_price(Order *o, float price)
 {
     assert(o != NULL);
@@ -172,6 +358,24 @@ int order_set_price(Order *o, float price)
     return 0;
 }
 
+int order_set_stop_price(Order *o, float stop_price)
+{
+    assert(o != NULL);
+
+    o->stop_price = stop_price;
+
+    return 0;
+}
+
+int order_set_peg_offset(Order *o, float peg_offset)
+{
+    assert(o != NULL);
+
+    o->peg_offset = peg_offset;
+
+    return 0;
+}
+
 int order_set_quantity(Order *o, unsigned long quantity)
 {
     assert(o != NULL);
@@ -181,6 +385,24 @@ int order_set_quantity(Order *o, unsigned long quantity)
     return 0;
 }
 
+int order_set_display_quantity(Order *o, unsigned long quantity)
+{
+    assert(o != NULL);
+
+    o->display_quantity = quantity;
+
+    return 0;
+}
+
+int order_set_hidden_quantity(Order *o, unsigned long quantity)
+{
+    assert(o != NULL);
+
+    o->hidden_quantity = quantity;
+
+    return 0;
+}
+
 int order_set_type(Order *o, ORDER_TYPE type)
 {
     assert(o != NULL);
@@ -199,6 +421,182 @@ int order_set_side(Order *o, ORDER_SIDE side)
     return 0;
 }
 
+int order_set_time_in_force(Order *o, ORDER_TIME_IN_FORCE time_in_force)
+{
+    assert(o != NULL);
+
+    o->time_in_force = time_in_force;
+
+    return 0;
+}
+
+int order_set_expire_time(Order *o, unsigned long long expire_time)
+{
+    assert(o != NULL);
+
+    o->expire_time = expire_time;
+
+    return 0;
+}
+
+/* The order takes ownership of the ClOrdID. It must be set before
+ * the order is added to a list, which indexes it.
+ */
+int order_set_cl_ord_id(Order *o, String *cl_ord_id)
+{
+    assert(o != NULL);
+    assert(NULL == o->owner);
+
+    if(NULL != o->cl_ord_id) {
+        string_free(o->cl_ord_id);
+    }
+    o->cl_ord_id = cl_ord_id;
+
+    return 0;
+}
+
+unsigned long long order_day_end(unsigned long long time)
+{
+    const unsigned long long day = 24ULL * 60 * 60 * 1000000000ULL;
+    unsigned long long end;
+
+    end = (time - (time % day)) + (ORDER_DAY_END_S * 1000000000ULL);
+    if(end <= time) {
+        end += day;
+    }
+
+    return end;
+}
+
+
+/* Owner lists */
+
+OrderList* order_list_create(void)
+{
+    OrderList *list;
+
+    list = malloc(sizeof(OrderList));
+    if(NULL == list) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    list->head = NULL;
+    list->count = 0;
+
+    list->cl_ord_ids = map_create((CompareFn)string_compare);
+    if(NULL == list->cl_ord_ids) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        free(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+/* Orders still in the list carry on without an owner */
+void order_list_free(OrderList *list)
+{
+    pthread_mutex_t *lock;
+
+    assert(list != NULL);
+
+    lock = _order_list_lock(list);
+
+    pthread_mutex_lock(lock);
+    while(NULL != list->head) {
+        _order_list_unlink(list->head);
+    }
+    pthread_mutex_unlock(lock);
+
+    map_free(list->cl_ord_ids);
+    free(list);
+}
+
+/* Must be called before the order is handed to the market */
+void order_list_add(OrderList *list, Order *o)
+{
+    pthread_mutex_t *lock;
+
+    assert(list != NULL);
+    assert(o != NULL);
+    assert(NULL == o->owner);
+
+    lock = _order_list_lock(list);
+
+    pthread_mutex_lock(lock);
+
+    o->owner_prev = NULL;
+    o->owner_next = list->head;
+    if(NULL != list->head) {
+        list->head->owner_prev = o;
+    }
+    list->head = o;
+    list->count++;
+
+    if((NULL != o->cl_ord_id) &&
+            (NULL == map_find(list->cl_ord_ids, o->cl_ord_id))) {
+        map_insert(list->cl_ord_ids, o->cl_ord_id, o);
+    }
+
+    __atomic_store_n(&o->owner, list, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(lock);
+}
+
+unsigned long order_list_get_count(OrderList *list)
+{
+    unsigned long count;
+
+    assert(list != NULL);
+
+    pthread_mutex_lock(_order_list_lock(list));
+    count = list->count;
+    pthread_mutex_unlock(_order_list_lock(list));
+
+    return count;
+}
+
+/* Call fn for the live order in the list with this ClOrdID. Returns
+ * -1 if there isn't one.
+ */
+int order_list_find(OrderList *list, const String *cl_ord_id, OrderFn fn,
+        void *data)
+{
+    MapIterator *it;
+
+    assert(list != NULL);
+    assert(cl_ord_id != NULL);
+    assert(fn != NULL);
+
+    pthread_mutex_lock(_order_list_lock(list));
+
+    it = map_find(list->cl_ord_ids, cl_ord_id);
+    if(NULL != it) {
+        fn((const Order *)map_get_value(it), data);
+    }
+
+    pthread_mutex_unlock(_order_list_lock(list));
+
+    return (NULL != it) ? 0 : -1;
+}
+
+void order_list_foreach(OrderList *list, OrderFn fn, void *data)
+{
+    const Order *o;
+
+    assert(list != NULL);
+    assert(fn != NULL);
+
+    pthread_mutex_lock(_order_list_lock(list));
+
+    for(o = list->head; NULL != o; o = o->owner_next) {
+        fn(o, data);
+    }
+
+    pthread_mutex_unlock(_order_list_lock(list));
+}
+
 
 /* Converters */
 
@@ -207,10 +605,48 @@ ORDER_TYPE order_convert_from_fix_ordtype(FIX_ORDER_TYPE ordtype)
     ORDER_TYPE ret;
 
     switch(ordtype) {
-        /* TODO Only Limit orders are supported for now */
+        case FIX_ORDER_TYPE_MARKET:
+            ret = ORDER_TYPE_MARKET;
+            break;
         case FIX_ORDER_TYPE_LIMIT:
             ret = ORDER_TYPE_LIMIT;
             break;
+        case FIX_ORDER_TYPE_STOP:
+            ret = ORDER_TYPE_STOP;
+            break;
+        case FIX_ORDER_TYPE_STOP_LIMIT:
+            ret = ORDER_TYPE_STOP_LIMIT;
+            break;
+        case FIX_ORDER_TYPE_MARKET_ON_CLOSE:
+        case FIX_ORDER_TYPE_ON_CLOSE:
+            ret = ORDER_TYPE_MARKET_ON_CLOSE;
+            break;
+        case FIX_ORDER_TYPE_LIMIT_ON_CLOSE:
+            ret = ORDER_TYPE_LIMIT_ON_CLOSE;
+            break;
+        default:
+            ret = ORDER_TYPE_INVALID;
+            break;
+    }
+
+    return ret;
+}
+
+/* The kind of peg a pegged order asks for */
+ORDER_TYPE order_convert_from_fix_exec_inst(FIX_EXEC_INST exec_inst)
+{
+    ORDER_TYPE ret;
+
+    switch(exec_inst) {
+        case FIX_EXEC_INST_PRIMARY_PEG:
+            ret = ORDER_TYPE_PEG_PRIMARY;
+            break;
+        case FIX_EXEC_INST_MARKET_PEG:
+            ret = ORDER_TYPE_PEG_MARKET;
+            break;
+        case FIX_EXEC_INST_MID_PRICE_PEG:
+            ret = ORDER_TYPE_PEG_MIDPOINT;
+            break;
         default:
             ret = ORDER_TYPE_INVALID;
             break;
@@ -237,3 +673,36 @@ ORDER_SIDE order_convert_from_fix_side(FIX_ORDER_SIDE side)
 
     return ret;
 }
+
+ORDER_TIME_IN_FORCE order_convert_from_fix_time_in_force(
+        FIX_TIME_IN_FORCE time_in_force)
+{
+    ORDER_TIME_IN_FORCE ret;
+
+    /* OPG and GTX aren't supported, and are rejected as invalid */
+    switch(time_in_force) {
+        case FIX_TIME_IN_FORCE_DAY:
+            ret = ORDER_TIME_IN_FORCE_DAY;
+            break;
+        case FIX_TIME_IN_FORCE_GTC:
+            ret = ORDER_TIME_IN_FORCE_GTC;
+            break;
+        case FIX_TIME_IN_FORCE_IOC:
+            ret = ORDER_TIME_IN_FORCE_IOC;
+            break;
+        case FIX_TIME_IN_FORCE_FOK:
+            ret = ORDER_TIME_IN_FORCE_FOK;
+            break;
+        case FIX_TIME_IN_FORCE_GTD:
+            /* FIX has no GTT. A GTD order with an ExpireTime rather
+             * than an ExpireDate is GTT, which the parser sorts out.
+             */
+            ret = ORDER_TIME_IN_FORCE_GTD;
+            break;
+        default:
+            ret = ORDER_TIME_IN_FORCE_INVALID;
+            break;
+    }
+
+    return ret;
+}
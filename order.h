@@ -29,6 +29,7 @@
 #define __ORDER_H__
 
 #include "fix_message.h"
+#include "latency.h"
 
 /* Opaque forward declaration */
 typedef struct _order Order;
@@ -38,11 +39,44 @@ typedef enum {
     ORDER_TYPE_LIMIT,
     ORDER_TYPE_CANCEL,
     ORDER_TYPE_REPLACE,
+    ORDER_TYPE_STOP,
+    ORDER_TYPE_STOP_LIMIT,
+    ORDER_TYPE_MARKET_ON_CLOSE,
+    ORDER_TYPE_LIMIT_ON_CLOSE,
+
+    /* Pegged to the best price on the order's own side, to the best
+     * price on the other side, or to the midpoint between them, plus
+     * the order's peg offset
+     */
+    ORDER_TYPE_PEG_PRIMARY,
+    ORDER_TYPE_PEG_MARKET,
+    ORDER_TYPE_PEG_MIDPOINT,
 
     /* Add new order types before this point */
     ORDER_TYPE_INVALID
 } ORDER_TYPE;
 
+typedef enum {
+    ORDER_TIME_IN_FORCE_DAY,
+    ORDER_TIME_IN_FORCE_GTC,
+    ORDER_TIME_IN_FORCE_IOC,
+    ORDER_TIME_IN_FORCE_FOK,
+
+    /* Good till the end of a given date, and good till a given time.
+     * Both rest until the order's expire time.
+     */
+    ORDER_TIME_IN_FORCE_GTD,
+    ORDER_TIME_IN_FORCE_GTT,
+
+    ORDER_TIME_IN_FORCE_INVALID
+} ORDER_TIME_IN_FORCE;
+
+/* The trading day ends this many seconds after the midnight UTC that
+ * starts it. Day orders expire at the end of the day they are entered,
+ * and GTD orders at the end of their expiry date.
+ */
+#define ORDER_DAY_END_S     (24 * 60 * 60)
+
 typedef enum {
     ORDER_SIDE_NONE,
 
@@ -52,6 +86,18 @@ typedef enum {
     ORDER_SIDE_INVALID
 } ORDER_SIDE;
 
+/* Orders owned by one client, whatever books they are in. An order
+ * is linked into its owner's list through the order itself, and
+ * leaves it when it is freed. Orders with a ClOrdID can be found by
+ * it while they are live.
+ */
+typedef struct _order_list OrderList;
+
+/* Called for each order in a list, with the list locked. It must
+ * not free the order, or add to or remove from the list.
+ */
+typedef void (*OrderFn)(const Order *o, void *data);
+
 /* Constructor and Destructor */
 Order*  order_create    (ORDER_TYPE type,
                          ORDER_SIDE side,
@@ -62,23 +108,57 @@ Order*  order_create    (ORDER_TYPE type,
 void    order_free      (Order *o);
 
 /* Accessors */
-unsigned long       order_get_timestamp (const Order *o);
+unsigned long long  order_get_timestamp (const Order *o);
 unsigned long long  order_get_id        (const Order *o);
+unsigned long long  order_get_sequence  (const Order *o);
 const String*       order_get_symbol    (const Order *o);
+const String*       order_get_cl_ord_id (const Order *o);
 float               order_get_price     (const Order *o);
+float               order_get_stop_price(const Order *o);
+float               order_get_peg_offset(const Order *o);
 unsigned long       order_get_quantity  (const Order *o);
+unsigned long       order_get_display_quantity  (const Order *o);
+unsigned long       order_get_hidden_quantity   (const Order *o);
 ORDER_TYPE          order_get_type      (const Order *o);
 ORDER_SIDE          order_get_side      (const Order *o);
+ORDER_TIME_IN_FORCE order_get_time_in_force (const Order *o);
+unsigned long long  order_get_expire_time   (const Order *o);
+LatencyTrace*       order_get_latency   (Order *o);
 
 /* Mutators */
 int order_set_id        (Order *o, unsigned long long id);
+int order_set_sequence  (Order *o, unsigned long long sequence);
 int order_set_price     (Order *o, float price);
+int order_set_stop_price(Order *o, float stop_price);
+int order_set_peg_offset(Order *o, float peg_offset);
 int order_set_quantity  (Order *o, unsigned long quantity);
+int order_set_display_quantity  (Order *o, unsigned long quantity);
+int order_set_hidden_quantity   (Order *o, unsigned long quantity);
 int order_set_type      (Order *o, ORDER_TYPE type);
 int order_set_side      (Order *o, ORDER_SIDE side);
+int order_set_time_in_force (Order *o, ORDER_TIME_IN_FORCE time_in_force);
+int order_set_expire_time   (Order *o, unsigned long long expire_time);
+int order_set_cl_ord_id     (Order *o, String *cl_ord_id);
+
+/* End of the trading day that a time, in nanoseconds since the Epoch,
+ * falls in
+ */
+unsigned long long  order_day_end   (unsigned long long time);
+
+/* Owner lists */
+OrderList*      order_list_create   (void);
+void            order_list_free     (OrderList *list);
+void            order_list_add      (OrderList *list, Order *o);
+unsigned long   order_list_get_count(OrderList *list);
+void            order_list_foreach  (OrderList *list, OrderFn fn, void *data);
+int             order_list_find     (OrderList *list, const String *cl_ord_id,
+                                     OrderFn fn, void *data);
 
 /* Converters */
 ORDER_TYPE  order_convert_from_fix_ordtype  (FIX_ORDER_TYPE ordtype);
+ORDER_TYPE  order_convert_from_fix_exec_inst(FIX_EXEC_INST exec_inst);
 ORDER_SIDE  order_convert_from_fix_side     (FIX_ORDER_SIDE side);
+ORDER_TIME_IN_FORCE order_convert_from_fix_time_in_force
+                                            (FIX_TIME_IN_FORCE time_in_force);
 
 #endif
@@ -0,0 +1,684 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libcore/string.h>
+
+#include "journal.h"
+#include "log.h"
+#include "market.h"
+#include "snapshot.h"
+#include "timestamp.h"
+#include "trace.h"
+
+/* Same as the market's limit on open books */
+#define SNAPSHOT_MAX_BOOKS      4096
+
+/* Room for the directory and a snapshot file name */
+#define SNAPSHOT_PATH_LEN       (PATH_MAX + 64)
+
+/* Books found by one recovery worker, keyed by the whole symbol as
+ * it is stored in journal records and snapshots. Open addressing,
+ * sized so that it can never fill up.
+ */
+#define SNAPSHOT_TABLE_SIZE     (SNAPSHOT_MAX_BOOKS * 2)
+
+typedef struct {
+    /* Zero padded, and not terminated if it fills the field */
+    char symbol[BOOK_SYMBOL_LEN];
+    Book *book;
+
+    /* Journal records up to here are already in the book */
+    unsigned long long applied;
+} SnapshotTableEntry;
+
+typedef struct {
+    unsigned int index;
+    unsigned int count;
+    const char *dir;
+
+    /* The snapshot file, mapped, or NULL if there isn't one */
+    const char *map;
+    size_t size;
+    unsigned long long sequence;
+
+    SnapshotTableEntry *table;
+
+    unsigned long books;
+    unsigned long long orders;
+    unsigned long long records;
+    unsigned long long next_id;
+} SnapshotWorker;
+
+static char snapshot_dir[PATH_MAX];
+
+static pthread_t snapshot_thread;
+static int running = 0;
+
+static unsigned int interval_s = SNAPSHOT_INTERVAL_S;
+
+/* Journal sequence of the last snapshot written */
+static unsigned long long last_sequence = 0;
+static int written = 0;
+
+static void _snapshot_path(const char *dir, unsigned long long sequence,
+        const char *suffix, char *path, size_t size)
+{
+    snprintf(path, size, "%s/snapshot-%016llu.%s", dir, sequence, suffix);
+}
+
+static int _snapshot_compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Find the snapshots in dir, oldest first. Returns how many, or -1
+ * if they couldn't be listed. The caller frees *sequences.
+ */
+static long _snapshot_list(const char *dir, unsigned long long **sequences)
+{
+    unsigned long long sequence, *s;
+    struct dirent *entry;
+    unsigned long count, size;
+    char suffix[8];
+    DIR *d;
+
+    *sequences = NULL;
+
+    d = opendir(dir);
+    if(NULL == d) {
+        return (ENOENT == errno) ? 0 : -1;
+    }
+
+    count = size = 0;
+
+    while(NULL != (entry = readdir(d))) {
+        if((2 != sscanf(entry->d_name, "snapshot-%llu.%3s", &sequence,
+                        suffix)) || (strcmp(suffix, "bin") != 0)) {
+            continue;
+        }
+
+        if(count == size) {
+            size = (0 == size) ? 16 : (size * 2);
+            s = realloc(*sequences, size * sizeof(unsigned long long));
+            if(NULL == s) {
+                LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+                free(*sequences);
+                *sequences = NULL;
+                closedir(d);
+                return -1;
+            }
+            *sequences = s;
+        }
+
+        (*sequences)[count++] = sequence;
+    }
+
+    closedir(d);
+
+    qsort(*sequences, count, sizeof(unsigned long long), _snapshot_compare);
+
+    return (long)count;
+}
+
+/* Remove all but the newest SNAPSHOT_KEEP snapshots */
+static void _snapshot_prune(const char *dir)
+{
+    char path[SNAPSHOT_PATH_LEN];
+    unsigned long long *sequences;
+    long count, i;
+
+    count = _snapshot_list(dir, &sequences);
+
+    for(i = 0; i < count - SNAPSHOT_KEEP; i++) {
+        _snapshot_path(dir, sequences[i], "bin", path, sizeof(path));
+        unlink(path);
+    }
+
+    free(sequences);
+}
+
+/* Write a snapshot of every open book to dir. Each book is only
+ * locked while its orders are copied, one book at a time, and the
+ * copies are written out with no locks held. Nothing is written if
+ * nothing has been journalled since the last snapshot.
+ */
+int snapshot_write(const char *dir)
+{
+    char path[SNAPSHOT_PATH_LEN], tmp[SNAPSHOT_PATH_LEN];
+    unsigned long long orders, start;
+    static Book *books[SNAPSHOT_MAX_BOOKS];
+    BookSavedOrder *saved;
+    SnapshotHeader header;
+    SnapshotBook sb;
+    unsigned long i, n;
+    FILE *f;
+    int rc;
+
+    assert(dir != NULL);
+
+    start = timestamp_now();
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.sequence = journal_get_sequence();
+    header.time = start;
+
+    if(written && (header.sequence == last_sequence)) {
+        return 0;
+    }
+
+    _snapshot_path(dir, header.sequence, "tmp", tmp, sizeof(tmp));
+    _snapshot_path(dir, header.sequence, "bin", path, sizeof(path));
+
+    f = fopen(tmp, "wb");
+    if(NULL == f) {
+        LOG_ERROR("(%s:%d) Couldn't create %s: %s",
+                __FUNCTION__, __LINE__, tmp, strerror(errno));
+        return -1;
+    }
+
+    /* The header is written again at the end with the book count */
+    fwrite(&header, sizeof(header), 1, f);
+
+    n = market_get_books(books, SNAPSHOT_MAX_BOOKS);
+    orders = 0;
+    rc = 0;
+
+    for(i = 0; (i < n) && (0 == rc); i++) {
+        /* Books are never opened for longer symbols */
+        memset(&sb, 0, sizeof(sb));
+        memcpy(sb.symbol, string_get_chars(book_get_symbol(books[i])),
+                string_length(book_get_symbol(books[i])));
+
+        if(book_save(books[i], &sb.state, &saved) < 0) {
+            rc = -1;
+            break;
+        }
+
+        if((fwrite(&sb, sizeof(sb), 1, f) != 1) ||
+                (fwrite(saved, sizeof(BookSavedOrder), sb.state.order_count,
+                        f) != sb.state.order_count)) {
+            rc = -1;
+        }
+
+        orders += sb.state.order_count;
+        header.book_count++;
+
+        free(saved);
+    }
+
+    if(0 == rc) {
+        rewind(f);
+        if(fwrite(&header, sizeof(header), 1, f) != 1) {
+            rc = -1;
+        }
+    }
+
+    if((0 != fflush(f)) || (0 != fsync(fileno(f)))) {
+        rc = -1;
+    }
+
+    fclose(f);
+
+    if((0 != rc) || (rename(tmp, path) < 0)) {
+        LOG_ERROR("(%s:%d) Couldn't write %s: %s",
+                __FUNCTION__, __LINE__, path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    last_sequence = header.sequence;
+    written = 1;
+
+    _snapshot_prune(dir);
+
+    LOG_INFO("Snapshot: Wrote %u books, %llu orders at sequence %llu in %llums",
+            header.book_count, orders, header.sequence,
+            (timestamp_now() - start) / 1000000);
+
+    return 0;
+}
+
+/* FNV-1a over a zero padded symbol of up to len characters */
+static unsigned long _snapshot_hash(const char *symbol, size_t len)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for(i = 0; (i < len) && ('\0' != symbol[i]); i++) {
+        hash ^= (unsigned char)symbol[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return (unsigned long)(hash >> 32);
+}
+
+static SnapshotTableEntry* _snapshot_table_find(SnapshotTableEntry *table,
+        const char *symbol, size_t len)
+{
+    unsigned long i;
+
+    for(i = _snapshot_hash(symbol, len) & (SNAPSHOT_TABLE_SIZE - 1);
+            NULL != table[i].book;
+            i = (i + 1) & (SNAPSHOT_TABLE_SIZE - 1)) {
+        if(strncmp(table[i].symbol, symbol, len) == 0) {
+            break;
+        }
+    }
+
+    return &table[i];
+}
+
+/* Find or open the book for a symbol, and add it to the worker's
+ * table. Returns NULL if the book couldn't be opened.
+ */
+static SnapshotTableEntry* _snapshot_worker_book(SnapshotWorker *w,
+        const char *symbol, size_t len, unsigned long long applied)
+{
+    SnapshotTableEntry *entry;
+    String *s;
+
+    assert(len <= BOOK_SYMBOL_LEN);
+
+    entry = _snapshot_table_find(w->table, symbol, len);
+    if(NULL != entry->book) {
+        return entry;
+    }
+
+    s = string_create_from_buf(symbol, strnlen(symbol, len));
+    entry->book = market_get_book(s);
+    string_free(s);
+
+    if(NULL == entry->book) {
+        return NULL;
+    }
+
+    /* Orders only expire as the journal says they did until the book
+     * has caught up
+     */
+    book_set_expiry(entry->book, 0);
+
+    memcpy(entry->symbol, symbol, strnlen(symbol, len));
+    entry->applied = applied;
+    w->books++;
+
+    return entry;
+}
+
+/* Load this worker's share of the books from the snapshot */
+static void _snapshot_worker_load(SnapshotWorker *w)
+{
+    const SnapshotHeader *header;
+    const BookSavedOrder *orders;
+    const SnapshotBook *sb;
+    SnapshotTableEntry *entry;
+    unsigned long long j;
+    unsigned int i;
+    size_t offset;
+
+    header = (const SnapshotHeader *)w->map;
+    offset = sizeof(SnapshotHeader);
+
+    for(i = 0; i < header->book_count; i++) {
+        sb = (const SnapshotBook *)(w->map + offset);
+        orders = (const BookSavedOrder *)(sb + 1);
+        offset += sizeof(SnapshotBook) +
+            (sb->state.order_count * sizeof(BookSavedOrder));
+
+        if(_snapshot_hash(sb->symbol, SNAPSHOT_SYMBOL_LEN) %
+                w->count != w->index) {
+            continue;
+        }
+
+        entry = _snapshot_worker_book(w, sb->symbol, SNAPSHOT_SYMBOL_LEN,
+                sb->state.journal_sequence);
+        if(NULL == entry) {
+            continue;
+        }
+
+        if(book_restore(entry->book, &sb->state, orders) < 0) {
+            LOG_ERROR("(%s:%d) Couldn't restore book for '%.*s'",
+                    __FUNCTION__, __LINE__, SNAPSHOT_SYMBOL_LEN, sb->symbol);
+        }
+
+        w->orders += sb->state.order_count;
+
+        for(j = 0; j < sb->state.order_count; j++) {
+            if(orders[j].id >= w->next_id) {
+                w->next_id = orders[j].id + 1;
+            }
+        }
+    }
+}
+
+/* Replay the journal after the snapshot into this worker's books.
+ * Every worker reads the whole journal and skips the other workers'
+ * books, so no records have to be handed between threads.
+ */
+static void _snapshot_worker_replay(SnapshotWorker *w)
+{
+    SnapshotTableEntry *entry;
+    const JournalRecord *r;
+    JournalReader *reader;
+
+    reader = journal_reader_open(w->dir, w->sequence + 1);
+    if(NULL == reader) {
+        return;
+    }
+
+    while(NULL != (r = journal_reader_next(reader))) {
+        if(_snapshot_hash(r->symbol, JOURNAL_SYMBOL_LEN) %
+                w->count != w->index) {
+            continue;
+        }
+
+        /* Books opened after the snapshot started take every record */
+        entry = _snapshot_worker_book(w, r->symbol, JOURNAL_SYMBOL_LEN,
+                w->sequence);
+        if((NULL == entry) || (r->sequence <= entry->applied)) {
+            continue;
+        }
+
+        if(journal_apply(entry->book, r) > 0) {
+            w->records++;
+
+            if(r->id >= w->next_id) {
+                w->next_id = r->id + 1;
+            }
+        }
+    }
+
+    journal_reader_close(reader);
+}
+
+static void* _snapshot_worker(void *arg)
+{
+    SnapshotWorker *w = (SnapshotWorker *)arg;
+
+    if(NULL != w->map) {
+        _snapshot_worker_load(w);
+    }
+
+    _snapshot_worker_replay(w);
+
+    return NULL;
+}
+
+/* Map the newest valid snapshot. Returns -1 if there is none. */
+static int _snapshot_map(const char *dir, const char **map, size_t *size)
+{
+    const SnapshotHeader *header;
+    const SnapshotBook *sb;
+    char path[SNAPSHOT_PATH_LEN];
+    unsigned long long *sequences;
+    struct stat st;
+    size_t offset;
+    unsigned int j;
+    long i;
+    void *p;
+    int fd;
+
+    i = _snapshot_list(dir, &sequences);
+
+    for(i = i - 1; i >= 0; i--) {
+        _snapshot_path(dir, sequences[i], "bin", path, sizeof(path));
+
+        fd = open(path, O_RDONLY);
+        if(fd < 0) {
+            continue;
+        }
+
+        if((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(SnapshotHeader))) {
+            close(fd);
+            continue;
+        }
+
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                fd, 0);
+        close(fd);
+
+        if(MAP_FAILED == p) {
+            continue;
+        }
+
+        /* Check that the books fit in the file before trusting it */
+        header = (const SnapshotHeader *)p;
+        offset = sizeof(SnapshotHeader);
+
+        if((SNAPSHOT_MAGIC == header->magic) &&
+                (SNAPSHOT_VERSION == header->version)) {
+            for(j = 0; j < header->book_count; j++) {
+                if(offset + sizeof(SnapshotBook) > (size_t)st.st_size) {
+                    break;
+                }
+
+                sb = (const SnapshotBook *)((const char *)p + offset);
+                offset += sizeof(SnapshotBook) +
+                    (sb->state.order_count * sizeof(BookSavedOrder));
+            }
+
+            if((j == header->book_count) && (offset == (size_t)st.st_size)) {
+                free(sequences);
+                *map = p;
+                *size = st.st_size;
+                return 0;
+            }
+        }
+
+        LOG_WARNING("Snapshot: Ignoring damaged snapshot %s", path);
+        munmap(p, st.st_size);
+    }
+
+    free(sequences);
+
+    return -1;
+}
+
+/* Rebuild the books from the newest snapshot in dir, or JOURNAL_DIR
+ * if it is NULL, and then replay the journal from where the snapshot
+ * was taken. Books are independent, so they are shared out between
+ * worker threads that load and replay them in parallel. Must be
+ * called with the market open, before any orders are routed and
+ * before the journal is opened for this run.
+ */
+int snapshot_recover(const char *dir)
+{
+    SnapshotWorker workers[SNAPSHOT_MAX_WORKERS];
+    pthread_t threads[SNAPSHOT_MAX_WORKERS];
+    int started[SNAPSHOT_MAX_WORKERS];
+    unsigned long long start, next_id, orders, records;
+    unsigned long books;
+    const char *map;
+    unsigned int i, n;
+    unsigned long j;
+    size_t size;
+    long cpus;
+
+    if(NULL == dir) {
+        dir = JOURNAL_DIR;
+    }
+
+    start = timestamp_now();
+
+    map = NULL;
+    size = 0;
+    _snapshot_map(dir, &map, &size);
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (cpus < 1) ? 1 : ((cpus > SNAPSHOT_MAX_WORKERS) ?
+            SNAPSHOT_MAX_WORKERS : (unsigned int)cpus);
+
+    for(i = 0; i < n; i++) {
+        memset(&workers[i], 0, sizeof(SnapshotWorker));
+        workers[i].index = i;
+        workers[i].count = n;
+        workers[i].dir = dir;
+        workers[i].map = map;
+        workers[i].size = size;
+        workers[i].sequence = (NULL != map) ?
+            ((const SnapshotHeader *)map)->sequence : 0;
+
+        workers[i].table = calloc(SNAPSHOT_TABLE_SIZE,
+                sizeof(SnapshotTableEntry));
+        if(NULL == workers[i].table) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            n = i;
+            break;
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, _snapshot_worker,
+                    &workers[i]) == 0);
+        if(!started[i]) {
+            /* Do this worker's share here instead */
+            _snapshot_worker(&workers[i]);
+        }
+    }
+
+    books = 0;
+    orders = records = 0;
+    next_id = 0;
+
+    for(i = 0; i < n; i++) {
+        if(started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+
+        books += workers[i].books;
+        orders += workers[i].orders;
+        records += workers[i].records;
+        if(workers[i].next_id > next_id) {
+            next_id = workers[i].next_id;
+        }
+
+        for(j = 0; j < SNAPSHOT_TABLE_SIZE; j++) {
+            if(NULL != workers[i].table[j].book) {
+                book_set_expiry(workers[i].table[j].book, 1);
+            }
+        }
+
+        free(workers[i].table);
+    }
+
+    if(NULL != map) {
+        munmap((void *)map, size);
+    }
+
+    market_reserve_order_ids(next_id);
+
+    if((books > 0) || (records > 0)) {
+        LOG_INFO("Snapshot: Recovered %lu books, %llu orders and %llu journal "
+                "records with %u threads in %llums", books, orders, records,
+                n, (timestamp_now() - start) / 1000000);
+    }
+
+    return (n > 0) ? 0 : -1;
+}
+
+static void* _snapshot_thread(void *arg)
+{
+    unsigned int ticks;
+
+    trace_set_thread_name("snapshot");
+
+    ticks = 0;
+
+    while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        usleep(100000);
+
+        if(++ticks >= interval_s * 10) {
+            snapshot_write(snapshot_dir);
+            ticks = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/* Take snapshots into dir, or JOURNAL_DIR if it is NULL, every
+ * SNAPSHOT_INTERVAL_S seconds or as set by the SNAPSHOT_INTERVAL_S
+ * environment variable
+ */
+void snapshot_start(const char *dir)
+{
+    const char *env;
+
+    if(NULL == dir) {
+        dir = JOURNAL_DIR;
+    }
+
+    strncpy(snapshot_dir, dir, sizeof(snapshot_dir) - 1);
+
+    env = getenv("SNAPSHOT_INTERVAL_S");
+    if(NULL != env) {
+        interval_s = (unsigned int)strtoul(env, NULL, 10);
+        if(0 == interval_s) {
+            interval_s = 1;
+        }
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+    if(pthread_create(&snapshot_thread, NULL, _snapshot_thread, NULL) != 0) {
+        LOG_ERROR("(%s:%d) Couldn't start snapshot thread",
+                __FUNCTION__, __LINE__);
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* Stop taking snapshots, and take a last one so that the next start
+ * has little of the journal to replay. The books must still be open.
+ */
+void snapshot_stop(void)
+{
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(snapshot_thread, NULL);
+
+    snapshot_write(snapshot_dir);
+}
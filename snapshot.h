@@ -0,0 +1,81 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#include "book.h"
+
+/* A snapshot file, snapshot-<sequence>.bin in the journal directory,
+ * is a SnapshotHeader followed by each book: a SnapshotBook and then
+ * its orders. The sequence is the journal's when the snapshot
+ * started. Any change to the layout must bump SNAPSHOT_VERSION.
+ */
+#define SNAPSHOT_MAGIC          0x736e6170656e67ULL
+#define SNAPSHOT_VERSION        5
+
+#define SNAPSHOT_SYMBOL_LEN     BOOK_SYMBOL_LEN
+
+/* How often snapshots are taken, and how many are kept */
+#define SNAPSHOT_INTERVAL_S     60
+#define SNAPSHOT_KEEP           2
+
+/* Most threads used to recover the books */
+#define SNAPSHOT_MAX_WORKERS    16
+
+typedef struct {
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int book_count;
+
+    unsigned long long sequence;
+
+    /* Nanoseconds since the Epoch */
+    unsigned long long time;
+} SnapshotHeader;
+
+typedef struct {
+    /* Zero padded, and not terminated if it fills the field */
+    char symbol[SNAPSHOT_SYMBOL_LEN];
+    BookSavedState state;
+} SnapshotBook;
+
+int     snapshot_write      (const char *dir);
+int     snapshot_recover    (const char *dir);
+
+void    snapshot_start      (const char *dir);
+void    snapshot_stop       (void);
+
+#if __cplusplus
+}
+#endif
+
+#endif
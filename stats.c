@@ -0,0 +1,226 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libcore/string.h>
+
+#include "fix_session_manager.h"
+#include "log.h"
+#include "market.h"
+#include "stats.h"
+#include "timestamp.h"
+
+static StatsRegion *region = NULL;
+
+/* Scratch space for sampling the books and latencies */
+static MarketRates book_rates[STATS_MAX_BOOKS];
+static StatsLatency latencies[STATS_MAX_LATENCIES];
+
+/* Session counters at the previous update */
+static FixSessionCounters last_sessions;
+static unsigned long long last_time = 0;
+
+static void _stats_book(StatsBook *sb, const MarketRates *rates)
+{
+    memset(sb->symbol, 0, STATS_SYMBOL_LEN);
+    if(NULL != rates->symbol) {
+        strncpy(sb->symbol, string_get_chars(rates->symbol),
+                STATS_SYMBOL_LEN - 1);
+    }
+
+    sb->counters = rates->counters;
+    sb->top = rates->top;
+
+    sb->orders_per_second = rates->orders_per_second;
+    sb->fills_per_second = rates->fills_per_second;
+    sb->volume_per_second = rates->volume_per_second;
+}
+
+static void _stats_sessions(StatsSessions *ss, double seconds)
+{
+    FixSessionCounters c;
+
+    ss->sessions = fix_session_manager_get_counters(&c);
+    ss->active = c.activations - c.deactivations;
+    ss->counters = c;
+
+    ss->rx_queue_depth = c.rx_messages - c.rx_processed;
+    ss->tx_queue_depth = c.tx_messages - c.tx_sent;
+
+    ss->rx_per_second = (c.rx_messages - last_sessions.rx_messages) / seconds;
+    ss->tx_per_second = (c.tx_sent - last_sessions.tx_sent) / seconds;
+
+    last_sessions = c;
+}
+
+/* Merge the latency histograms, leaving out stages that never
+ * happen, such as reports while there are none to send. Returns the
+ * number of summaries.
+ */
+static unsigned long _stats_latencies(void)
+{
+    LatencySummary summary;
+    unsigned long n;
+    int h;
+
+    n = 0;
+
+    for(h = 0; (h < LATENCY_HISTOGRAMS) && (n < STATS_MAX_LATENCIES); h++) {
+        latency_get_summary(h, &summary);
+        if(0 == summary.count) {
+            continue;
+        }
+
+        memset(latencies[n].name, 0, STATS_NAME_LEN);
+        strncpy(latencies[n].name, latency_get_name(h), STATS_NAME_LEN - 1);
+        latencies[n].summary = summary;
+        n++;
+    }
+
+    return n;
+}
+
+/* Create the shared memory region. Readers find it by name, so an
+ * existing region left behind by an engine that died is reused.
+ */
+int stats_open(void)
+{
+    void *p;
+    int fd;
+
+    fd = shm_open(STATS_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if(fd < 0) {
+        LOG_ERROR("(%s:%d) Couldn't open stats region",
+                __FUNCTION__, __LINE__);
+        return -1;
+    }
+
+    if(ftruncate(fd, sizeof(StatsRegion)) < 0) {
+        LOG_ERROR("(%s:%d) Couldn't size stats region",
+                __FUNCTION__, __LINE__);
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, sizeof(StatsRegion), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(MAP_FAILED == p) {
+        LOG_ERROR("(%s:%d) Couldn't map stats region",
+                __FUNCTION__, __LINE__);
+        return -1;
+    }
+
+    region = (StatsRegion *)p;
+
+    /* Readers ignore the region until the magic number is there */
+    __atomic_store_n(&region->magic, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memset(&region->version, 0, sizeof(StatsRegion) -
+            offsetof(StatsRegion, version));
+
+    region->version = STATS_VERSION;
+    region->size = sizeof(StatsRegion);
+    region->start_time = last_time = timestamp_now();
+
+    memset(&last_sessions, 0, sizeof(last_sessions));
+
+    __atomic_store_n(&region->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+    LOG_INFO("Stats: Publishing to %s", STATS_SHM_NAME);
+
+    return 0;
+}
+
+/* Sample the market and the sessions into the region. Only the
+ * engine's stats thread may call this. Nothing it reads takes a
+ * lock that routing or matching uses.
+ */
+void stats_update(void)
+{
+    MarketRates market;
+    unsigned long long now;
+    unsigned long i, n, l;
+    double seconds;
+
+    if(NULL == region) {
+        return;
+    }
+
+    n = market_sample_rates(&market, book_rates, STATS_MAX_BOOKS);
+    if(n > STATS_MAX_BOOKS) {
+        n = STATS_MAX_BOOKS;
+    }
+
+    l = _stats_latencies();
+
+    now = timestamp_now();
+    seconds = (now > last_time) ? (now - last_time) / 1e9 : 1e-9;
+
+    __atomic_store_n(&region->sequence, region->sequence + 1,
+            __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    region->update_time = now;
+
+    _stats_book(&region->market, &market);
+    _stats_sessions(&region->sessions, seconds);
+
+    memcpy(region->latencies, latencies, l * sizeof(StatsLatency));
+    region->latency_count = l;
+
+    for(i = 0; i < n; i++) {
+        _stats_book(&region->books[i], &book_rates[i]);
+    }
+    region->book_count = n;
+
+    __atomic_store_n(&region->sequence, region->sequence + 1,
+            __ATOMIC_RELEASE);
+
+    last_time = now;
+}
+
+/* Unmap and remove the region */
+void stats_close(void)
+{
+    if(NULL == region) {
+        return;
+    }
+
+    munmap(region, sizeof(StatsRegion));
+    region = NULL;
+
+    shm_unlink(STATS_SHM_NAME);
+}
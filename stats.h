@@ -0,0 +1,124 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#include "book.h"
+#include "fix_session.h"
+#include "latency.h"
+
+/* The engine publishes its stats in a fixed-layout shared memory
+ * region, which tools such as engine-stat attach to read-only. Any
+ * change to the layout must bump STATS_VERSION.
+ */
+#define STATS_SHM_NAME      "/trading-engine-stats"
+#define STATS_MAGIC         0x7374617473656e67ULL
+#define STATS_VERSION       2
+
+#define STATS_MAX_BOOKS     4096
+#define STATS_SYMBOL_LEN    16
+
+#define STATS_MAX_LATENCIES 16
+#define STATS_NAME_LEN      24
+
+/* How often the engine updates the region */
+#define STATS_INTERVAL_MS   100
+
+/* Counters, rates and top of book for one book, or for the whole
+ * market with an empty symbol and top of book
+ */
+typedef struct {
+    char symbol[STATS_SYMBOL_LEN];
+
+    BookCounters counters;
+    BookTop top;
+
+    double orders_per_second;
+    double fills_per_second;
+    double volume_per_second;
+} StatsBook;
+
+/* Totals over every FIX session */
+typedef struct {
+    unsigned long long sessions;
+    unsigned long long active;
+
+    FixSessionCounters counters;
+
+    /* Messages waiting in the receive and send queues */
+    unsigned long long rx_queue_depth;
+    unsigned long long tx_queue_depth;
+
+    double rx_per_second;
+    double tx_per_second;
+} StatsSessions;
+
+/* Latency of one stage of order handling, or end to end */
+typedef struct {
+    char name[STATS_NAME_LEN];
+    LatencySummary summary;
+} StatsLatency;
+
+/* The sequence is odd while the engine is writing an update, so a
+ * reader has a consistent copy if it reads the same even sequence
+ * before and after copying.
+ */
+typedef struct {
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int size;
+
+    unsigned long sequence;
+
+    /* Nanoseconds since the Epoch */
+    unsigned long long start_time;
+    unsigned long long update_time;
+
+    StatsBook market;
+    StatsSessions sessions;
+
+    unsigned long latency_count;
+    StatsLatency latencies[STATS_MAX_LATENCIES];
+
+    unsigned long book_count;
+    StatsBook books[STATS_MAX_BOOKS];
+} StatsRegion;
+
+int     stats_open      (void);
+void    stats_update    (void);
+void    stats_close     (void);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -147,7 +147,7 @@ void fix_send_message(int sockfd, FIX_MSG_TYPE type, String *payload)
 void send_logon(int sockfd)
 {
     fix_send_message(sockfd, FIX_MSG_TYPE_LOGON,
-            fix_message_generate_logon(FIX_ENCRYPT_METHOD_NONE, 0));
+            fix_message_generate_logon(FIX_ENCRYPT_METHOD_NONE, 0, 1));
 }
 
 void send_order(int sockfd)
@@ -0,0 +1,273 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "timer.h"
+
+#define TIMER_SLOT_MASK     (TIMER_SLOTS - 1)
+
+/* Every list is circular, headed by a Timer that is never armed */
+struct _timer_wheel {
+    Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+    Timer expired;
+
+    unsigned long long tick_ns;
+    unsigned long long now;
+
+    /* Timers armed, counting those expired but not yet taken */
+    unsigned long armed;
+};
+
+static void _timer_list_init(Timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void _timer_unlink(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void _timer_link(Timer *head, Timer *timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/* File a timer by how far away it is. Each level holds the timers
+ * due within one turn of it.
+ */
+static void _timer_wheel_insert(TimerWheel *wheel, Timer *timer)
+{
+    unsigned long long delta;
+    int level, shift;
+
+    if(timer->expires <= wheel->now) {
+        _timer_link(&wheel->expired, timer);
+        return;
+    }
+
+    delta = timer->expires - wheel->now;
+
+    for(level = 0; level < TIMER_LEVELS - 1; level++) {
+        if(delta < (1ULL << ((level + 1) * TIMER_SLOT_BITS))) {
+            break;
+        }
+    }
+
+    shift = level * TIMER_SLOT_BITS;
+    _timer_link(&wheel->slots[level][(timer->expires >> shift) &
+            TIMER_SLOT_MASK], timer);
+}
+
+/* Refile the timers in a slot now that it has come round */
+static void _timer_wheel_cascade(TimerWheel *wheel, int level,
+        unsigned long slot)
+{
+    Timer head, *timer;
+
+    _timer_list_init(&head);
+
+    /* Take the whole slot first, as timers may refile into it */
+    if(wheel->slots[level][slot].next != &wheel->slots[level][slot]) {
+        head.next = wheel->slots[level][slot].next;
+        head.prev = wheel->slots[level][slot].prev;
+        head.next->prev = &head;
+        head.prev->next = &head;
+        _timer_list_init(&wheel->slots[level][slot]);
+    }
+
+    while(head.next != &head) {
+        timer = head.next;
+        _timer_unlink(timer);
+        _timer_wheel_insert(wheel, timer);
+    }
+}
+
+TimerWheel* timer_wheel_create(unsigned long long tick_ns,
+        unsigned long long now)
+{
+    TimerWheel *wheel;
+    int level, slot;
+
+    assert(tick_ns > 0);
+
+    wheel = malloc(sizeof(TimerWheel));
+    if(NULL == wheel) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    for(level = 0; level < TIMER_LEVELS; level++) {
+        for(slot = 0; slot < TIMER_SLOTS; slot++) {
+            _timer_list_init(&wheel->slots[level][slot]);
+        }
+    }
+    _timer_list_init(&wheel->expired);
+
+    wheel->tick_ns = tick_ns;
+    wheel->now = now / tick_ns;
+    wheel->armed = 0;
+
+    return wheel;
+}
+
+/* Timers still armed are left unarmed */
+void timer_wheel_free(TimerWheel *wheel)
+{
+    Timer *timer;
+
+    assert(wheel != NULL);
+
+    while(NULL != (timer = timer_wheel_next_expired(wheel))) {
+        /* Empty */
+    }
+
+    free(wheel);
+}
+
+void timer_init(Timer *timer, TimerFn fn, void *data)
+{
+    assert(timer != NULL);
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+int timer_is_armed(const Timer *timer)
+{
+    assert(timer != NULL);
+
+    return NULL != timer->next;
+}
+
+void timer_wheel_arm(TimerWheel *wheel, Timer *timer,
+        unsigned long long when)
+{
+    assert(wheel != NULL);
+    assert(timer != NULL);
+
+    if(timer_is_armed(timer)) {
+        _timer_unlink(timer);
+    } else {
+        wheel->armed++;
+    }
+
+    /* Round up, so a timer never fires early */
+    timer->expires = (when + wheel->tick_ns - 1) / wheel->tick_ns;
+    if(timer->expires <= wheel->now) {
+        timer->expires = wheel->now + 1;
+    }
+
+    _timer_wheel_insert(wheel, timer);
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer)
+{
+    assert(wheel != NULL);
+    assert(timer != NULL);
+
+    if(timer_is_armed(timer)) {
+        _timer_unlink(timer);
+        wheel->armed--;
+    }
+}
+
+unsigned long timer_wheel_get_armed(const TimerWheel *wheel)
+{
+    assert(wheel != NULL);
+
+    return wheel->armed;
+}
+
+void timer_wheel_advance(TimerWheel *wheel, unsigned long long now)
+{
+    unsigned long long target;
+    unsigned long slot;
+    int level;
+
+    assert(wheel != NULL);
+
+    target = now / wheel->tick_ns;
+
+    /* With nothing armed there is nothing to cascade, so an idle
+     * wheel catches up in one step however long it has been idle
+     */
+    if((0 == wheel->armed) && (wheel->now < target)) {
+        wheel->now = target;
+    }
+
+    while(wheel->now < target) {
+        wheel->now++;
+
+        /* Each time a level turns over, bring the next slot of the
+         * level above down into it
+         */
+        for(level = 1; level < TIMER_LEVELS; level++) {
+            if(0 != ((wheel->now >> ((level - 1) * TIMER_SLOT_BITS)) &
+                        TIMER_SLOT_MASK)) {
+                break;
+            }
+
+            slot = (wheel->now >> (level * TIMER_SLOT_BITS)) &
+                TIMER_SLOT_MASK;
+            _timer_wheel_cascade(wheel, level, slot);
+        }
+
+        _timer_wheel_cascade(wheel, 0, wheel->now & TIMER_SLOT_MASK);
+    }
+}
+
+Timer* timer_wheel_next_expired(TimerWheel *wheel)
+{
+    Timer *timer;
+
+    assert(wheel != NULL);
+
+    timer = wheel->expired.next;
+    if(timer == &wheel->expired) {
+        return NULL;
+    }
+
+    _timer_unlink(timer);
+    wheel->armed--;
+
+    return timer;
+}
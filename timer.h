@@ -0,0 +1,96 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/* A hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS
+ * slots, each level's slot spanning a whole turn of the level below.
+ * Arming and cancelling are O(1), and a timer only moves down a
+ * level when its slot comes round, so idle timers cost nothing.
+ * With a 10ms tick the wheel spans over 46 hours; later timers are
+ * parked in the top level until they come within range.
+ *
+ * A wheel isn't thread safe. Whoever owns it serializes access.
+ */
+#define TIMER_LEVELS        4
+#define TIMER_SLOT_BITS     6
+#define TIMER_SLOTS         (1 << TIMER_SLOT_BITS)
+
+typedef void (*TimerFn)(void *data);
+
+/* Embedded in whatever it times, so arming never allocates. fn may
+ * be NULL if the owner takes expired timers and acts on data itself.
+ */
+typedef struct _timer {
+    struct _timer *next;
+    struct _timer *prev;
+
+    /* Tick the timer is due at */
+    unsigned long long expires;
+
+    TimerFn fn;
+    void *data;
+} Timer;
+
+/* Opaque forward declaration */
+typedef struct _timer_wheel TimerWheel;
+
+TimerWheel* timer_wheel_create  (unsigned long long tick_ns,
+                                 unsigned long long now);
+void        timer_wheel_free    (TimerWheel *wheel);
+
+void        timer_init          (Timer *timer, TimerFn fn, void *data);
+int         timer_is_armed      (const Timer *timer);
+
+/* Arm a timer to expire at a time in nanoseconds, moving it if it
+ * is already armed. A time already passed expires on the next tick.
+ */
+void        timer_wheel_arm     (TimerWheel *wheel, Timer *timer,
+                                 unsigned long long when);
+void        timer_wheel_cancel  (TimerWheel *wheel, Timer *timer);
+
+/* Timers armed, including those expired but not yet taken */
+unsigned long   timer_wheel_get_armed   (const TimerWheel *wheel);
+
+/* Move the wheel on to the given time. Timers that expire are
+ * queued, to be taken one at a time with timer_wheel_next_expired
+ * and run by the caller, so that the wheel's lock need not be held
+ * while they run.
+ */
+void        timer_wheel_advance (TimerWheel *wheel, unsigned long long now);
+Timer*      timer_wheel_next_expired (TimerWheel *wheel);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC    1
+#else
+#define HAVE_TSC    0
+#endif
+
+#include "log.h"
+#include "timestamp.h"
+
+#define NSEC_PER_SEC        1000000000ULL
+
+/* Length of the TSC calibration period, in nanoseconds */
+#define CALIBRATION_NSEC    20000000ULL
+
+/* Fixed-point shift of the cycles to nanoseconds multiplier */
+#define TSC_SHIFT           32
+
+static int use_tsc = 0;
+
+/* Wall time at base_cycles, and the nanoseconds per cycle scaled
+ * by 2^TSC_SHIFT. Written once by timestamp_init.
+ */
+static unsigned long long base_cycles = 0;
+static unsigned long long base_ns = 0;
+static unsigned long long tsc_mult = 0;
+
+/* Wall time minus monotonic time, for the clock_gettime fallback */
+static unsigned long long monotonic_offset_ns = 0;
+
+static unsigned long long _timestamp_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ((unsigned long long)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+#if HAVE_TSC
+/* The TSC can only be used as a clock if it ticks at a constant
+ * rate regardless of power state (the "invariant TSC" CPUID bit).
+ */
+static int _timestamp_tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (edx & (1 << 8)) != 0;
+}
+
+static void _timestamp_calibrate_tsc(void)
+{
+    unsigned long long start_ns, end_ns, start_cycles, end_cycles;
+    struct timespec delay;
+
+    delay.tv_sec = 0;
+    delay.tv_nsec = CALIBRATION_NSEC;
+
+    start_ns = _timestamp_clock_ns(CLOCK_MONOTONIC);
+    start_cycles = __rdtsc();
+
+    nanosleep(&delay, NULL);
+
+    end_ns = _timestamp_clock_ns(CLOCK_MONOTONIC);
+    end_cycles = __rdtsc();
+
+    if(end_cycles <= start_cycles) {
+        return;
+    }
+
+    tsc_mult = ((end_ns - start_ns) << TSC_SHIFT) /
+        (end_cycles - start_cycles);
+
+    base_ns = _timestamp_clock_ns(CLOCK_REALTIME);
+    base_cycles = __rdtsc();
+
+    use_tsc = (tsc_mult != 0);
+}
+#endif
+
+void timestamp_init(void)
+{
+    monotonic_offset_ns = _timestamp_clock_ns(CLOCK_REALTIME) -
+        _timestamp_clock_ns(CLOCK_MONOTONIC);
+
+#if HAVE_TSC
+    if(_timestamp_tsc_is_invariant()) {
+        _timestamp_calibrate_tsc();
+    }
+#endif
+
+    LOG_INFO("Timestamp: Using %s clock", use_tsc ? "TSC" : "monotonic");
+}
+
+unsigned long long timestamp_now(void)
+{
+#if HAVE_TSC
+    if(use_tsc) {
+        return timestamp_from_cycles(__rdtsc());
+    }
+#endif
+
+    return _timestamp_clock_ns(CLOCK_MONOTONIC) + monotonic_offset_ns;
+}
+
+unsigned long long timestamp_cycles(void)
+{
+#if HAVE_TSC
+    if(use_tsc) {
+        return __rdtsc();
+    }
+#endif
+
+    return timestamp_now();
+}
+
+unsigned long long timestamp_from_cycles(unsigned long long cycles)
+{
+#if HAVE_TSC
+    if(use_tsc) {
+        return base_ns + (unsigned long long)
+            (((unsigned __int128)(cycles - base_cycles) * tsc_mult) >>
+             TSC_SHIFT);
+    }
+#endif
+
+    return cycles;
+}
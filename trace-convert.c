@@ -0,0 +1,160 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* trace-convert: turn a trace dump written by trading-engine into
+ * Chrome trace JSON, for viewing in chrome://tracing or Perfetto.
+ *
+ * Usage: trace-convert <trace-dump.bin> > trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void _trace_convert_string(const char *s)
+{
+    putchar('"');
+    for(; *s != '\0'; s++) {
+        if((*s == '"') || (*s == '\\')) {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[])
+{
+    TraceFileHeader header;
+    TraceFileThread thread;
+    TraceFileEvent *events;
+    TraceRecord record;
+    unsigned long long base;
+    unsigned int t, i;
+    long threads_at;
+    int first;
+    FILE *f;
+
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s <trace-dump.bin>\n", argv[0]);
+        return 1;
+    }
+
+    f = fopen(argv[1], "rb");
+    if(NULL == f) {
+        fprintf(stderr, "Couldn't open %s\n", argv[1]);
+        return 1;
+    }
+
+    if((fread(&header, sizeof(header), 1, f) != 1) ||
+            (header.magic != TRACE_FILE_MAGIC) ||
+            (header.version != TRACE_FILE_VERSION)) {
+        fprintf(stderr, "%s is not a version %u trace dump\n",
+                argv[1], TRACE_FILE_VERSION);
+        fclose(f);
+        return 1;
+    }
+
+    events = calloc(header.event_count, sizeof(TraceFileEvent));
+    if((NULL == events) ||
+            (fread(events, sizeof(TraceFileEvent), header.event_count, f) !=
+             header.event_count)) {
+        fprintf(stderr, "Truncated trace dump\n");
+        free(events);
+        fclose(f);
+        return 1;
+    }
+
+    /* Times are shown relative to the earliest event in the dump */
+    threads_at = ftell(f);
+    base = ~0ULL;
+
+    for(t = 0; t < header.thread_count; t++) {
+        if(fread(&thread, sizeof(thread), 1, f) != 1) {
+            break;
+        }
+        for(i = 0; i < thread.count; i++) {
+            if(fread(&record, sizeof(record), 1, f) != 1) {
+                break;
+            }
+            if(record.time < base) {
+                base = record.time;
+            }
+        }
+    }
+
+    fseek(f, threads_at, SEEK_SET);
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    first = 1;
+
+    for(t = 0; t < header.thread_count; t++) {
+        if(fread(&thread, sizeof(thread), 1, f) != 1) {
+            fprintf(stderr, "Truncated trace dump\n");
+            break;
+        }
+
+        printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n",
+                thread.tid);
+        _trace_convert_string(thread.name);
+        printf("}}");
+        first = 0;
+
+        for(i = 0; i < thread.count; i++) {
+            if(fread(&record, sizeof(record), 1, f) != 1) {
+                fprintf(stderr, "Truncated trace dump\n");
+                break;
+            }
+            if(record.id >= header.event_count) {
+                continue;
+            }
+
+            printf(",\n{\"name\":");
+            _trace_convert_string(events[record.id].name);
+            printf(",\"cat\":");
+            _trace_convert_string(events[record.id].category);
+            printf(",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,",
+                    events[record.id].phase,
+                    (record.time - base) / 1e3, thread.tid);
+            if('i' == events[record.id].phase) {
+                printf("\"s\":\"t\",");
+            }
+            printf("\"args\":{\"arg0\":%llu,\"arg1\":%llu}}",
+                    record.arg0, record.arg1);
+        }
+    }
+
+    printf("\n]}\n");
+
+    free(events);
+    fclose(f);
+
+    return 0;
+}
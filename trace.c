@@ -0,0 +1,448 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "timestamp.h"
+#include "trace.h"
+
+/* Events kept per thread. Must be a power of two. */
+#define TRACE_RING_EVENTS       16384
+
+/* Dumps triggered by slow orders are at least this far apart */
+#define TRACE_DUMP_INTERVAL_NS  1000000000ULL
+
+typedef struct _trace_ring TraceRing;
+
+/* One thread's events. Only the owning thread writes to its ring,
+ * and the dump copies it out without stopping the thread, throwing
+ * away anything that may have been overwritten during the copy.
+ * Rings are never freed: when a thread exits its ring is released
+ * for the next new thread to use.
+ */
+struct _trace_ring {
+    TraceRecord events[TRACE_RING_EVENTS];
+    unsigned long long head;
+
+    char name[TRACE_NAME_LEN];
+    unsigned int tid;
+
+    int in_use;
+    TraceRing *next;
+};
+
+static const struct {
+    const char *name;
+    unsigned int category;
+    char phase;
+} events[TRACE_EVENT_LAST] = {
+    { "socket_read",    TRACE_CATEGORY_SOCKET,  'i' },
+    { "frame",          TRACE_CATEGORY_SOCKET,  'i' },
+    { "rx_message",     TRACE_CATEGORY_RX,      'B' },
+    { "rx_message",     TRACE_CATEGORY_RX,      'E' },
+    { "order",          TRACE_CATEGORY_MATCHER, 'B' },
+    { "order",          TRACE_CATEGORY_MATCHER, 'E' },
+    { "trade",          TRACE_CATEGORY_MATCHER, 'i' },
+    { "uncross",        TRACE_CATEGORY_MATCHER, 'i' },
+    { "tx_send",        TRACE_CATEGORY_TX,      'i' },
+    { "latency",        TRACE_CATEGORY_LATENCY, 'i' },
+    { "expire",         TRACE_CATEGORY_MATCHER, 'i' },
+    { "cancel",         TRACE_CATEGORY_MATCHER, 'i' },
+    { "amend",          TRACE_CATEGORY_MATCHER, 'i' },
+    { "reprice",        TRACE_CATEGORY_MATCHER, 'i' }
+};
+
+static const struct {
+    const char *name;
+    unsigned int category;
+} categories[] = {
+    { "socket",     TRACE_CATEGORY_SOCKET },
+    { "rx",         TRACE_CATEGORY_RX },
+    { "matcher",    TRACE_CATEGORY_MATCHER },
+    { "tx",         TRACE_CATEGORY_TX },
+    { "latency",    TRACE_CATEGORY_LATENCY },
+    { "all",        TRACE_CATEGORY_ALL },
+    { NULL,         0 }
+};
+
+static TraceRing *rings = NULL;
+
+static __thread TraceRing *local_ring = NULL;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static unsigned int enabled = TRACE_CATEGORY_ALL;
+static unsigned long long threshold_ns = 0;
+
+static int dump_requested = 0;
+static unsigned long long last_dump_time = 0;
+static unsigned int dump_count = 0;
+
+static const char* _trace_category_name(unsigned int category)
+{
+    int i;
+
+    for(i = 0; NULL != categories[i].name; i++) {
+        if(categories[i].category == category) {
+            return categories[i].name;
+        }
+    }
+
+    return "";
+}
+
+/* Parse a comma separated list of category names */
+static unsigned int _trace_parse_categories(const char *list)
+{
+    unsigned int mask;
+    const char *c;
+    size_t len;
+    int i;
+
+    mask = 0;
+
+    for(c = list; *c != '\0'; c += len + ((c[len] == ',') ? 1 : 0)) {
+        len = strcspn(c, ",");
+
+        for(i = 0; NULL != categories[i].name; i++) {
+            if((strlen(categories[i].name) == len) &&
+                    (strncmp(categories[i].name, c, len) == 0)) {
+                mask |= categories[i].category;
+            }
+        }
+    }
+
+    return mask;
+}
+
+static void _trace_ring_release(void *data)
+{
+    TraceRing *ring = (TraceRing *)data;
+
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _trace_ring_key_create(void)
+{
+    pthread_key_create(&ring_key, _trace_ring_release);
+}
+
+/* Find this thread a ring, reusing one released by a thread that
+ * has exited before allocating a new one
+ */
+static TraceRing* _trace_ring_claim(void)
+{
+    TraceRing *ring;
+    int unused;
+
+    pthread_once(&ring_key_once, _trace_ring_key_create);
+
+    for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+            NULL != ring;
+            ring = ring->next) {
+        unused = 0;
+        if(__atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if(NULL == ring) {
+        ring = calloc(1, sizeof(TraceRing));
+        if(NULL == ring) {
+            LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+            return NULL;
+        }
+
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            /* ring->next now holds the new head, so try again */
+        }
+    } else {
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    }
+
+    strcpy(ring->name, "thread");
+    ring->tid = (unsigned int)syscall(SYS_gettid);
+
+    pthread_setspecific(ring_key, ring);
+
+    return ring;
+}
+
+/* Read the categories to trace, and the end to end latency that
+ * triggers a dump, from the environment. By default everything is
+ * traced and slow orders don't trigger dumps.
+ */
+void trace_init(void)
+{
+    const char *env;
+
+    env = getenv("TRACE_CATEGORIES");
+    if(NULL != env) {
+        trace_set_categories(_trace_parse_categories(env));
+    }
+
+    env = getenv("TRACE_THRESHOLD_US");
+    if(NULL != env) {
+        trace_set_threshold(strtoull(env, NULL, 10) * 1000);
+    }
+
+    LOG_INFO("Trace: Categories 0x%x, dump threshold %lluus",
+            enabled, threshold_ns / 1000);
+}
+
+void trace_set_categories(unsigned int categories)
+{
+    __atomic_store_n(&enabled, categories, __ATOMIC_RELAXED);
+}
+
+/* Dump the rings whenever an order takes longer than this end to
+ * end. Zero turns this off.
+ */
+void trace_set_threshold(unsigned long long ns)
+{
+    __atomic_store_n(&threshold_ns, ns, __ATOMIC_RELAXED);
+}
+
+void trace_set_thread_name(const char *name)
+{
+    TraceRing *ring;
+
+    assert(name != NULL);
+
+    ring = local_ring;
+    if(NULL == ring) {
+        ring = local_ring = _trace_ring_claim();
+        if(NULL == ring) {
+            return;
+        }
+    }
+
+    strncpy(ring->name, name, TRACE_NAME_LEN - 1);
+    ring->name[TRACE_NAME_LEN - 1] = '\0';
+}
+
+/* Record an event in this thread's ring, if its category is on */
+void trace_event(TRACE_EVENT id, unsigned long long arg0,
+        unsigned long long arg1)
+{
+    unsigned long long head;
+    TraceRecord *r;
+    TraceRing *ring;
+
+    if(0 == (__atomic_load_n(&enabled, __ATOMIC_RELAXED) &
+                events[id].category)) {
+        return;
+    }
+
+    ring = local_ring;
+    if(NULL == ring) {
+        ring = local_ring = _trace_ring_claim();
+        if(NULL == ring) {
+            return;
+        }
+    }
+
+    head = ring->head;
+    r = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+
+    r->time = timestamp_cycles();
+    r->arg0 = arg0;
+    r->arg1 = arg1;
+    r->id = id;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Record an order's end to end latency, and ask for a dump if it
+ * was over the threshold
+ */
+void trace_latency(unsigned long long ns)
+{
+    unsigned long long threshold;
+
+    trace_event(TRACE_EVENT_LATENCY, ns, 0);
+
+    threshold = __atomic_load_n(&threshold_ns, __ATOMIC_RELAXED);
+    if((threshold > 0) && (ns > threshold)) {
+        trace_request_dump();
+    }
+}
+
+/* Safe to call from a signal handler. The dump itself happens in
+ * the next trace_poll.
+ */
+void trace_request_dump(void)
+{
+    __atomic_store_n(&dump_requested, 1, __ATOMIC_RELAXED);
+}
+
+/* Copy out one ring's events, oldest first, with times converted
+ * to nanoseconds. Returns the number of events.
+ */
+static unsigned int _trace_ring_copy(TraceRing *ring, TraceRecord *out)
+{
+    unsigned long long start, end, after, i;
+    unsigned int n;
+
+    end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    start = (end > TRACE_RING_EVENTS) ? (end - TRACE_RING_EVENTS) : 0;
+
+    for(i = start; i < end; i++) {
+        out[i - start] = ring->events[i & (TRACE_RING_EVENTS - 1)];
+    }
+
+    /* Events the thread wrote while we copied, including one it
+     * may be part way through, may have overwritten the oldest
+     * ones we copied
+     */
+    after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+    if(after <= end) {
+        /* The ring was handed to a new thread; nothing is reliable */
+        return 0;
+    }
+
+    if((after > TRACE_RING_EVENTS) && (after - TRACE_RING_EVENTS > start)) {
+        i = (after - TRACE_RING_EVENTS) - start;
+        if(i >= end - start) {
+            return 0;
+        }
+
+        memmove(out, out + i, (end - start - i) * sizeof(TraceRecord));
+        start += i;
+    }
+
+    n = (unsigned int)(end - start);
+
+    for(i = 0; i < n; i++) {
+        out[i].time = timestamp_from_cycles(out[i].time);
+    }
+
+    return n;
+}
+
+static int _trace_dump(void)
+{
+    TraceFileHeader header;
+    TraceFileThread thread;
+    TraceFileEvent event;
+    TraceRecord *records;
+    unsigned int i, n;
+    TraceRing *ring, *first;
+    char path[64];
+    FILE *f;
+
+    records = malloc(TRACE_RING_EVENTS * sizeof(TraceRecord));
+    if(NULL == records) {
+        LOG_ERROR("(%s:%d) Out of memory", __FUNCTION__, __LINE__);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "trace-%d-%u.bin", (int)getpid(),
+            dump_count++);
+
+    f = fopen(path, "wb");
+    if(NULL == f) {
+        LOG_ERROR("(%s:%d) Couldn't create %s",
+                __FUNCTION__, __LINE__, path);
+        free(records);
+        return -1;
+    }
+
+    /* Rings added after this point are left out */
+    first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_FILE_MAGIC;
+    header.version = TRACE_FILE_VERSION;
+    header.event_count = TRACE_EVENT_LAST;
+    for(ring = first; NULL != ring; ring = ring->next) {
+        header.thread_count++;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+
+    for(i = 0; i < TRACE_EVENT_LAST; i++) {
+        memset(&event, 0, sizeof(event));
+        strncpy(event.name, events[i].name, TRACE_NAME_LEN - 1);
+        strncpy(event.category, _trace_category_name(events[i].category),
+                TRACE_NAME_LEN - 1);
+        event.phase = events[i].phase;
+        fwrite(&event, sizeof(event), 1, f);
+    }
+
+    for(ring = first; NULL != ring; ring = ring->next) {
+        n = _trace_ring_copy(ring, records);
+
+        memset(&thread, 0, sizeof(thread));
+        memcpy(thread.name, ring->name, TRACE_NAME_LEN);
+        thread.name[TRACE_NAME_LEN - 1] = '\0';
+        thread.tid = ring->tid;
+        thread.count = n;
+
+        fwrite(&thread, sizeof(thread), 1, f);
+        fwrite(records, sizeof(TraceRecord), n, f);
+    }
+
+    fclose(f);
+    free(records);
+
+    LOG_INFO("Trace: Dumped %u threads to %s", header.thread_count, path);
+
+    return 0;
+}
+
+/* Write out the rings if a dump has been asked for. Called
+ * periodically from a thread that is off the order path.
+ */
+int trace_poll(void)
+{
+    unsigned long long now;
+
+    if(!__atomic_exchange_n(&dump_requested, 0, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    now = timestamp_now();
+    if((last_dump_time > 0) &&
+            (now - last_dump_time < TRACE_DUMP_INTERVAL_NS)) {
+        return 0;
+    }
+    last_dump_time = now;
+
+    return _trace_dump();
+}
@@ -0,0 +1,122 @@
+/* Copyright (c) 2012, Chris Winter <wintercni@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *    2. Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *    3. Neither the name of the copyright holder nor the
+ *       names of contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#if __cplusplus
+extern "C" {
+#endif
+
+/* Event categories, which can be turned on and off at runtime */
+#define TRACE_CATEGORY_SOCKET   (1 << 0)
+#define TRACE_CATEGORY_RX       (1 << 1)
+#define TRACE_CATEGORY_MATCHER  (1 << 2)
+#define TRACE_CATEGORY_TX       (1 << 3)
+#define TRACE_CATEGORY_LATENCY  (1 << 4)
+#define TRACE_CATEGORY_ALL      0xffffffff
+
+typedef enum {
+    TRACE_EVENT_SOCKET_READ,        /* bytes read */
+    TRACE_EVENT_FRAME,              /* message length */
+    TRACE_EVENT_RX_BEGIN,           /* message sequence number */
+    TRACE_EVENT_RX_END,             /* message sequence number */
+    TRACE_EVENT_ORDER_BEGIN,        /* order id, quantity */
+    TRACE_EVENT_ORDER_END,          /* order id, book sequence */
+    TRACE_EVENT_TRADE,              /* price in ticks, quantity */
+    TRACE_EVENT_UNCROSS,            /* price in ticks, quantity */
+    TRACE_EVENT_TX_SEND,            /* first and last MsgSeqNum */
+    TRACE_EVENT_LATENCY,            /* end to end latency in ns */
+    TRACE_EVENT_EXPIRE,             /* order id, quantity left */
+    TRACE_EVENT_CANCEL,             /* order id, quantity left */
+    TRACE_EVENT_AMEND,              /* order id, new quantity */
+    TRACE_EVENT_REPRICE,            /* peg group's new tick, its offset */
+
+    /* Add new events before this point */
+    TRACE_EVENT_LAST
+} TRACE_EVENT;
+
+/* Dump file layout: a TraceFileHeader, then a TraceFileEvent for
+ * each event ID describing it, then for each thread a
+ * TraceFileThread followed by its events, oldest first.
+ */
+#define TRACE_FILE_MAGIC    0x7472616365656e67ULL
+#define TRACE_FILE_VERSION  1
+#define TRACE_NAME_LEN      24
+
+typedef struct {
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int event_count;
+    unsigned int thread_count;
+    unsigned int reserved;
+} TraceFileHeader;
+
+typedef struct {
+    char name[TRACE_NAME_LEN];
+    char category[TRACE_NAME_LEN];
+
+    /* Chrome trace phase: 'B'egin, 'E'nd or 'i'nstant */
+    char phase;
+    char reserved[7];
+} TraceFileEvent;
+
+typedef struct {
+    char name[TRACE_NAME_LEN];
+    unsigned int tid;
+    unsigned int count;
+} TraceFileThread;
+
+/* A recorded event. In a dump file the time is in nanoseconds
+ * since the Epoch.
+ */
+typedef struct {
+    unsigned long long time;
+    unsigned long long arg0;
+    unsigned long long arg1;
+    unsigned int id;
+    unsigned int reserved;
+} TraceRecord;
+
+void    trace_init              (void);
+
+void    trace_set_categories    (unsigned int categories);
+void    trace_set_threshold     (unsigned long long ns);
+void    trace_set_thread_name   (const char *name);
+
+void    trace_event     (TRACE_EVENT id, unsigned long long arg0,
+                         unsigned long long arg1);
+void    trace_latency   (unsigned long long ns);
+
+void    trace_request_dump  (void);
+int     trace_poll          (void);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -32,10 +32,14 @@
 
 #include "fix_server.h"
 #include "fix_session_manager.h"
+#include "journal.h"
+#include "snapshot.h"
 
 #include "market.h"
-
-#define WAIT_SECONDS    5
+#include "log.h"
+#include "stats.h"
+#include "timestamp.h"
+#include "trace.h"
 
 static int done = 0;
 
@@ -44,40 +48,58 @@ void sigint_handler(int sig)
     done = 1;
 }
 
-int main(int argc, char *argv[])
+/* Dump the trace rings on SIGUSR1 */
+void sigusr1_handler(int sig)
 {
-    unsigned long long total_volume, last_volume;
-    unsigned long long total_filled, last_filled;
+    trace_request_dump();
+}
 
+int main(int argc, char *argv[])
+{
     signal(SIGINT, sigint_handler);
+    signal(SIGUSR1, sigusr1_handler);
 
+    timestamp_init();
+    log_init();
+    trace_init();
+    trace_set_thread_name("main");
     market_open();
+
+    /* Rebuild the books from the last run's snapshot and journal
+     * before this run starts journalling
+     */
+    snapshot_recover(NULL);
+
+    /* Accepted orders and executions are journalled to disk. The
+     * engine still runs if the journal can't be opened.
+     */
+    journal_open(NULL);
+    snapshot_start(NULL);
+
     fix_session_manager_init();
     fix_server_init();
 
-    total_volume = last_volume = 0;
-    total_filled = last_filled = 0;
+    /* Stats are published to shared memory for engine-stat to read.
+     * The engine still runs if the region can't be created.
+     */
+    stats_open();
 
     while(!done) {
-        total_volume = market_get_total_volume();
-        total_filled = market_get_total_orders_filled();
-
-        printf("Market total volume: %llu\n", total_volume);
-        printf("Volume per second: %llu\n",
-                (total_volume - last_volume) / WAIT_SECONDS);
-        printf("Market total orders filled: %llu\n", total_filled);
-        printf("Orders filled per second: %llu\n\n",
-                (total_filled - last_filled) / WAIT_SECONDS);
+        stats_update();
+        trace_poll();
 
-        last_volume = total_volume;
-        last_filled = total_filled;
-
-        sleep(WAIT_SECONDS);
+        usleep(STATS_INTERVAL_MS * 1000);
     }
 
+    stats_close();
+
     fix_server_destroy();
     fix_session_manager_destroy();
+    snapshot_stop();
     market_close();
+    journal_close();
+
+    log_close();
 
     return 0;
 }